@@ -0,0 +1,92 @@
+#pragma once
+
+// Count the heap allocations made by the calling thread, including the ones
+// FFmpeg, libva and the other shared libraries make on its behalf.
+//
+// With ALLOC_COUNTING defined, this header defines malloc, calloc, realloc and
+// the aligned variants for the whole executable. They count, then forward to
+// glibc's __libc_* entry points. Include it from exactly one translation unit.
+// Without ALLOC_COUNTING the counters read zero and nothing is interposed.
+//
+// Only the calling thread's allocations are counted, so decoder worker threads
+// do not blur a measurement of the loop that drives them.
+//
+//   uint64_t before = allocCount();
+//   ...steady-state work...
+//   uint64_t allocations = allocCount() - before;
+
+#include <cstddef>
+#include <cstdint>
+
+#ifdef ALLOC_COUNTING
+
+#include <cerrno>
+#include <cstdlib>
+
+#include <malloc.h>
+
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* pointer, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+}
+
+// Initial-exec TLS in the executable: reading it never allocates
+static thread_local uint64_t allocCounter = 0;
+
+extern "C" {
+void* malloc(size_t size) noexcept {
+    ++allocCounter;
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) noexcept {
+    ++allocCounter;
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void* pointer, size_t size) noexcept {
+    ++allocCounter;
+    return __libc_realloc(pointer, size);
+}
+
+void* memalign(size_t alignment, size_t size) noexcept {
+    ++allocCounter;
+    return __libc_memalign(alignment, size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size) noexcept {
+    ++allocCounter;
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void** pointer, size_t alignment, size_t size) noexcept {
+    ++allocCounter;
+    if (alignment < sizeof(void*) || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+    void* memory = __libc_memalign(alignment, size);
+    if (memory == nullptr && size != 0) {
+        return ENOMEM;
+    }
+    *pointer = memory;
+    return 0;
+}
+}
+
+constexpr bool allocCountingEnabled = true;
+
+inline uint64_t allocCount() {
+    return allocCounter;
+}
+
+#else
+
+constexpr bool allocCountingEnabled = false;
+
+inline uint64_t allocCount() {
+    return 0;
+}
+
+#endif
@@ -0,0 +1,236 @@
+#pragma once
+
+// Demuxer input from memory instead of FFmpeg's file protocol.
+//
+// avformat_open_input on a path reads the file with a read() syscall per
+// buffered block. An InputBuffer holds the whole clip instead:
+//   mapFile(path)       mmap'ed read-only
+//   loadFile(path)      read once into heap memory; reruns never touch the file
+//   borrow(data, size)  caller-owned memory that outlives every input opened on it
+//
+// openMemoryInput gives an AVFormatContext its own cursor over an InputBuffer,
+// through a custom AVIOContext with read and seek callbacks. Many inputs may
+// share one buffer, e.g. 64 streams replaying one clip. Close them with
+// closeInput(), which frees the AVIOContext as well.
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavformat/avio.h>
+#include <libavutil/mem.h>
+}
+
+class InputBuffer {
+public:
+    static std::shared_ptr<const InputBuffer> mapFile(const std::string& path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("Failed to open " + path + ": " + strerror(errno));
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            close(fd);
+            throw std::runtime_error("Cannot map " + path + ": empty or unreadable");
+        }
+        void* mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (mapped == MAP_FAILED) {
+            throw std::runtime_error("Failed to mmap " + path + ": " + strerror(errno));
+        }
+
+        std::shared_ptr<InputBuffer> buffer(new InputBuffer(path));
+        buffer->data_ = static_cast<const uint8_t*>(mapped);
+        buffer->size_ = st.st_size;
+        buffer->mapped_ = true;
+        buffer->adviseReaders(1);
+        return buffer;
+    }
+
+    static std::shared_ptr<const InputBuffer> loadFile(const std::string& path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("Failed to open " + path + ": " + strerror(errno));
+        }
+        std::shared_ptr<InputBuffer> buffer(new InputBuffer(path));
+        struct stat st;
+        if (fstat(fd, &st) == 0) {
+            buffer->owned_.reserve(st.st_size);
+        }
+        uint8_t chunk[1 << 16];
+        ssize_t n;
+        while ((n = read(fd, chunk, sizeof(chunk))) > 0 || (n < 0 && errno == EINTR)) {
+            if (n > 0) {
+                buffer->owned_.insert(buffer->owned_.end(), chunk, chunk + n);
+            }
+        }
+        close(fd);
+        if (n < 0) {
+            throw std::runtime_error("Failed to read " + path + ": " + strerror(errno));
+        }
+        buffer->data_ = buffer->owned_.data();
+        buffer->size_ = buffer->owned_.size();
+        return buffer;
+    }
+
+    // name is what the demuxer sees as the URL, e.g. for probing by extension
+    static std::shared_ptr<const InputBuffer> borrow(const uint8_t* data, size_t size, const std::string& name) {
+        std::shared_ptr<InputBuffer> buffer(new InputBuffer(name));
+        buffer->data_ = data;
+        buffer->size_ = size;
+        return buffer;
+    }
+
+    ~InputBuffer() {
+        if (mapped_) {
+            munmap(const_cast<uint8_t*>(data_), size_);
+        }
+    }
+
+    InputBuffer(const InputBuffer&) = delete;
+    InputBuffer& operator=(const InputBuffer&) = delete;
+
+    // Page cache hint for a mapFile buffer, given how many inputs read it at once.
+    // One reader walks the file front to back: MADV_SEQUENTIAL reads ahead
+    // aggressively and lets the kernel drop pages behind the cursor. Several readers
+    // sit at their own positions, where that would evict pages another cursor still
+    // needs, so the mapping goes back to normal and the whole file is read ahead.
+    void adviseReaders(size_t readers) const {
+        if (!mapped_) {
+            return;
+        }
+        void* addr = const_cast<uint8_t*>(data_);
+        if (readers <= 1) {
+            madvise(addr, size_, MADV_SEQUENTIAL);
+        } else {
+            madvise(addr, size_, MADV_NORMAL);
+            madvise(addr, size_, MADV_WILLNEED);
+        }
+    }
+
+    const uint8_t* data() const { return data_; }
+    size_t size() const { return size_; }
+    const std::string& name() const { return name_; }
+
+private:
+    explicit InputBuffer(const std::string& name) : name_(name) {}
+
+    std::string name_;
+    const uint8_t* data_ = nullptr;
+    size_t size_ = 0;
+    bool mapped_ = false;
+    std::vector<uint8_t> owned_;    // loadFile only
+};
+
+namespace detail {
+
+// One input's position in a shared buffer; the AVIOContext's opaque
+typedef struct {
+    std::shared_ptr<const InputBuffer> buffer;
+    int64_t pos;
+} InputCursor;
+
+inline int readInput(void* opaque, uint8_t* dst, int size) {
+    InputCursor* cursor = static_cast<InputCursor*>(opaque);
+    const int64_t left = int64_t(cursor->buffer->size()) - cursor->pos;
+    if (left <= 0) {
+        return AVERROR_EOF;
+    }
+    const int n = int(std::min<int64_t>(left, size));
+    memcpy(dst, cursor->buffer->data() + cursor->pos, n);
+    cursor->pos += n;
+    return n;
+}
+
+inline int64_t seekInput(void* opaque, int64_t offset, int whence) {
+    InputCursor* cursor = static_cast<InputCursor*>(opaque);
+    const int64_t size = int64_t(cursor->buffer->size());
+    if (whence & AVSEEK_SIZE) {
+        return size;
+    }
+    int64_t pos;
+    switch (whence & ~AVSEEK_FORCE) {
+    case SEEK_SET:
+        pos = offset;
+        break;
+    case SEEK_CUR:
+        pos = cursor->pos + offset;
+        break;
+    case SEEK_END:
+        pos = size + offset;
+        break;
+    default:
+        return AVERROR(EINVAL);
+    }
+    if (pos < 0 || pos > size) {
+        return AVERROR(EINVAL);
+    }
+    cursor->pos = pos;
+    return pos;
+}
+
+inline void freeMemoryIo(AVIOContext* pb) {
+    delete static_cast<InputCursor*>(pb->opaque);
+    // FFmpeg may have replaced the buffer it was given, so free the current one
+    av_freep(&pb->buffer);
+    avio_context_free(&pb);
+}
+
+}  // namespace detail
+
+// Open a demuxer on buffer. Returns 0 or an AVERROR, like avformat_open_input.
+// ioBufferSize is the block the AVIOContext copies out of the buffer at a time.
+inline int openMemoryInput(AVFormatContext** ctx, std::shared_ptr<const InputBuffer> buffer,
+                           int ioBufferSize = 256 << 10) {
+    AVFormatContext* input = avformat_alloc_context();
+    unsigned char* ioBuffer = static_cast<unsigned char*>(av_malloc(ioBufferSize));
+    detail::InputCursor* cursor = new detail::InputCursor{buffer, 0};
+    AVIOContext* pb = ioBuffer ? avio_alloc_context(ioBuffer, ioBufferSize, 0, cursor, detail::readInput, nullptr,
+                                                    detail::seekInput)
+                               : nullptr;
+    if (!input || !pb) {
+        avformat_close_input(&input);
+        if (pb) {
+            detail::freeMemoryIo(pb);
+        } else {
+            av_free(ioBuffer);
+            delete cursor;
+        }
+        return AVERROR(ENOMEM);
+    }
+    input->pb = pb;
+    input->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+    // Frees input on failure, but never a custom AVIOContext
+    int err = avformat_open_input(&input, buffer->name().c_str(), nullptr, nullptr);
+    if (err < 0) {
+        detail::freeMemoryIo(pb);
+        return err;
+    }
+    *ctx = input;
+    return 0;
+}
+
+// Close an input opened with avformat_open_input or openMemoryInput
+inline void closeInput(AVFormatContext** ctx) {
+    if (!*ctx) {
+        return;
+    }
+    AVIOContext* pb = ((*ctx)->flags & AVFMT_FLAG_CUSTOM_IO) ? (*ctx)->pb : nullptr;
+    avformat_close_input(ctx);
+    if (pb) {
+        detail::freeMemoryIo(pb);
+    }
+}
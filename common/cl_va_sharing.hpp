@@ -0,0 +1,283 @@
+#pragma once
+
+// Zero-copy sharing of VA surfaces with OpenCL (cl_intel_va_api_media_sharing).
+//
+// The extension functions are not exported by the ICD loader and have to be
+// looked up per platform; loadClVaSharing() does that and reports whether the
+// platform supports the extension at all. A context created with
+// CL_CONTEXT_VA_API_DISPLAY_INTEL can then wrap each plane of a VA surface as
+// a cl_mem image with clCreateFromVA_APIMediaSurfaceINTEL (NV12: plane 0 is
+// the CL_R Y plane, plane 1 the CL_RG UV plane).
+//
+// Shared images have to be acquired before OpenCL commands use them and
+// released afterwards. ClVaSurfaceBatch acquires and releases every image of
+// every surface it holds with a single enqueue each, instead of one pair per
+// surface. ClContext, ClQueue and ClKernel release the other handles the same way,
+// when they go out of scope.
+//
+// Synchronization with VA follows CL_CONTEXT_INTEROP_USER_SYNC:
+//   implicit (CL_FALSE): the runtime orders acquire/release against VA work.
+//   user sync (CL_TRUE): the application does. acquire() then calls
+//                        vaSyncSurface on every surface first, and release()
+//                        waits for the release to complete, so VA can use the
+//                        surfaces as soon as it returns.
+//
+// Without the extension (e.g. the OpenCL CPU runtime), the batch holds plain
+// images added with addImages() and acquire/release become markers, so the
+// kernels and the batching around them run unchanged.
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <va/va.h>
+}
+
+#ifndef CL_TARGET_OPENCL_VERSION
+#define CL_TARGET_OPENCL_VERSION 220
+#endif
+#include <CL/cl.h>
+#include <CL/cl_va_api_media_sharing_intel.h>
+
+#include "trace.hpp"
+
+typedef struct {
+    cl_platform_id platform;
+    clGetDeviceIDsFromVA_APIMediaAdapterINTEL_fn getDeviceIDs;
+    clCreateFromVA_APIMediaSurfaceINTEL_fn createFromSurface;
+    clEnqueueAcquireVA_APIMediaSurfacesINTEL_fn enqueueAcquire;
+    clEnqueueReleaseVA_APIMediaSurfacesINTEL_fn enqueueRelease;
+} ClVaSharing;
+
+inline bool clVaSharingSupported(const ClVaSharing& sharing) {
+    return sharing.getDeviceIDs && sharing.createFromSurface && sharing.enqueueAcquire && sharing.enqueueRelease;
+}
+
+inline bool clPlatformHasExtension(cl_platform_id platform, const char* name) {
+    size_t size = 0;
+    if (clGetPlatformInfo(platform, CL_PLATFORM_EXTENSIONS, 0, nullptr, &size) != CL_SUCCESS || size == 0) {
+        return false;
+    }
+    std::string extensions(size, '\0');
+    if (clGetPlatformInfo(platform, CL_PLATFORM_EXTENSIONS, size, extensions.data(), nullptr) != CL_SUCCESS) {
+        return false;
+    }
+    // Match whole, space separated names only
+    extensions = " " + std::string(extensions.c_str()) + " ";
+    return extensions.find(" " + std::string(name) + " ") != std::string::npos;
+}
+
+// Extension entry points of a platform; all null when it does not support the extension
+inline ClVaSharing loadClVaSharing(cl_platform_id platform) {
+    ClVaSharing sharing = {};
+    sharing.platform = platform;
+    if (!clPlatformHasExtension(platform, "cl_intel_va_api_media_sharing")) {
+        return sharing;
+    }
+    sharing.getDeviceIDs = reinterpret_cast<clGetDeviceIDsFromVA_APIMediaAdapterINTEL_fn>(
+        clGetExtensionFunctionAddressForPlatform(platform, "clGetDeviceIDsFromVA_APIMediaAdapterINTEL"));
+    sharing.createFromSurface = reinterpret_cast<clCreateFromVA_APIMediaSurfaceINTEL_fn>(
+        clGetExtensionFunctionAddressForPlatform(platform, "clCreateFromVA_APIMediaSurfaceINTEL"));
+    sharing.enqueueAcquire = reinterpret_cast<clEnqueueAcquireVA_APIMediaSurfacesINTEL_fn>(
+        clGetExtensionFunctionAddressForPlatform(platform, "clEnqueueAcquireVA_APIMediaSurfacesINTEL"));
+    sharing.enqueueRelease = reinterpret_cast<clEnqueueReleaseVA_APIMediaSurfacesINTEL_fn>(
+        clGetExtensionFunctionAddressForPlatform(platform, "clEnqueueReleaseVA_APIMediaSurfacesINTEL"));
+    return sharing;
+}
+
+// First platform that supports the extension; clVaSharingSupported() is false if none does
+inline ClVaSharing findClVaSharing() {
+    cl_uint numPlatforms = 0;
+    if (clGetPlatformIDs(0, nullptr, &numPlatforms) != CL_SUCCESS || numPlatforms == 0) {
+        throw std::runtime_error("No OpenCL platforms found");
+    }
+    std::vector<cl_platform_id> platforms(numPlatforms);
+    clGetPlatformIDs(numPlatforms, platforms.data(), nullptr);
+
+    for (cl_platform_id platform : platforms) {
+        ClVaSharing sharing = loadClVaSharing(platform);
+        if (clVaSharingSupported(sharing)) {
+            return sharing;
+        }
+    }
+    return ClVaSharing{};
+}
+
+// Devices that can share surfaces with the display, preferred devices first
+inline std::vector<cl_device_id> clDevicesForVaDisplay(const ClVaSharing& sharing, VADisplay va_dpy) {
+    for (cl_va_api_device_set_intel set : {CL_PREFERRED_DEVICES_FOR_VA_API_INTEL, CL_ALL_DEVICES_FOR_VA_API_INTEL}) {
+        cl_uint numDevices = 0;
+        cl_int err = sharing.getDeviceIDs(sharing.platform, CL_VA_API_DISPLAY_INTEL, va_dpy, set, 0, nullptr,
+                                          &numDevices);
+        if (err != CL_SUCCESS || numDevices == 0) {
+            continue;
+        }
+        std::vector<cl_device_id> devices(numDevices);
+        err = sharing.getDeviceIDs(sharing.platform, CL_VA_API_DISPLAY_INTEL, va_dpy, set, numDevices,
+                                   devices.data(), nullptr);
+        if (err == CL_SUCCESS) {
+            return devices;
+        }
+    }
+    throw std::runtime_error("No OpenCL device can share surfaces with the VA display");
+}
+
+// Context whose devices can wrap surfaces of va_dpy
+inline cl_context createClVaContext(const ClVaSharing& sharing, VADisplay va_dpy,
+                                    const std::vector<cl_device_id>& devices, bool userSync) {
+    const cl_context_properties props[] = {
+        CL_CONTEXT_PLATFORM, reinterpret_cast<cl_context_properties>(sharing.platform),
+        CL_CONTEXT_VA_API_DISPLAY_INTEL, reinterpret_cast<cl_context_properties>(va_dpy),
+        CL_CONTEXT_INTEROP_USER_SYNC, userSync ? CL_TRUE : CL_FALSE,
+        0
+    };
+    cl_int err;
+    cl_context context = clCreateContext(props, static_cast<cl_uint>(devices.size()), devices.data(), nullptr,
+                                         nullptr, &err);
+    if (err != CL_SUCCESS) {
+        throw std::runtime_error("Failed to create the VA sharing OpenCL context. Error: " + std::to_string(err));
+    }
+    return context;
+}
+
+// Owns one OpenCL handle and releases it when it goes out of scope
+template <typename T, cl_int (*Release)(T)>
+class ClObject {
+public:
+    explicit ClObject(T handle = nullptr) : handle_(handle) {}
+    ~ClObject() {
+        if (handle_) {
+            Release(handle_);
+        }
+    }
+
+    ClObject(const ClObject&) = delete;
+    ClObject& operator=(const ClObject&) = delete;
+
+    T get() const { return handle_; }
+
+private:
+    T handle_;
+};
+
+typedef ClObject<cl_context, clReleaseContext> ClContext;
+typedef ClObject<cl_command_queue, clReleaseCommandQueue> ClQueue;
+typedef ClObject<cl_kernel, clReleaseKernel> ClKernel;
+
+// Shared images of many surfaces, acquired and released together
+class ClVaSurfaceBatch {
+public:
+    // sharing may be unsupported; the batch then only takes plain images (addImages)
+    ClVaSurfaceBatch(const ClVaSharing& sharing, cl_context context, VADisplay va_dpy, bool userSync)
+        : sharing_(sharing), context_(context), va_dpy_(va_dpy), userSync_(userSync) {}
+
+    ~ClVaSurfaceBatch() { clear(); }
+
+    ClVaSurfaceBatch(const ClVaSurfaceBatch&) = delete;
+    ClVaSurfaceBatch& operator=(const ClVaSurfaceBatch&) = delete;
+
+    // Wrap planes 0..numPlanes-1 of a surface. Returns the index of the surface in the batch.
+    size_t addSurface(VASurfaceID surface, cl_uint numPlanes, cl_mem_flags flags = CL_MEM_READ_WRITE) {
+        if (!clVaSharingSupported(sharing_)) {
+            throw std::runtime_error("cl_intel_va_api_media_sharing is not supported by the platform");
+        }
+        std::vector<cl_mem> planes;
+        for (cl_uint plane = 0; plane < numPlanes; ++plane) {
+            cl_int err;
+            cl_mem image = sharing_.createFromSurface(context_, flags, &surface, plane, &err);
+            if (err != CL_SUCCESS) {
+                for (cl_mem created : planes) {
+                    clReleaseMemObject(created);
+                }
+                throw std::runtime_error("clCreateFromVA_APIMediaSurfaceINTEL failed for plane " +
+                                         std::to_string(plane) + ". Error: " + std::to_string(err));
+            }
+            planes.push_back(image);
+        }
+        return append(surface, planes);
+    }
+
+    // Take ownership of plain images standing in for the planes of one surface
+    size_t addImages(const std::vector<cl_mem>& planes) { return append(VA_INVALID_SURFACE, planes); }
+
+    size_t size() const { return surfaces_.size(); }
+    VASurfaceID surface(size_t index) const { return surfaces_[index]; }
+    cl_mem plane(size_t index, cl_uint plane) const { return mems_[first_[index] + plane]; }
+
+    // One enqueue for every image in the batch
+    cl_int acquire(cl_command_queue queue, cl_uint numEvents = 0, const cl_event* waitList = nullptr,
+                   cl_event* event = nullptr) {
+        TRACE_SCOPE("clEnqueueAcquireVA_APIMediaSurfacesINTEL");
+        if (!shared()) {
+            return clEnqueueMarkerWithWaitList(queue, numEvents, waitList, event);
+        }
+        if (userSync_) {
+            // VA work on the surfaces must be done before OpenCL touches them
+            for (VASurfaceID surface : surfaces_) {
+                VAStatus va_status = vaSyncSurface(va_dpy_, surface);
+                if (va_status != VA_STATUS_SUCCESS) {
+                    throw std::runtime_error("vaSyncSurface failed: " + std::to_string(va_status));
+                }
+            }
+        }
+        return sharing_.enqueueAcquire(queue, static_cast<cl_uint>(mems_.size()), mems_.data(), numEvents,
+                                       waitList, event);
+    }
+
+    // One enqueue for every image in the batch. In user-sync mode it returns once the release completed.
+    cl_int release(cl_command_queue queue, cl_uint numEvents = 0, const cl_event* waitList = nullptr,
+                   cl_event* event = nullptr) {
+        TRACE_SCOPE("clEnqueueReleaseVA_APIMediaSurfacesINTEL");
+        cl_event done = nullptr;
+        cl_int err = shared() ? sharing_.enqueueRelease(queue, static_cast<cl_uint>(mems_.size()), mems_.data(),
+                                                        numEvents, waitList, &done)
+                              : clEnqueueMarkerWithWaitList(queue, numEvents, waitList, &done);
+        if (err != CL_SUCCESS) {
+            return err;
+        }
+        if (userSync_) {
+            err = clWaitForEvents(1, &done);
+        }
+        if (event) {
+            *event = done;
+        } else {
+            clReleaseEvent(done);
+        }
+        return err;
+    }
+
+    void clear() {
+        for (cl_mem mem : mems_) {
+            clReleaseMemObject(mem);
+        }
+        mems_.clear();
+        first_.clear();
+        surfaces_.clear();
+    }
+
+private:
+    bool shared() const { return !surfaces_.empty() && surfaces_.front() != VA_INVALID_SURFACE; }
+
+    size_t append(VASurfaceID surface, const std::vector<cl_mem>& planes) {
+        if (!surfaces_.empty() && shared() != (surface != VA_INVALID_SURFACE)) {
+            // A single acquire cannot cover shared and plain images
+            for (cl_mem mem : planes) {
+                clReleaseMemObject(mem);
+            }
+            throw std::runtime_error("A batch holds either shared surfaces or plain images, not both");
+        }
+        surfaces_.push_back(surface);
+        first_.push_back(mems_.size());
+        mems_.insert(mems_.end(), planes.begin(), planes.end());
+        return surfaces_.size() - 1;
+    }
+
+    ClVaSharing sharing_;
+    cl_context context_;
+    VADisplay va_dpy_;
+    bool userSync_;
+    std::vector<VASurfaceID> surfaces_;  // VA_INVALID_SURFACE for plain images
+    std::vector<size_t> first_;          // Index of each surface's plane 0 in mems_
+    std::vector<cl_mem> mems_;           // Every image, in acquire/release order
+};
@@ -0,0 +1,357 @@
+#pragma once
+
+// Zero-copy DLPack tensors over frames, in both directions.
+//
+// Export: dlpackFromFrame() wraps every plane of a linear frame as its own
+// DLManagedTensor (RGBA: [H, W, 4]; NV12/P010: Y [H, W] and UV [H/2, W/2, 2])
+// with the layout's pitches as strides. All plane tensors of a frame share one
+// DLPackFrameOwner, which holds what keeps the memory valid: USM imports,
+// dma-buf fds, mappings and the VA surface. It is released when the last
+// tensor's deleter runs, whichever consumer calls it.
+//
+// Import: dlpackToVaSurface() turns a tensor into a VA surface. USM tensors
+// (kDLOneAPI) are exported as a dma-buf and imported with PRIME_2; page
+// aligned host tensors (kDLCPU) are wrapped as user pointers. Both keep the
+// tensor until the surface is destroyed. Anything else is copied into a new
+// surface and the tensor is deleted right away.
+//
+// DLPack strides cannot describe tiled memory, so only linear
+// (DRM_FORMAT_MOD_LINEAR) frames can be exported. Request linear surfaces
+// when creating them (see common/va_surface_caps.hpp).
+
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <dlpack/dlpack.h>
+#include <level_zero/ze_api.h>
+
+extern "C" {
+#include <va/va.h>
+#include <va/va_drmcommon.h>
+}
+
+#include "prime_frame.hpp"
+
+// Everything the plane tensors of one frame keep alive
+class DLPackFrameOwner {
+public:
+    DLPackFrameOwner() = default;
+
+    // Released in dependency order: imports, mappings, fds, then the surface
+    ~DLPackFrameOwner() {
+        for (auto& [context, ptr] : usm_) {
+            zeMemFree(context, ptr);
+        }
+        for (auto& [addr, size] : mappings_) {
+            munmap(addr, size);
+        }
+        for (int fd : fds_) {
+            close(fd);
+        }
+        if (releaseSurface_) {
+            releaseSurface_();
+        } else if (va_display_ && va_surface_ != VA_INVALID_SURFACE) {
+            vaDestroySurfaces(va_display_, &va_surface_, 1);
+        }
+    }
+
+    DLPackFrameOwner(const DLPackFrameOwner&) = delete;
+    DLPackFrameOwner& operator=(const DLPackFrameOwner&) = delete;
+
+    void addUsm(ze_context_handle_t context, void* ptr) { usm_.emplace_back(context, ptr); }
+    void addFd(int fd) { fds_.push_back(fd); }
+    void addMapping(void* addr, size_t size) { mappings_.emplace_back(addr, size); }
+
+    // The surface is destroyed with vaDestroySurfaces unless releaseSurface is set
+    // (e.g. to av_frame_free the decoder's reference or return it to a pool)
+    void setSurface(VADisplay va_display, VASurfaceID va_surface, std::function<void()> releaseSurface = nullptr) {
+        va_display_ = va_display;
+        va_surface_ = va_surface;
+        releaseSurface_ = std::move(releaseSurface);
+    }
+
+private:
+    std::vector<std::pair<ze_context_handle_t, void*>> usm_;
+    std::vector<std::pair<void*, size_t>> mappings_;
+    std::vector<int> fds_;
+    VADisplay va_display_ = nullptr;
+    VASurfaceID va_surface_ = VA_INVALID_SURFACE;
+    std::function<void()> releaseSurface_;
+};
+
+namespace detail {
+
+struct DLPackPlane {
+    DLManagedTensor tensor;
+    int64_t shape[3];
+    int64_t strides[3];
+    std::shared_ptr<DLPackFrameOwner> owner;
+};
+
+inline void deleteDLPackPlane(DLManagedTensor* tensor) {
+    delete static_cast<DLPackPlane*>(tensor->manager_ctx);
+}
+
+} // namespace detail
+
+// kDLOneAPI for device and shared USM, kDLCPU for host USM and for memory Level Zero does not know
+inline DLDevice dlpackDeviceOf(ze_context_handle_t ze_context, const void* ptr, int32_t deviceId = 0) {
+    if (!ze_context) {
+        return {kDLCPU, 0};
+    }
+    ze_memory_allocation_properties_t props = {};
+    props.stype = ZE_STRUCTURE_TYPE_MEMORY_ALLOCATION_PROPERTIES;
+    if (zeMemGetAllocProperties(ze_context, ptr, &props, nullptr) != ZE_RESULT_SUCCESS ||
+        props.type == ZE_MEMORY_TYPE_UNKNOWN || props.type == ZE_MEMORY_TYPE_HOST) {
+        return {kDLCPU, 0};
+    }
+    return {kDLOneAPI, deviceId};
+}
+
+// One tensor per plane. objectBase[i] is where object i of the layout is mapped for the
+// consumer (USM import, mmap, ...). Every returned tensor must reach a consumer or be
+// deleted with tensor->deleter(tensor); owner is released after the last one.
+inline std::vector<DLManagedTensor*> dlpackFromFrame(const PrimeFrameLayout& layout, void* const* objectBase,
+                                                     DLDevice device, std::shared_ptr<DLPackFrameOwner> owner) {
+    const PrimeFormatInfo info = primeFormatInfo(layout.vaFourcc);
+    const uint32_t sampleBytes = layout.numPlanes == 1 ? 1 : info.bytesPerSample;
+
+    for (uint32_t i = 0; i < layout.numObjects; ++i) {
+        if (layout.modifier[i] != DRM_FORMAT_MOD_LINEAR) {
+            throw std::runtime_error("DLPack needs linear frames; object " + std::to_string(i) + " is tiled");
+        }
+    }
+
+    std::vector<DLManagedTensor*> tensors;
+    for (uint32_t p = 0; p < layout.numPlanes; ++p) {
+        const PrimePlane& plane = layout.planes[p];
+        if (plane.pitch % sampleBytes != 0 || plane.offset % sampleBytes != 0) {
+            for (DLManagedTensor* tensor : tensors) {
+                tensor->deleter(tensor);
+            }
+            throw std::runtime_error("Plane " + std::to_string(p) + " is not aligned to its sample size");
+        }
+
+        detail::DLPackPlane* ctx = new detail::DLPackPlane();
+        ctx->owner = owner;
+        const int64_t pitch = plane.pitch / sampleBytes;
+        const bool interleaved = layout.numPlanes == 1 || p > 0;   // RGBA pixels, UV pairs
+        ctx->shape[0] = plane.height;
+        ctx->shape[1] = plane.width;
+        ctx->strides[0] = pitch;
+        ctx->strides[1] = interleaved ? (layout.numPlanes == 1 ? 4 : 2) : 1;
+        ctx->shape[2] = interleaved ? ctx->strides[1] : 0;
+        ctx->strides[2] = 1;
+
+        DLTensor& t = ctx->tensor.dl_tensor;
+        // The plane offset is folded into data: not every consumer honours byte_offset
+        t.data = static_cast<uint8_t*>(objectBase[plane.objectIndex]) + plane.offset;
+        t.device = device;
+        t.ndim = interleaved ? 3 : 2;
+        t.dtype = {kDLUInt, static_cast<uint8_t>(sampleBytes * 8), 1};
+        t.shape = ctx->shape;
+        t.strides = ctx->strides;
+        t.byte_offset = 0;
+        ctx->tensor.manager_ctx = ctx;
+        ctx->tensor.deleter = detail::deleteDLPackPlane;
+        tensors.push_back(&ctx->tensor);
+    }
+    return tensors;
+}
+
+// Single-object layout of a frame stored in one tensor, relative to its first byte:
+//   RGBA/BGRA: uint8 [H, W, 4]
+//   NV12:      uint8 [H * 3 / 2, W], the Y rows followed by the interleaved UV rows
+//   P010:      uint16 [H * 3 / 2, W]
+// Row strides may be padded; everything else must be compact.
+inline PrimeFrameLayout primeLayoutFromDLTensor(const DLTensor& t, uint32_t vaFourcc) {
+    const PrimeFormatInfo info = primeFormatInfo(vaFourcc);
+    const uint32_t sampleBytes = info.numPlanes == 1 ? 1 : info.bytesPerSample;
+    if (t.dtype.code != kDLUInt || t.dtype.bits != sampleBytes * 8 || t.dtype.lanes != 1) {
+        throw std::runtime_error("Tensor dtype must be uint" + std::to_string(sampleBytes * 8));
+    }
+    if (t.ndim != (info.numPlanes == 1 ? 3 : 2) || (info.numPlanes == 1 && t.shape[2] != 4)) {
+        throw std::runtime_error(info.numPlanes == 1 ? "Expected a [H, W, 4] tensor" : "Expected a [H * 3 / 2, W] tensor");
+    }
+
+    // Only the row stride may differ from a compact tensor
+    const int64_t rowSamples = t.shape[1] * (info.numPlanes == 1 ? 4 : 1);
+    const int64_t rowElements = t.strides ? t.strides[0] : rowSamples;
+    const bool compactRows = !t.strides || (info.numPlanes == 1 ? t.strides[1] == 4 && t.strides[2] == 1
+                                                                 : t.strides[1] == 1);
+    if (!compactRows || rowElements < rowSamples) {
+        throw std::runtime_error("Tensor rows must be compact with a row stride of at least one row");
+    }
+
+    const uint32_t rows = static_cast<uint32_t>(t.shape[0]);
+    const uint32_t height = info.numPlanes == 1 ? rows : rows / 3 * 2;
+    if (info.numPlanes == 2 && (rows % 3 != 0 || height % 2 != 0 || t.shape[1] % 2 != 0)) {
+        throw std::runtime_error("NV12/P010 tensors need an even width and height");
+    }
+
+    PrimeFrameLayout layout = {};
+    layout.vaFourcc = vaFourcc;
+    layout.width = static_cast<uint32_t>(t.shape[1]);
+    layout.height = height;
+    layout.numObjects = 1;
+    layout.modifier[0] = DRM_FORMAT_MOD_LINEAR;
+    layout.numPlanes = info.numPlanes;
+
+    const uint32_t pitch = static_cast<uint32_t>(rowElements * sampleBytes);
+    layout.planes[0] = {0, 0, pitch, layout.width, height};
+    if (info.numPlanes == 2) {
+        layout.planes[1] = {0, pitch * height, pitch, layout.width / 2, height / 2};
+    }
+    const PrimePlane& last = layout.planes[layout.numPlanes - 1];
+    layout.objectSize[0] = last.offset + last.pitch * last.height;
+    return layout;
+}
+
+// A VA surface made from a DLPack tensor; destroys the surface, then releases the tensor
+class DLPackVaSurface {
+public:
+    DLPackVaSurface() = default;
+    DLPackVaSurface(VADisplay va_display, VASurfaceID surface, DLManagedTensor* tensor, int fd, bool zeroCopy)
+        : va_display_(va_display), surface_(surface), tensor_(tensor), fd_(fd), zeroCopy_(zeroCopy) {}
+    ~DLPackVaSurface() { reset(); }
+
+    DLPackVaSurface(DLPackVaSurface&& other) noexcept { *this = std::move(other); }
+    DLPackVaSurface& operator=(DLPackVaSurface&& other) noexcept {
+        if (this != &other) {
+            reset();
+            va_display_ = other.va_display_;
+            surface_ = std::exchange(other.surface_, VA_INVALID_SURFACE);
+            tensor_ = std::exchange(other.tensor_, nullptr);
+            fd_ = std::exchange(other.fd_, -1);
+            zeroCopy_ = other.zeroCopy_;
+        }
+        return *this;
+    }
+    DLPackVaSurface(const DLPackVaSurface&) = delete;
+    DLPackVaSurface& operator=(const DLPackVaSurface&) = delete;
+
+    VASurfaceID surface() const { return surface_; }
+    bool zeroCopy() const { return zeroCopy_; }
+
+    void reset() {
+        if (surface_ != VA_INVALID_SURFACE) {
+            vaDestroySurfaces(va_display_, &surface_, 1);
+            surface_ = VA_INVALID_SURFACE;
+        }
+        if (fd_ >= 0) {
+            close(fd_);
+            fd_ = -1;
+        }
+        if (tensor_) {
+            if (tensor_->deleter) {
+                tensor_->deleter(tensor_);
+            }
+            tensor_ = nullptr;
+        }
+    }
+
+private:
+    VADisplay va_display_ = nullptr;
+    VASurfaceID surface_ = VA_INVALID_SURFACE;
+    DLManagedTensor* tensor_ = nullptr;   // Kept while the surface aliases its memory
+    int fd_ = -1;
+    bool zeroCopy_ = false;
+};
+
+namespace detail {
+
+inline VAStatus createExternalSurface(VADisplay va_dpy, const PrimeFrameLayout& layout, uint32_t memType,
+                                      void* descriptor, VASurfaceID* surface) {
+    VASurfaceAttrib attribs[2] = {};
+    attribs[0].type = VASurfaceAttribMemoryType;
+    attribs[0].flags = VA_SURFACE_ATTRIB_SETTABLE;
+    attribs[0].value.type = VAGenericValueTypeInteger;
+    attribs[0].value.value.i = memType;
+    attribs[1].type = VASurfaceAttribExternalBufferDescriptor;
+    attribs[1].flags = VA_SURFACE_ATTRIB_SETTABLE;
+    attribs[1].value.type = VAGenericValueTypePointer;
+    attribs[1].value.value.p = descriptor;
+    return vaCreateSurfaces(va_dpy, primeFormatInfo(layout.vaFourcc).rtFormat, layout.width, layout.height, surface, 1,
+                            attribs, 2);
+}
+
+} // namespace detail
+
+// VA surface over a tensor in the layout primeLayoutFromDLTensor() describes. Takes ownership
+// of the tensor on success. ze_context is only needed for kDLOneAPI tensors.
+inline DLPackVaSurface dlpackToVaSurface(VADisplay va_dpy, DLManagedTensor* tensor, uint32_t vaFourcc,
+                                         ze_context_handle_t ze_context = nullptr) {
+    const DLTensor& t = tensor->dl_tensor;
+    PrimeFrameLayout layout = primeLayoutFromDLTensor(t, vaFourcc);
+    uint8_t* data = static_cast<uint8_t*>(t.data) + t.byte_offset;
+
+    if (t.device.device_type == kDLOneAPI) {
+        if (!ze_context) {
+            throw std::runtime_error("A Level Zero context is needed to import kDLOneAPI tensors");
+        }
+        // The dma-buf covers the whole allocation; the tensor may start anywhere inside it
+        void* base = nullptr;
+        size_t size = 0;
+        if (zeMemGetAddressRange(ze_context, data, &base, &size) != ZE_RESULT_SUCCESS) {
+            throw std::runtime_error("The kDLOneAPI tensor is not a USM allocation of the context");
+        }
+        const uint32_t offset = static_cast<uint32_t>(data - static_cast<uint8_t*>(base));
+        for (uint32_t p = 0; p < layout.numPlanes; ++p) {
+            layout.planes[p].offset += offset;
+        }
+        layout.objectSize[0] = static_cast<uint32_t>(size);
+
+        ze_external_memory_export_fd_t export_fd = {ZE_STRUCTURE_TYPE_EXTERNAL_MEMORY_EXPORT_FD, nullptr,
+                                                    ZE_EXTERNAL_MEMORY_TYPE_FLAG_DMA_BUF, 0};
+        ze_memory_allocation_properties_t alloc_props = {};
+        alloc_props.stype = ZE_STRUCTURE_TYPE_MEMORY_ALLOCATION_PROPERTIES;
+        alloc_props.pNext = &export_fd;
+        ze_result_t ze_res = zeMemGetAllocProperties(ze_context, base, &alloc_props, nullptr);
+        if (ze_res != ZE_RESULT_SUCCESS) {
+            throw std::runtime_error("Failed to export the tensor as a dma-buf: " + std::to_string(ze_res));
+        }
+
+        VADRMPRIMESurfaceDescriptor prime_desc;
+        fillPrimeDescriptor(prime_desc, layout, export_fd.fd);
+        VASurfaceID surface;
+        VAStatus va_status =
+            detail::createExternalSurface(va_dpy, layout, VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME_2, &prime_desc, &surface);
+        if (va_status != VA_STATUS_SUCCESS) {
+            close(export_fd.fd);
+            throw std::runtime_error("vaCreateSurfaces rejected the tensor's dma-buf: " + std::to_string(va_status));
+        }
+        return DLPackVaSurface(va_dpy, surface, tensor, export_fd.fd, true);
+    }
+
+    if (t.device.device_type != kDLCPU) {
+        throw std::runtime_error("Only kDLCPU and kDLOneAPI tensors can be imported");
+    }
+
+    // Page-aligned host memory can back the surface directly
+    const uintptr_t address = reinterpret_cast<uintptr_t>(data);
+    if (address % sysconf(_SC_PAGESIZE) == 0) {
+        uintptr_t buffer = address;
+        VASurfaceAttribExternalBuffers ext;
+        fillExternalBuffers(ext, layout, &buffer);
+        VASurfaceID surface;
+        if (detail::createExternalSurface(va_dpy, layout, VA_SURFACE_ATTRIB_MEM_TYPE_USER_PTR, &ext, &surface) ==
+            VA_STATUS_SUCCESS) {
+            return DLPackVaSurface(va_dpy, surface, tensor, -1, true);
+        }
+    }
+
+    // The driver cannot wrap this memory: copy, and the tensor is no longer needed
+    VASurfaceID surface = copyFrameToNewSurface(va_dpy, layout, data);
+    if (tensor->deleter) {
+        tensor->deleter(tensor);
+    }
+    return DLPackVaSurface(va_dpy, surface, nullptr, -1, false);
+}
@@ -0,0 +1,492 @@
+#pragma once
+
+// Ownership handoff of a shared dma-buf between VA-API and Level Zero without
+// blocking the submitting thread.
+//
+// Every handoff yields a SyncFd: a file descriptor that becomes readable
+// (POLLIN) once the previous owner is done with the buffer, so it can sit in
+// any poll()/epoll event loop.
+//
+//   VA -> L0: vaSurfaceReady() exports the buffer's implicit fences as a sync
+//             file (DMA_BUF_IOCTL_EXPORT_SYNC_FILE, Linux 6.0+). Older kernels
+//             fall back to polling vaQuerySurfaceStatus on the SyncWatcher
+//             thread. zeSignalWhenReady() then signals an L0 event the queued
+//             work waits on, so the GPU work is submitted up front.
+//   L0 -> VA: zeEventDone() turns an L0 event into a SyncFd, which the VA
+//             side waits on before it touches the buffer.
+//
+// A SyncFd that fires may still report failed(): the fence signaled with an
+// error, the L0 event reported one (device lost, ...), or the watcher shut
+// down before the work finished. The buffer contents are undefined then.
+//
+// Any sync file works as a fence, so sw_sync timelines (CONFIG_SW_SYNC) can
+// stand in for GPU fences when exercising the handoff: see SwSyncTimeline and
+// checkSwSyncHandoff().
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <linux/dma-buf.h>
+#include <linux/sync_file.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <level_zero/ze_api.h>
+
+extern "C" {
+#include <va/va.h>
+}
+
+// Kernel headers before 6.0 lack the sync file ioctl
+#ifndef DMA_BUF_IOCTL_EXPORT_SYNC_FILE
+struct dma_buf_export_sync_file {
+    __u32 flags;
+    __s32 fd;
+};
+#define DMA_BUF_IOCTL_EXPORT_SYNC_FILE _IOWR(DMA_BUF_BASE, 2, struct dma_buf_export_sync_file)
+#endif
+
+// Sync file with the fences a reader (DMA_BUF_SYNC_READ) or writer (DMA_BUF_SYNC_WRITE)
+// has to wait for. Returns -1 when the kernel does not support the ioctl.
+inline int exportSyncFile(int dmabufFd, uint32_t flags) {
+    struct dma_buf_export_sync_file args = {flags, -1};
+    if (ioctl(dmabufFd, DMA_BUF_IOCTL_EXPORT_SYNC_FILE, &args) != 0) {
+        return -1;
+    }
+    return args.fd;
+}
+
+// sw_sync is debugfs-only and its ioctls are not in the uapi headers
+typedef struct {
+    __u32 value;
+    char name[32];
+    __s32 fence;
+} SwSyncCreateFence;
+#define SW_SYNC_IOC_CREATE_FENCE _IOWR('W', 0, SwSyncCreateFence)
+#define SW_SYNC_IOC_INC _IOW('W', 1, __u32)
+
+// A software fence timeline: fence(n) returns a sync file that signals once advance() has moved
+// the timeline to n. Needs CONFIG_SW_SYNC and a mounted debugfs.
+class SwSyncTimeline {
+public:
+    static constexpr const char* kPath = "/sys/kernel/debug/sync/sw_sync";
+
+    static bool available() { return access(kPath, R_OK | W_OK) == 0; }
+
+    SwSyncTimeline() : fd_(open(kPath, O_RDWR | O_CLOEXEC)) {
+        if (fd_ < 0) {
+            throw std::runtime_error(std::string("Failed to open ") + kPath + ": " + strerror(errno));
+        }
+    }
+    ~SwSyncTimeline() { close(fd_); }
+
+    SwSyncTimeline(const SwSyncTimeline&) = delete;
+    SwSyncTimeline& operator=(const SwSyncTimeline&) = delete;
+
+    int fence(uint32_t value) {
+        SwSyncCreateFence args = {};
+        args.value = value;
+        strncpy(args.name, "dmabuf_sync", sizeof(args.name) - 1);
+        if (ioctl(fd_, SW_SYNC_IOC_CREATE_FENCE, &args) != 0) {
+            throw std::runtime_error(std::string("Failed to create a sw_sync fence: ") + strerror(errno));
+        }
+        return args.fence;
+    }
+
+    void advance(uint32_t steps) {
+        if (ioctl(fd_, SW_SYNC_IOC_INC, &steps) != 0) {
+            throw std::runtime_error(std::string("Failed to advance the sw_sync timeline: ") + strerror(errno));
+        }
+    }
+
+private:
+    int fd_;
+};
+
+// A poll()-able completion fd: a sync file or an eventfd written by SyncWatcher
+class SyncFd {
+public:
+    SyncFd() = default;
+    SyncFd(int fd, bool syncFile) : fd_(fd), syncFile_(syncFile) {}
+    // Eventfd whose outcome SyncWatcher reports through failed
+    SyncFd(int fd, std::shared_ptr<std::atomic<bool>> failed) : fd_(fd), failed_(std::move(failed)) {}
+    ~SyncFd() { reset(); }
+
+    SyncFd(SyncFd&& other) noexcept
+        : fd_(std::exchange(other.fd_, -1)), syncFile_(other.syncFile_), failed_(std::move(other.failed_)) {}
+    SyncFd& operator=(SyncFd&& other) noexcept {
+        if (this != &other) {
+            reset();
+            fd_ = std::exchange(other.fd_, -1);
+            syncFile_ = other.syncFile_;
+            failed_ = std::move(other.failed_);
+        }
+        return *this;
+    }
+    SyncFd(const SyncFd&) = delete;
+    SyncFd& operator=(const SyncFd&) = delete;
+
+    int fd() const { return fd_; }
+    bool valid() const { return fd_ >= 0; }
+    bool isSyncFile() const { return syncFile_; }
+
+    // Wait up to timeoutMs (-1: forever). Returns true once signaled.
+    bool wait(int timeoutMs) const {
+        if (fd_ < 0) {
+            return true;
+        }
+        pollfd pfd = {fd_, POLLIN, 0};
+        int ret;
+        do {
+            ret = poll(&pfd, 1, timeoutMs);
+        } while (ret < 0 && errno == EINTR);
+        return ret > 0 && (pfd.revents & POLLIN);
+    }
+
+    bool signaled() const { return wait(0); }
+
+    // Another fd on the same fence, sharing the outcome
+    SyncFd duplicate() const {
+        SyncFd copy;
+        if (fd_ >= 0) {
+            copy.fd_ = dup(fd_);
+            if (copy.fd_ < 0) {
+                throw std::runtime_error("Failed to duplicate the sync fd");
+            }
+        }
+        copy.syncFile_ = syncFile_;
+        copy.failed_ = failed_;
+        return copy;
+    }
+
+    // Once signaled: true when the work behind the fd failed or was cancelled
+    bool failed() const {
+        if (fd_ < 0) {
+            return false;
+        }
+        if (syncFile_) {
+            sync_file_info info = {};
+            return ioctl(fd_, SYNC_IOC_FILE_INFO, &info) == 0 && info.status < 0;
+        }
+        return failed_ && failed_->load();
+    }
+
+    void reset() {
+        if (fd_ >= 0) {
+            close(fd_);
+            fd_ = -1;
+        }
+    }
+
+private:
+    int fd_ = -1;
+    bool syncFile_ = false;
+    std::shared_ptr<std::atomic<bool>> failed_;
+};
+
+// Result of a SyncWatcher::when() check
+enum class SyncCheck { Pending, Done, Failed };
+
+// One background thread that turns non-blocking completion checks into SyncFds and runs
+// actions when fds become readable. Nothing it runs may block.
+//
+// Shutting down never strands a waiter, and never passes unfinished work off as done.
+// Pending fds get up to kShutdownWaitMs to fire; the actions of those that did not run
+// with fired = false. Pending checks are checked once more; the SyncFds of those not done
+// are signaled with failed() set.
+class SyncWatcher {
+public:
+    static constexpr int kShutdownWaitMs = 500;
+
+    SyncWatcher() : wakeFd_(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) {
+        if (wakeFd_ < 0) {
+            throw std::runtime_error("Failed to create the SyncWatcher eventfd");
+        }
+        thread_ = std::thread(&SyncWatcher::run, this);
+    }
+
+    ~SyncWatcher() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        wake();
+        thread_.join();
+        close(wakeFd_);
+    }
+
+    SyncWatcher(const SyncWatcher&) = delete;
+    SyncWatcher& operator=(const SyncWatcher&) = delete;
+
+    // SyncFd that is signaled once ready() returns Done or Failed; Failed also sets its
+    // failed(). ready() is polled every ~100 us.
+    SyncFd when(std::function<SyncCheck()> ready) {
+        int fd = eventfd(0, EFD_CLOEXEC);
+        if (fd < 0) {
+            throw std::runtime_error("Failed to create a completion eventfd");
+        }
+        int signalFd = dup(fd);
+        if (signalFd < 0) {
+            close(fd);
+            throw std::runtime_error("Failed to duplicate the completion eventfd");
+        }
+        auto failed = std::make_shared<std::atomic<bool>>(false);
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            pollItems_.push_back({std::move(ready), signalFd, failed});
+        }
+        wake();
+        return SyncFd(fd, failed);
+    }
+
+    // Run action(true) on the watcher thread once fd is readable, or action(false) if the
+    // watcher shuts down first (see above). fd is duplicated, the caller keeps its own.
+    void onReadable(int fd, std::function<void(bool fired)> action) {
+        int watchFd = dup(fd);
+        if (watchFd < 0) {
+            throw std::runtime_error("Failed to duplicate the fd to watch");
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            fdItems_.push_back({watchFd, std::move(action)});
+        }
+        wake();
+    }
+
+private:
+    typedef struct {
+        std::function<SyncCheck()> ready;
+        int signalFd;
+        std::shared_ptr<std::atomic<bool>> failed;
+    } PollItem;
+
+    typedef struct {
+        int fd;
+        std::function<void(bool)> action;
+    } FdItem;
+
+    void wake() {
+        uint64_t one = 1;
+        (void)!write(wakeFd_, &one, sizeof(one));
+    }
+
+    static void signal(PollItem& item, bool failed) {
+        item.failed->store(failed);
+        uint64_t one = 1;
+        (void)!write(item.signalFd, &one, sizeof(one));
+        close(item.signalFd);
+    }
+
+    void run() {
+        std::vector<pollfd> pfds;
+        for (;;) {
+            bool polling;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (stop_) {
+                    break;
+                }
+                pfds.assign(1, {wakeFd_, POLLIN, 0});
+                for (const FdItem& item : fdItems_) {
+                    pfds.push_back({item.fd, POLLIN, 0});
+                }
+                polling = !pollItems_.empty();
+            }
+
+            // Sleep until an fd fires; wake up regularly only while there are checks to poll
+            timespec interval = {0, 100 * 1000};
+            ppoll(pfds.data(), pfds.size(), polling ? &interval : nullptr, nullptr);
+
+            if (pfds[0].revents & POLLIN) {
+                uint64_t count;
+                (void)!read(wakeFd_, &count, sizeof(count));
+            }
+
+            std::vector<std::pair<std::function<void(bool)>, bool>> actions;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                // Items appended since the poll were not in pfds; they are checked next round.
+                // An fd that errors out without becoming readable never fired.
+                for (size_t i = 1; i < pfds.size(); ++i) {
+                    if (pfds[i].revents & (POLLIN | POLLERR | POLLHUP)) {
+                        for (auto it = fdItems_.begin(); it != fdItems_.end(); ++it) {
+                            if (it->fd == pfds[i].fd) {
+                                actions.push_back({std::move(it->action), (pfds[i].revents & POLLIN) != 0});
+                                close(it->fd);
+                                fdItems_.erase(it);
+                                break;
+                            }
+                        }
+                    }
+                }
+                for (auto it = pollItems_.begin(); it != pollItems_.end();) {
+                    const SyncCheck check = it->ready();
+                    if (check != SyncCheck::Pending) {
+                        signal(*it, check == SyncCheck::Failed);
+                        it = pollItems_.erase(it);
+                    } else {
+                        ++it;
+                    }
+                }
+            }
+            for (auto& [action, fired] : actions) {
+                action(fired);
+            }
+        }
+
+        // Nothing may wait forever on a watcher that is gone, nor take unfinished work for done
+        std::vector<FdItem> fdItems;
+        std::vector<PollItem> pollItems;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            fdItems.swap(fdItems_);
+            pollItems.swap(pollItems_);
+        }
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(kShutdownWaitMs);
+        std::vector<bool> fired(fdItems.size());
+        for (size_t i = 0; i < fdItems.size(); ++i) {
+            const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                deadline - std::chrono::steady_clock::now());
+            pollfd pfd = {fdItems[i].fd, POLLIN, 0};
+            int ret;
+            do {
+                ret = poll(&pfd, 1, left.count() > 0 ? int(left.count()) : 0);
+            } while (ret < 0 && errno == EINTR);
+            fired[i] = ret > 0 && (pfd.revents & POLLIN);
+            close(fdItems[i].fd);
+        }
+        for (PollItem& item : pollItems) {
+            signal(item, item.ready() != SyncCheck::Done);
+        }
+        for (size_t i = 0; i < fdItems.size(); ++i) {
+            fdItems[i].action(fired[i]);
+        }
+    }
+
+    int wakeFd_;
+    std::mutex mutex_;
+    bool stop_ = false;
+    std::vector<PollItem> pollItems_;
+    std::vector<FdItem> fdItems_;
+    std::thread thread_;
+};
+
+// VA -> L0: signaled once VA's pending writes to the surface have landed
+inline SyncFd vaSurfaceReady(SyncWatcher& watcher, VADisplay va_dpy, VASurfaceID surface, int dmabufFd) {
+    int syncFile = dmabufFd >= 0 ? exportSyncFile(dmabufFd, DMA_BUF_SYNC_READ) : -1;
+    if (syncFile >= 0) {
+        return SyncFd(syncFile, true);
+    }
+    // No sync file support: poll the surface status instead of blocking in vaSyncSurface
+    return watcher.when([va_dpy, surface]() {
+        VASurfaceStatus status;
+        if (vaQuerySurfaceStatus(va_dpy, surface, &status) != VA_STATUS_SUCCESS) {
+            return SyncCheck::Failed;
+        }
+        return status == VASurfaceReady ? SyncCheck::Done : SyncCheck::Pending;
+    });
+}
+
+// Gate queued L0 work: the host signals gate (an event the work waits on) once ready fires.
+// A gate whose fence fails or never fires stays unsignaled, so the work behind it never runs
+// on a buffer that is not ready; whoever owns that work has to reset or destroy it.
+inline void zeSignalWhenReady(SyncWatcher& watcher, const SyncFd& ready, ze_event_handle_t gate) {
+    if (!ready.valid() || (ready.signaled() && !ready.failed())) {
+        zeEventHostSignal(gate);
+        return;
+    }
+    if (ready.signaled()) {
+        return;
+    }
+    // The action outlives the caller's SyncFd, so it checks the outcome on its own copy
+    auto fence = std::make_shared<SyncFd>(ready.duplicate());
+    watcher.onReadable(ready.fd(), [gate, fence](bool fired) {
+        if (fired && !fence->failed()) {
+            zeEventHostSignal(gate);
+        }
+    });
+}
+
+// L0 -> VA: signaled once the L0 event completes. The event must be host visible. Any
+// status other than success or not ready (device lost, ...) signals it with failed() set.
+inline SyncFd zeEventDone(SyncWatcher& watcher, ze_event_handle_t event) {
+    return watcher.when([event]() {
+        const ze_result_t result = zeEventQueryStatus(event);
+        if (result == ZE_RESULT_NOT_READY) {
+            return SyncCheck::Pending;
+        }
+        return result == ZE_RESULT_SUCCESS ? SyncCheck::Done : SyncCheck::Failed;
+    });
+}
+
+// Runs the watcher's fd and check paths against sw_sync fences, no GPU needed. Returns false on
+// a failed check; skips (returns true) when sw_sync is unavailable.
+inline bool checkSwSyncHandoff() {
+    if (!SwSyncTimeline::available()) {
+        printf("sw_sync unavailable (%s), skipping the handoff checks\n", SwSyncTimeline::kPath);
+        return true;
+    }
+    SwSyncTimeline timeline;
+    SyncFd first(timeline.fence(1), true);
+    SyncFd second(timeline.fence(2), true);
+    SyncFd late(timeline.fence(3), true);
+    SyncFd never(timeline.fence(100), true);
+    bool ok = !first.signaled() && !second.signaled();
+
+    std::atomic<int> fired{0};
+    std::atomic<int> cancelled{0};
+    std::atomic<bool> checked{false};
+    auto count = [&fired, &cancelled](bool f) { (f ? fired : cancelled)++; };
+    SyncFd pendingDone;
+    std::thread advancer;
+    {
+        SyncWatcher watcher;
+        watcher.onReadable(first.fd(), count);
+        SyncFd secondDone = watcher.when([&second, &checked]() {
+            checked = second.signaled();
+            return checked ? SyncCheck::Done : SyncCheck::Pending;
+        });
+
+        timeline.advance(1);
+        ok = ok && first.wait(1000) && !first.failed() && !second.signaled();
+        timeline.advance(1);
+        ok = ok && secondDone.wait(1000) && checked && !secondDone.failed();
+        for (int i = 0; i < 1000 && fired == 0; ++i) {
+            usleep(1000);
+        }
+        ok = ok && fired == 1;
+
+        // A failed check signals too, with failed() set
+        SyncFd failedDone = watcher.when([]() { return SyncCheck::Failed; });
+        ok = ok && failedDone.wait(1000) && failedDone.failed();
+
+        // Pending at shutdown: late fires within the shutdown wait and its action runs as fired;
+        // never does not and runs as cancelled. The open check signals as failed.
+        watcher.onReadable(late.fd(), count);
+        watcher.onReadable(never.fd(), count);
+        pendingDone = watcher.when([]() { return SyncCheck::Pending; });
+        advancer = std::thread([&timeline]() {
+            usleep(SyncWatcher::kShutdownWaitMs * 1000 / 5);
+            timeline.advance(1);
+        });
+    }
+    advancer.join();
+    ok = ok && fired == 2 && cancelled == 1 && !never.signaled();
+    ok = ok && pendingDone.signaled() && pendingDone.failed();
+    printf("sw_sync handoff checks %s\n", ok ? "passed" : "FAILED");
+    return ok;
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+// CPU tiling and detiling of Intel Y-tiled and Tile4 planes.
+//
+// Both layouts use 4 KiB tiles of 128 bytes x 32 rows, laid out row-major
+// across the plane pitch. They differ in how a tile is filled; with x the
+// byte column (0..127) and y the row (0..31) inside the tile, the byte offset
+// inside the tile is built from these bits (most significant first):
+//
+//   Y-tile: x6 x5 x4 y4 y3 y2 y1 y0 x3 x2 x1 x0   (16-byte columns, 32 rows tall)
+//   Tile4:  y4 x6 y3 x5 y2 x4 y1 y0 x3 x2 x1 x0   (16B x 4-row chunks, nested 2x2)
+//
+// Numbering the 64 chunks of a Tile4 tile in memory order gives the table in
+// the PRM (and Mesa's isl_tiled_memcpy.c); its first rows are
+//
+//    0  1  4  5 16 17 20 21
+//    2  3  6  7 18 19 22 23
+//    8  9 12 13 24 25 28 29
+//
+// In both, 16 consecutive bytes of a row stay contiguous, so the copies below
+// move one 16-byte span at a time. Planes must start on a tile boundary and
+// have a pitch that is a multiple of 128, which is what the drivers export.
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <drm_fourcc.h>
+
+inline const char* drmModifierName(uint64_t modifier) {
+    switch (modifier) {
+    case DRM_FORMAT_MOD_LINEAR: return "LINEAR";
+    case I915_FORMAT_MOD_X_TILED: return "X_TILED";
+    case I915_FORMAT_MOD_Y_TILED: return "Y_TILED";
+    case I915_FORMAT_MOD_4_TILED: return "4_TILED";
+    case DRM_FORMAT_MOD_INVALID: return "INVALID";
+    default: return "UNKNOWN";
+    }
+}
+
+// True for the modifiers detilePlane() and tilePlane() understand
+inline bool cpuTilingSupported(uint64_t modifier) {
+    return modifier == DRM_FORMAT_MOD_LINEAR || modifier == I915_FORMAT_MOD_Y_TILED ||
+           modifier == I915_FORMAT_MOD_4_TILED;
+}
+
+// Byte offset of (x, y) inside a 4 KiB tile
+inline uint32_t tileByteOffset(uint64_t modifier, uint32_t x, uint32_t y) {
+    if (modifier == I915_FORMAT_MOD_Y_TILED) {
+        return ((x >> 4) << 9) | (y << 4) | (x & 0xf);
+    }
+    // Tile4
+    return ((y >> 4) << 11) | (((x >> 6) & 0x1) << 10) | (((y >> 3) & 0x1) << 9) | (((x >> 5) & 0x1) << 8) |
+           (((y >> 2) & 0x1) << 7) | (((x >> 4) & 0x1) << 6) | ((y & 0x3) << 4) | (x & 0xf);
+}
+
+// Byte offset of (x, y) in a tiled plane with the given pitch
+inline size_t tiledByteOffset(uint64_t modifier, size_t pitch, uint32_t x, uint32_t y) {
+    if (modifier == DRM_FORMAT_MOD_LINEAR) {
+        return size_t(y) * pitch + x;
+    }
+    const size_t tileRow = size_t(y >> 5) * (pitch >> 7);
+    return ((tileRow + (x >> 7)) << 12) + tileByteOffset(modifier, x & 0x7f, y & 0x1f);
+}
+
+namespace detail {
+
+template <bool ToLinear>
+inline void copyTiledPlane(uint64_t modifier, uint8_t* tiled, size_t tiledPitch, uint8_t* linear,
+                           size_t linearPitch, uint32_t rowBytes, uint32_t rows) {
+    if (!cpuTilingSupported(modifier)) {
+        throw std::runtime_error(std::string("Unsupported modifier for CPU tiling: ") + drmModifierName(modifier));
+    }
+    if (modifier != DRM_FORMAT_MOD_LINEAR && (tiledPitch % 128 != 0 || tiledPitch < rowBytes)) {
+        throw std::runtime_error("Tiled pitch must be a multiple of 128 and cover the row");
+    }
+
+    for (uint32_t y = 0; y < rows; ++y) {
+        uint8_t* line = linear + size_t(y) * linearPitch;
+        for (uint32_t x = 0; x < rowBytes; x += 16) {
+            const uint32_t span = rowBytes - x < 16 ? rowBytes - x : 16;
+            uint8_t* tile = tiled + tiledByteOffset(modifier, tiledPitch, x, y);
+            if (ToLinear) {
+                memcpy(line + x, tile, span);
+            } else {
+                memcpy(tile, line + x, span);
+            }
+        }
+    }
+}
+
+} // namespace detail
+
+// Copy rows x rowBytes of a tiled plane into a linear buffer
+inline void detilePlane(uint64_t modifier, const uint8_t* tiled, size_t tiledPitch, uint8_t* linear,
+                        size_t linearPitch, uint32_t rowBytes, uint32_t rows) {
+    detail::copyTiledPlane<true>(modifier, const_cast<uint8_t*>(tiled), tiledPitch, linear, linearPitch, rowBytes,
+                                 rows);
+}
+
+// Inverse of detilePlane: lay a linear buffer out as a tiled plane
+inline void tilePlane(uint64_t modifier, const uint8_t* linear, size_t linearPitch, uint8_t* tiled,
+                      size_t tiledPitch, uint32_t rowBytes, uint32_t rows) {
+    detail::copyTiledPlane<false>(modifier, tiled, tiledPitch, const_cast<uint8_t*>(linear), linearPitch, rowBytes,
+                                  rows);
+}
+
+// Bytes a tiled plane of this pitch needs for the given rows (whole tile rows)
+inline size_t tiledPlaneSize(uint64_t modifier, size_t pitch, uint32_t rows) {
+    if (modifier == DRM_FORMAT_MOD_LINEAR) {
+        return pitch * rows;
+    }
+    return pitch * ((rows + 31) / 32 * 32);
+}
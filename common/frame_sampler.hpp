@@ -0,0 +1,125 @@
+#pragma once
+
+// Decode only the frames an analytics job looks at.
+//
+//   all    every frame
+//   key    keyframes only: non-key packets never reach the decoder, and
+//          skip_frame = AVDISCARD_NONKEY discards whatever else it is given
+//   N      about one frame in N of the source's timeline: skip_frame =
+//          AVDISCARD_NONREF saves decoding frames nothing else references,
+//          and FrameSampler passes on the first decoded frame at or after
+//          every Nth frame position
+//
+// Frames the sampler holds back are unref'd right after the decoder returns
+// them, so downstream stages (readback, conversion, writers) never see them.
+// For one frame per second, N is the stream's frame rate.
+
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+enum class SampleMode { All, Keyframes, EveryNth };
+
+typedef struct {
+    SampleMode mode = SampleMode::All;
+    int interval = 1;           // EveryNth: frame positions between two sampled frames
+} FrameSampling;
+
+// "all", "key" or a frame interval N >= 1
+inline FrameSampling parseFrameSampling(const std::string& text) {
+    FrameSampling sampling;
+    if (text == "all") {
+        return sampling;
+    }
+    if (text == "key") {
+        sampling.mode = SampleMode::Keyframes;
+        return sampling;
+    }
+    size_t used = 0;
+    int interval = 0;
+    try {
+        interval = std::stoi(text, &used);
+    } catch (const std::exception&) {
+        used = 0;
+    }
+    if (used != text.size() || interval < 1) {
+        throw std::runtime_error("Sampling must be all, key or a frame interval >= 1, not " + text);
+    }
+    if (interval > 1) {
+        sampling.mode = SampleMode::EveryNth;
+        sampling.interval = interval;
+    }
+    return sampling;
+}
+
+inline std::string frameSamplingName(const FrameSampling& sampling) {
+    switch (sampling.mode) {
+    case SampleMode::Keyframes:
+        return "key";
+    case SampleMode::EveryNth:
+        return "1/" + std::to_string(sampling.interval);
+    default:
+        return "all";
+    }
+}
+
+// Tell the decoder what it may skip; call before avcodec_open2
+inline void applyFrameSampling(AVCodecContext* decoder, const FrameSampling& sampling) {
+    if (sampling.mode == SampleMode::Keyframes) {
+        decoder->skip_frame = AVDISCARD_NONKEY;
+    } else if (sampling.mode == SampleMode::EveryNth) {
+        decoder->skip_frame = AVDISCARD_NONREF;
+    }
+}
+
+class FrameSampler {
+public:
+    FrameSampler() = default;
+    // timeBase of the stream's timestamps, frameRate of the source (fallback: count decoded frames)
+    FrameSampler(const FrameSampling& sampling, AVRational timeBase, AVRational frameRate)
+        : sampling_(sampling) {
+        if (timeBase.num > 0 && timeBase.den > 0 && frameRate.num > 0 && frameRate.den > 0) {
+            framesPerTick_ = double(timeBase.num) * frameRate.num / (double(timeBase.den) * frameRate.den);
+        }
+    }
+
+    // Whether a packet should reach the decoder at all
+    bool wantsPacket(const AVPacket* packet) const {
+        return sampling_.mode != SampleMode::Keyframes || (packet->flags & AV_PKT_FLAG_KEY);
+    }
+
+    // Whether a decoded frame goes downstream
+    bool take(const AVFrame* frame) {
+        if (sampling_.mode != SampleMode::EveryNth) {
+            return true;
+        }
+        // The frame's position in the source, from its timestamp: discarded frames leave gaps in the count
+        int64_t position = decoded_++;
+        const int64_t pts = frame->best_effort_timestamp != AV_NOPTS_VALUE ? frame->best_effort_timestamp : frame->pts;
+        if (framesPerTick_ > 0 && pts != AV_NOPTS_VALUE) {
+            if (firstPts_ == AV_NOPTS_VALUE) {
+                firstPts_ = pts;
+            }
+            position = std::llround((pts - firstPts_) * framesPerTick_);
+        }
+        if (position < next_) {
+            return false;
+        }
+        next_ = (position / sampling_.interval + 1) * sampling_.interval;
+        return true;
+    }
+
+    const FrameSampling& sampling() const { return sampling_; }
+
+private:
+    FrameSampling sampling_;
+    double framesPerTick_ = 0;
+    int64_t firstPts_ = AV_NOPTS_VALUE;
+    int64_t decoded_ = 0;
+    int64_t next_ = 0;
+};
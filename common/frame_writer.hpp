@@ -0,0 +1,275 @@
+#pragma once
+
+// Writes decoded frames to disk on a background thread.
+//
+// The decode loop copies each frame once into a pooled host buffer (acquire),
+// then hands it over (submit) and moves on. The writer thread collects every
+// frame queued since its last write and issues one pwritev for all of them, so
+// the disk sees a few large writes instead of one fwrite per row. The decoder
+// only waits for the disk when every pool buffer is queued; such waits are
+// counted as stalls.
+//
+// Output is headerless (raw) or Y4M: a "YUV4MPEG2 W H F A C420mpeg2" header
+// (chroma sited left, as decoders output 4:2:0), then "FRAME\n" before each
+// I420 frame. Any player or ffmpeg -i reads it. Writes go through the page
+// cache; the buffers only need to stay put until the writer is done with them.
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "numa_placement.hpp"
+
+typedef struct {
+    int width = 0;
+    int height = 0;
+    size_t frameBytes = 0;          // Bytes per frame, as the caller lays it out
+    bool y4m = true;                // Y4M header and frame markers; false for raw frames
+    int frameRateNum = 30;          // Y4M F field
+    int frameRateDen = 1;
+    int buffers = 16;               // Frames that may wait for the disk before acquire() blocks
+    size_t maxWriteBytes = 32 << 20;// Upper bound of one pwritev
+} FrameWriterOptions;
+
+typedef struct {
+    uint64_t frames = 0;
+    uint64_t bytes = 0;
+    uint64_t writes = 0;            // pwritev calls
+    uint64_t stalls = 0;            // acquire() calls that had to wait for the writer
+    double stallSeconds = 0;
+} FrameWriterStats;
+
+class FrameWriter {
+public:
+    // Buffers are bound to the placement's node, like the decode thread's staging memory,
+    // and the writer thread is pinned to its cores
+    FrameWriter(const std::string& path, const FrameWriterOptions& options, const NumaPlacement& placement)
+        : options_(options), placement_(placement) {
+        if (options_.frameBytes == 0 || options_.buffers < 1) {
+            throw std::runtime_error("FrameWriter needs a frame size and at least one buffer");
+        }
+        fd_ = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd_ < 0) {
+            throw std::runtime_error("Failed to create " + path + ": " + strerror(errno));
+        }
+        try {
+            if (options_.y4m) {
+                char header[128];
+                int n = snprintf(header, sizeof(header), "YUV4MPEG2 W%d H%d F%d:%d Ip A1:1 C420mpeg2\n",
+                                 options_.width, options_.height, options_.frameRateNum, options_.frameRateDen);
+                writeAll(header, n);
+            }
+
+            // One mapping for the pool; cache-line sized slots keep neighbouring frames apart
+            slotBytes_ = (options_.frameBytes + 63) / 64 * 64;
+            poolBytes_ = slotBytes_ * options_.buffers;
+            pool_ = static_cast<uint8_t*>(allocStaging(placement, poolBytes_));
+            free_.reserve(options_.buffers);
+            queued_.reserve(options_.buffers);
+            for (int i = options_.buffers - 1; i >= 0; --i) {
+                free_.push_back(pool_ + i * slotBytes_);
+            }
+            thread_ = std::thread(&FrameWriter::run, this);
+        } catch (...) {
+            freeStaging(pool_, poolBytes_);
+            ::close(fd_);
+            throw;
+        }
+    }
+
+    ~FrameWriter() {
+        try {
+            close();
+        } catch (const std::exception& e) {
+            fprintf(stderr, "FrameWriter: %s\n", e.what());
+        }
+        freeStaging(pool_, poolBytes_);
+    }
+
+    FrameWriter(const FrameWriter&) = delete;
+    FrameWriter& operator=(const FrameWriter&) = delete;
+
+    size_t frameBytes() const { return options_.frameBytes; }
+
+    // A buffer of frameBytes() to copy the next frame into
+    uint8_t* acquire() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (free_.empty()) {
+            auto start = std::chrono::steady_clock::now();
+            returned_.wait(lock, [this] { return !free_.empty() || failed(); });
+            stats_.stalls++;
+            stats_.stallSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+        if (failed()) {
+            throw std::runtime_error(error_);
+        }
+        uint8_t* buffer = free_.back();
+        free_.pop_back();
+        return buffer;
+    }
+
+    // Queue a filled buffer; frames reach the file in submission order
+    void submit(uint8_t* buffer) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (failed()) {
+            throw std::runtime_error(error_);
+        }
+        queued_.push_back(buffer);
+        queuedCv_.notify_one();
+    }
+
+    // Write what is queued and close the file. Throws if a write failed.
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            closing_ = true;
+        }
+        queuedCv_.notify_one();
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+        if (fd_ >= 0) {
+            ::close(fd_);
+            fd_ = -1;
+        }
+        if (failed()) {
+            throw std::runtime_error(error_);
+        }
+    }
+
+    FrameWriterStats stats() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return stats_;
+    }
+
+private:
+    bool failed() const { return !error_.empty(); }
+
+    // Header writes, before the thread starts
+    void writeAll(const void* data, size_t size) {
+        const uint8_t* p = static_cast<const uint8_t*>(data);
+        while (size > 0) {
+            ssize_t n = pwrite(fd_, p, size, offset_);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                throw std::runtime_error(std::string("Frame write failed: ") + strerror(errno));
+            }
+            p += n;
+            size -= n;
+            offset_ += n;
+        }
+    }
+
+    // One pwritev for the batch, resumed after short writes
+    void writeBatch(const std::vector<uint8_t*>& batch, std::vector<iovec>& iov) {
+        static const char marker[] = "FRAME\n";
+        iov.clear();
+        for (uint8_t* buffer : batch) {
+            if (options_.y4m) {
+                iov.push_back({const_cast<char*>(marker), sizeof(marker) - 1});
+            }
+            iov.push_back({buffer, options_.frameBytes});
+        }
+        size_t first = 0;
+        while (first < iov.size()) {
+            const int count = int(std::min<size_t>(iov.size() - first, IOV_MAX));
+            ssize_t n = pwritev(fd_, iov.data() + first, count, offset_);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                throw std::runtime_error(std::string("Frame write failed: ") + strerror(errno));
+            }
+            offset_ += n;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stats_.writes++;
+                stats_.bytes += n;
+            }
+            // Skip what was written, trimming a partially written entry
+            while (n > 0 && first < iov.size()) {
+                const size_t done = std::min<size_t>(n, iov[first].iov_len);
+                iov[first].iov_base = static_cast<uint8_t*>(iov[first].iov_base) + done;
+                iov[first].iov_len -= done;
+                n -= done;
+                if (iov[first].iov_len == 0) {
+                    first++;
+                }
+            }
+        }
+    }
+
+    void run() {
+        pinCurrentThread(placement_);
+        std::vector<uint8_t*> batch;
+        batch.reserve(options_.buffers);
+        std::vector<iovec> iov;
+        iov.reserve(options_.buffers * 2);
+        const size_t maxFrames = std::max<size_t>(1, options_.maxWriteBytes / options_.frameBytes);
+
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                queuedCv_.wait(lock, [this] { return !queued_.empty() || closing_; });
+                if (queued_.empty()) {
+                    return;
+                }
+                // Everything queued so far, up to one write's worth
+                const size_t take = std::min(queued_.size(), maxFrames);
+                batch.assign(queued_.begin(), queued_.begin() + take);
+                queued_.erase(queued_.begin(), queued_.begin() + take);
+            }
+
+            std::string error;
+            try {
+                writeBatch(batch, iov);
+            } catch (const std::exception& e) {
+                error = e.what();
+            }
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            free_.insert(free_.end(), batch.begin(), batch.end());
+            stats_.frames += batch.size();
+            if (!error.empty()) {
+                error_ = error;
+                queued_.clear();
+                returned_.notify_all();
+                return;
+            }
+            returned_.notify_one();
+        }
+    }
+
+    FrameWriterOptions options_;
+    NumaPlacement placement_;
+    int fd_ = -1;
+    off_t offset_ = 0;              // Writer thread only, once started
+    uint8_t* pool_ = nullptr;
+    size_t slotBytes_ = 0;
+    size_t poolBytes_ = 0;
+    std::thread thread_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable queuedCv_;
+    std::condition_variable returned_;
+    std::vector<uint8_t*> free_;
+    std::vector<uint8_t*> queued_;  // Submission order
+    bool closing_ = false;
+    std::string error_;
+    FrameWriterStats stats_;
+};
@@ -0,0 +1,103 @@
+#pragma once
+
+// Latency histogram with a fixed relative error, in the manner of HdrHistogram.
+//
+// Values below 128 get a bucket each. Above that, every power of two is split
+// into 128 buckets, so a bucket is at most 1/128 (< 0.8%) of its values wide:
+// 1 us and 10 s of nanoseconds are both kept to three significant digits.
+// record() is a few shifts and one increment, with no allocation after
+// construction. Histograms of several threads or streams are combined with
+// add().
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+class LatencyHistogram {
+public:
+    static constexpr int kSubBucketBits = 7;
+    static constexpr uint64_t kSubBuckets = uint64_t(1) << kSubBucketBits;
+
+    LatencyHistogram() : counts_((64 - kSubBucketBits + 1) * kSubBuckets, 0) {}
+
+    void record(uint64_t value) {
+        counts_[index(value)]++;
+        count_++;
+        sum_ += value;
+        min_ = count_ == 1 ? value : std::min(min_, value);
+        max_ = std::max(max_, value);
+    }
+
+    void add(const LatencyHistogram& other) {
+        for (size_t i = 0; i < counts_.size(); ++i) {
+            counts_[i] += other.counts_[i];
+        }
+        if (other.count_ > 0) {
+            min_ = count_ == 0 ? other.min_ : std::min(min_, other.min_);
+            max_ = std::max(max_, other.max_);
+        }
+        count_ += other.count_;
+        sum_ += other.sum_;
+    }
+
+    // The smallest value that at least percentile % of the values do not exceed,
+    // as the upper end of its bucket (never above max())
+    uint64_t percentile(double percentile) const {
+        if (count_ == 0) {
+            return 0;
+        }
+        const uint64_t rank = std::max<uint64_t>(1, uint64_t(percentile / 100.0 * count_ + 0.5));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts_.size(); ++i) {
+            seen += counts_[i];
+            if (seen >= rank) {
+                return std::min(highestEquivalent(i), max_);
+            }
+        }
+        return max_;
+    }
+
+    uint64_t count() const { return count_; }
+    uint64_t min() const { return min_; }
+    uint64_t max() const { return max_; }
+    double mean() const { return count_ ? double(sum_) / count_ : 0; }
+
+private:
+    static size_t index(uint64_t value) {
+        if (value < kSubBuckets) {
+            return size_t(value);
+        }
+        const int msb = 63 - __builtin_clzll(value);
+        const int shift = msb - kSubBucketBits;
+        // The top kSubBucketBits + 1 bits, whose leading 1 is implied by the group
+        return size_t(shift + 1) * kSubBuckets + size_t((value >> shift) - kSubBuckets);
+    }
+
+    static uint64_t highestEquivalent(size_t index) {
+        const size_t group = index >> kSubBucketBits;
+        if (group == 0) {
+            return index;
+        }
+        const int shift = int(group) - 1;
+        const uint64_t low = ((index & (kSubBuckets - 1)) + kSubBuckets) << shift;
+        return low + ((uint64_t(1) << shift) - 1);
+    }
+
+    std::vector<uint64_t> counts_;
+    uint64_t count_ = 0;
+    uint64_t sum_ = 0;
+    uint64_t min_ = 0;
+    uint64_t max_ = 0;
+};
+
+// One line of percentiles in milliseconds, for values recorded in nanoseconds
+inline void printLatencyHistogram(const char* name, const LatencyHistogram& histogram) {
+    printf("%-10s %8lu %9.3f %9.3f %9.3f %9.3f %9.3f\n", name, (unsigned long)histogram.count(),
+           histogram.percentile(50) / 1e6, histogram.percentile(99) / 1e6, histogram.percentile(99.9) / 1e6,
+           histogram.max() / 1e6, histogram.mean() / 1e6);
+}
+
+inline void printLatencyHeader(const char* name) {
+    printf("%-10s %8s %9s %9s %9s %9s %9s\n", name, "frames", "p50 ms", "p99 ms", "p999 ms", "max ms", "mean ms");
+}
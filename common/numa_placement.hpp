@@ -0,0 +1,189 @@
+#pragma once
+
+// NUMA placement of the threads and host staging memory that drive a GPU.
+//
+// The GPU's NUMA node comes from /sys/bus/pci/devices/<bdf>/numa_node. Threads
+// that map or copy surface memory are pinned to that node's cores and host
+// staging buffers are bound to that node with mbind, so a dual-socket box does
+// not pay cross-socket latency on every frame.
+//
+// Environment overrides:
+//   NUMA_PLACEMENT=off        opt out, threads and memory are left to the kernel
+//   NUMA_PLACEMENT_NODE=<n>   force a node, e.g. to exercise a CPU-only NUMA box; anything
+//                             but a non-negative number turns placement off
+
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <numaif.h>
+
+typedef struct {
+    bool enabled;          // False when opted out or the node is unknown
+    int node;              // NUMA node of the GPU, -1 when unknown
+    std::vector<int> cpus; // Cores of that node
+    std::string reason;    // How the placement was chosen
+} NumaPlacement;
+
+inline std::string pciBdfString(unsigned domain, unsigned bus, unsigned device, unsigned function) {
+    char bdf[32];
+    snprintf(bdf, sizeof(bdf), "%04x:%02x:%02x.%x", domain, bus, device, function);
+    return bdf;
+}
+
+// PCI BDF of the GPU behind a DRM node such as /dev/dri/renderD128, empty when unknown
+inline std::string renderNodePciBdf(const std::string& node, const std::string& sysfsRoot = "/sys") {
+    std::string name = std::filesystem::path(node).filename().string();
+    std::error_code ec;
+    auto device = std::filesystem::canonical(sysfsRoot + "/class/drm/" + name + "/device", ec);
+    if (ec) {
+        return "";
+    }
+    return device.filename().string();
+}
+
+// Parse a sysfs cpulist such as "0-3,8-11,16"
+inline std::vector<int> parseCpuList(const std::string& list) {
+    std::vector<int> cpus;
+    std::stringstream ss(list);
+    std::string range;
+    while (std::getline(ss, range, ',')) {
+        if (range.empty() || range == "\n") {
+            continue;
+        }
+        size_t dash = range.find('-');
+        int first = std::stoi(range.substr(0, dash));
+        int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+        for (int cpu = first; cpu <= last; ++cpu) {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+// NUMA node of a PCI device, -1 when the platform does not report one
+inline int readPciNumaNode(const std::string& bdf, const std::string& sysfsRoot = "/sys") {
+    std::ifstream file(sysfsRoot + "/bus/pci/devices/" + bdf + "/numa_node");
+    int node = -1;
+    if (!(file >> node)) {
+        return -1;
+    }
+    return node;
+}
+
+inline std::vector<int> readNodeCpus(int node, const std::string& sysfsRoot = "/sys") {
+    std::ifstream file(sysfsRoot + "/devices/system/node/node" + std::to_string(node) + "/cpulist");
+    std::string list;
+    if (!std::getline(file, list)) {
+        return {};
+    }
+    return parseCpuList(list);
+}
+
+// Decide where the threads and staging memory of a GPU should live
+inline NumaPlacement choosePlacement(const std::string& bdf, const std::string& sysfsRoot = "/sys") {
+    NumaPlacement placement = {false, -1, {}, ""};
+
+    const char* mode = getenv("NUMA_PLACEMENT");
+    if (mode && std::string(mode) == "off") {
+        placement.reason = "disabled by NUMA_PLACEMENT=off";
+        return placement;
+    }
+
+    const char* forced = getenv("NUMA_PLACEMENT_NODE");
+    if (forced) {
+        char* end = nullptr;
+        errno = 0;
+        const long node = strtol(forced, &end, 10);
+        if (end == forced || *end != '\0' || errno != 0 || node < 0 || node > INT_MAX) {
+            placement.reason = std::string("NUMA_PLACEMENT_NODE=") + forced + " is not a node number";
+            return placement;
+        }
+        placement.node = static_cast<int>(node);
+        placement.reason = "forced by NUMA_PLACEMENT_NODE";
+    } else {
+        placement.node = readPciNumaNode(bdf, sysfsRoot);
+        placement.reason = "numa_node of " + bdf;
+    }
+
+    if (placement.node < 0) {
+        placement.reason = bdf + " reports no NUMA node";
+        return placement;
+    }
+
+    placement.cpus = readNodeCpus(placement.node, sysfsRoot);
+    if (placement.cpus.empty()) {
+        placement.reason = "node " + std::to_string(placement.node) + " has no CPUs";
+        return placement;
+    }
+
+    placement.enabled = true;
+    return placement;
+}
+
+// Pin the calling thread to the cores of the placement's node
+inline bool pinCurrentThread(const NumaPlacement& placement) {
+    if (!placement.enabled) {
+        return false;
+    }
+
+    // cpu_set_t holds CPU_SETSIZE CPUs; CPU_SET past it writes out of bounds
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    int count = 0;
+    for (int cpu : placement.cpus) {
+        if (cpu >= 0 && cpu < CPU_SETSIZE) {
+            CPU_SET(cpu, &set);
+            count++;
+        }
+    }
+    return count > 0 && pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+// Allocate host staging memory bound to the placement's node.
+// Release with freeStaging.
+inline void* allocStaging(const NumaPlacement& placement, size_t size) {
+    void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        throw std::runtime_error("Failed to allocate " + std::to_string(size) + " bytes of staging memory");
+    }
+
+    if (placement.enabled) {
+        // Pages are not touched yet, so binding before first use places all of them on the node
+        unsigned long nodemask[16] = {};
+        const unsigned long bits = sizeof(unsigned long) * 8;
+        if (static_cast<unsigned long>(placement.node) < sizeof(nodemask) * 8) {
+            nodemask[placement.node / bits] = 1UL << (placement.node % bits);
+            if (mbind(memory, size, MPOL_BIND, nodemask, sizeof(nodemask) * 8, 0) != 0) {
+                std::cerr << "mbind to node " << placement.node << " failed, using default policy" << std::endl;
+            }
+        }
+    }
+    return memory;
+}
+
+inline void freeStaging(void* memory, size_t size) {
+    if (memory) {
+        munmap(memory, size);
+    }
+}
+
+inline void printPlacement(const std::string& name, const NumaPlacement& placement) {
+    if (!placement.enabled) {
+        std::cout << name << ": no NUMA placement (" << placement.reason << ")" << std::endl;
+        return;
+    }
+    std::cout << name << ": NUMA node " << placement.node << ", " << placement.cpus.size()
+              << " CPU(s) (" << placement.reason << ")" << std::endl;
+}
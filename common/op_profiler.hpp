@@ -0,0 +1,91 @@
+#pragma once
+
+// Per-operation device timing records shared by the Level Zero and SYCL profilers
+// (ze_op_profiler.hpp, sycl_op_profiler.hpp).
+//
+// Profiling is compiled in only when OP_PROFILING is defined (cmake -DOP_PROFILING=ON).
+// Without it the profilers are empty inline stubs: no events are created, no
+// queue property is set and nothing is recorded.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+typedef struct {
+    const char* name;  // Operation, e.g. "writeToUSM copy"; must outlive the buffer
+    const char* api;   // "L0" or "SYCL"
+    uint64_t startNs;  // Host time the device started the operation
+    uint64_t endNs;    // Host time the device finished the operation
+} OpRecord;
+
+// Device ticks to host nanoseconds, against one (hostNow, deviceNow) pair read together,
+// e.g. with zeDeviceGetGlobalTimestamps after the timed work completed. Timestamps only
+// carry the bits in mask, so the distance to the reference is taken modulo that width
+// to survive counter wrap.
+inline uint64_t deviceTicksToHostNs(uint64_t ticks, uint64_t hostNow, uint64_t deviceNow, double nsPerTick,
+                                    uint64_t mask) {
+    const uint64_t behind = ((deviceNow & mask) - (ticks & mask)) & mask;
+    return hostNow - static_cast<uint64_t>(behind * nsPerTick);
+}
+
+// The common buffer every profiler appends to
+class OpRecordBuffer {
+public:
+    static OpRecordBuffer& instance() {
+        static OpRecordBuffer buffer;
+        return buffer;
+    }
+
+    void push(const OpRecord& record) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        records_.push_back(record);
+    }
+
+    std::vector<OpRecord> snapshot() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return records_;
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        records_.clear();
+    }
+
+private:
+    OpRecordBuffer() { records_.reserve(4096); }
+
+    mutable std::mutex mutex_;
+    std::vector<OpRecord> records_;
+};
+
+// Print every record relative to the first one, followed by a per-operation summary
+inline void printOpRecords() {
+    std::vector<OpRecord> records = OpRecordBuffer::instance().snapshot();
+    if (records.empty()) {
+        return;
+    }
+    std::sort(records.begin(), records.end(),
+              [](const OpRecord& a, const OpRecord& b) { return a.startNs < b.startNs; });
+
+    const uint64_t origin = records.front().startNs;
+    printf("%-5s %-32s %12s %12s\n", "API", "Operation", "Start (us)", "Time (us)");
+    for (const OpRecord& r : records) {
+        printf("%-5s %-32s %12.1f %12.1f\n", r.api, r.name, (r.startNs - origin) / 1e3, (r.endNs - r.startNs) / 1e3);
+    }
+
+    std::map<std::string, std::pair<uint64_t, uint64_t>> totals; // name -> (count, ns)
+    for (const OpRecord& r : records) {
+        auto& total = totals[std::string(r.api) + " " + r.name];
+        total.first++;
+        total.second += r.endNs - r.startNs;
+    }
+    printf("%-38s %8s %12s %12s\n", "Summary", "Count", "Total (us)", "Mean (us)");
+    for (const auto& [name, total] : totals) {
+        printf("%-38s %8lu %12.1f %12.1f\n", name.c_str(), (unsigned long)total.first, total.second / 1e3,
+               total.second / 1e3 / total.first);
+    }
+}
@@ -0,0 +1,236 @@
+#pragma once
+
+// Solid fills and pitch-aware 2D copies on the planes of a frame.
+//
+// Canvas clears, letterbox bars and overlays are rectangles on the planes
+// behind a surface. PlaneOps describes them once; the backend decides who
+// writes the memory:
+//   CpuPlaneOps   memset/memcpy on host-visible memory (a vaMapBuffer mapping,
+//                 malloc'd test buffers)
+//   ZePlaneOps    zeCommandListAppendMemoryFill / AppendMemoryCopyRegion on USM,
+//                 e.g. the allocation a surface was imported from (ze_plane_ops.hpp)
+//
+// Operations run in the order they are issued. They may be queued until
+// finish(), so call it before VA or the CPU reads the planes.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <va/va.h>
+}
+
+#include "prime_frame.hpp"
+
+typedef struct {
+    void* base;              // First pixel of the plane
+    size_t pitch;            // Bytes per row
+    uint32_t width;          // Pixels per row (UV: sample pairs)
+    uint32_t height;         // Rows
+    uint32_t bytesPerPixel;  // Y: 1 (P010: 2), UV: 2 (P010: 4), RGBA: 4
+} SurfacePlane;
+
+typedef struct {
+    uint32_t x;
+    uint32_t y;
+    uint32_t width;
+    uint32_t height;
+} PlaneRect;
+
+inline PlaneRect fullRect(const SurfacePlane& plane) {
+    return {0, 0, plane.width, plane.height};
+}
+
+inline void checkRect(const SurfacePlane& plane, const PlaneRect& rect, const char* what) {
+    if (rect.x + rect.width > plane.width || rect.y + rect.height > plane.height) {
+        throw std::runtime_error(std::string(what) + " rectangle " + std::to_string(rect.width) + "x" +
+                                 std::to_string(rect.height) + "+" + std::to_string(rect.x) + "+" +
+                                 std::to_string(rect.y) + " is outside the " + std::to_string(plane.width) + "x" +
+                                 std::to_string(plane.height) + " plane");
+    }
+}
+
+class PlaneOps {
+public:
+    virtual ~PlaneOps() = default;
+
+    // Set every pixel of rect to pattern (plane.bytesPerPixel bytes)
+    virtual void fill(const SurfacePlane& plane, const PlaneRect& rect, const void* pattern) = 0;
+
+    // Copy srcRect of src to (dstX, dstY) of dst. Both planes have the same bytesPerPixel.
+    virtual void copy(const SurfacePlane& dst, uint32_t dstX, uint32_t dstY, const SurfacePlane& src,
+                      const PlaneRect& srcRect) = 0;
+
+    // Wait until every issued operation has landed
+    virtual void finish() = 0;
+
+protected:
+    static void checkCopy(const SurfacePlane& dst, uint32_t dstX, uint32_t dstY, const SurfacePlane& src,
+                          const PlaneRect& srcRect) {
+        if (dst.bytesPerPixel != src.bytesPerPixel) {
+            throw std::runtime_error("Copy between planes of different pixel sizes");
+        }
+        checkRect(src, srcRect, "Copy source");
+        checkRect(dst, {dstX, dstY, srcRect.width, srcRect.height}, "Copy destination");
+    }
+};
+
+class CpuPlaneOps : public PlaneOps {
+public:
+    void fill(const SurfacePlane& plane, const PlaneRect& rect, const void* pattern) override {
+        checkRect(plane, rect, "Fill");
+        if (rect.width == 0 || rect.height == 0) {
+            return;
+        }
+        const size_t rowBytes = size_t(rect.width) * plane.bytesPerPixel;
+        uint8_t* first = rowAt(plane, rect.x, rect.y);
+
+        // Build the first row, then replicate it: one memcpy per row afterwards
+        const uint8_t* bytes = static_cast<const uint8_t*>(pattern);
+        if (isByteRepeat(bytes, plane.bytesPerPixel)) {
+            memset(first, bytes[0], rowBytes);
+        } else {
+            memcpy(first, bytes, plane.bytesPerPixel);
+            for (size_t done = plane.bytesPerPixel; done < rowBytes;) {
+                const size_t chunk = std::min(done, rowBytes - done);
+                memcpy(first + done, first, chunk);
+                done += chunk;
+            }
+        }
+        for (uint32_t y = 1; y < rect.height; ++y) {
+            memcpy(first + y * plane.pitch, first, rowBytes);
+        }
+    }
+
+    void copy(const SurfacePlane& dst, uint32_t dstX, uint32_t dstY, const SurfacePlane& src,
+              const PlaneRect& srcRect) override {
+        checkCopy(dst, dstX, dstY, src, srcRect);
+        const size_t rowBytes = size_t(srcRect.width) * src.bytesPerPixel;
+        for (uint32_t y = 0; y < srcRect.height; ++y) {
+            // memmove: an overlay may copy within one plane
+            memmove(rowAt(dst, dstX, dstY + y), rowAt(src, srcRect.x, srcRect.y + y), rowBytes);
+        }
+    }
+
+    void finish() override {}
+
+private:
+    static uint8_t* rowAt(const SurfacePlane& plane, uint32_t x, uint32_t y) {
+        return static_cast<uint8_t*>(plane.base) + size_t(y) * plane.pitch + size_t(x) * plane.bytesPerPixel;
+    }
+
+    static bool isByteRepeat(const uint8_t* bytes, uint32_t size) {
+        for (uint32_t i = 1; i < size; ++i) {
+            if (bytes[i] != bytes[0]) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+// ---------------------------------
+//          Frame helpers
+// ---------------------------------
+
+// The planes of a linear frame, e.g. from linearPrimeFrameLayout or primeFrameLayout
+inline std::vector<SurfacePlane> framePlanes(const PrimeFrameLayout& layout, void* const* objectBase) {
+    const PrimeFormatInfo info = primeFormatInfo(layout.vaFourcc);
+    std::vector<SurfacePlane> planes;
+    for (uint32_t p = 0; p < layout.numPlanes; ++p) {
+        const PrimePlane& plane = layout.planes[p];
+        const uint32_t bytesPerPixel = info.bytesPerSample * (info.numPlanes == 2 && p > 0 ? 2 : 1);
+        planes.push_back({static_cast<uint8_t*>(objectBase[plane.objectIndex]) + plane.offset, plane.pitch,
+                          plane.width, plane.height, bytesPerPixel});
+    }
+    return planes;
+}
+
+// The planes of a mapped VAImage (vaDeriveImage + vaMapBuffer)
+inline std::vector<SurfacePlane> imagePlanes(const VAImage& image, void* mapped) {
+    PrimeFrameLayout layout;
+    linearPrimeFrameLayout(layout, image.format.fourcc, image.width, image.height);
+    for (uint32_t p = 0; p < layout.numPlanes; ++p) {
+        layout.planes[p].offset = image.offsets[p];
+        layout.planes[p].pitch = image.pitches[p];
+    }
+    return framePlanes(layout, &mapped);
+}
+
+// Sample values at the format's bit depth (NV12: 0-255, P010: 0-1023)
+typedef struct {
+    uint16_t y;
+    uint16_t u;
+    uint16_t v;
+} YuvColor;
+
+// Fill a rectangle of an NV12 or P010 frame. The chroma rectangle covers every chroma
+// sample the luma rectangle touches, so keep rect on even coordinates for exact edges.
+inline void fillFrameRect(PlaneOps& ops, const std::vector<SurfacePlane>& planes, uint32_t fourcc,
+                          const PlaneRect& rect, const YuvColor& color) {
+    if (fourcc != VA_FOURCC_NV12 && fourcc != VA_FOURCC_P010) {
+        throw std::runtime_error("fillFrameRect with YuvColor needs NV12 or P010");
+    }
+    const PlaneRect chroma = {rect.x / 2, rect.y / 2, (rect.x + rect.width + 1) / 2 - rect.x / 2,
+                              (rect.y + rect.height + 1) / 2 - rect.y / 2};
+    if (fourcc == VA_FOURCC_NV12) {
+        const uint8_t y = static_cast<uint8_t>(color.y);
+        const uint8_t uv[2] = {static_cast<uint8_t>(color.u), static_cast<uint8_t>(color.v)};
+        ops.fill(planes[0], rect, &y);
+        ops.fill(planes[1], chroma, uv);
+    } else {
+        // P010 keeps the 10 bits in the high bits of each 16-bit sample
+        const uint16_t y = static_cast<uint16_t>(color.y << 6);
+        const uint16_t uv[2] = {static_cast<uint16_t>(color.u << 6), static_cast<uint16_t>(color.v << 6)};
+        ops.fill(planes[0], rect, &y);
+        ops.fill(planes[1], chroma, uv);
+    }
+}
+
+// Fill a rectangle of an RGBA or BGRA frame with the pixel's four bytes as stored
+inline void fillFrameRect(PlaneOps& ops, const std::vector<SurfacePlane>& planes, uint32_t fourcc,
+                          const PlaneRect& rect, const uint8_t (&pixel)[4]) {
+    if (fourcc != VA_FOURCC_RGBA && fourcc != VA_FOURCC_BGRA) {
+        throw std::runtime_error("fillFrameRect with a packed pixel needs RGBA or BGRA");
+    }
+    ops.fill(planes[0], rect, pixel);
+}
+
+// Copy srcRect of one frame to (dstX, dstY) of another of the same format, every plane
+inline void copyFrameRect(PlaneOps& ops, const std::vector<SurfacePlane>& dst, uint32_t dstX, uint32_t dstY,
+                          const std::vector<SurfacePlane>& src, const PlaneRect& srcRect) {
+    if (dst.size() != src.size()) {
+        throw std::runtime_error("copyFrameRect between frames of different formats");
+    }
+    ops.copy(dst[0], dstX, dstY, src[0], srcRect);
+    if (src.size() == 2) {
+        // Semi-planar chroma: half the coordinates, even luma coordinates expected
+        ops.copy(dst[1], dstX / 2, dstY / 2, src[1],
+                 {srcRect.x / 2, srcRect.y / 2, (srcRect.width + 1) / 2, (srcRect.height + 1) / 2});
+    }
+}
+
+// Letterbox: clear everything outside the content rectangle with color
+template <typename Color>
+inline void fillOutside(PlaneOps& ops, const std::vector<SurfacePlane>& planes, uint32_t fourcc,
+                        const PlaneRect& content, const Color& color) {
+    const SurfacePlane& luma = planes[0];
+    checkRect(luma, content, "Content");
+    const uint32_t right = content.x + content.width;
+    const uint32_t bottom = content.y + content.height;
+    const PlaneRect bars[4] = {
+        {0, 0, luma.width, content.y},                                 // Top
+        {0, bottom, luma.width, luma.height - bottom},                 // Bottom
+        {0, content.y, content.x, content.height},                     // Left
+        {right, content.y, luma.width - right, content.height},        // Right
+    };
+    for (const PlaneRect& bar : bars) {
+        if (bar.width > 0 && bar.height > 0) {
+            fillFrameRect(ops, planes, fourcc, bar, color);
+        }
+    }
+}
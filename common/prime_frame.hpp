@@ -0,0 +1,271 @@
+#pragma once
+
+// Multi-plane frame layouts for PRIME_2 (VADRMPRIMESurfaceDescriptor) interop.
+//
+// primeFrameLayout() flattens an exported descriptor into an ordered plane
+// list (Y then UV for NV12/P010) no matter whether the driver used one
+// composed layer or separate per-plane layers. fillPrimeDescriptor() goes the
+// other way: it describes a linear buffer of a given format so it can be
+// imported with vaCreateSurfaces. Neither touches the driver, so any fd works,
+// including a memfd standing in for a real dma-buf. copyFrameToNewSurface() is
+// the fallback for drivers that cannot import such a buffer.
+//
+// PlanarFrameView gives typed access to the Y and UV planes once each object
+// of the layout is mapped (USM import, mmap, ...).
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <drm_fourcc.h>
+
+extern "C" {
+#include <va/va.h>
+#include <va/va_drmcommon.h>
+}
+
+typedef struct {
+    uint32_t vaFourcc;
+    uint32_t rtFormat;         // VA_RT_FORMAT_* for vaCreateSurfaces
+    uint32_t drmFormat;        // Layer format when the frame is one composed layer
+    uint32_t numPlanes;
+    uint32_t bytesPerSample;   // Bytes per luma sample (RGB: per pixel)
+    uint32_t planeDrmFormat[2];// Per-plane layer formats for separate layers
+} PrimeFormatInfo;
+
+inline PrimeFormatInfo primeFormatInfo(uint32_t vaFourcc) {
+    switch (vaFourcc) {
+    case VA_FOURCC_NV12:
+        return {vaFourcc, VA_RT_FORMAT_YUV420, DRM_FORMAT_NV12, 2, 1, {DRM_FORMAT_R8, DRM_FORMAT_GR88}};
+    case VA_FOURCC_P010:
+        return {vaFourcc, VA_RT_FORMAT_YUV420_10, DRM_FORMAT_P010, 2, 2, {DRM_FORMAT_R16, DRM_FORMAT_GR1616}};
+    case VA_FOURCC_RGBA:
+        return {vaFourcc, VA_RT_FORMAT_RGB32, DRM_FORMAT_ABGR8888, 1, 4, {DRM_FORMAT_ABGR8888, 0}};
+    case VA_FOURCC_BGRA:
+        return {vaFourcc, VA_RT_FORMAT_RGB32, DRM_FORMAT_ARGB8888, 1, 4, {DRM_FORMAT_ARGB8888, 0}};
+    default:
+        throw std::runtime_error("Unsupported fourcc: " + std::to_string(vaFourcc));
+    }
+}
+
+typedef struct {
+    uint32_t objectIndex;
+    uint32_t offset;     // Bytes from the start of the object
+    uint32_t pitch;      // Bytes per row
+    uint32_t width;      // Samples per row (UV: sample pairs)
+    uint32_t height;     // Rows
+} PrimePlane;
+
+typedef struct {
+    uint32_t vaFourcc;
+    uint32_t width;
+    uint32_t height;
+    uint32_t numObjects;
+    uint32_t objectSize[4];
+    uint64_t modifier[4];
+    uint32_t numPlanes;
+    PrimePlane planes[4];
+} PrimeFrameLayout;
+
+// Plane list of an exported descriptor, checked against the object sizes
+inline PrimeFrameLayout primeFrameLayout(const VADRMPRIMESurfaceDescriptor& desc) {
+    PrimeFormatInfo info = primeFormatInfo(desc.fourcc);
+
+    PrimeFrameLayout layout = {};
+    layout.vaFourcc = desc.fourcc;
+    layout.width = desc.width;
+    layout.height = desc.height;
+    layout.numObjects = desc.num_objects;
+    if (desc.num_objects == 0 || desc.num_objects > 4) {
+        throw std::runtime_error("Unexpected number of objects in the descriptor: " + std::to_string(desc.num_objects));
+    }
+    for (uint32_t i = 0; i < desc.num_objects; ++i) {
+        layout.objectSize[i] = desc.objects[i].size;
+        layout.modifier[i] = desc.objects[i].drm_format_modifier;
+    }
+
+    // Composed: one layer holding every plane. Separate: one layer per plane.
+    for (uint32_t l = 0; l < desc.num_layers && l < 4; ++l) {
+        for (uint32_t p = 0; p < desc.layers[l].num_planes && layout.numPlanes < 4; ++p) {
+            PrimePlane& plane = layout.planes[layout.numPlanes];
+            plane.objectIndex = desc.layers[l].object_index[p];
+            plane.offset = desc.layers[l].offset[p];
+            plane.pitch = desc.layers[l].pitch[p];
+            // Every plane after the first one of a 4:2:0 format is the interleaved chroma
+            bool chroma = layout.numPlanes > 0 && info.numPlanes == 2;
+            plane.width = chroma ? (desc.width + 1) / 2 : desc.width;
+            plane.height = chroma ? (desc.height + 1) / 2 : desc.height;
+            layout.numPlanes++;
+        }
+    }
+    if (layout.numPlanes != info.numPlanes) {
+        throw std::runtime_error("Expected " + std::to_string(info.numPlanes) + " plane(s), descriptor has " +
+                                 std::to_string(layout.numPlanes));
+    }
+
+    for (uint32_t p = 0; p < layout.numPlanes; ++p) {
+        const PrimePlane& plane = layout.planes[p];
+        uint64_t rowBytes = uint64_t(plane.width) * info.bytesPerSample * (p > 0 ? 2 : 1);
+        if (plane.objectIndex >= layout.numObjects || plane.pitch < rowBytes ||
+            uint64_t(plane.offset) + uint64_t(plane.pitch) * plane.height > layout.objectSize[plane.objectIndex]) {
+            throw std::runtime_error("Plane " + std::to_string(p) + " does not fit its object");
+        }
+    }
+    return layout;
+}
+
+// Describe a linear single-object buffer: the Y plane at offset 0 and the UV plane right
+// after it. Pitches are rounded up to pitchAlign. Returns the bytes the buffer must hold.
+inline size_t linearPrimeFrameLayout(PrimeFrameLayout& layout, uint32_t vaFourcc, uint32_t width, uint32_t height,
+                                     uint32_t pitchAlign = 64) {
+    PrimeFormatInfo info = primeFormatInfo(vaFourcc);
+    auto align = [pitchAlign](uint32_t v) { return (v + pitchAlign - 1) / pitchAlign * pitchAlign; };
+
+    layout = {};
+    layout.vaFourcc = vaFourcc;
+    layout.width = width;
+    layout.height = height;
+    layout.numObjects = 1;
+    layout.modifier[0] = DRM_FORMAT_MOD_LINEAR;
+    layout.numPlanes = info.numPlanes;
+
+    layout.planes[0] = {0, 0, align(width * info.bytesPerSample), width, height};
+    if (info.numPlanes == 2) {
+        const PrimePlane& y = layout.planes[0];
+        // Interleaved UV: half the rows, the same bytes per row as Y
+        layout.planes[1] = {0, y.pitch * y.height, y.pitch, (width + 1) / 2, (height + 1) / 2};
+    }
+
+    const PrimePlane& last = layout.planes[layout.numPlanes - 1];
+    layout.objectSize[0] = last.offset + last.pitch * last.height;
+    return layout.objectSize[0];
+}
+
+// PRIME_2 descriptor for a single-object layout, as one composed layer
+inline void fillPrimeDescriptor(VADRMPRIMESurfaceDescriptor& desc, const PrimeFrameLayout& layout, int fd) {
+    PrimeFormatInfo info = primeFormatInfo(layout.vaFourcc);
+
+    desc = {};
+    desc.fourcc = layout.vaFourcc;
+    desc.width = layout.width;
+    desc.height = layout.height;
+    desc.num_objects = 1;
+    desc.objects[0].fd = fd;
+    desc.objects[0].size = layout.objectSize[0];
+    desc.objects[0].drm_format_modifier = layout.modifier[0];
+
+    desc.num_layers = 1;
+    desc.layers[0].drm_format = info.drmFormat;
+    desc.layers[0].num_planes = layout.numPlanes;
+    for (uint32_t p = 0; p < layout.numPlanes; ++p) {
+        desc.layers[0].object_index[p] = 0;
+        desc.layers[0].offset[p] = layout.planes[p].offset;
+        desc.layers[0].pitch[p] = layout.planes[p].pitch;
+    }
+}
+
+// Legacy PRIME descriptor for the same single-object layout
+inline void fillExternalBuffers(VASurfaceAttribExternalBuffers& ext, const PrimeFrameLayout& layout, uintptr_t* fd) {
+    ext = {};
+    ext.pixel_format = layout.vaFourcc;
+    ext.width = layout.width;
+    ext.height = layout.height;
+    ext.data_size = layout.objectSize[0];
+    ext.num_planes = layout.numPlanes;
+    for (uint32_t p = 0; p < layout.numPlanes; ++p) {
+        ext.pitches[p] = layout.planes[p].pitch;
+        ext.offsets[p] = layout.planes[p].offset;
+    }
+    ext.buffers = fd;
+    ext.num_buffers = 1;
+}
+
+// Copy a host frame in this layout into a new surface of the driver's own tiling, with
+// vaPutImage. For buffers the driver cannot import.
+inline VASurfaceID copyFrameToNewSurface(VADisplay va_dpy, const PrimeFrameLayout& layout, const uint8_t* data) {
+    VASurfaceAttrib attrib = {};
+    attrib.type = VASurfaceAttribPixelFormat;
+    attrib.flags = VA_SURFACE_ATTRIB_SETTABLE;
+    attrib.value.type = VAGenericValueTypeInteger;
+    attrib.value.value.i = layout.vaFourcc;
+
+    VASurfaceID surface;
+    VAStatus va_status = vaCreateSurfaces(va_dpy, primeFormatInfo(layout.vaFourcc).rtFormat, layout.width,
+                                          layout.height, &surface, 1, &attrib, 1);
+    if (va_status != VA_STATUS_SUCCESS) {
+        throw std::runtime_error("vaCreateSurfaces failed: " + std::to_string(va_status));
+    }
+
+    VAImageFormat format = {};
+    format.fourcc = layout.vaFourcc;
+    format.byte_order = VA_LSB_FIRST;
+    format.bits_per_pixel = layout.numPlanes == 1 ? 32 : (layout.vaFourcc == VA_FOURCC_P010 ? 24 : 12);
+    VAImage image;
+    va_status = vaCreateImage(va_dpy, &format, layout.width, layout.height, &image);
+    uint8_t* mapped = nullptr;
+    if (va_status == VA_STATUS_SUCCESS) {
+        va_status = vaMapBuffer(va_dpy, image.buf, (void**)&mapped);
+        if (va_status == VA_STATUS_SUCCESS) {
+            const uint32_t bytesPerSample = primeFormatInfo(layout.vaFourcc).bytesPerSample;
+            for (uint32_t p = 0; p < layout.numPlanes; ++p) {
+                const PrimePlane& plane = layout.planes[p];
+                const uint32_t rowBytes = plane.width * bytesPerSample * (p > 0 ? 2 : 1);
+                for (uint32_t y = 0; y < plane.height; ++y) {
+                    memcpy(mapped + image.offsets[p] + size_t(y) * image.pitches[p],
+                           data + plane.offset + size_t(y) * plane.pitch, rowBytes);
+                }
+            }
+            vaUnmapBuffer(va_dpy, image.buf);
+            va_status = vaPutImage(va_dpy, surface, image.image_id, 0, 0, layout.width, layout.height, 0, 0,
+                                   layout.width, layout.height);
+        }
+        vaDestroyImage(va_dpy, image.image_id);
+    }
+    if (va_status != VA_STATUS_SUCCESS) {
+        vaDestroySurfaces(va_dpy, &surface, 1);
+        throw std::runtime_error("Copying the frame into the surface failed: " + std::to_string(va_status));
+    }
+    return surface;
+}
+
+// Typed Y and UV planes of a 4:2:0 frame. T is uint8_t for NV12 and uint16_t for P010
+// (10 bits in the high bits of each sample). UV rows interleave U and V.
+template <typename T>
+struct PlanarFrameView {
+    T* y = nullptr;
+    T* uv = nullptr;
+    size_t yPitch = 0;    // Bytes per Y row
+    size_t uvPitch = 0;   // Bytes per UV row
+    uint32_t width = 0;
+    uint32_t height = 0;
+
+    T* yRow(uint32_t row) const { return reinterpret_cast<T*>(reinterpret_cast<uint8_t*>(y) + row * yPitch); }
+    T* uvRow(uint32_t row) const { return reinterpret_cast<T*>(reinterpret_cast<uint8_t*>(uv) + row * uvPitch); }
+};
+
+typedef PlanarFrameView<uint8_t> NV12FrameView;
+typedef PlanarFrameView<uint16_t> P010FrameView;
+
+// View of a mapped layout; objectBase[i] is where object i of the layout is mapped
+template <typename T>
+PlanarFrameView<T> makePlanarFrameView(const PrimeFrameLayout& layout, void* const* objectBase) {
+    const PrimeFormatInfo info = primeFormatInfo(layout.vaFourcc);
+    if (layout.numPlanes != 2 || info.bytesPerSample != sizeof(T)) {
+        throw std::runtime_error("Layout does not match the view's plane format");
+    }
+    auto plane = [&](uint32_t p) {
+        return reinterpret_cast<T*>(static_cast<uint8_t*>(objectBase[layout.planes[p].objectIndex]) +
+                                    layout.planes[p].offset);
+    };
+
+    PlanarFrameView<T> view;
+    view.y = plane(0);
+    view.uv = plane(1);
+    view.yPitch = layout.planes[0].pitch;
+    view.uvPitch = layout.planes[1].pitch;
+    view.width = layout.width;
+    view.height = layout.height;
+    return view;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+// Runs a cleanup when the scope ends, however it ends. Guards declared one after
+// another unwind in reverse, so declare them in the order the resources are made.
+
+#include <utility>
+
+template <typename F>
+class ScopeExit {
+public:
+    explicit ScopeExit(F cleanup) : cleanup_(std::move(cleanup)) {}
+    ~ScopeExit() { cleanup_(); }
+    ScopeExit(const ScopeExit&) = delete;
+    ScopeExit& operator=(const ScopeExit&) = delete;
+
+private:
+    F cleanup_;
+};
@@ -0,0 +1,44 @@
+#pragma once
+
+// The `selftest` mode samples share: checks that run without a GPU or VA driver.
+//
+//   int runFooChecks() {
+//       CHECK(a == b);  // on failure: prints the condition and returns -1
+//       return 0;
+//   }
+//   if (isSelfTest(argc, argv)) {
+//       return runSelfTest([&]() { return runFooChecks(); });
+//   }
+//
+// runSelfTest turns an exception into a failure and prints one verdict line, so
+// every sample's self-test ends the same way and exits 0 only when it passed.
+
+#include <exception>
+#include <iostream>
+#include <string>
+
+#define CHECK(cond)                                                                      \
+    do {                                                                                 \
+        if (!(cond)) {                                                                   \
+            std::cerr << "Check failed at line " << __LINE__ << ": " #cond << std::endl; \
+            return -1;                                                                   \
+        }                                                                                \
+    } while (0)
+
+// The program was started as `<program> selftest [args...]`
+inline bool isSelfTest(int argc, char* argv[]) {
+    return argc > 1 && std::string(argv[1]) == "selftest";
+}
+
+// 0 if checks returned 0, -1 if it returned anything else or threw
+template <typename F>
+int runSelfTest(F&& checks) {
+    int result = -1;
+    try {
+        result = checks();
+    } catch (const std::exception& e) {
+        std::cerr << "Self-test threw: " << e.what() << std::endl;
+    }
+    std::cout << "Self-test " << (result == 0 ? "passed" : "FAILED") << std::endl;
+    return result == 0 ? 0 : -1;
+}
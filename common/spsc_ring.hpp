@@ -0,0 +1,128 @@
+#pragma once
+
+// Bounded lock-free ring for exactly one producer thread and one consumer thread.
+//
+// tryPush/tryPop never block and never take a lock: each side owns one index
+// and only reads the other side's. push/pop block when the ring is full or
+// empty, which is the back-pressure between pipeline stages. They sleep in
+// std::atomic::wait on an event counter, so a waiting side costs no CPU and
+// the fast path makes no syscall while nobody is waiting.
+//
+// close() ends the ring: push fails from then on, and pop drains what is left
+// before it fails. Either side may call it, e.g. a consumer that gives up
+// early releases a producer blocked on a full ring.
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+template <typename T>
+class SpscRing {
+public:
+    // capacity is rounded up to a power of two
+    explicit SpscRing(size_t capacity) {
+        if (capacity == 0) {
+            throw std::runtime_error("SpscRing needs a capacity of at least 1");
+        }
+        size_t size = 1;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        slots_.resize(size);
+        mask_ = size - 1;
+    }
+
+    SpscRing(const SpscRing&) = delete;
+    SpscRing& operator=(const SpscRing&) = delete;
+
+    size_t capacity() const { return slots_.size(); }
+
+    // Approximate from any thread other than the two sides
+    size_t size() const { return tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_acquire); }
+
+    bool closed() const { return closed_.load(std::memory_order_acquire); }
+
+    // Producer only. False when the ring is full.
+    bool tryPush(const T& value) {
+        const size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - cachedHead_ == slots_.size()) {
+            cachedHead_ = head_.load(std::memory_order_acquire);
+            if (tail - cachedHead_ == slots_.size()) {
+                return false;
+            }
+        }
+        slots_[tail & mask_] = value;
+        tail_.store(tail + 1, std::memory_order_release);
+        pushEvents_.fetch_add(1, std::memory_order_release);
+        pushEvents_.notify_one();
+        return true;
+    }
+
+    // Consumer only. False when the ring is empty.
+    bool tryPop(T& value) {
+        const size_t head = head_.load(std::memory_order_relaxed);
+        if (head == cachedTail_) {
+            cachedTail_ = tail_.load(std::memory_order_acquire);
+            if (head == cachedTail_) {
+                return false;
+            }
+        }
+        value = slots_[head & mask_];
+        head_.store(head + 1, std::memory_order_release);
+        popEvents_.fetch_add(1, std::memory_order_release);
+        popEvents_.notify_one();
+        return true;
+    }
+
+    // Producer only. Waits while the ring is full. False once it is closed.
+    bool push(const T& value) {
+        for (;;) {
+            // Read the counter before trying, so a pop in between ends the wait
+            const uint32_t seen = popEvents_.load(std::memory_order_acquire);
+            if (closed()) {
+                return false;
+            }
+            if (tryPush(value)) {
+                return true;
+            }
+            popEvents_.wait(seen, std::memory_order_acquire);
+        }
+    }
+
+    // Consumer only. Waits while the ring is empty. False once it is closed and drained.
+    bool pop(T& value) {
+        for (;;) {
+            const uint32_t seen = pushEvents_.load(std::memory_order_acquire);
+            if (tryPop(value)) {
+                return true;
+            }
+            if (closed()) {
+                // A push may have landed just before close
+                return tryPop(value);
+            }
+            pushEvents_.wait(seen, std::memory_order_acquire);
+        }
+    }
+
+    void close() {
+        closed_.store(true, std::memory_order_release);
+        pushEvents_.fetch_add(1, std::memory_order_release);
+        pushEvents_.notify_all();
+        popEvents_.fetch_add(1, std::memory_order_release);
+        popEvents_.notify_all();
+    }
+
+private:
+    // Each side's index and its cached copy of the other side's on separate cache lines
+    alignas(64) std::atomic<size_t> head_{0};      // Next slot to pop, written by the consumer
+    size_t cachedTail_ = 0;                        // Consumer only
+    alignas(64) std::atomic<size_t> tail_{0};      // Next slot to push, written by the producer
+    size_t cachedHead_ = 0;                        // Producer only
+    alignas(64) std::atomic<uint32_t> pushEvents_{0};
+    alignas(64) std::atomic<uint32_t> popEvents_{0};
+    std::atomic<bool> closed_{false};
+    std::vector<T> slots_;
+    size_t mask_ = 0;
+};
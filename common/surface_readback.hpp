@@ -0,0 +1,411 @@
+#pragma once
+
+// Read VA surfaces back into cached host memory.
+//
+// A vaMapBuffer'd surface or image is often uncached or write-combined (WC):
+// plain loads from it are not cached and run at a fraction of memory
+// bandwidth, worst of all one pixel at a time. streamingCopy() reads it with
+// SSE4.1 movntdqa streaming loads, four 16-byte loads per 64-byte line, into
+// cached memory that is then cheap to scan. On cached memory it behaves like
+// memcpy, so it is safe on any mapping.
+//
+// SurfaceReadback copies a surface into its own host buffer through one of
+//   derive-map  vaDeriveImage + vaMapBuffer of the surface itself
+//   get-image   vaGetImage into a VAImage created once and reused
+//   device      a caller-supplied copy, e.g. Level Zero from the surface's USM
+// Which one is fastest depends on the driver and the surface's tiling, so the
+// first read() times every available method and keeps the fastest one.
+// describe() reports the timings and the choice. readRows() hands the mapped
+// rows to the caller instead, to copy them straight into memory of its own.
+//
+// Environment overrides:
+//   READBACK_METHOD=derive|getimage|device   skip the measurement; any other value,
+//                                            or device without a device copy, throws.
+//                                            checkReadbackMethodEnv() reports that at startup.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+extern "C" {
+#include <va/va.h>
+}
+
+#include "prime_frame.hpp"
+#include "trace.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+namespace detail {
+
+__attribute__((target("sse4.1"))) inline void streamingCopySse41(uint8_t* dst, const uint8_t* src, size_t bytes) {
+    // movntdqa needs a 16-byte aligned source
+    const size_t head = std::min<size_t>((16 - (uintptr_t(src) & 15)) & 15, bytes);
+    memcpy(dst, src, head);
+    dst += head;
+    src += head;
+    bytes -= head;
+
+    // Whole lines: the four loads drain one streaming-load buffer
+    for (; bytes >= 64; bytes -= 64, src += 64, dst += 64) {
+        __m128i a = _mm_stream_load_si128((__m128i*)(src));
+        __m128i b = _mm_stream_load_si128((__m128i*)(src + 16));
+        __m128i c = _mm_stream_load_si128((__m128i*)(src + 32));
+        __m128i d = _mm_stream_load_si128((__m128i*)(src + 48));
+        _mm_storeu_si128((__m128i*)(dst), a);
+        _mm_storeu_si128((__m128i*)(dst + 16), b);
+        _mm_storeu_si128((__m128i*)(dst + 32), c);
+        _mm_storeu_si128((__m128i*)(dst + 48), d);
+    }
+    for (; bytes >= 16; bytes -= 16, src += 16, dst += 16) {
+        _mm_storeu_si128((__m128i*)dst, _mm_stream_load_si128((__m128i*)src));
+    }
+    memcpy(dst, src, bytes);
+}
+
+}  // namespace detail
+#endif
+
+inline bool streamingLoadsSupported() {
+#if defined(__x86_64__) || defined(__i386__)
+    static const bool supported = __builtin_cpu_supports("sse4.1");
+    return supported;
+#else
+    return false;
+#endif
+}
+
+// memcpy for reads from WC memory. Call streamingLoadFence() once before the
+// first copy out of a freshly mapped buffer.
+inline void streamingCopy(void* dst, const void* src, size_t bytes) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (streamingLoadsSupported()) {
+        detail::streamingCopySse41(static_cast<uint8_t*>(dst), static_cast<const uint8_t*>(src), bytes);
+        return;
+    }
+#endif
+    memcpy(dst, src, bytes);
+}
+
+// Streaming loads are weakly ordered: order them after everything before
+inline void streamingLoadFence() {
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_mfence();
+#endif
+}
+
+enum class ReadbackMethod { DeriveMap, GetImage, Device };
+
+inline const char* readbackMethodName(ReadbackMethod method) {
+    switch (method) {
+    case ReadbackMethod::DeriveMap:
+        return "derive-map";
+    case ReadbackMethod::GetImage:
+        return "get-image";
+    case ReadbackMethod::Device:
+        return "device";
+    }
+    return "unknown";
+}
+
+// The method READBACK_METHOD forces, if it is set. Throws for a value a reader cannot
+// follow: an unknown name, or device when the reader has no device copy.
+inline std::optional<ReadbackMethod> readbackMethodFromEnv(bool hasDeviceCopy) {
+    const char* forced = getenv("READBACK_METHOD");
+    if (!forced) {
+        return std::nullopt;
+    }
+    const std::string name = forced;
+    if (name == "derive") {
+        return ReadbackMethod::DeriveMap;
+    } else if (name == "getimage") {
+        return ReadbackMethod::GetImage;
+    } else if (name == "device" && hasDeviceCopy) {
+        return ReadbackMethod::Device;
+    } else if (name == "device") {
+        throw std::runtime_error("READBACK_METHOD=device, but this reader has no device copy");
+    }
+    throw std::runtime_error("Unknown READBACK_METHOD=" + name + ", expected derive, getimage or device");
+}
+
+// Call at startup, before any work, so a bad READBACK_METHOD fails there and not at the first read
+inline void checkReadbackMethodEnv(bool hasDeviceCopy) {
+    readbackMethodFromEnv(hasDeviceCopy);
+}
+
+// A surface's pixels in host memory: one object, planes as in layout
+struct HostFrame {
+    const uint8_t* base;
+    PrimeFrameLayout layout;
+
+    const uint8_t* plane(uint32_t p) const { return base + layout.planes[p].offset; }
+    uint32_t pitch(uint32_t p) const { return layout.planes[p].pitch; }
+};
+
+class SurfaceReadback {
+public:
+    // Copies the surface into host memory it owns and returns a view of it
+    typedef std::function<HostFrame(VASurfaceID)> DeviceCopy;
+
+    // Reads the top-left width x height of surfaces of the given fourcc
+    SurfaceReadback(VADisplay va_dpy, uint32_t fourcc, uint32_t width, uint32_t height) : va_dpy_(va_dpy) {
+        hostBytes_ = linearPrimeFrameLayout(host_.layout, fourcc, width, height);
+        host_.base = hostBuffer_ = static_cast<uint8_t*>(aligned_alloc(64, (hostBytes_ + 63) / 64 * 64));
+        if (!hostBuffer_) {
+            throw std::runtime_error("Failed to allocate the readback buffer");
+        }
+        for (double& ms : ms_) {
+            ms = -1;
+        }
+        image_.image_id = VA_INVALID_ID;
+    }
+
+    ~SurfaceReadback() {
+        if (image_.image_id != VA_INVALID_ID) {
+            vaDestroyImage(va_dpy_, image_.image_id);
+        }
+        free(hostBuffer_);
+    }
+
+    SurfaceReadback(const SurfaceReadback&) = delete;
+    SurfaceReadback& operator=(const SurfaceReadback&) = delete;
+
+    // Offer a device copy as a third method; call before the first read()
+    void setDeviceCopy(DeviceCopy copy) { deviceCopy_ = std::move(copy); }
+
+    // Always read with method, without measuring, e.g. to keep a baseline fixed across machines
+    void use(ReadbackMethod method) {
+        method_ = method;
+        forcedBy_ = "the caller";
+        calibrated_ = true;
+    }
+
+    // Time every available method on surface and keep the fastest. read() does this on first use.
+    ReadbackMethod calibrate(VASurfaceID surface, int runs = 3) {
+        TRACE_SCOPE("SurfaceReadback calibrate");
+        if (std::optional<ReadbackMethod> forced = readbackMethodFromEnv(bool(deviceCopy_))) {
+            method_ = *forced;
+            forcedBy_ = "READBACK_METHOD";
+            calibrated_ = true;
+            return method_;
+        }
+
+        double best = -1;
+        for (ReadbackMethod method : {ReadbackMethod::DeriveMap, ReadbackMethod::GetImage, ReadbackMethod::Device}) {
+            if (method == ReadbackMethod::Device && !deviceCopy_) {
+                continue;
+            }
+            double fastest = -1;
+            try {
+                readWith(method, surface);  // Warm-up: image creation, first mapping
+                for (int i = 0; i < runs; ++i) {
+                    auto start = std::chrono::steady_clock::now();
+                    readWith(method, surface);
+                    double ms =
+                        std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+                    fastest = fastest < 0 ? ms : std::min(fastest, ms);
+                }
+            } catch (const std::exception& e) {
+                errors_[int(method)] = e.what();
+                continue;
+            }
+            ms_[int(method)] = fastest;
+            if (best < 0 || fastest < best) {
+                best = fastest;
+                method_ = method;
+            }
+        }
+        if (best < 0) {
+            throw std::runtime_error("No readback method works: " + describe());
+        }
+        calibrated_ = true;
+        return method_;
+    }
+
+    // The surface's pixels, copied with the chosen method. Valid until the next read().
+    HostFrame read(VASurfaceID surface) {
+        if (!calibrated_) {
+            calibrate(surface);
+        }
+        return readWith(method_, surface);
+    }
+
+    // Hand the surface's rows straight from the mapping to sink(plane, y, row, rowBytes), for
+    // callers that lay the pixels out in memory of their own: one copy instead of two. Copy
+    // rows out with streamingCopy(). Uses the chosen method; the device copy has no mapping,
+    // so it falls back to get-image.
+    template <typename RowSink>
+    void readRows(VASurfaceID surface, RowSink&& sink) {
+        if (!calibrated_) {
+            calibrate(surface);
+        }
+        const ReadbackMethod method = method_ == ReadbackMethod::Device ? ReadbackMethod::GetImage : method_;
+        withMapping(method, surface,
+                    [this, &sink](const uint8_t* mapped, const VAImage& image) { forEachRow(mapped, image, sink); });
+    }
+
+    ReadbackMethod method() const { return method_; }
+
+    // e.g. "derive-map 4.10 ms, get-image 1.20 ms, device n/a -> get-image (streaming loads)"
+    std::string describe() const {
+        std::string text;
+        if (forcedBy_) {
+            text = std::string("forced by ") + forcedBy_;
+        }
+        for (ReadbackMethod method : {ReadbackMethod::DeriveMap, ReadbackMethod::GetImage, ReadbackMethod::Device}) {
+            if (forcedBy_) {
+                break;
+            }
+            char timing[64];
+            if (ms_[int(method)] >= 0) {
+                snprintf(timing, sizeof(timing), "%s %.2f ms", readbackMethodName(method), ms_[int(method)]);
+            } else {
+                snprintf(timing, sizeof(timing), "%s n/a", readbackMethodName(method));
+            }
+            text += (text.empty() ? "" : ", ") + std::string(timing);
+        }
+        if (calibrated_) {
+            text += std::string(" -> ") + readbackMethodName(method_) +
+                    (streamingLoadsSupported() ? " (streaming loads)" : " (memcpy)");
+        }
+        return text;
+    }
+
+    // Why a method was left out of the measurement, empty if it was not
+    const std::string& error(ReadbackMethod method) const { return errors_[int(method)]; }
+
+private:
+    HostFrame readWith(ReadbackMethod method, VASurfaceID surface) {
+        if (method == ReadbackMethod::Device) {
+            if (!deviceCopy_) {
+                throw std::runtime_error("No device copy was set");
+            }
+            TRACE_SCOPE("readback device");
+            return deviceCopy_(surface);
+        }
+
+        withMapping(method, surface,
+                    [this](const uint8_t* mapped, const VAImage& image) { copyPlanes(mapped, image); });
+        return host_;
+    }
+
+    // Map the surface's pixels with derive-map or get-image and hand them to use(mapped, image)
+    template <typename Use>
+    void withMapping(ReadbackMethod method, VASurfaceID surface, Use&& use) {
+        VAImage derived;
+        const VAImage* image = &derived;
+        if (method == ReadbackMethod::DeriveMap) {
+            TRACE_SCOPE("vaDeriveImage");
+            vaSyncSurface(va_dpy_, surface);
+            check(vaDeriveImage(va_dpy_, surface, &derived), "vaDeriveImage");
+            if (derived.format.fourcc != host_.layout.vaFourcc || derived.width < host_.layout.width ||
+                derived.height < host_.layout.height) {
+                vaDestroyImage(va_dpy_, derived.image_id);
+                throw std::runtime_error("vaDeriveImage gave a different format or size");
+            }
+        } else {
+            createImage();
+            TRACE_SCOPE("vaGetImage");
+            check(vaGetImage(va_dpy_, surface, 0, 0, host_.layout.width, host_.layout.height, image_.image_id),
+                  "vaGetImage");
+            image = &image_;
+        }
+
+        void* mapped = nullptr;
+        VAStatus status;
+        {
+            TRACE_SCOPE("vaMapBuffer");
+            status = vaMapBuffer(va_dpy_, image->buf, &mapped);
+        }
+        if (status == VA_STATUS_SUCCESS) {
+            TRACE_SCOPE("readback copy");
+            try {
+                use(static_cast<const uint8_t*>(mapped), *image);
+            } catch (...) {
+                vaUnmapBuffer(va_dpy_, image->buf);
+                if (method == ReadbackMethod::DeriveMap) {
+                    vaDestroyImage(va_dpy_, derived.image_id);
+                }
+                throw;
+            }
+            vaUnmapBuffer(va_dpy_, image->buf);
+        }
+        if (method == ReadbackMethod::DeriveMap) {
+            vaDestroyImage(va_dpy_, derived.image_id);
+        }
+        check(status, "vaMapBuffer");
+    }
+
+    // Every row of the mapped image within the readback's size: sink(plane, y, row, rowBytes)
+    template <typename RowSink>
+    void forEachRow(const uint8_t* mapped, const VAImage& image, RowSink&& sink) const {
+        streamingLoadFence();
+        const PrimeFormatInfo info = primeFormatInfo(host_.layout.vaFourcc);
+        for (uint32_t p = 0; p < host_.layout.numPlanes; ++p) {
+            const PrimePlane& plane = host_.layout.planes[p];
+            const size_t rowBytes = size_t(plane.width) * info.bytesPerSample * (p > 0 ? 2 : 1);
+            const uint8_t* src = mapped + image.offsets[p];
+            for (uint32_t y = 0; y < plane.height; ++y) {
+                sink(p, y, src + size_t(y) * image.pitches[p], rowBytes);
+            }
+        }
+    }
+
+    // Row by row: the image's pitch is the driver's, the host buffer's is ours
+    void copyPlanes(const uint8_t* mapped, const VAImage& image) {
+        forEachRow(mapped, image, [this](uint32_t p, uint32_t y, const uint8_t* row, size_t rowBytes) {
+            const PrimePlane& plane = host_.layout.planes[p];
+            streamingCopy(hostBuffer_ + plane.offset + size_t(y) * plane.pitch, row, rowBytes);
+        });
+    }
+
+    // The pooled image for vaGetImage, in a format the driver lists
+    void createImage() {
+        if (image_.image_id != VA_INVALID_ID) {
+            return;
+        }
+        std::vector<VAImageFormat> formats(vaMaxNumImageFormats(va_dpy_));
+        int count = 0;
+        check(vaQueryImageFormats(va_dpy_, formats.data(), &count), "vaQueryImageFormats");
+        for (int i = 0; i < count; ++i) {
+            if (formats[i].fourcc == host_.layout.vaFourcc) {
+                VAImageFormat format = formats[i];
+                check(vaCreateImage(va_dpy_, &format, host_.layout.width, host_.layout.height, &image_),
+                      "vaCreateImage");
+                return;
+            }
+        }
+        throw std::runtime_error("The driver has no image format for fourcc " +
+                                 std::to_string(host_.layout.vaFourcc));
+    }
+
+    static void check(VAStatus status, const char* what) {
+        if (status != VA_STATUS_SUCCESS) {
+            throw std::runtime_error(std::string(what) + " failed: " + std::to_string(status));
+        }
+    }
+
+    VADisplay va_dpy_;
+    HostFrame host_;
+    uint8_t* hostBuffer_ = nullptr;
+    size_t hostBytes_ = 0;
+    VAImage image_ = {};  // image_id is VA_INVALID_ID until get-image creates it
+    DeviceCopy deviceCopy_;
+
+    ReadbackMethod method_ = ReadbackMethod::DeriveMap;
+    bool calibrated_ = false;
+    const char* forcedBy_ = nullptr;  // Who skipped the measurement, if anyone
+    double ms_[3];                  // Best time per method, -1 when not measured
+    std::string errors_[3];
+};
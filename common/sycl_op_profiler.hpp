@@ -0,0 +1,128 @@
+#pragma once
+
+// SYCL event profiling.
+//
+// Create the queue with syclProfilingProperties(), hand every event returned by
+// queue::submit to record() together with its queue and call collect() once the
+// results are needed. command_start / command_end are nanoseconds of the
+// device's clock, not the host's. collect() reads one host/device timestamp pair
+// per device with zeDeviceGetGlobalTimestamps, as ZeOpProfiler does, and maps
+// them to host nanoseconds before pushing them into OpRecordBuffer, so SYCL and
+// L0 records share one time base. The queue's device must therefore be on the
+// Level Zero backend.
+//
+// Without OP_PROFILING, the queue is created without enable_profiling and
+// record()/collect() do nothing.
+
+#include <vector>
+
+#include <sycl/sycl.hpp>
+
+#include "op_profiler.hpp"
+
+#ifdef OP_PROFILING
+
+#include <cstdint>
+#include <map>
+#include <stdexcept>
+#include <string>
+
+#include <level_zero/ze_api.h>
+#include <sycl/ext/oneapi/backend/level_zero.hpp>
+
+inline sycl::property_list syclProfilingProperties() {
+    return sycl::property_list{sycl::property::queue::enable_profiling()};
+}
+
+class SyclOpProfiler {
+public:
+    ~SyclOpProfiler() { collect(); }
+
+    // event must come from queue; throws unless the queue's device is a Level Zero device
+    void record(const sycl::queue& queue, const char* name, const sycl::event& event) {
+        const sycl::device device = queue.get_device();
+        if (device.get_backend() != sycl::backend::ext_oneapi_level_zero) {
+            throw std::runtime_error("SYCL op profiling maps device timestamps with Level Zero; "
+                                     "run on the level_zero backend (ONEAPI_DEVICE_SELECTOR=level_zero:gpu)");
+        }
+        ze_device_handle_t zeDevice = sycl::get_native<sycl::backend::ext_oneapi_level_zero>(device);
+        if (!clocks_.count(zeDevice)) {
+            clocks_[zeDevice] = deviceClock(zeDevice);
+        }
+        pending_.push_back({name, event, zeDevice});
+    }
+
+    // Wait for the recorded events and move their timestamps, in host time, into OpRecordBuffer
+    void collect() {
+        if (pending_.empty()) {
+            return;
+        }
+        for (Pending& p : pending_) {
+            p.event.wait();
+        }
+
+        // Correlate after the events completed, so every timestamp lies before the reference point
+        for (auto& [device, clock] : clocks_) {
+            zeDeviceGetGlobalTimestamps(device, &clock.hostNow, &clock.deviceNow);
+        }
+
+        for (Pending& p : pending_) {
+            const DeviceClock& clock = clocks_.at(p.device);
+            uint64_t start = p.event.get_profiling_info<sycl::info::event_profiling::command_start>();
+            uint64_t end = p.event.get_profiling_info<sycl::info::event_profiling::command_end>();
+            OpRecordBuffer::instance().push({p.name, "SYCL", toHostNs(clock, start), toHostNs(clock, end)});
+        }
+        pending_.clear();
+    }
+
+private:
+    typedef struct {
+        const char* name;
+        sycl::event event;
+        ze_device_handle_t device;
+    } Pending;
+
+    typedef struct {
+        double nsPerTick;
+        uint64_t mask;          // kernelTimestampValidBits, as for ZeOpProfiler
+        uint64_t hostNow;
+        uint64_t deviceNow;
+    } DeviceClock;
+
+    static DeviceClock deviceClock(ze_device_handle_t device) {
+        // With ZE_STRUCTURE_TYPE_DEVICE_PROPERTIES the timer resolution is in ns per tick
+        ze_device_properties_t props = {};
+        props.stype = ZE_STRUCTURE_TYPE_DEVICE_PROPERTIES;
+        ze_result_t result = zeDeviceGetProperties(device, &props);
+        if (result != ZE_RESULT_SUCCESS) {
+            throw std::runtime_error("Failed to query device properties: " + std::to_string(result));
+        }
+        DeviceClock clock = {};
+        clock.nsPerTick = static_cast<double>(props.timerResolution);
+        clock.mask = props.kernelTimestampValidBits >= 64 ? ~0ULL : (1ULL << props.kernelTimestampValidBits) - 1;
+        return clock;
+    }
+
+    // SYCL reports the kernel timestamp ticks scaled to ns; back to ticks, then to host time
+    static uint64_t toHostNs(const DeviceClock& clock, uint64_t deviceNs) {
+        const uint64_t ticks = static_cast<uint64_t>(deviceNs / clock.nsPerTick + 0.5);
+        return deviceTicksToHostNs(ticks, clock.hostNow, clock.deviceNow, clock.nsPerTick, clock.mask);
+    }
+
+    std::vector<Pending> pending_;
+    std::map<ze_device_handle_t, DeviceClock> clocks_;
+};
+
+#else
+
+inline sycl::property_list syclProfilingProperties() {
+    return sycl::property_list{};
+}
+
+class SyclOpProfiler {
+public:
+    void record(const sycl::queue&, const char*, const sycl::event&) {}
+    void collect() {}
+};
+
+#endif
@@ -0,0 +1,225 @@
+#pragma once
+
+// Span tracing with per-thread ring buffers, flushed as Chrome trace-event JSON
+// (load the file in chrome://tracing or ui.perfetto.dev).
+//
+//   TRACE_SCOPE("vaExportSurfaceHandle");   // records the enclosing scope as one span
+//   ...
+//   traceFlushFromEnv();                    // writes $TRACE_FILE, if set
+//
+// Recording a span takes two timestamp reads and a few stores into the calling
+// thread's ring; there are no locks or allocations after a thread's first span.
+// Each ring has one writer (its thread). Every slot is a small seqlock, so the
+// flusher only reads and skips slots that were being overwritten while it
+// copied them. When a ring is full the oldest spans are dropped. Span names
+// must be string literals.
+//
+// Define TRACE_DISABLED to compile every TRACE_SCOPE out.
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace trace {
+
+typedef struct {
+    const char* name;
+    uint64_t start; // Raw clock ticks, converted at flush time
+    uint64_t end;
+} Span;
+
+// Raw timestamp: the TSC on x86, nanoseconds elsewhere
+inline uint64_t now() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+inline uint64_t steadyNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+class Ring {
+public:
+    static constexpr uint64_t kCapacity = 1 << 14; // Power of two
+
+    explicit Ring(uint32_t tid) : tid_(tid), slots_(new Slot[kCapacity]) {}
+
+    // Writer side, only ever called by the owning thread
+    void push(const char* name, uint64_t start, uint64_t end) {
+        uint64_t head = head_.load(std::memory_order_relaxed);
+        Slot& slot = slots_[head & (kCapacity - 1)];
+        // Odd while the slot is being written, 2 * (position + 1) once it holds that position
+        slot.seq.store(2 * head + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        std::atomic_ref<const char*>(slot.span.name).store(name, std::memory_order_relaxed);
+        std::atomic_ref<uint64_t>(slot.span.start).store(start, std::memory_order_relaxed);
+        std::atomic_ref<uint64_t>(slot.span.end).store(end, std::memory_order_relaxed);
+        slot.seq.store(2 * head + 2, std::memory_order_release);
+        head_.store(head + 1, std::memory_order_release);
+    }
+
+    // Reader side: copy the spans that are still intact
+    void snapshot(std::vector<Span>& out) const {
+        uint64_t head = head_.load(std::memory_order_acquire);
+        uint64_t first = head > kCapacity ? head - kCapacity : 0;
+        for (uint64_t i = first; i < head; ++i) {
+            Slot& slot = slots_[i & (kCapacity - 1)];
+            const uint64_t seq = slot.seq.load(std::memory_order_acquire);
+            if (seq != 2 * i + 2) {
+                continue; // Already reused by the writer
+            }
+            Span span;
+            span.name = std::atomic_ref<const char*>(slot.span.name).load(std::memory_order_relaxed);
+            span.start = std::atomic_ref<uint64_t>(slot.span.start).load(std::memory_order_relaxed);
+            span.end = std::atomic_ref<uint64_t>(slot.span.end).load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.seq.load(std::memory_order_relaxed) == seq) {
+                out.push_back(span);
+            }
+        }
+    }
+
+    uint32_t tid() const { return tid_; }
+
+private:
+    typedef struct {
+        std::atomic<uint64_t> seq{0};
+        Span span = {};
+    } Slot;
+
+    uint32_t tid_;
+    std::unique_ptr<Slot[]> slots_;
+    std::atomic<uint64_t> head_{0};
+};
+
+class Registry {
+public:
+    static Registry& instance() {
+        static Registry registry;
+        return registry;
+    }
+
+    // Rings stay registered after their thread exits so its spans can still be flushed
+    Ring* add() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        rings_.push_back(std::make_unique<Ring>(static_cast<uint32_t>(rings_.size())));
+        return rings_.back().get();
+    }
+
+    // Write every ring as Chrome trace-event JSON
+    bool flush(const std::string& path) {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        FILE* file = fopen(path.c_str(), "w");
+        if (!file) {
+            return false;
+        }
+
+        // Map raw ticks to microseconds using the two calibration points
+        uint64_t ticksNow = now();
+        uint64_t nsNow = steadyNs();
+        double nsPerTick = ticksNow > ticks0_ ? double(nsNow - ns0_) / double(ticksNow - ticks0_) : 1.0;
+
+        fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+        const int pid = getpid();
+        bool first = true;
+        std::vector<Span> spans;
+        for (const auto& ring : rings_) {
+            spans.clear();
+            ring->snapshot(spans);
+            for (const Span& span : spans) {
+                double ts = (span.start - ticks0_) * nsPerTick / 1e3;
+                double dur = (span.end - span.start) * nsPerTick / 1e3;
+                fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%u}",
+                        first ? "" : ",\n", escape(span.name).c_str(), ts, dur, pid, ring->tid());
+                first = false;
+            }
+        }
+        fprintf(file, "\n]}\n");
+        fclose(file);
+        return true;
+    }
+
+private:
+    Registry() : ticks0_(now()), ns0_(steadyNs()) {}
+
+    static std::string escape(const char* name) {
+        std::string out;
+        for (const char* c = name; *c; ++c) {
+            if (*c == '"' || *c == '\\') {
+                out += '\\';
+            }
+            out += *c;
+        }
+        return out;
+    }
+
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<Ring>> rings_;
+    uint64_t ticks0_;
+    uint64_t ns0_;
+};
+
+inline Ring& threadRing() {
+    thread_local Ring* ring = Registry::instance().add();
+    return *ring;
+}
+
+// Records the lifetime of the scope as one span
+class Scope {
+public:
+    explicit Scope(const char* name) : name_(name), ring_(threadRing()), start_(now()) {}
+    ~Scope() { ring_.push(name_, start_, now()); }
+
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+
+private:
+    const char* name_;
+    Ring& ring_;
+    uint64_t start_;
+};
+
+} // namespace trace
+
+inline bool traceFlush(const std::string& path) {
+    return trace::Registry::instance().flush(path);
+}
+
+// Flush to $TRACE_FILE when it is set
+inline void traceFlushFromEnv() {
+    const char* path = getenv("TRACE_FILE");
+    if (path && *path) {
+        if (traceFlush(path)) {
+            printf("Trace written to %s\n", path);
+        } else {
+            fprintf(stderr, "Failed to write trace to %s\n", path);
+        }
+    }
+}
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+
+#ifdef TRACE_DISABLED
+#define TRACE_SCOPE(name) do { } while (0)
+#else
+#define TRACE_SCOPE(name) trace::Scope TRACE_CONCAT(traceScope_, __LINE__)(name)
+#endif
@@ -0,0 +1,106 @@
+#pragma once
+
+// What a VA driver accepts for external surfaces, and the modifier both sides agree on.
+//
+// queryVaSurfaceCaps() asks vaQuerySurfaceAttributes (on a VideoProc config)
+// which memory types and pixel formats the driver supports and, on drivers
+// that report them, which DRM format modifiers. chooseDrmModifier() then
+// picks the fastest modifier from preferredDrmModifiers() that both the
+// driver and the consumer handle. Drivers that do not report modifiers get
+// DRM_FORMAT_MOD_LINEAR, which every driver that accepts PRIME buffers takes.
+// When the two sides share nothing (say a Tile4-only driver and a linear USM
+// buffer) it returns DRM_FORMAT_MOD_INVALID, and the caller has to copy
+// instead of sharing the buffer.
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include <drm_fourcc.h>
+
+extern "C" {
+#include <va/va.h>
+#include <va/va_drmcommon.h>
+}
+
+typedef struct {
+    uint32_t memTypes;                 // VA_SURFACE_ATTRIB_MEM_TYPE_* bitmask, 0 if not reported
+    std::vector<uint32_t> fourccs;     // Supported pixel formats
+    std::vector<uint64_t> modifiers;   // Reported modifiers, empty if the driver does not report any
+    bool prime2;                       // DRM PRIME_2 (VADRMPRIMESurfaceDescriptor) import/export
+    bool prime;                        // Legacy DRM PRIME (VASurfaceAttribExternalBuffers)
+} VaSurfaceCaps;
+
+inline VaSurfaceCaps queryVaSurfaceCaps(VADisplay va_dpy) {
+    VaSurfaceCaps caps = {};
+
+    VAConfigID config = VA_INVALID_ID;
+    if (vaCreateConfig(va_dpy, VAProfileNone, VAEntrypointVideoProc, nullptr, 0, &config) != VA_STATUS_SUCCESS) {
+        // No VideoProc entrypoint to query: assume the PRIME_2 baseline of current drivers
+        caps.prime2 = true;
+        return caps;
+    }
+
+    unsigned int count = 0;
+    std::vector<VASurfaceAttrib> attribs;
+    if (vaQuerySurfaceAttributes(va_dpy, config, nullptr, &count) == VA_STATUS_SUCCESS && count > 0) {
+        attribs.resize(count);
+        if (vaQuerySurfaceAttributes(va_dpy, config, attribs.data(), &count) != VA_STATUS_SUCCESS) {
+            count = 0;
+        }
+    }
+
+    for (unsigned int i = 0; i < count; ++i) {
+        const VASurfaceAttrib& attrib = attribs[i];
+        if (attrib.type == VASurfaceAttribMemoryType && attrib.value.type == VAGenericValueTypeInteger) {
+            caps.memTypes = static_cast<uint32_t>(attrib.value.value.i);
+        } else if (attrib.type == VASurfaceAttribPixelFormat && attrib.value.type == VAGenericValueTypeInteger) {
+            caps.fourccs.push_back(static_cast<uint32_t>(attrib.value.value.i));
+        } else if (attrib.type == VASurfaceAttribDRMFormatModifiers && attrib.value.type == VAGenericValueTypePointer &&
+                   attrib.value.value.p) {
+            const VADRMFormatModifierList* list = static_cast<const VADRMFormatModifierList*>(attrib.value.value.p);
+            caps.modifiers.assign(list->modifiers, list->modifiers + list->num_modifiers);
+        }
+    }
+    vaDestroyConfig(va_dpy, config);
+
+    if (caps.memTypes == 0) {
+        caps.prime2 = true;
+    } else {
+        caps.prime2 = (caps.memTypes & VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME_2) != 0;
+        caps.prime = (caps.memTypes & VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME) != 0;
+    }
+    return caps;
+}
+
+inline bool vaSupportsFourcc(const VaSurfaceCaps& caps, uint32_t fourcc) {
+    // An empty list means the driver did not say, so let vaCreateSurfaces decide
+    return caps.fourccs.empty() || std::find(caps.fourccs.begin(), caps.fourccs.end(), fourcc) != caps.fourccs.end();
+}
+
+// Fastest first: Tile4 (DG2 and later), Y-tile (Gen9-Gen12), linear
+inline const std::vector<uint64_t>& preferredDrmModifiers() {
+    static const std::vector<uint64_t> modifiers = {I915_FORMAT_MOD_4_TILED, I915_FORMAT_MOD_Y_TILED,
+                                                    DRM_FORMAT_MOD_LINEAR};
+    return modifiers;
+}
+
+// The VA side's modifiers that the consumer also handles, fastest first
+inline std::vector<uint64_t> commonDrmModifiers(const VaSurfaceCaps& caps, const std::vector<uint64_t>& consumer) {
+    std::vector<uint64_t> common;
+    for (uint64_t modifier : preferredDrmModifiers()) {
+        bool va = caps.modifiers.empty() ? modifier == DRM_FORMAT_MOD_LINEAR
+                                         : std::find(caps.modifiers.begin(), caps.modifiers.end(), modifier) !=
+                                               caps.modifiers.end();
+        if (va && std::find(consumer.begin(), consumer.end(), modifier) != consumer.end()) {
+            common.push_back(modifier);
+        }
+    }
+    return common;
+}
+
+// Fastest modifier both sides handle, DRM_FORMAT_MOD_INVALID when they share none
+inline uint64_t chooseDrmModifier(const VaSurfaceCaps& caps, const std::vector<uint64_t>& consumer) {
+    std::vector<uint64_t> common = commonDrmModifiers(caps, consumer);
+    return common.empty() ? DRM_FORMAT_MOD_INVALID : common.front();
+}
@@ -0,0 +1,343 @@
+#pragma once
+
+// Pool of VA surfaces keyed by (fourcc, rt_format, width, height, modifier).
+//
+// vaCreateSurfaces is a kernel round trip plus a buffer allocation. A
+// pipeline that converts or scales every frame should not pay it per frame.
+// The pool hands out surfaces as RAII leases. A released surface goes back to
+// an idle list instead of being destroyed. Idle surfaces are destroyed least
+// recently used first, when the pool's surfaces exceed its memory budget.
+//
+// Surfaces are created and destroyed through a VaSurfaceAllocator. A stub
+// allocator can replace vaCreateSurfaces, so the pool logic runs without a
+// driver.
+
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+
+#include <drm_fourcc.h>
+
+extern "C" {
+#include <va/va.h>
+}
+
+#include "prime_frame.hpp"
+
+typedef struct VaSurfaceKey {
+    uint32_t fourcc;
+    uint32_t rtFormat;
+    uint32_t width;
+    uint32_t height;
+    uint64_t modifier = DRM_FORMAT_MOD_INVALID;  // INVALID: the driver picks the tiling
+
+    bool operator<(const VaSurfaceKey& other) const {
+        return std::tie(fourcc, rtFormat, width, height, modifier) <
+               std::tie(other.fourcc, other.rtFormat, other.width, other.height, other.modifier);
+    }
+} VaSurfaceKey;
+
+// Key with the rt_format the fourcc needs (NV12, P010, RGBA, BGRA)
+inline VaSurfaceKey vaSurfaceKey(uint32_t fourcc, uint32_t width, uint32_t height,
+                                 uint64_t modifier = DRM_FORMAT_MOD_INVALID) {
+    return {fourcc, primeFormatInfo(fourcc).rtFormat, width, height, modifier};
+}
+
+typedef struct {
+    std::function<VASurfaceID(const VaSurfaceKey&)> create;  // Throws on failure
+    std::function<void(VASurfaceID)> destroy;
+    std::function<size_t(const VaSurfaceKey&)> bytes;        // Budget charge of one surface
+} VaSurfaceAllocator;
+
+// Linear estimate of a surface's size. Drivers pad pitch and height further,
+// so leave some headroom in the budget.
+inline size_t estimateVaSurfaceBytes(const VaSurfaceKey& key) {
+    try {
+        PrimeFrameLayout layout;
+        return linearPrimeFrameLayout(layout, key.fourcc, key.width, key.height);
+    } catch (const std::runtime_error&) {
+        return size_t(key.width) * key.height * 4;
+    }
+}
+
+inline VaSurfaceAllocator vaSurfaceAllocator(VADisplay va_dpy) {
+    VaSurfaceAllocator allocator;
+    allocator.create = [va_dpy](const VaSurfaceKey& key) {
+        VADRMFormatModifierList modifierList = {1, const_cast<uint64_t*>(&key.modifier)};
+        VASurfaceAttrib attribs[2];
+        attribs[0].type = VASurfaceAttribPixelFormat;
+        attribs[0].flags = VA_SURFACE_ATTRIB_SETTABLE;
+        attribs[0].value.type = VAGenericValueTypeInteger;
+        attribs[0].value.value.i = key.fourcc;
+        attribs[1].type = VASurfaceAttribDRMFormatModifiers;
+        attribs[1].flags = VA_SURFACE_ATTRIB_SETTABLE;
+        attribs[1].value.type = VAGenericValueTypePointer;
+        attribs[1].value.value.p = &modifierList;
+        const unsigned numAttribs = key.modifier == DRM_FORMAT_MOD_INVALID ? 1 : 2;
+
+        VASurfaceID surface = VA_INVALID_SURFACE;
+        VAStatus va_status = vaCreateSurfaces(va_dpy, key.rtFormat, key.width, key.height, &surface, 1, attribs,
+                                              numAttribs);
+        if (va_status != VA_STATUS_SUCCESS) {
+            throw std::runtime_error("vaCreateSurfaces failed: " + std::to_string(va_status));
+        }
+        return surface;
+    };
+    allocator.destroy = [va_dpy](VASurfaceID surface) { vaDestroySurfaces(va_dpy, &surface, 1); };
+    allocator.bytes = estimateVaSurfaceBytes;
+    return allocator;
+}
+
+typedef struct {
+    uint64_t hits;        // Leases served from an idle surface
+    uint64_t misses;      // Leases that had to create a surface
+    uint64_t created;     // Including reserve()
+    uint64_t evicted;     // Idle surfaces destroyed by the budget or trim()
+    size_t leased;
+    size_t idle;
+    size_t bytes;         // Leased and idle
+    size_t idleBytes;
+} VaSurfacePoolStats;
+
+namespace detail {
+
+// Shared by the pool and its leases, so a lease may outlive the pool
+class VaSurfacePoolState {
+public:
+    VaSurfacePoolState(VaSurfaceAllocator allocator, size_t budget) : allocator_(std::move(allocator)), budget_(budget) {
+        if (!allocator_.bytes) {
+            allocator_.bytes = estimateVaSurfaceBytes;
+        }
+    }
+
+    ~VaSurfacePoolState() {
+        close();
+    }
+
+    VASurfaceID acquire(const VaSurfaceKey& key) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (closed_) {
+            throw std::runtime_error("VA surface pool is closed");
+        }
+        auto idle = byKey_.find(key);
+        if (idle != byKey_.end() && !idle->second.empty()) {
+            // The most recently released surface of the key is the likeliest to be cache warm
+            auto entry = idle->second.back();
+            idle->second.pop_back();
+            const VASurfaceID surface = entry->surface;
+            idleBytes_ -= entry->bytes;
+            lru_.erase(entry);
+            stats_.hits++;
+            stats_.leased++;
+            stats_.idle--;
+            return surface;
+        }
+        stats_.misses++;
+        const size_t bytes = allocator_.bytes(key);
+        // Make room first, so the new surface fits in the budget if idle ones can go
+        evictDownTo(budget_ > bytes ? budget_ - bytes : 0);
+        lock.unlock();
+
+        const VASurfaceID surface = allocator_.create(key);
+
+        lock.lock();
+        stats_.created++;
+        stats_.leased++;
+        bytes_ += bytes;
+        return surface;
+    }
+
+    void release(const VaSurfaceKey& key, VASurfaceID surface) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        const size_t bytes = allocator_.bytes(key);
+        stats_.leased--;
+        if (closed_) {
+            bytes_ -= bytes;
+            lock.unlock();
+            allocator_.destroy(surface);
+            return;
+        }
+        addIdleLocked(key, surface, bytes);
+        evictDownTo(budget_);
+    }
+
+    void reserve(const VaSurfaceKey& key, size_t count) {
+        const size_t bytes = allocator_.bytes(key);
+        for (size_t i = 0; i < count; ++i) {
+            std::unique_lock<std::mutex> lock(mutex_);
+            evictDownTo(budget_ > bytes ? budget_ - bytes : 0);
+            lock.unlock();
+
+            const VASurfaceID surface = allocator_.create(key);
+
+            lock.lock();
+            stats_.created++;
+            bytes_ += bytes;
+            addIdleLocked(key, surface, bytes);
+        }
+    }
+
+    void trim(size_t budget) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        budget_ = budget;
+        evictDownTo(budget_);
+    }
+
+    // Destroys the idle surfaces; leases still out are destroyed when they are released
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        evictDownTo(0);
+    }
+
+    VaSurfacePoolStats stats() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        VaSurfacePoolStats stats = stats_;
+        stats.bytes = bytes_;
+        stats.idleBytes = idleBytes_;
+        return stats;
+    }
+
+private:
+    struct IdleEntry;
+    typedef std::list<IdleEntry>::iterator LruIterator;
+    struct IdleEntry {
+        VaSurfaceKey key;
+        VASurfaceID surface;
+        size_t bytes;
+        std::list<LruIterator>::iterator keyEntry;
+    };
+
+    void addIdleLocked(const VaSurfaceKey& key, VASurfaceID surface, size_t bytes) {
+        lru_.push_front({key, surface, bytes, {}});
+        auto& list = byKey_[key];
+        list.push_back(lru_.begin());
+        lru_.front().keyEntry = std::prev(list.end());
+        idleBytes_ += bytes;
+        stats_.idle++;
+    }
+
+    // Destroy least recently used idle surfaces until the pool holds at most target bytes
+    void evictDownTo(size_t target) {
+        while (!lru_.empty() && bytes_ > target) {
+            IdleEntry& oldest = lru_.back();
+            auto idle = byKey_.find(oldest.key);
+            idle->second.erase(oldest.keyEntry);
+            if (idle->second.empty()) {
+                byKey_.erase(idle);
+            }
+            bytes_ -= oldest.bytes;
+            idleBytes_ -= oldest.bytes;
+            stats_.idle--;
+            stats_.evicted++;
+            // Destroying under the lock keeps the budget exact; vaDestroySurfaces does not block on the GPU
+            allocator_.destroy(oldest.surface);
+            lru_.pop_back();
+        }
+    }
+
+    VaSurfaceAllocator allocator_;
+    size_t budget_;
+    std::mutex mutex_;
+    std::list<IdleEntry> lru_;                              // Front: most recently released
+    std::map<VaSurfaceKey, std::list<LruIterator>> byKey_;  // Idle surfaces per key, oldest first
+    VaSurfacePoolStats stats_ = {};
+    size_t bytes_ = 0;
+    size_t idleBytes_ = 0;
+    bool closed_ = false;
+};
+
+} // namespace detail
+
+// A surface borrowed from a VaSurfacePool. Returns it on destruction or release().
+class VaSurfaceLease {
+public:
+    VaSurfaceLease() = default;
+    VaSurfaceLease(std::shared_ptr<detail::VaSurfacePoolState> pool, const VaSurfaceKey& key, VASurfaceID surface)
+        : pool_(std::move(pool)), key_(key), surface_(surface) {}
+
+    VaSurfaceLease(VaSurfaceLease&& other) noexcept
+        : pool_(std::move(other.pool_)), key_(other.key_), surface_(other.surface_) {
+        other.surface_ = VA_INVALID_SURFACE;
+    }
+
+    VaSurfaceLease& operator=(VaSurfaceLease&& other) noexcept {
+        if (this != &other) {
+            release();
+            pool_ = std::move(other.pool_);
+            key_ = other.key_;
+            surface_ = other.surface_;
+            other.surface_ = VA_INVALID_SURFACE;
+        }
+        return *this;
+    }
+
+    VaSurfaceLease(const VaSurfaceLease&) = delete;
+    VaSurfaceLease& operator=(const VaSurfaceLease&) = delete;
+
+    ~VaSurfaceLease() {
+        release();
+    }
+
+    void release() {
+        if (surface_ != VA_INVALID_SURFACE) {
+            pool_->release(key_, surface_);
+            surface_ = VA_INVALID_SURFACE;
+        }
+        pool_.reset();
+    }
+
+    VASurfaceID surface() const { return surface_; }
+    const VaSurfaceKey& key() const { return key_; }
+    explicit operator bool() const { return surface_ != VA_INVALID_SURFACE; }
+
+private:
+    std::shared_ptr<detail::VaSurfacePoolState> pool_;
+    VaSurfaceKey key_ = {};
+    VASurfaceID surface_ = VA_INVALID_SURFACE;
+};
+
+// budgetBytes caps the leased and idle surfaces together. Leases are never
+// refused: when they alone exceed the budget, every idle surface is destroyed
+// and the pool runs over budget until leases come back.
+class VaSurfacePool {
+public:
+    VaSurfacePool(VaSurfaceAllocator allocator, size_t budgetBytes)
+        : state_(std::make_shared<detail::VaSurfacePoolState>(std::move(allocator), budgetBytes)) {}
+
+    VaSurfacePool(VADisplay va_dpy, size_t budgetBytes) : VaSurfacePool(vaSurfaceAllocator(va_dpy), budgetBytes) {}
+
+    ~VaSurfacePool() {
+        state_->close();
+    }
+
+    VaSurfacePool(const VaSurfacePool&) = delete;
+    VaSurfacePool& operator=(const VaSurfacePool&) = delete;
+
+    // Pre-allocate count idle surfaces of a key, e.g. a pipeline's depth before the first frame
+    void reserve(const VaSurfaceKey& key, size_t count) { state_->reserve(key, count); }
+
+    VaSurfaceLease acquire(const VaSurfaceKey& key) { return VaSurfaceLease(state_, key, state_->acquire(key)); }
+
+    // Set a new budget and destroy idle surfaces down to it
+    void trim(size_t budgetBytes) { state_->trim(budgetBytes); }
+
+    VaSurfacePoolStats stats() const { return state_->stats(); }
+
+private:
+    std::shared_ptr<detail::VaSurfacePoolState> state_;
+};
+
+inline void printVaSurfacePoolStats(const VaSurfacePoolStats& stats) {
+    std::cout << "Surface pool: " << stats.hits << " hit(s), " << stats.misses << " miss(es), " << stats.created
+              << " created, " << stats.evicted << " evicted, " << stats.leased << " leased, " << stats.idle
+              << " idle, " << stats.bytes / 1024 << " KiB (" << stats.idleBytes / 1024 << " KiB idle)" << std::endl;
+}
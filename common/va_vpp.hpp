@@ -0,0 +1,316 @@
+#pragma once
+
+// Colour conversion and scaling of decoded surfaces on the GPU's video
+// processing (VPP) engines, as a stage of a decode loop.
+//
+// A stage has one or more outputs, each with its own size, fourcc, source
+// crop and optional letterbox (e.g. 640x640 for a detector, 224x224 for a
+// classifier and a thumbnail). The config, the context and one pipeline
+// parameter buffer per output are created once. Each submit() only updates
+// the buffers with the source surface and queues one picture per output with
+// vaBeginPicture/vaRenderPicture/vaEndPicture, back to back. VA-API renders
+// one target per picture, so the engine reads the source once per output;
+// there is no per-frame setup and no wait between the outputs. Destinations
+// come from a VaSurfacePool, so steady state creates no surfaces. Nothing
+// waits for the GPU at submit time: VppFrame::ready() syncs an output when a
+// consumer first needs it.
+//
+// The scaling option is the pipeline's filter_flags, a quality hint for the
+// scaling algorithm (fast, default or high quality). It does not select an
+// engine: the driver picks SFC, VEBox or the render engine from the formats,
+// the sizes and the hint, and intel_gpu_top shows which one ran.
+// The input size comes from the decoder; decoded surfaces are often larger
+// than the picture (e.g. 1088 rows for 1080p).
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <va/va.h>
+#include <va/va_vpp.h>
+}
+
+#include "trace.hpp"
+#include "va_surface_pool.hpp"
+
+enum class VppScaling { Fast, Default, Quality };
+
+inline const char* vppScalingName(VppScaling scaling) {
+    switch (scaling) {
+    case VppScaling::Fast:
+        return "fast";
+    case VppScaling::Quality:
+        return "hq";
+    default:
+        return "default";
+    }
+}
+
+// VA_FILTER_SCALING_* for the pipeline's filter_flags
+inline uint32_t vppScalingFlags(VppScaling scaling) {
+    switch (scaling) {
+    case VppScaling::Fast:
+        return VA_FILTER_SCALING_FAST;
+    case VppScaling::Quality:
+        return VA_FILTER_SCALING_HQ;
+    default:
+        return VA_FILTER_SCALING_DEFAULT;
+    }
+}
+
+typedef struct {
+    uint32_t width = 0;             // 0: the input size
+    uint32_t height = 0;
+    uint32_t fourcc = VA_FOURCC_RGBA;  // RGBA, BGRA or NV12
+    VARectangle crop = {};          // Source region; width or height 0: the whole picture
+    bool letterbox = false;         // Keep the crop's aspect ratio and pad with black bars
+} VppOutput;
+
+// Where an output reads from and writes to
+typedef struct {
+    VARectangle source;
+    VARectangle target;             // Inside the output; smaller than it when letterboxed
+} VppPlacement;
+
+// The regions of an output for a picture of inWidth x inHeight, shared by the stage and the CPU reference
+inline VppPlacement vppPlacement(const VppOutput& output, uint32_t inWidth, uint32_t inHeight) {
+    VppPlacement placement;
+    placement.source = output.crop;
+    if (placement.source.width == 0 || placement.source.height == 0) {
+        placement.source = {0, 0, uint16_t(inWidth), uint16_t(inHeight)};
+    }
+    const uint32_t outWidth = output.width ? output.width : placement.source.width;
+    const uint32_t outHeight = output.height ? output.height : placement.source.height;
+    placement.target = {0, 0, uint16_t(outWidth), uint16_t(outHeight)};
+    if (output.letterbox) {
+        // Fit the wider side, centre the other; even offsets and sizes keep NV12 chroma aligned
+        const uint64_t srcW = placement.source.width, srcH = placement.source.height;
+        uint32_t w = outWidth, h = outHeight;
+        if (srcW * outHeight > srcH * outWidth) {
+            h = std::max<uint32_t>(2, uint32_t(srcH * outWidth / srcW) & ~1u);
+        } else {
+            w = std::max<uint32_t>(2, uint32_t(srcW * outHeight / srcH) & ~1u);
+        }
+        placement.target = {int16_t((outWidth - w) / 2 & ~1u), int16_t((outHeight - h) / 2 & ~1u), uint16_t(w),
+                            uint16_t(h)};
+    }
+    return placement;
+}
+
+// True when the placement reads only from inside an inWidth x inHeight picture
+inline bool vppSourceInside(const VppPlacement& placement, uint32_t inWidth, uint32_t inHeight) {
+    const VARectangle& source = placement.source;
+    return source.x >= 0 && source.y >= 0 && int64_t(source.x) + source.width <= int64_t(inWidth) &&
+           int64_t(source.y) + source.height <= int64_t(inHeight);
+}
+
+typedef struct {
+    uint32_t inWidth = 0;           // Picture size from the decoder
+    uint32_t inHeight = 0;
+    std::vector<VppOutput> outputs; // Empty: one RGBA output at the input size
+    VppScaling scaling = VppScaling::Fast;  // Scaling-quality hint, not an engine choice
+    size_t depth = 4;               // Surfaces reserved up front per output: frames in flight plus the consumer's
+    size_t budgetBytes = 256 << 20; // Pool budget for all output surfaces
+} VppOptions;
+
+typedef struct {
+    uint64_t submitted = 0;         // Source frames
+    uint64_t pictures = 0;          // Outputs queued, one picture each
+    uint64_t synced = 0;            // Outputs a consumer waited for
+    double submitSeconds = 0;       // CPU time in submit()
+    double syncSeconds = 0;         // Time blocked in vaSyncSurface
+} VppStats;
+
+class VppStage;
+
+// An output surface of the stage. Returns to the pool when destroyed.
+class VppFrame {
+public:
+    VppFrame() = default;
+    VppFrame(VppFrame&&) = default;
+    VppFrame& operator=(VppFrame&&) = default;
+
+    explicit operator bool() const { return bool(lease_); }
+
+    // The surface, possibly still being written; fine to hand to more VA work on the same display
+    VASurfaceID surface() const { return lease_.surface(); }
+
+    // The surface once the conversion has finished. Only the first call waits.
+    VASurfaceID ready();
+
+private:
+    friend class VppStage;
+    VppFrame(VppStage* stage, VaSurfaceLease lease) : stage_(stage), lease_(std::move(lease)) {}
+
+    VppStage* stage_ = nullptr;
+    VaSurfaceLease lease_;
+    bool synced_ = false;
+};
+
+class VppStage {
+public:
+    VppStage(VADisplay va_dpy, const VppOptions& options)
+        : va_dpy_(va_dpy), options_(options), pool_(va_dpy, options.budgetBytes) {
+        if (options_.inWidth == 0 || options_.inHeight == 0) {
+            throw std::runtime_error("VppStage needs the decoder's picture size");
+        }
+        if (options_.outputs.empty()) {
+            options_.outputs.push_back(VppOutput());
+        }
+        // Sized once: the parameter buffers point at the regions for the stage's lifetime
+        outputs_.resize(options_.outputs.size());
+        uint32_t maxWidth = 0, maxHeight = 0;
+        for (size_t i = 0; i < outputs_.size(); ++i) {
+            VppOutput& spec = options_.outputs[i];
+            const VppPlacement placement = vppPlacement(spec, options_.inWidth, options_.inHeight);
+            if (!vppSourceInside(placement, options_.inWidth, options_.inHeight)) {
+                throw std::runtime_error("VppStage output " + std::to_string(i) + " crops outside the picture");
+            }
+            spec.width = spec.width ? spec.width : placement.source.width;
+            spec.height = spec.height ? spec.height : placement.source.height;
+            outputs_[i].source = placement.source;
+            outputs_[i].target = placement.target;
+            outputs_[i].key = vaSurfaceKey(spec.fourcc, spec.width, spec.height);
+            maxWidth = std::max(maxWidth, spec.width);
+            maxHeight = std::max(maxHeight, spec.height);
+        }
+
+        check(vaCreateConfig(va_dpy_, VAProfileNone, VAEntrypointVideoProc, nullptr, 0, &config_), "vaCreateConfig");
+        VAStatus status =
+            vaCreateContext(va_dpy_, config_, maxWidth, maxHeight, VA_PROGRESSIVE, nullptr, 0, &context_);
+        for (size_t i = 0; i < outputs_.size() && status == VA_STATUS_SUCCESS; ++i) {
+            Output& output = outputs_[i];
+            VAProcPipelineParameterBuffer params = {};
+            params.surface = VA_INVALID_SURFACE;
+            params.surface_region = &output.source;
+            params.output_region = &output.target;
+            params.output_background_color = 0xff000000;  // Opaque black around a letterboxed picture
+            params.filter_flags = vppScalingFlags(options_.scaling);
+            status = vaCreateBuffer(va_dpy_, context_, VAProcPipelineParameterBufferType, sizeof(params), 1, &params,
+                                    &output.params);
+        }
+        if (status != VA_STATUS_SUCCESS) {
+            release();
+            throw std::runtime_error("Failed to set up the VPP context: " + std::to_string(status));
+        }
+        try {
+            for (const Output& output : outputs_) {
+                pool_.reserve(output.key, options_.depth);
+            }
+        } catch (...) {
+            release();
+            throw;
+        }
+    }
+
+    ~VppStage() { release(); }
+
+    VppStage(const VppStage&) = delete;
+    VppStage& operator=(const VppStage&) = delete;
+
+    // Queue every output's conversion of a decoded surface into frames[0, outputCount()).
+    // The source must stay untouched until the outputs are ready(), e.g. by holding the
+    // decoder's AVFrame.
+    void submit(VASurfaceID source, VppFrame* frames) {
+        TRACE_SCOPE("VppStage submit");
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < outputs_.size(); ++i) {
+            Output& output = outputs_[i];
+            VaSurfaceLease lease = pool_.acquire(output.key);
+
+            VAProcPipelineParameterBuffer* params = nullptr;
+            check(vaMapBuffer(va_dpy_, output.params, (void**)&params), "vaMapBuffer");
+            params->surface = source;
+            vaUnmapBuffer(va_dpy_, output.params);
+
+            check(vaBeginPicture(va_dpy_, context_, lease.surface()), "vaBeginPicture");
+            VAStatus status = vaRenderPicture(va_dpy_, context_, &output.params, 1);
+            // EndPicture closes the picture whether or not the render succeeded
+            VAStatus endStatus = vaEndPicture(va_dpy_, context_);
+            check(status, "vaRenderPicture");
+            check(endStatus, "vaEndPicture");
+            frames[i] = VppFrame(this, std::move(lease));
+            stats_.pictures++;
+        }
+        stats_.submitted++;
+        stats_.submitSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // The single output of a one-output stage
+    VppFrame submit(VASurfaceID source) {
+        if (outputs_.size() != 1) {
+            throw std::runtime_error("VppStage has " + std::to_string(outputs_.size()) + " outputs");
+        }
+        VppFrame frame;
+        submit(source, &frame);
+        return frame;
+    }
+
+    size_t outputCount() const { return outputs_.size(); }
+    // Output i with the sizes resolved
+    const VppOutput& output(size_t i) const { return options_.outputs[i]; }
+    const VppOptions& options() const { return options_; }
+    VppStats stats() const { return stats_; }
+    VaSurfacePoolStats poolStats() const { return pool_.stats(); }
+
+private:
+    friend class VppFrame;
+
+    void sync(VASurfaceID surface) {
+        TRACE_SCOPE("VppStage sync");
+        auto start = std::chrono::steady_clock::now();
+        check(vaSyncSurface(va_dpy_, surface), "vaSyncSurface");
+        stats_.synced++;
+        stats_.syncSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    void release() {
+        for (Output& output : outputs_) {
+            if (output.params != VA_INVALID_ID) {
+                vaDestroyBuffer(va_dpy_, output.params);
+                output.params = VA_INVALID_ID;
+            }
+        }
+        if (context_ != VA_INVALID_ID) {
+            vaDestroyContext(va_dpy_, context_);
+            context_ = VA_INVALID_ID;
+        }
+        if (config_ != VA_INVALID_ID) {
+            vaDestroyConfig(va_dpy_, config_);
+            config_ = VA_INVALID_ID;
+        }
+    }
+
+    static void check(VAStatus status, const char* what) {
+        if (status != VA_STATUS_SUCCESS) {
+            throw std::runtime_error(std::string(what) + " failed: " + std::to_string(status));
+        }
+    }
+
+    typedef struct {
+        VaSurfaceKey key;
+        VABufferID params = VA_INVALID_ID;
+        VARectangle source = {};
+        VARectangle target = {};
+    } Output;
+
+    VADisplay va_dpy_;
+    VppOptions options_;
+    VaSurfacePool pool_;
+    std::vector<Output> outputs_;
+    VAConfigID config_ = VA_INVALID_ID;
+    VAContextID context_ = VA_INVALID_ID;
+    VppStats stats_;
+};
+
+inline VASurfaceID VppFrame::ready() {
+    if (!synced_ && lease_) {
+        stage_->sync(lease_.surface());
+        synced_ = true;
+    }
+    return lease_.surface();
+}
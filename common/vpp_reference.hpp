@@ -0,0 +1,117 @@
+#pragma once
+
+// CPU reference for VppStage outputs: the same crop, letterbox and format
+// conversion, from a decoded NV12 picture read back to host memory.
+//
+// Colour is limited-range BT.601, scaling is nearest neighbour at pixel
+// centres. The VPP engines filter when they scale and may use another
+// matrix, so compare with a tolerance (vppCompare) rather than bit for bit.
+// The reference is also the CPU baseline of the conversion benchmarks.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+
+#include "prime_frame.hpp"
+#include "surface_readback.hpp"
+#include "va_vpp.hpp"
+
+// Converts src into dst, laid out as dstLayout (linearPrimeFrameLayout of the output's fourcc and size)
+inline void vppReference(const HostFrame& src, uint32_t inWidth, uint32_t inHeight, const VppOutput& output,
+                         const PrimeFrameLayout& dstLayout, uint8_t* dst) {
+    if (src.layout.vaFourcc != VA_FOURCC_NV12) {
+        throw std::runtime_error("vppReference reads NV12 only");
+    }
+    const VppPlacement placement = vppPlacement(output, inWidth, inHeight);
+    const VARectangle& s = placement.source;
+    const VARectangle& t = placement.target;
+    const uint32_t outWidth = dstLayout.width, outHeight = dstLayout.height;
+    auto sourceX = [&](uint32_t x) { return s.x + (2 * (x - t.x) + 1) * s.width / (2 * t.width); };
+    auto sourceY = [&](uint32_t y) { return s.y + (2 * (y - t.y) + 1) * s.height / (2 * t.height); };
+    auto inside = [&](uint32_t x, uint32_t y) {
+        return x >= uint32_t(t.x) && x < uint32_t(t.x + t.width) && y >= uint32_t(t.y) && y < uint32_t(t.y + t.height);
+    };
+
+    if (dstLayout.vaFourcc == VA_FOURCC_NV12) {
+        uint8_t* luma = dst + dstLayout.planes[0].offset;
+        for (uint32_t y = 0; y < outHeight; ++y) {
+            uint8_t* row = luma + size_t(y) * dstLayout.planes[0].pitch;
+            for (uint32_t x = 0; x < outWidth; ++x) {
+                row[x] = inside(x, y) ? src.plane(0)[size_t(sourceY(y)) * src.pitch(0) + sourceX(x)] : 16;
+            }
+        }
+        // One chroma pair per 2x2 block, taken at the block's top-left luma sample
+        uint8_t* chroma = dst + dstLayout.planes[1].offset;
+        for (uint32_t y = 0; y < (outHeight + 1) / 2; ++y) {
+            uint8_t* row = chroma + size_t(y) * dstLayout.planes[1].pitch;
+            for (uint32_t x = 0; x < (outWidth + 1) / 2; ++x) {
+                if (inside(2 * x, 2 * y)) {
+                    const uint8_t* uv = src.plane(1) + size_t(sourceY(2 * y) / 2) * src.pitch(1) + (sourceX(2 * x) & ~1u);
+                    row[2 * x] = uv[0];
+                    row[2 * x + 1] = uv[1];
+                } else {
+                    row[2 * x] = row[2 * x + 1] = 128;
+                }
+            }
+        }
+        return;
+    }
+
+    if (dstLayout.vaFourcc != VA_FOURCC_RGBA && dstLayout.vaFourcc != VA_FOURCC_BGRA) {
+        throw std::runtime_error("vppReference writes NV12, RGBA or BGRA");
+    }
+    const int r = dstLayout.vaFourcc == VA_FOURCC_RGBA ? 0 : 2, b = 2 - r;
+    for (uint32_t y = 0; y < outHeight; ++y) {
+        uint8_t* out = dst + dstLayout.planes[0].offset + size_t(y) * dstLayout.planes[0].pitch;
+        for (uint32_t x = 0; x < outWidth; ++x, out += 4) {
+            out[3] = 255;
+            if (!inside(x, y)) {
+                out[0] = out[1] = out[2] = 0;
+                continue;
+            }
+            const uint32_t sx = sourceX(x), sy = sourceY(y);
+            const uint8_t* uv = src.plane(1) + size_t(sy / 2) * src.pitch(1) + (sx & ~1u);
+            const int c = 298 * (int(src.plane(0)[size_t(sy) * src.pitch(0) + sx]) - 16);
+            const int d = int(uv[0]) - 128;
+            const int e = int(uv[1]) - 128;
+            out[r] = uint8_t(std::clamp((c + 409 * e + 128) >> 8, 0, 255));
+            out[1] = uint8_t(std::clamp((c - 100 * d - 208 * e + 128) >> 8, 0, 255));
+            out[b] = uint8_t(std::clamp((c + 516 * d + 128) >> 8, 0, 255));
+        }
+    }
+}
+
+typedef struct {
+    int maxDiff = 0;                // Largest difference of one sample
+    double meanDiff = 0;            // Mean absolute difference over every sample
+} VppDiff;
+
+// Sample-wise difference of two frames of the same fourcc and size; padding past each row is ignored
+inline VppDiff vppCompare(const HostFrame& a, const HostFrame& b) {
+    if (a.layout.vaFourcc != b.layout.vaFourcc || a.layout.width != b.layout.width ||
+        a.layout.height != b.layout.height) {
+        throw std::runtime_error("vppCompare needs frames of the same format and size");
+    }
+    const PrimeFormatInfo info = primeFormatInfo(a.layout.vaFourcc);
+    VppDiff diff;
+    uint64_t total = 0, samples = 0;
+    for (uint32_t p = 0; p < a.layout.numPlanes; ++p) {
+        const PrimePlane& plane = a.layout.planes[p];
+        // Interleaved UV rows hold as many bytes as Y rows
+        const size_t rowBytes = size_t(a.layout.width) * info.bytesPerSample;
+        for (uint32_t y = 0; y < plane.height; ++y) {
+            const uint8_t* rowA = a.plane(p) + size_t(y) * a.pitch(p);
+            const uint8_t* rowB = b.plane(p) + size_t(y) * b.pitch(p);
+            for (size_t x = 0; x < rowBytes; ++x) {
+                const int d = std::abs(int(rowA[x]) - int(rowB[x]));
+                diff.maxDiff = std::max(diff.maxDiff, d);
+                total += d;
+            }
+            samples += rowBytes;
+        }
+    }
+    diff.meanDiff = samples ? double(total) / samples : 0;
+    return diff;
+}
@@ -0,0 +1,167 @@
+#pragma once
+
+// Level Zero kernel-timestamp profiling.
+//
+// Pass profiler.event("name") as the signal event of an append call and call
+// collect() once the work is submitted. collect() waits for the pending events,
+// reads them with zeEventQueryKernelTimestamp and converts the device ticks to
+// host nanoseconds before pushing them into OpRecordBuffer. Call release()
+// before the context is destroyed.
+//
+// collect() blocks until every pending event signals. Events recorded into a
+// regular command list only signal once it is executed, so a caller that takes
+// several before executing checks available() first, and a caller whose
+// submission failed calls discard() instead.
+//
+// Without OP_PROFILING, event() returns nullptr and everything else is a no-op.
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <level_zero/ze_api.h>
+
+#include "op_profiler.hpp"
+
+#ifdef OP_PROFILING
+
+class ZeOpProfiler {
+public:
+    ZeOpProfiler(ze_context_handle_t context, ze_device_handle_t device, uint32_t capacity = 64)
+        : device_(device) {
+        // With ZE_STRUCTURE_TYPE_DEVICE_PROPERTIES the timer resolution is in ns per tick
+        ze_device_properties_t props = {};
+        props.stype = ZE_STRUCTURE_TYPE_DEVICE_PROPERTIES;
+        ze_result_t result = zeDeviceGetProperties(device, &props);
+        if (result != ZE_RESULT_SUCCESS) {
+            throw std::runtime_error("Failed to query device properties: " + std::to_string(result));
+        }
+        nsPerTick_ = static_cast<double>(props.timerResolution);
+        kernelMask_ = props.kernelTimestampValidBits >= 64 ? ~0ULL : (1ULL << props.kernelTimestampValidBits) - 1;
+
+        ze_event_pool_desc_t poolDesc = {};
+        poolDesc.stype = ZE_STRUCTURE_TYPE_EVENT_POOL_DESC;
+        poolDesc.flags = ZE_EVENT_POOL_FLAG_HOST_VISIBLE | ZE_EVENT_POOL_FLAG_KERNEL_TIMESTAMP;
+        poolDesc.count = capacity;
+        result = zeEventPoolCreate(context, &poolDesc, 1, &device_, &pool_);
+        if (result != ZE_RESULT_SUCCESS) {
+            throw std::runtime_error("Failed to create timestamp event pool: " + std::to_string(result));
+        }
+
+        events_.resize(capacity);
+        for (uint32_t i = 0; i < capacity; ++i) {
+            ze_event_desc_t eventDesc = {};
+            eventDesc.stype = ZE_STRUCTURE_TYPE_EVENT_DESC;
+            eventDesc.index = i;
+            eventDesc.signal = ZE_EVENT_SCOPE_FLAG_HOST;
+            eventDesc.wait = ZE_EVENT_SCOPE_FLAG_HOST;
+            result = zeEventCreate(pool_, &eventDesc, &events_[i]);
+            if (result != ZE_RESULT_SUCCESS) {
+                throw std::runtime_error("Failed to create timestamp event: " + std::to_string(result));
+            }
+            free_.push_back(i);
+        }
+    }
+
+    ~ZeOpProfiler() { release(); }
+
+    ZeOpProfiler(const ZeOpProfiler&) = delete;
+    ZeOpProfiler& operator=(const ZeOpProfiler&) = delete;
+
+    // Event to signal from the next append call. Collects first when every event is in flight.
+    ze_event_handle_t event(const char* name) {
+        if (free_.empty()) {
+            collect();
+        }
+        uint32_t index = free_.back();
+        free_.pop_back();
+        pending_.push_back({index, name});
+        return events_[index];
+    }
+
+    // Events that event() hands out without collecting first
+    uint32_t available() const { return static_cast<uint32_t>(free_.size()); }
+
+    // Drop the pending events unread, for a submission that failed and will never signal them
+    void discard() {
+        for (const Pending& p : pending_) {
+            zeEventHostReset(events_[p.index]);
+            free_.push_back(p.index);
+        }
+        pending_.clear();
+    }
+
+    // Wait for the pending events and move their timestamps into OpRecordBuffer
+    void collect() {
+        if (pending_.empty()) {
+            return;
+        }
+        for (const Pending& p : pending_) {
+            zeEventHostSynchronize(events_[p.index], UINT64_MAX);
+        }
+
+        // Correlate after the events completed, so every timestamp lies before the reference point
+        uint64_t hostNow = 0, deviceNow = 0;
+        zeDeviceGetGlobalTimestamps(device_, &hostNow, &deviceNow);
+
+        for (const Pending& p : pending_) {
+            ze_kernel_timestamp_result_t ts = {};
+            if (zeEventQueryKernelTimestamp(events_[p.index], &ts) == ZE_RESULT_SUCCESS) {
+                OpRecordBuffer::instance().push({p.name, "L0", toHostNs(ts.global.kernelStart, hostNow, deviceNow),
+                                                 toHostNs(ts.global.kernelEnd, hostNow, deviceNow)});
+            }
+            zeEventHostReset(events_[p.index]);
+            free_.push_back(p.index);
+        }
+        pending_.clear();
+    }
+
+    // Collect and destroy the events. Must run before the context is destroyed.
+    void release() {
+        if (!pool_) {
+            return;
+        }
+        collect();
+        for (ze_event_handle_t event : events_) {
+            zeEventDestroy(event);
+        }
+        zeEventPoolDestroy(pool_);
+        events_.clear();
+        free_.clear();
+        pool_ = nullptr;
+    }
+
+private:
+    typedef struct {
+        uint32_t index;
+        const char* name;
+    } Pending;
+
+    // Kernel timestamps only carry kernelTimestampValidBits
+    uint64_t toHostNs(uint64_t ticks, uint64_t hostNow, uint64_t deviceNow) const {
+        return deviceTicksToHostNs(ticks, hostNow, deviceNow, nsPerTick_, kernelMask_);
+    }
+
+    ze_device_handle_t device_;
+    ze_event_pool_handle_t pool_ = nullptr;
+    std::vector<ze_event_handle_t> events_;
+    std::vector<uint32_t> free_;
+    std::vector<Pending> pending_;
+    double nsPerTick_ = 1.0;
+    uint64_t kernelMask_ = ~0ULL;
+};
+
+#else
+
+class ZeOpProfiler {
+public:
+    ZeOpProfiler(ze_context_handle_t, ze_device_handle_t, uint32_t = 64) {}
+    ze_event_handle_t event(const char*) { return nullptr; }
+    uint32_t available() const { return UINT32_MAX; }
+    void discard() {}
+    void collect() {}
+    void release() {}
+};
+
+#endif
@@ -0,0 +1,227 @@
+#pragma once
+
+// Level Zero backend of PlaneOps (plane_ops.hpp) for planes in USM: device,
+// shared, or imported from a surface's dma-buf.
+//
+// Operations are recorded into one command list and submitted together by
+// finish(), with a barrier between them so they land in issue order.
+//   fill  a rectangle that spans whole rows is one zeCommandListAppendMemoryFill
+//         over those rows (row padding included). A narrower rectangle is filled
+//         into device scratch memory and copied in with one MemoryCopyRegion.
+//   copy  one zeCommandListAppendMemoryCopyRegion with both pitches.
+// With a ZeOpProfiler every fill and copy signals one of its events, collected by
+// finish(). A batch that would take more events than the profiler has left is
+// submitted early, since collecting waits for events of a list not yet executed.
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <level_zero/ze_api.h>
+
+#include "plane_ops.hpp"
+#include "ze_op_profiler.hpp"
+
+class ZePlaneOps : public PlaneOps {
+public:
+    ZePlaneOps(ze_context_handle_t context, ze_device_handle_t device, ZeOpProfiler* profiler = nullptr)
+        : context_(context), device_(device), profiler_(profiler) {
+        ze_command_queue_desc_t queueDesc = {};
+        queueDesc.stype = ZE_STRUCTURE_TYPE_COMMAND_QUEUE_DESC;
+        queueDesc.mode = ZE_COMMAND_QUEUE_MODE_ASYNCHRONOUS;
+        ze_result_t result = zeCommandQueueCreate(context_, device_, &queueDesc, &queue_);
+        if (result != ZE_RESULT_SUCCESS) {
+            throw std::runtime_error("Failed to create command queue: " + std::to_string(result));
+        }
+        ze_command_list_desc_t listDesc = {};
+        listDesc.stype = ZE_STRUCTURE_TYPE_COMMAND_LIST_DESC;
+        result = zeCommandListCreate(context_, device_, &listDesc, &list_);
+        if (result != ZE_RESULT_SUCCESS) {
+            zeCommandQueueDestroy(queue_);
+            throw std::runtime_error("Failed to create command list: " + std::to_string(result));
+        }
+    }
+
+    ~ZePlaneOps() override {
+        try {
+            finish();
+        } catch (const std::exception&) {
+        }
+        releaseScratch();
+        zeCommandListDestroy(list_);
+        zeCommandQueueDestroy(queue_);
+    }
+
+    ZePlaneOps(const ZePlaneOps&) = delete;
+    ZePlaneOps& operator=(const ZePlaneOps&) = delete;
+
+    void fill(const SurfacePlane& plane, const PlaneRect& rect, const void* pattern) override {
+        checkRect(plane, rect, "Fill");
+        if (rect.width == 0 || rect.height == 0) {
+            return;
+        }
+        if (plane.bytesPerPixel > 4 || (plane.bytesPerPixel & (plane.bytesPerPixel - 1)) != 0) {
+            throw std::runtime_error("Fill pattern of " + std::to_string(plane.bytesPerPixel) + " bytes");
+        }
+        const bool wholeRows = rect.x == 0 && rect.width == plane.width;
+        reserveEvents(wholeRows ? 1 : 2);
+        // The pattern stays alive until the list has run
+        patterns_.emplace_back();
+        memcpy(patterns_.back().data(), pattern, plane.bytesPerPixel);
+        const void* kept = patterns_.back().data();
+
+        uint8_t* base = static_cast<uint8_t*>(plane.base);
+        const size_t rowBytes = size_t(rect.width) * plane.bytesPerPixel;
+        if (wholeRows) {
+            // Whole rows: the padding after each row may be overwritten, so it is one contiguous fill
+            const size_t bytes = (size_t(rect.height) - 1) * plane.pitch + rowBytes;
+            check(zeCommandListAppendMemoryFill(list_, base + size_t(rect.y) * plane.pitch, kept,
+                                                plane.bytesPerPixel, bytes, event("PlaneOps fill"), 0, nullptr),
+                  "zeCommandListAppendMemoryFill");
+        } else {
+            // Letterbox side bars, boxes: fill a packed scratch rectangle, then copy it in
+            void* scratch = allocScratch(rowBytes * rect.height);
+            check(zeCommandListAppendMemoryFill(list_, scratch, kept, plane.bytesPerPixel, rowBytes * rect.height,
+                                                event("PlaneOps fill scratch"), 0, nullptr),
+                  "zeCommandListAppendMemoryFill");
+            barrier();
+            const ze_copy_region_t dstRegion = {uint32_t(rect.x * plane.bytesPerPixel), rect.y, 0, uint32_t(rowBytes),
+                                                rect.height, 1};
+            const ze_copy_region_t srcRegion = {0, 0, 0, uint32_t(rowBytes), rect.height, 1};
+            check(zeCommandListAppendMemoryCopyRegion(list_, base, &dstRegion, uint32_t(plane.pitch), 0, scratch,
+                                                      &srcRegion, uint32_t(rowBytes), 0,
+                                                      event("PlaneOps fill copy"), 0, nullptr),
+                  "zeCommandListAppendMemoryCopyRegion");
+        }
+        barrier();
+    }
+
+    void copy(const SurfacePlane& dst, uint32_t dstX, uint32_t dstY, const SurfacePlane& src,
+              const PlaneRect& srcRect) override {
+        checkCopy(dst, dstX, dstY, src, srcRect);
+        if (srcRect.width == 0 || srcRect.height == 0) {
+            return;
+        }
+        reserveEvents(1);
+        const uint32_t rowBytes = srcRect.width * src.bytesPerPixel;
+        const ze_copy_region_t dstRegion = {dstX * dst.bytesPerPixel, dstY, 0, rowBytes, srcRect.height, 1};
+        const ze_copy_region_t srcRegion = {srcRect.x * src.bytesPerPixel, srcRect.y, 0, rowBytes, srcRect.height, 1};
+        check(zeCommandListAppendMemoryCopyRegion(list_, dst.base, &dstRegion, uint32_t(dst.pitch), 0, src.base,
+                                                  &srcRegion, uint32_t(src.pitch), 0, event("PlaneOps copy"), 0,
+                                                  nullptr),
+              "zeCommandListAppendMemoryCopyRegion");
+        barrier();
+    }
+
+    // Submit everything recorded since the last finish() and wait for it
+    void finish() override {
+        if (!recorded_) {
+            return;
+        }
+        recorded_ = false;
+        ze_result_t result = zeCommandListClose(list_);
+        if (result == ZE_RESULT_SUCCESS) {
+            result = zeCommandQueueExecuteCommandLists(queue_, 1, &list_, nullptr);
+        }
+        if (result == ZE_RESULT_SUCCESS) {
+            result = zeCommandQueueSynchronize(queue_, UINT64_MAX);
+        }
+        zeCommandListReset(list_);
+        patterns_.clear();
+        scratchUsed_ = 0;
+        batchScratch_ = 0;
+        if (profiler_) {
+            // The events of a batch that failed may never signal
+            if (result == ZE_RESULT_SUCCESS) {
+                profiler_->collect();
+            } else {
+                profiler_->discard();
+            }
+        }
+        if (result != ZE_RESULT_SUCCESS) {
+            throw std::runtime_error("Plane operations failed: " + std::to_string(result));
+        }
+        // Scratch grown during the batch can go now; the next batch gets one buffer of the peak size
+        if (scratch_.size() > 1) {
+            const size_t peak = scratchPeak_;
+            releaseScratch();
+            scratchPeak_ = peak;
+        }
+    }
+
+private:
+    // Every append goes through here, so finish() knows there is work to submit
+    void check(ze_result_t result, const char* what) {
+        recorded_ = true;
+        if (result != ZE_RESULT_SUCCESS) {
+            if (profiler_) {
+                profiler_->discard();  // The failed append's event never signals
+            }
+            throw std::runtime_error(std::string(what) + " failed: " + std::to_string(result));
+        }
+    }
+
+    ze_event_handle_t event(const char* name) { return profiler_ ? profiler_->event(name) : nullptr; }
+
+    // Submit what is recorded when the next operation would run the profiler out of events
+    void reserveEvents(uint32_t count) {
+        if (profiler_ && profiler_->available() < count) {
+            finish();
+        }
+    }
+
+    void barrier() {
+        check(zeCommandListAppendBarrier(list_, nullptr, 0, nullptr), "zeCommandListAppendBarrier");
+    }
+
+    // Bump allocation from device scratch; a batch that outgrows it gets another buffer
+    void* allocScratch(size_t bytes) {
+        bytes = (bytes + 255) / 256 * 256;
+        if (scratch_.empty() || scratchUsed_ + bytes > scratchSize_) {
+            const size_t size = std::max({bytes, scratchPeak_, size_t(1) << 20});
+            ze_device_mem_alloc_desc_t allocDesc = {};
+            allocDesc.stype = ZE_STRUCTURE_TYPE_DEVICE_MEM_ALLOC_DESC;
+            void* memory = nullptr;
+            ze_result_t result = zeMemAllocDevice(context_, &allocDesc, size, 256, device_, &memory);
+            if (result != ZE_RESULT_SUCCESS) {
+                throw std::runtime_error("Failed to allocate fill scratch: " + std::to_string(result));
+            }
+            scratch_.push_back(memory);
+            scratchSize_ = size;
+            scratchUsed_ = 0;
+        }
+        void* memory = static_cast<uint8_t*>(scratch_.back()) + scratchUsed_;
+        scratchUsed_ += bytes;
+        batchScratch_ += bytes;
+        scratchPeak_ = std::max(scratchPeak_, batchScratch_);
+        return memory;
+    }
+
+    void releaseScratch() {
+        for (void* memory : scratch_) {
+            zeMemFree(context_, memory);
+        }
+        scratch_.clear();
+        scratchSize_ = 0;
+        scratchUsed_ = 0;
+        scratchPeak_ = 0;
+    }
+
+    ze_context_handle_t context_;
+    ze_device_handle_t device_;
+    ZeOpProfiler* profiler_;
+    ze_command_queue_handle_t queue_ = nullptr;
+    ze_command_list_handle_t list_ = nullptr;
+    bool recorded_ = false;
+    std::deque<std::array<uint8_t, 4>> patterns_;
+    std::vector<void*> scratch_;  // The last one is the current buffer
+    size_t scratchSize_ = 0;
+    size_t scratchUsed_ = 0;
+    size_t batchScratch_ = 0;     // Scratch used since the last finish()
+    size_t scratchPeak_ = 0;      // Largest batchScratch_ so far
+};
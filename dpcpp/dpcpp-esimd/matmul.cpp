@@ -5,16 +5,20 @@
 #include <iomanip>
 #include <vector>
 
+#include "sycl_op_profiler.hpp"
+#include "trace.hpp"
+
 const int SIZE = 11;
 
-void matrix_multiply(const float* A, const float* B, float* C, int size) {
-    sycl::queue q = sycl::queue(sycl::gpu_selector_v);
+void matrix_multiply(const float* A, const float* B, float* C, int size, SyclOpProfiler& profiler) {
+    sycl::queue q = sycl::queue(sycl::gpu_selector_v, syclProfilingProperties());
 
     sycl::buffer<float, 1> bufferA(A, sycl::range<1>(size * size));
     sycl::buffer<float, 1> bufferB(B, sycl::range<1>(size * size));
     sycl::buffer<float, 1> bufferC(C, sycl::range<1>(size * size));
 
-    q.submit([&](sycl::handler& cgh) {
+    TRACE_SCOPE("queue::submit");
+    sycl::event event = q.submit([&](sycl::handler& cgh) {
         auto accA = bufferA.get_access<sycl::access::mode::read>(cgh);
         auto accB = bufferB.get_access<sycl::access::mode::read>(cgh);
         auto accC = bufferC.get_access<sycl::access::mode::write>(cgh);
@@ -34,6 +38,7 @@ void matrix_multiply(const float* A, const float* B, float* C, int size) {
             sycl::ext::intel::esimd::block_store(accC, (row * size + col) * sizeof(float), sum);
         });
     });
+    profiler.record(q, "matrix_multiply", event);
 }
 
 void draw_line(int n, char ch) {
@@ -63,7 +68,10 @@ int main() {
             B[i * SIZE + j] = static_cast<float>(i - j);
         }
     }
-    matrix_multiply(A.data(), B.data(), C.data(), SIZE);
+    SyclOpProfiler profiler;
+    matrix_multiply(A.data(), B.data(), C.data(), SIZE, profiler);
+    profiler.collect();
+    printOpRecords();
     
     // ASCII output for visualization
     draw_line(50, '-');
@@ -82,5 +90,6 @@ int main() {
         }
     }
     draw_line(50, '-');
+    traceFlushFromEnv();
     return 0;
 }
@@ -2,16 +2,20 @@
 #include <iostream>
 #include <iomanip>
 
+#include "sycl_op_profiler.hpp"
+#include "trace.hpp"
+
 const int SIZE = 11;
 
-void matrix_multiply(const float* A, const float* B, float* C, int size) {
-    cl::sycl::queue q = sycl::queue(sycl::gpu_selector_v);
+void matrix_multiply(const float* A, const float* B, float* C, int size, SyclOpProfiler& profiler) {
+    cl::sycl::queue q = sycl::queue(sycl::gpu_selector_v, syclProfilingProperties());
 
     cl::sycl::buffer<float, 1> bufferA(A, cl::sycl::range<1>(size * size));
     cl::sycl::buffer<float, 1> bufferB(B, cl::sycl::range<1>(size * size));
     cl::sycl::buffer<float, 1> bufferC(C, cl::sycl::range<1>(size * size));
 
-    q.submit([&](cl::sycl::handler& cgh) {
+    TRACE_SCOPE("queue::submit");
+    sycl::event event = q.submit([&](cl::sycl::handler& cgh) {
         auto accA = bufferA.get_access<cl::sycl::access::mode::read>(cgh);
         auto accB = bufferB.get_access<cl::sycl::access::mode::read>(cgh);
         auto accC = bufferC.get_access<cl::sycl::access::mode::write>(cgh);
@@ -26,6 +30,7 @@ void matrix_multiply(const float* A, const float* B, float* C, int size) {
             accC[row * size + col] = sum;
         });
     });
+    profiler.record(q, "matrix_multiply", event);
 }
 
 void draw_line(int n, char ch) {
@@ -55,7 +60,10 @@ int main() {
             B[i * SIZE + j] = static_cast<float>(i - j);
         }
     }
-    matrix_multiply(A.data(), B.data(), C.data(), SIZE);
+    SyclOpProfiler profiler;
+    matrix_multiply(A.data(), B.data(), C.data(), SIZE, profiler);
+    profiler.collect();
+    printOpRecords();
     
     // ASCII output for visualization
     draw_line(50, '-');
@@ -74,5 +82,6 @@ int main() {
         }
     }
     draw_line(50, '-');
+    traceFlushFromEnv();
     return 0;
 }
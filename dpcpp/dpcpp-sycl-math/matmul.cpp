@@ -1,9 +1,13 @@
 #include <CL/sycl.hpp>
 
+#include "sycl_op_profiler.hpp"
+#include "trace.hpp"
+
 const int SIZE = 1024;
 
 void basic_sycl_math(cl::sycl::float4 a, cl::sycl::float4 b, cl::sycl::float4 c, int size) {
-    cl::sycl::queue q = sycl::queue(sycl::gpu_selector_v);
+    cl::sycl::queue q = sycl::queue(sycl::gpu_selector_v, syclProfilingProperties());
+    SyclOpProfiler profiler;
     std::cout << "Running on "
                 << q.get_device().get_info<cl::sycl::info::device::name>()
                 << "\n";
@@ -12,7 +16,8 @@ void basic_sycl_math(cl::sycl::float4 a, cl::sycl::float4 b, cl::sycl::float4 c,
         cl::sycl::buffer<cl::sycl::float4, 1> b_sycl(&b, cl::sycl::range<1>(1));
         cl::sycl::buffer<cl::sycl::float4, 1> c_sycl(&c, cl::sycl::range<1>(1));
     
-        q.submit([&] (cl::sycl::handler& cgh) {
+        TRACE_SCOPE("queue::submit");
+        sycl::event event = q.submit([&] (cl::sycl::handler& cgh) {
             auto a_acc = a_sycl.get_access<cl::sycl::access::mode::read>(cgh);
             auto b_acc = b_sycl.get_access<cl::sycl::access::mode::read>(cgh);
             auto c_acc = c_sycl.get_access<cl::sycl::access::mode::discard_write>(cgh);
@@ -21,12 +26,15 @@ void basic_sycl_math(cl::sycl::float4 a, cl::sycl::float4 b, cl::sycl::float4 c,
             c_acc[0] = a_acc[0] + b_acc[0];
             });
         });
+        profiler.record(q, "vector_addition", event);
     }
+    profiler.collect();
     std::cout << "  A { " << a.x() << ", " << a.y() << ", " << a.z() << ", " << a.w() << " }\n"
             << "+ B { " << b.x() << ", " << b.y() << ", " << b.z() << ", " << b.w() << " }\n"
             << "------------------\n"
             << "= C { " << c.x() << ", " << c.y() << ", " << c.z() << ", " << c.w() << " }"
             << std::endl;
+    printOpRecords();
 }
 
 int main() {
@@ -39,5 +47,6 @@ int main() {
 
     // Print or validate the results here, if necessary...
 
+    traceFlushFromEnv();
     return 0;
 }
@@ -0,0 +1,4 @@
+// Kernel used by the module cache benchmark
+kernel void fill(global uint* dst, uint value) {
+    dst[get_global_id(0)] = value;
+}
@@ -0,0 +1,235 @@
+#pragma once
+
+// Content-addressed on-disk cache of native module binaries.
+//
+// An entry is keyed by the SPIR-V hash and size, the build flags, the device
+// (vendor and device ID) and the driver version, so a driver update or a
+// different GPU never picks up a stale binary. This file has no Level Zero
+// dependency: the caller fills in ModuleCacheKey from the driver properties
+// and hands the native binary over as plain bytes.
+//
+// Every entry starts with a header that repeats the key and carries the
+// payload size and hash. The header has no padding, so every byte written is
+// defined. load() rejects (and deletes) truncated, corrupt or mismatched
+// entries, and entries whose payload size disagrees with the file size.
+// store() writes to a uniquely named temporary file (mkstemp) and renames it
+// into place, so concurrent writers never share a temporary file and readers
+// never see a partial entry.
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// 64-bit FNV-1a
+inline uint64_t fnv1a64(const void* data, size_t size, uint64_t hash = 0xcbf29ce484222325ULL) {
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+typedef struct ModuleCacheKey {
+    uint64_t spirvHash;
+    uint64_t spirvSize;
+    uint64_t flagsHash;
+    uint32_t vendorId;
+    uint32_t deviceId;
+    uint32_t driverVersion;
+
+    // File name of the entry, e.g. 8086-56a0-01036e8b-<spirv>-<size>-<flags>.bin
+    std::string fileName() const {
+        char name[128];
+        snprintf(name, sizeof(name), "%04x-%04x-%08x-%016llx-%llx-%016llx.bin", vendorId, deviceId, driverVersion,
+                 (unsigned long long)spirvHash, (unsigned long long)spirvSize, (unsigned long long)flagsHash);
+        return name;
+    }
+
+    bool operator==(const ModuleCacheKey& other) const {
+        return spirvHash == other.spirvHash && spirvSize == other.spirvSize && flagsHash == other.flagsHash &&
+               vendorId == other.vendorId && deviceId == other.deviceId && driverVersion == other.driverVersion;
+    }
+} ModuleCacheKey;
+
+inline ModuleCacheKey makeModuleCacheKey(const std::vector<uint8_t>& spirv, const char* buildFlags, uint32_t vendorId,
+                                         uint32_t deviceId, uint32_t driverVersion) {
+    ModuleCacheKey key = {};
+    key.spirvHash = fnv1a64(spirv.data(), spirv.size());
+    key.spirvSize = spirv.size();
+    key.flagsHash = fnv1a64(buildFlags ? buildFlags : "", buildFlags ? strlen(buildFlags) : 0);
+    key.vendorId = vendorId;
+    key.deviceId = deviceId;
+    key.driverVersion = driverVersion;
+    return key;
+}
+
+class ModuleCache {
+public:
+    explicit ModuleCache(std::string directory) : directory_(std::move(directory)) {}
+
+    // $ZE_MODULE_CACHE_DIR, else $XDG_CACHE_HOME/ze_module_cache, else ~/.cache/ze_module_cache
+    static std::string defaultDirectory() {
+        if (const char* dir = getenv("ZE_MODULE_CACHE_DIR"); dir && *dir) {
+            return dir;
+        }
+        if (const char* xdg = getenv("XDG_CACHE_HOME"); xdg && *xdg) {
+            return std::string(xdg) + "/ze_module_cache";
+        }
+        if (const char* home = getenv("HOME"); home && *home) {
+            return std::string(home) + "/.cache/ze_module_cache";
+        }
+        return "/tmp/ze_module_cache";
+    }
+
+    const std::string& directory() const { return directory_; }
+
+    std::string pathFor(const ModuleCacheKey& key) const { return directory_ + "/" + key.fileName(); }
+
+    // Read the entry for key into binary. Returns false on a miss or an invalid entry.
+    bool load(const ModuleCacheKey& key, std::vector<uint8_t>& binary) const {
+        const std::string path = pathFor(key);
+        FILE* file = fopen(path.c_str(), "rb");
+        if (!file) {
+            return false;
+        }
+
+        // The payload size comes from disk: check it against the file before allocating
+        struct stat st = {};
+        Header header = {};
+        bool valid = fstat(fileno(file), &st) == 0 && static_cast<uint64_t>(st.st_size) >= sizeof(header) &&
+                     fread(&header, sizeof(header), 1, file) == 1 && memcmp(header.magic, kMagic, sizeof(kMagic)) == 0 &&
+                     header.version == kVersion && headerKey(header) == key &&
+                     header.payloadSize == static_cast<uint64_t>(st.st_size) - sizeof(header);
+        if (valid) {
+            binary.resize(header.payloadSize);
+            valid = header.payloadSize > 0 && fread(binary.data(), 1, binary.size(), file) == binary.size() &&
+                    fgetc(file) == EOF && fnv1a64(binary.data(), binary.size()) == header.payloadHash;
+        }
+        fclose(file);
+
+        if (!valid) {
+            binary.clear();
+            unlink(path.c_str());
+        }
+        return valid;
+    }
+
+    // Write binary as the entry for key, replacing any existing entry atomically
+    bool store(const ModuleCacheKey& key, const std::vector<uint8_t>& binary) const {
+        if (binary.empty() || !makeDirectories(directory_)) {
+            return false;
+        }
+
+        Header header = {};
+        memcpy(header.magic, kMagic, sizeof(kMagic));
+        header.version = kVersion;
+        header.spirvHash = key.spirvHash;
+        header.spirvSize = key.spirvSize;
+        header.flagsHash = key.flagsHash;
+        header.vendorId = key.vendorId;
+        header.deviceId = key.deviceId;
+        header.driverVersion = key.driverVersion;
+        header.payloadSize = binary.size();
+        header.payloadHash = fnv1a64(binary.data(), binary.size());
+
+        // A pid alone is not unique across containers or hosts sharing the directory
+        const std::string path = pathFor(key);
+        std::string tmpPath = path + ".tmp.XXXXXX";
+        int fd = mkstemp(tmpPath.data());
+        if (fd < 0) {
+            return false;
+        }
+        fchmod(fd, 0644); // mkstemp creates 0600, entries are shared like the directory
+        FILE* file = fdopen(fd, "wb");
+        if (!file) {
+            close(fd);
+            unlink(tmpPath.c_str());
+            return false;
+        }
+        bool written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                       fwrite(binary.data(), 1, binary.size(), file) == binary.size();
+        written = (fclose(file) == 0) && written;
+        if (!written || rename(tmpPath.c_str(), path.c_str()) != 0) {
+            unlink(tmpPath.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    bool remove(const ModuleCacheKey& key) const { return unlink(pathFor(key).c_str()) == 0; }
+
+    // Delete every entry, returns how many were removed
+    size_t clear() const {
+        DIR* dir = opendir(directory_.c_str());
+        if (!dir) {
+            return 0;
+        }
+        size_t removed = 0;
+        while (dirent* entry = readdir(dir)) {
+            std::string name = entry->d_name;
+            if (name.size() > 4 && name.compare(name.size() - 4, 4, ".bin") == 0 &&
+                unlink((directory_ + "/" + name).c_str()) == 0) {
+                removed++;
+            }
+        }
+        closedir(dir);
+        return removed;
+    }
+
+private:
+    static constexpr char kMagic[4] = {'Z', 'E', 'M', 'C'};
+    static constexpr uint32_t kVersion = 1;
+
+    // On-disk header. The key is stored field by field: ModuleCacheKey has tail padding,
+    // which would put indeterminate bytes into the file.
+    typedef struct {
+        char magic[4];
+        uint32_t version;
+        uint64_t spirvHash;
+        uint64_t spirvSize;
+        uint64_t flagsHash;
+        uint32_t vendorId;
+        uint32_t deviceId;
+        uint32_t driverVersion;
+        uint32_t reserved;     // Zero
+        uint64_t payloadSize;
+        uint64_t payloadHash;
+    } Header;
+    static_assert(sizeof(Header) == 64, "Header must not have padding");
+
+    static ModuleCacheKey headerKey(const Header& header) {
+        ModuleCacheKey key = {};
+        key.spirvHash = header.spirvHash;
+        key.spirvSize = header.spirvSize;
+        key.flagsHash = header.flagsHash;
+        key.vendorId = header.vendorId;
+        key.deviceId = header.deviceId;
+        key.driverVersion = header.driverVersion;
+        return key;
+    }
+
+    // mkdir -p
+    static bool makeDirectories(const std::string& path) {
+        for (size_t pos = 1; pos <= path.size(); ++pos) {
+            if (pos == path.size() || path[pos] == '/') {
+                std::string prefix = path.substr(0, pos);
+                if (mkdir(prefix.c_str(), 0755) != 0 && errno != EEXIST) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    std::string directory_;
+};
@@ -0,0 +1,320 @@
+#include <level_zero/ze_api.h>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <unistd.h>
+
+#include "module_cache.hpp"
+#include "selftest.hpp"
+
+// Initialize Level Zero and return the first driver
+ze_driver_handle_t initializeDriver() {
+    ze_result_t result = zeInit(ZE_INIT_FLAG_GPU_ONLY);
+    if (result != ZE_RESULT_SUCCESS) {
+        throw std::runtime_error("Failed to initialize Level Zero");
+    }
+
+    uint32_t driverCount = 0;
+    result = zeDriverGet(&driverCount, nullptr);
+    if (result != ZE_RESULT_SUCCESS || driverCount == 0) {
+        throw std::runtime_error("Failed to find any drivers");
+    }
+
+    std::vector<ze_driver_handle_t> drivers(driverCount);
+    result = zeDriverGet(&driverCount, drivers.data());
+    if (result != ZE_RESULT_SUCCESS) {
+        throw std::runtime_error("Error retrieving driver handles");
+    }
+    return drivers[0];
+}
+
+// Return the first device of the driver
+ze_device_handle_t initializeDevice(ze_driver_handle_t driverHandle) {
+    uint32_t deviceCount = 0;
+    ze_result_t result = zeDeviceGet(driverHandle, &deviceCount, nullptr);
+    if (result != ZE_RESULT_SUCCESS || deviceCount == 0) {
+        throw std::runtime_error("No devices found for the driver");
+    }
+
+    std::vector<ze_device_handle_t> devices(deviceCount);
+    result = zeDeviceGet(driverHandle, &deviceCount, devices.data());
+    if (result != ZE_RESULT_SUCCESS) {
+        throw std::runtime_error("Error retrieving device handles");
+    }
+    return devices[0];
+}
+
+ze_context_handle_t createContext(ze_driver_handle_t driverHandle) {
+    ze_context_desc_t contextDesc = {};
+    contextDesc.stype = ZE_STRUCTURE_TYPE_CONTEXT_DESC;
+    ze_context_handle_t contextHandle = nullptr;
+
+    ze_result_t result = zeContextCreate(driverHandle, &contextDesc, &contextHandle);
+    if (result != ZE_RESULT_SUCCESS) {
+        throw std::runtime_error("Failed to create context: " + std::to_string(result));
+    }
+    return contextHandle;
+}
+
+std::vector<uint8_t> readFile(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        throw std::runtime_error("Failed to open " + path);
+    }
+    return std::vector<uint8_t>(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+// Cache key for this SPIR-V on this device and driver
+ModuleCacheKey moduleKey(ze_driver_handle_t driverHandle, ze_device_handle_t deviceHandle,
+                         const std::vector<uint8_t>& spirv, const char* buildFlags) {
+    ze_driver_properties_t driverProps = {};
+    driverProps.stype = ZE_STRUCTURE_TYPE_DRIVER_PROPERTIES;
+    ze_result_t result = zeDriverGetProperties(driverHandle, &driverProps);
+    if (result != ZE_RESULT_SUCCESS) {
+        throw std::runtime_error("Failed to query driver properties: " + std::to_string(result));
+    }
+
+    ze_device_properties_t deviceProps = {};
+    deviceProps.stype = ZE_STRUCTURE_TYPE_DEVICE_PROPERTIES;
+    result = zeDeviceGetProperties(deviceHandle, &deviceProps);
+    if (result != ZE_RESULT_SUCCESS) {
+        throw std::runtime_error("Failed to query device properties: " + std::to_string(result));
+    }
+
+    return makeModuleCacheKey(spirv, buildFlags, deviceProps.vendorId, deviceProps.deviceId,
+                              driverProps.driverVersion);
+}
+
+// Build from SPIR-V and throw with the build log on failure
+ze_module_handle_t buildSpirvModule(ze_context_handle_t contextHandle, ze_device_handle_t deviceHandle,
+                                    const std::vector<uint8_t>& spirv, const char* buildFlags) {
+    ze_module_desc_t moduleDesc = {};
+    moduleDesc.stype = ZE_STRUCTURE_TYPE_MODULE_DESC;
+    moduleDesc.format = ZE_MODULE_FORMAT_IL_SPIRV;
+    moduleDesc.inputSize = spirv.size();
+    moduleDesc.pInputModule = spirv.data();
+    moduleDesc.pBuildFlags = buildFlags;
+
+    ze_module_handle_t module = nullptr;
+    ze_module_build_log_handle_t buildLog = nullptr;
+    ze_result_t result = zeModuleCreate(contextHandle, deviceHandle, &moduleDesc, &module, &buildLog);
+    if (result != ZE_RESULT_SUCCESS) {
+        std::string log;
+        size_t logSize = 0;
+        if (buildLog && zeModuleBuildLogGetString(buildLog, &logSize, nullptr) == ZE_RESULT_SUCCESS && logSize > 0) {
+            log.resize(logSize);
+            zeModuleBuildLogGetString(buildLog, &logSize, log.data());
+        }
+        if (buildLog) {
+            zeModuleBuildLogDestroy(buildLog);
+        }
+        throw std::runtime_error("Failed to build SPIR-V module: " + std::to_string(result) + "\n" + log);
+    }
+    if (buildLog) {
+        zeModuleBuildLogDestroy(buildLog);
+    }
+    return module;
+}
+
+// Create the module from the cached native binary when there is one, otherwise build it
+// from SPIR-V and store its native binary for the next start
+ze_module_handle_t loadModule(ze_context_handle_t contextHandle, ze_device_handle_t deviceHandle,
+                              const ModuleCache& cache, const ModuleCacheKey& key,
+                              const std::vector<uint8_t>& spirv, const char* buildFlags, bool* cacheHit) {
+    *cacheHit = false;
+
+    std::vector<uint8_t> binary;
+    if (cache.load(key, binary)) {
+        ze_module_desc_t moduleDesc = {};
+        moduleDesc.stype = ZE_STRUCTURE_TYPE_MODULE_DESC;
+        moduleDesc.format = ZE_MODULE_FORMAT_NATIVE;
+        moduleDesc.inputSize = binary.size();
+        moduleDesc.pInputModule = binary.data();
+
+        ze_module_handle_t module = nullptr;
+        if (zeModuleCreate(contextHandle, deviceHandle, &moduleDesc, &module, nullptr) == ZE_RESULT_SUCCESS) {
+            *cacheHit = true;
+            return module;
+        }
+        // The driver rejected the binary, rebuild and overwrite the entry
+        cache.remove(key);
+    }
+
+    ze_module_handle_t module = buildSpirvModule(contextHandle, deviceHandle, spirv, buildFlags);
+
+    size_t binarySize = 0;
+    if (zeModuleGetNativeBinary(module, &binarySize, nullptr) == ZE_RESULT_SUCCESS && binarySize > 0) {
+        binary.resize(binarySize);
+        if (zeModuleGetNativeBinary(module, &binarySize, binary.data()) == ZE_RESULT_SUCCESS &&
+            !cache.store(key, binary)) {
+            std::cerr << "Failed to store native binary in " << cache.directory() << std::endl;
+        }
+    }
+    return module;
+}
+
+// Time one startup: hash the SPIR-V, load or build the module and create the kernel
+double timedStartup(ze_driver_handle_t driverHandle, ze_context_handle_t contextHandle,
+                    ze_device_handle_t deviceHandle, const ModuleCache& cache, const std::vector<uint8_t>& spirv,
+                    const char* buildFlags, const char* kernelName, bool* cacheHit) {
+    auto start = std::chrono::steady_clock::now();
+
+    ModuleCacheKey key = moduleKey(driverHandle, deviceHandle, spirv, buildFlags);
+    ze_module_handle_t module = loadModule(contextHandle, deviceHandle, cache, key, spirv, buildFlags, cacheHit);
+
+    ze_kernel_desc_t kernelDesc = {};
+    kernelDesc.stype = ZE_STRUCTURE_TYPE_KERNEL_DESC;
+    kernelDesc.pKernelName = kernelName;
+    ze_kernel_handle_t kernel = nullptr;
+    ze_result_t result = zeKernelCreate(module, &kernelDesc, &kernel);
+
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    if (result != ZE_RESULT_SUCCESS) {
+        zeModuleDestroy(module);
+        throw std::runtime_error(std::string("Failed to create kernel ") + kernelName + ": " + std::to_string(result));
+    }
+    zeKernelDestroy(kernel);
+    zeModuleDestroy(module);
+    return ms;
+}
+
+// Files in dir whose name contains part
+size_t countFiles(const std::string& dir, const char* part) {
+    size_t count = 0;
+    if (DIR* d = opendir(dir.c_str())) {
+        while (dirent* entry = readdir(d)) {
+            count += strstr(entry->d_name, part) ? 1 : 0;
+        }
+        closedir(d);
+    }
+    return count;
+}
+
+// The cache on a scratch directory with a made-up binary, no driver needed
+int runCacheChecks() {
+    char dirTemplate[] = "/tmp/ze_module_cache_check.XXXXXX";
+    CHECK(mkdtemp(dirTemplate) != nullptr);
+    const std::string dir = dirTemplate;
+    ModuleCache cache(dir + "/nested");
+
+    std::vector<uint8_t> spirv(4096), binary(10000);
+    for (size_t i = 0; i < binary.size(); ++i) {
+        spirv[i % spirv.size()] = uint8_t(i * 7);
+        binary[i] = uint8_t(i * 13 + 1);
+    }
+    // Garbage in the key's padding must not reach the file
+    ModuleCacheKey key;
+    memset(&key, 0xff, sizeof(key));
+    const ModuleCacheKey made = makeModuleCacheKey(spirv, "-ze-opt-level=2", 0x8086, 0x56a0, 0x01036e8b);
+    key.spirvHash = made.spirvHash;
+    key.spirvSize = made.spirvSize;
+    key.flagsHash = made.flagsHash;
+    key.vendorId = made.vendorId;
+    key.deviceId = made.deviceId;
+    key.driverVersion = made.driverVersion;
+
+    std::vector<uint8_t> loaded;
+    CHECK(!cache.load(key, loaded));
+    CHECK(cache.store(key, binary) && cache.store(key, binary));
+    CHECK(cache.load(key, loaded) && loaded == binary);
+    CHECK(countFiles(cache.directory(), ".tmp.") == 0);
+
+    // A 64-byte header in front of the payload, with no byte left undefined
+    std::vector<uint8_t> file = readFile(cache.pathFor(key));
+    CHECK(file.size() == 64 + binary.size() && memcmp(file.data(), "ZEMC", 4) == 0);
+    for (size_t i = 44; i < 48; ++i) {
+        CHECK(file[i] == 0);
+    }
+
+    // Another driver version is a miss and leaves the entry alone
+    ModuleCacheKey updated = made;
+    updated.driverVersion++;
+    CHECK(!cache.load(updated, loaded) && cache.load(key, loaded));
+
+    // A flipped payload byte and a truncated file are rejected and deleted
+    file[64 + 100] ^= 1;
+    std::ofstream(cache.pathFor(key), std::ios::binary).write(reinterpret_cast<const char*>(file.data()), file.size());
+    CHECK(!cache.load(key, loaded) && loaded.empty() && access(cache.pathFor(key).c_str(), F_OK) != 0);
+    CHECK(cache.store(key, binary));
+    CHECK(truncate(cache.pathFor(key).c_str(), 64 + binary.size() / 2) == 0);
+    CHECK(!cache.load(key, loaded) && access(cache.pathFor(key).c_str(), F_OK) != 0);
+
+    // A payload size that disagrees with the file is a miss, before anything is allocated for it
+    CHECK(cache.store(key, binary));
+    file = readFile(cache.pathFor(key));
+    const uint64_t hugeSize = 1ULL << 60;
+    memcpy(&file[48], &hugeSize, sizeof(hugeSize));
+    std::ofstream(cache.pathFor(key), std::ios::binary).write(reinterpret_cast<const char*>(file.data()), file.size());
+    CHECK(!cache.load(key, loaded) && loaded.empty() && access(cache.pathFor(key).c_str(), F_OK) != 0);
+
+    CHECK(cache.store(key, binary) && cache.store(updated, binary));
+    CHECK(cache.clear() == 2 && countFiles(cache.directory(), ".bin") == 0);
+    CHECK(rmdir(cache.directory().c_str()) == 0 && rmdir(dir.c_str()) == 0);
+    std::cout << "Module cache checks passed" << std::endl;
+    return 0;
+}
+
+// Usage: ze_main <module.spv> [kernel] [iterations]
+//        ze_main selftest
+//   selftest: check the cache on a scratch directory, no GPU needed
+int main(int argc, char* argv[]) {
+    if (isSelfTest(argc, argv)) {
+        return runSelfTest(runCacheChecks);
+    }
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <module.spv> [kernel] [iterations]" << std::endl;
+        std::cerr << "       " << argv[0] << " selftest" << std::endl;
+        return -1;
+    }
+    const std::string spirvPath = argv[1];
+    const char* kernelName = argc > 2 ? argv[2] : "fill";
+    const int iterations = argc > 3 ? std::stoi(argv[3]) : 10;
+    const char* buildFlags = "";
+
+    std::cout << "Running initializeDriver" << std::endl;
+    ze_driver_handle_t driverHandle = initializeDriver();
+
+    std::cout << "Running initializeDevice" << std::endl;
+    ze_device_handle_t deviceHandle = initializeDevice(driverHandle);
+
+    std::cout << "Running createContext" << std::endl;
+    ze_context_handle_t contextHandle = createContext(driverHandle);
+
+    std::vector<uint8_t> spirv = readFile(spirvPath);
+    ModuleCache cache(ModuleCache::defaultDirectory());
+    std::cout << "Module cache: " << cache.directory() << std::endl;
+
+    // Cold: no entry, so the SPIR-V is compiled and the native binary stored
+    std::cout << "Running cold start" << std::endl;
+    cache.remove(moduleKey(driverHandle, deviceHandle, spirv, buildFlags));
+    bool cacheHit = false;
+    double coldMs = timedStartup(driverHandle, contextHandle, deviceHandle, cache, spirv, buildFlags, kernelName,
+                                 &cacheHit);
+    std::cout << "Cold start: " << coldMs << " ms" << (cacheHit ? " (unexpected cache hit)" : "") << std::endl;
+
+    // Warm: every start loads the native binary
+    std::cout << "Running warm start x" << iterations << std::endl;
+    double warmTotalMs = 0.0;
+    int hits = 0;
+    for (int i = 0; i < iterations; ++i) {
+        warmTotalMs += timedStartup(driverHandle, contextHandle, deviceHandle, cache, spirv, buildFlags, kernelName,
+                                    &cacheHit);
+        hits += cacheHit ? 1 : 0;
+    }
+    double warmMs = iterations > 0 ? warmTotalMs / iterations : 0.0;
+    std::cout << "Warm start: " << warmMs << " ms avg, " << hits << "/" << iterations << " cache hits" << std::endl;
+    if (warmMs > 0.0) {
+        std::cout << "Speedup: " << coldMs / warmMs << "x" << std::endl;
+    }
+
+    zeContextDestroy(contextHandle);
+    return 0;
+}
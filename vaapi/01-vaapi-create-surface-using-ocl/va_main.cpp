@@ -1,4 +1,5 @@
 #include <optional>
+#include <utility>
 #include <vector>
 #include <string>
 #include <iostream>
@@ -11,82 +12,98 @@
 #include <fcntl.h>
 #include <unistd.h>
 
-#include <drm_fourcc.h> // For DRM_FORMAT_MOD_LINEAR
-
 extern "C" {
-#include <libavcodec/avcodec.h>
-#include <libavformat/avformat.h>
-#include <libavutil/hwcontext.h>
-#include <libavutil/hwcontext_vaapi.h>
-#include <libavutil/pixdesc.h>
 #include <va/va.h>
 #include <va/va_drm.h>
-#include <va/va_drmcommon.h>
 }
-#define CL_TARGET_OPENCL_VERSION 220
-#include <CL/cl.h>
-#include <CL/cl_va_api_media_sharing_intel.h>
 
-bool isSurfaceRed(VADisplay va_dpy, VASurfaceID surface, int width, int height) {
-    VAImage vaImage;
-    vaDeriveImage(va_dpy, surface, &vaImage);
+#include "cl_va_sharing.hpp"
+#include "scope_exit.hpp"
+#include "selftest.hpp"
+
+// Fills the Y and UV planes of an NV12 frame with one color (Y, U, V as unorm floats)
+static const char* kFillNv12Source = R"CLC(
+__kernel void fill_nv12(__write_only image2d_t y_plane, __write_only image2d_t uv_plane, float4 yuv) {
+    int2 pos = (int2)(get_global_id(0), get_global_id(1));
+    write_imagef(y_plane, pos, (float4)(yuv.x, 0.0f, 0.0f, 1.0f));
+    if ((pos.x & 1) == 0 && (pos.y & 1) == 0) {
+        write_imagef(uv_plane, pos / 2, (float4)(yuv.y, yuv.z, 0.0f, 1.0f));
+    }
+}
+)CLC";
 
-    uint8_t* pBuf = nullptr;
-    vaMapBuffer(va_dpy, vaImage.buf, (void**)&pBuf);
+typedef struct {
+    uint8_t y;
+    uint8_t u;
+    uint8_t v;
+} Nv12Color;
 
+// BT.601 limited range red. Y differs per surface so a mixed-up plane shows up.
+Nv12Color surfaceColor(size_t index) {
+    return {static_cast<uint8_t>(81 + index % 32), 90, 240};
+}
+
+bool isNv12Color(const uint8_t* yPlane, size_t yPitch, const uint8_t* uvPlane, size_t uvPitch, int width,
+                 int height, Nv12Color color) {
+    auto near = [](uint8_t value, uint8_t expected) { return value + 1 >= expected && value <= expected + 1; };
     for (int y = 0; y < height; ++y) {
         for (int x = 0; x < width; ++x) {
-            uint8_t* pixel = &pBuf[y * vaImage.pitches[0] + x * 4];
-            if (pixel[0] != 255 || pixel[1] != 0 || pixel[2] != 0) {
-                vaUnmapBuffer(va_dpy, vaImage.buf);
-                vaDestroyImage(va_dpy, vaImage.image_id);
+            if (!near(yPlane[y * yPitch + x], color.y)) {
+                return false;
+            }
+        }
+    }
+    for (int y = 0; y < height / 2; ++y) {
+        for (int x = 0; x < width / 2; ++x) {
+            const uint8_t* uv = &uvPlane[y * uvPitch + x * 2];
+            if (!near(uv[0], color.u) || !near(uv[1], color.v)) {
                 return false;
             }
         }
     }
+    return true;
+}
+
+bool isSurfaceColor(VADisplay va_dpy, VASurfaceID surface, int width, int height, Nv12Color color) {
+    VAImage vaImage;
+    if (vaDeriveImage(va_dpy, surface, &vaImage) != VA_STATUS_SUCCESS) {
+        throw std::runtime_error("vaDeriveImage failed");
+    }
+
+    uint8_t* pBuf = nullptr;
+    if (vaMapBuffer(va_dpy, vaImage.buf, (void**)&pBuf) != VA_STATUS_SUCCESS) {
+        vaDestroyImage(va_dpy, vaImage.image_id);
+        throw std::runtime_error("vaMapBuffer failed");
+    }
+
+    bool match = isNv12Color(pBuf + vaImage.offsets[0], vaImage.pitches[0], pBuf + vaImage.offsets[1],
+                             vaImage.pitches[1], width, height, color);
 
     vaUnmapBuffer(va_dpy, vaImage.buf);
     vaDestroyImage(va_dpy, vaImage.image_id);
-    return true;
+    return match;
 }
-bool verifyVASurface(VASurfaceID surface, VADisplay vaDpy) {
-    VAImage vaImg;
-    VAStatus vaStatus;
-    uint8_t* bufPtr = nullptr;
-
-    // Derive an image from the surface
-    vaStatus = vaDeriveImage(vaDpy, surface, &vaImg);
-    if (vaStatus != VA_STATUS_SUCCESS) {
-        std::cerr << "vaDeriveImage failed. Error code: " << vaStatus << std::endl;
-        return false;
-    }
-
-    // Map the buffer into process address space
-    vaStatus = vaMapBuffer(vaDpy, vaImg.buf, (void**)&bufPtr);
-    if (vaStatus != VA_STATUS_SUCCESS) {
-        std::cerr << "vaMapBuffer failed. Error code: " << vaStatus << std::endl;
-        vaDestroyImage(vaDpy, vaImg.image_id); // Clean up the image
-        return false;
-    }
-    bool crash_flag = true;
-    // Check the data; let's assume the image data type is int32 and stride is width * 4
-    for (int i = 0; i < 100; ++i) {
-        if (((int*)bufPtr)[i] != i + 1) {
-            std::cerr << "Data mismatch at index " << i << ". Expected: " << (i + 1) << ", Got: " << ((int*)bufPtr)[i] << std::endl;
-            // vaUnmapBuffer(vaDpy, vaImg.buf); // Unmap before returning
-            // vaDestroyImage(vaDpy, vaImg.image_id); // Clean up the image
-            crash_flag = false;
-        }
-    }
 
-    vaUnmapBuffer(vaDpy, vaImg.buf);
-    vaDestroyImage(vaDpy, vaImg.image_id); // Clean up the image
-    if (crash_flag == false)
-        throw std::runtime_error("Surface not ready!");
-    std::cout << "GPU data match!" << std::endl;
-    return true; // Data matched
+bool isImageColor(cl_command_queue queue, cl_mem yPlane, cl_mem uvPlane, int width, int height, Nv12Color color) {
+    std::vector<uint8_t> y(size_t(width) * height);
+    std::vector<uint8_t> uv(size_t(width) * height / 2);
+    const size_t origin[3] = {0, 0, 0};
+    const size_t yRegion[3] = {size_t(width), size_t(height), 1};
+    const size_t uvRegion[3] = {size_t(width) / 2, size_t(height) / 2, 1};
+
+    cl_int err = clEnqueueReadImage(queue, yPlane, CL_TRUE, origin, yRegion, width, 0, y.data(), 0, nullptr, nullptr);
+    if (err == CL_SUCCESS) {
+        err = clEnqueueReadImage(queue, uvPlane, CL_TRUE, origin, uvRegion, width, 0, uv.data(), 0, nullptr,
+                                 nullptr);
+    }
+    if (err != CL_SUCCESS) {
+        throw std::runtime_error("clEnqueueReadImage failed. Error: " + std::to_string(err));
+    }
+    return isNv12Color(y.data(), width, uv.data(), width, width, height, color);
 }
-cl_context createOpenCLContext() {
+
+// Plain context on the first device of the given type (the CPU path)
+cl_context createOpenCLContext(cl_device_type type, cl_device_id& device) {
     cl_int err;
 
     // Platform availability
@@ -102,134 +119,359 @@ cl_context createOpenCLContext() {
         throw std::runtime_error("Error getting platform IDs");
     }
 
-    // Just choosing the first platform for demonstration purposes
-    cl_platform_id chosenPlatform = platforms[0];
+    for (cl_platform_id platform : platforms) {
+        if (clGetDeviceIDs(platform, type, 1, &device, nullptr) != CL_SUCCESS) {
+            continue;
+        }
+        cl_context context = clCreateContext(nullptr, 1, &device, nullptr, nullptr, &err);
+        if (err != CL_SUCCESS) {
+            throw std::runtime_error("Failed to create OpenCL context. Error: " + std::to_string(err));
+        }
+        return context;
+    }
+    throw std::runtime_error("No OpenCL device of the requested type found");
+}
+
+cl_command_queue createQueue(cl_context context, cl_device_id device) {
+    cl_int err;
+    cl_command_queue queue = clCreateCommandQueueWithProperties(context, device, nullptr, &err);
+    if (err != CL_SUCCESS) {
+        throw std::runtime_error("clCreateCommandQueueWithProperties failed. Error: " + std::to_string(err));
+    }
+    return queue;
+}
 
-    // Device Availability
-    cl_uint numDevices;
-    err = clGetDeviceIDs(chosenPlatform, CL_DEVICE_TYPE_GPU, 0, nullptr, &numDevices);
-    if (err != CL_SUCCESS || numDevices == 0) {
-        throw std::runtime_error("No OpenCL GPU devices found for the platform");
+cl_kernel buildFillKernel(cl_context context, cl_device_id device) {
+    cl_int err;
+    cl_program program = clCreateProgramWithSource(context, 1, &kFillNv12Source, nullptr, &err);
+    if (err != CL_SUCCESS) {
+        throw std::runtime_error("clCreateProgramWithSource failed. Error: " + std::to_string(err));
     }
 
-    std::vector<cl_device_id> devices(numDevices);
-    err = clGetDeviceIDs(chosenPlatform, CL_DEVICE_TYPE_GPU, numDevices, devices.data(), nullptr);
+    err = clBuildProgram(program, 1, &device, nullptr, nullptr, nullptr);
     if (err != CL_SUCCESS) {
-        std::string errorMsg = "OpenCL Error: " + std::to_string(err);
-        throw std::runtime_error(errorMsg);
+        size_t logSize = 0;
+        clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, nullptr, &logSize);
+        std::string log(logSize, '\0');
+        clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, logSize, log.data(), nullptr);
+        clReleaseProgram(program);
+        throw std::runtime_error("clBuildProgram failed:\n" + log);
     }
 
-    cl_context context = clCreateContext(nullptr, numDevices, devices.data(), nullptr, nullptr, &err);
-    if(err != CL_SUCCESS) {
-        std::string errorMsg = "Failed to create OpenCL context. Error: " + std::to_string(err);
-        throw std::runtime_error(errorMsg);
+    cl_kernel kernel = clCreateKernel(program, "fill_nv12", &err);
+    clReleaseProgram(program);
+    if (err != CL_SUCCESS) {
+        throw std::runtime_error("clCreateKernel failed. Error: " + std::to_string(err));
     }
-    
-    return context;
+    return kernel;
 }
 
-cl_mem createOpenCLBuffer(cl_context context, int width, int height) {
-    cl_int err;
-    cl_mem buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, width * height * 4, NULL, &err);
-    if(err != CL_SUCCESS) {
-        throw std::runtime_error("Failed to create OpenCL buffer");
+// Y (CL_R) and UV (CL_RG) planes laid out like the images the extension returns for NV12
+std::vector<cl_mem> createNv12Images(cl_context context, int width, int height) {
+    std::vector<cl_mem> planes;
+    const cl_image_format formats[2] = {{CL_R, CL_UNORM_INT8}, {CL_RG, CL_UNORM_INT8}};
+    for (int plane = 0; plane < 2; ++plane) {
+        cl_image_desc desc = {};
+        desc.image_type = CL_MEM_OBJECT_IMAGE2D;
+        desc.image_width = plane == 0 ? width : width / 2;
+        desc.image_height = plane == 0 ? height : height / 2;
+
+        cl_int err;
+        cl_mem image = clCreateImage(context, CL_MEM_READ_WRITE, &formats[plane], &desc, nullptr, &err);
+        if (err != CL_SUCCESS) {
+            for (cl_mem created : planes) {
+                clReleaseMemObject(created);
+            }
+            throw std::runtime_error("clCreateImage failed. Error: " + std::to_string(err));
+        }
+        planes.push_back(image);
     }
-    return buffer;
+    return planes;
 }
-VASurfaceID OpenCLBufferToVaSurface(VADisplay va_dpy, cl_context clContext, cl_mem clBuffer, int width, int height) {
-    VAStatus va_status;
-    VASurfaceID va_surface;
-    cl_int err;
 
-    VASurfaceAttribExternalBuffers va_ext_buf_desc;
-    VASurfaceAttrib attribs[2];
+// Acquire every surface once, fill each one, release every surface once
+void fillBatch(cl_command_queue queue, cl_kernel kernel, ClVaSurfaceBatch& batch, int width, int height) {
+    cl_int err = batch.acquire(queue);
+    if (err != CL_SUCCESS) {
+        throw std::runtime_error("Acquiring the surfaces failed. Error: " + std::to_string(err));
+    }
 
-    attribs[0].type = VASurfaceAttribMemoryType;
-    attribs[0].flags = VA_SURFACE_ATTRIB_SETTABLE;
-    attribs[0].value.type = VAGenericValueTypeInteger;
-    attribs[0].value.value.i = VA_SURFACE_ATTRIB_MEM_TYPE_VA;
+    for (size_t i = 0; i < batch.size(); ++i) {
+        TRACE_SCOPE("clEnqueueNDRangeKernel");
+        const Nv12Color color = surfaceColor(i);
+        const cl_float4 yuv = {{color.y / 255.0f, color.u / 255.0f, color.v / 255.0f, 0.0f}};
+        cl_mem yPlane = batch.plane(i, 0);
+        cl_mem uvPlane = batch.plane(i, 1);
+        clSetKernelArg(kernel, 0, sizeof(cl_mem), &yPlane);
+        clSetKernelArg(kernel, 1, sizeof(cl_mem), &uvPlane);
+        clSetKernelArg(kernel, 2, sizeof(cl_float4), &yuv);
+
+        const size_t global[2] = {size_t(width), size_t(height)};
+        err = clEnqueueNDRangeKernel(queue, kernel, 2, nullptr, global, nullptr, 0, nullptr, nullptr);
+        if (err != CL_SUCCESS) {
+            throw std::runtime_error("clEnqueueNDRangeKernel failed. Error: " + std::to_string(err));
+        }
+    }
 
-    attribs[1].type = VASurfaceAttribExternalBufferDescriptor;
-    attribs[1].flags = VA_SURFACE_ATTRIB_SETTABLE;
-    attribs[1].value.type = VAGenericValueTypePointer;
-    attribs[1].value.value.p = &va_ext_buf_desc;
+    cl_event released;
+    err = batch.release(queue, 0, nullptr, &released);
+    if (err != CL_SUCCESS) {
+        throw std::runtime_error("Releasing the surfaces failed. Error: " + std::to_string(err));
+    }
+    // The surfaces are read on the host next, so wait even when the runtime syncs with VA
+    clWaitForEvents(1, &released);
+    clReleaseEvent(released);
+}
 
-    va_ext_buf_desc.pixel_format = VA_FOURCC_RGBA;
-    va_ext_buf_desc.width = width;
-    va_ext_buf_desc.height = height;
-    va_ext_buf_desc.data_size = width * height * 4;
-    va_ext_buf_desc.num_planes = 1;
-    va_ext_buf_desc.pitches[0] = width * 4;
-    va_ext_buf_desc.offsets[0] = 0;
+int runCpu(int numSurfaces, bool userSync, int width, int height) {
+    std::cout << "Running on the OpenCL CPU device (plain images, no VA sharing)" << std::endl;
+    cl_device_id device;
+    ClContext clContext(createOpenCLContext(CL_DEVICE_TYPE_CPU, device));
+    ClQueue queue(createQueue(clContext.get(), device));
+    ClKernel kernel(buildFillKernel(clContext.get(), device));
 
-    // Create a VASurface from the OpenCL buffer
-    err = clGetMemObjectInfo(clBuffer, CL_MEM_VA_API_MEDIA_SURFACE_INTEL, sizeof(va_surface), &va_surface, NULL);
-    if(err != CL_SUCCESS) {
-        throw std::runtime_error("Failed to get VASurface from OpenCL buffer");
+    ClVaSurfaceBatch batch(ClVaSharing{}, clContext.get(), nullptr, userSync);
+    for (int i = 0; i < numSurfaces; ++i) {
+        batch.addImages(createNv12Images(clContext.get(), width, height));
     }
 
-    va_status = vaCreateSurfaces(va_dpy, VA_RT_FORMAT_RGB32, width, height, &va_surface, 1, attribs, 2);
-    if(va_status != VA_STATUS_SUCCESS) {
-        throw std::runtime_error("Failed to create VA surface from OpenCL buffer");
-    }
+    auto start = std::chrono::steady_clock::now();
+    fillBatch(queue.get(), kernel.get(), batch, width, height);
+    auto elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start);
+    std::cout << "Filled " << batch.size() << " images in " << elapsed.count() << " ms" << std::endl;
 
-    return va_surface;
+    int failures = 0;
+    for (size_t i = 0; i < batch.size(); ++i) {
+        if (!isImageColor(queue.get(), batch.plane(i, 0), batch.plane(i, 1), width, height, surfaceColor(i))) {
+            std::cerr << "Image " << i << " doesn't match the expected color!" << std::endl;
+            failures++;
+        }
+    }
+    return failures;
 }
 
-int main() {
-
+int runGpu(int numSurfaces, bool userSync, int width, int height) {
     std::cout << "Running drmFd" << std::endl;
     int drmFd = open("/dev/dri/renderD128", O_RDWR); // Opening the first render node. Change index as per your system.
     if (drmFd < 0) {
-        std::cerr << "Failed to open DRM" << std::endl;
-        return -1;
+        throw std::runtime_error("Failed to open DRM");
     }
+    ScopeExit closeDrm([&]() { close(drmFd); });
 
     std::cout << "Running vaGetDisplayDRM" << std::endl;
     VADisplay vaDisplay = vaGetDisplayDRM(drmFd);
-    if (vaDisplay == nullptr) {
-        std::cerr << "Failed to get VA Display" << std::endl;
-        close(drmFd);
-        return -1;
+    int major, minor;
+    if (vaDisplay == nullptr || vaInitialize(vaDisplay, &major, &minor) != VA_STATUS_SUCCESS) {
+        throw std::runtime_error("Failed to initialize VA Display");
     }
+    ScopeExit terminateVa([&]() { vaTerminate(vaDisplay); });
 
-    int major, minor;
-    VAStatus vaStatus = vaInitialize(vaDisplay, &major, &minor);
-    if (vaStatus != VA_STATUS_SUCCESS) {
-        std::cerr << "Failed to initialize VA Display" << std::endl;
-        vaTerminate(vaDisplay);
-        close(drmFd);
-        return -1;
+    std::cout << "Running findClVaSharing" << std::endl;
+    ClVaSharing sharing = findClVaSharing();
+    if (!clVaSharingSupported(sharing)) {
+        throw std::runtime_error("No OpenCL platform supports cl_intel_va_api_media_sharing (try the cpu mode)");
     }
 
-    // Create OpenCL context
-    cl_context clContext = createOpenCLContext();
+    // Context bound to the VA display
+    std::vector<cl_device_id> devices = clDevicesForVaDisplay(sharing, vaDisplay);
+    ClContext clContext(createClVaContext(sharing, vaDisplay, devices, userSync));
+    ClQueue queue(createQueue(clContext.get(), devices[0]));
+    ClKernel kernel(buildFillKernel(clContext.get(), devices[0]));
+
+    std::cout << "Running vaCreateSurfaces" << std::endl;
+    std::vector<VASurfaceID> surfaces(numSurfaces);
+    VASurfaceAttrib attrib = {};
+    attrib.type = VASurfaceAttribPixelFormat;
+    attrib.flags = VA_SURFACE_ATTRIB_SETTABLE;
+    attrib.value.type = VAGenericValueTypeInteger;
+    attrib.value.value.i = VA_FOURCC_NV12;
+    VAStatus va_status = vaCreateSurfaces(vaDisplay, VA_RT_FORMAT_YUV420, width, height, surfaces.data(),
+                                          surfaces.size(), &attrib, 1);
+    if (va_status != VA_STATUS_SUCCESS) {
+        throw std::runtime_error("vaCreateSurfaces failed: " + std::to_string(va_status));
+    }
+    ScopeExit destroySurfaces([&]() { vaDestroySurfaces(vaDisplay, surfaces.data(), surfaces.size()); });
 
-    // Allocate memory using OpenCL buffer
-    size_t width = 1920;
-    size_t height = 1080;
-    cl_mem clBuffer = createOpenCLBuffer(clContext, width, height);
+    // Zero-copy: the images alias the surfaces' memory. The batch releases them before the surfaces go.
+    ClVaSurfaceBatch batch(sharing, clContext.get(), vaDisplay, userSync);
+    for (VASurfaceID surface : surfaces) {
+        batch.addSurface(surface, 2);
+    }
 
-    // Convert the OpenCL buffer to a VASurface
-    VASurfaceID vaSurface = OpenCLBufferToVaSurface(vaDisplay, clContext, clBuffer, width, height);
+    auto start = std::chrono::steady_clock::now();
+    fillBatch(queue.get(), kernel.get(), batch, width, height);
+    auto elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start);
+    std::cout << "Filled " << batch.size() << " surfaces in " << elapsed.count() << " ms" << std::endl;
 
-    // Verify the VASurface
-    if (!verifyVASurface(vaSurface, vaDisplay)) {
-        std::cerr << "VASurface verification failed!" << std::endl;
-        vaTerminate(vaDisplay);
-        close(drmFd);
-        return -1;
+    int failures = 0;
+    for (size_t i = 0; i < batch.size(); ++i) {
+        if (!isSurfaceColor(vaDisplay, batch.surface(i), width, height, surfaceColor(i))) {
+            std::cerr << "Surface " << i << " doesn't match the expected color!" << std::endl;
+            failures++;
+        }
     }
+    return failures;
+}
 
-    // Check if the surface is red
-    if (isSurfaceRed(vaDisplay, vaSurface, width, height)) {
-        std::cout << "Surface is correctly filled with red!" << std::endl;
-    } else {
-        std::cerr << "Surface color doesn't match expected red color!" << std::endl;
+// Stand-ins for the extension entry points, backed by plain images on the CPU runtime.
+// They record what the batch asks for.
+typedef struct {
+    cl_context context;
+    int width;
+    int height;
+    std::vector<std::pair<VASurfaceID, cl_uint>> created;  // Surface and plane of every image
+    std::vector<cl_mem> images;                              // Every image, with a reference held here
+    std::vector<std::vector<cl_mem>> acquires;               // Image list of every acquire call
+    std::vector<std::vector<cl_mem>> releases;               // Image list of every release call
+    int failPlane;                                           // Plane whose creation fails, -1 for none
+} StubSharingState;
+
+static StubSharingState stubState;
+
+cl_mem stubCreateFromSurface(cl_context context, cl_mem_flags, VASurfaceID* surface, cl_uint plane, cl_int* err) {
+    if (int(plane) == stubState.failPlane) {
+        *err = CL_INVALID_VALUE;
+        return nullptr;
     }
+    std::vector<cl_mem> planes = createNv12Images(context, stubState.width, stubState.height);
+    clReleaseMemObject(planes[1 - plane]);
+    stubState.created.push_back({*surface, plane});
+    stubState.images.push_back(planes[plane]);
+    clRetainMemObject(planes[plane]);
+    *err = CL_SUCCESS;
+    return planes[plane];
+}
 
-    // Clean up
-    vaTerminate(vaDisplay);
-    close(drmFd);
+cl_int stubEnqueueAcquire(cl_command_queue queue, cl_uint count, const cl_mem* mems, cl_uint numEvents,
+                          const cl_event* waitList, cl_event* event) {
+    stubState.acquires.emplace_back(mems, mems + count);
+    return clEnqueueMarkerWithWaitList(queue, numEvents, waitList, event);
+}
+
+cl_int stubEnqueueRelease(cl_command_queue queue, cl_uint count, const cl_mem* mems, cl_uint numEvents,
+                          const cl_event* waitList, cl_event* event) {
+    stubState.releases.emplace_back(mems, mems + count);
+    return clEnqueueMarkerWithWaitList(queue, numEvents, waitList, event);
+}
+
+cl_uint referenceCount(cl_mem mem) {
+    cl_uint count = 0;
+    clGetMemObjectInfo(mem, CL_MEM_REFERENCE_COUNT, sizeof(count), &count, nullptr);
+    return count;
+}
+
+// ClVaSurfaceBatch against stub entry points on the OpenCL CPU runtime, no GPU or VA needed.
+// Implicit sync only: user-sync acquire calls vaSyncSurface.
+int runBatchChecks(int numSurfaces) {
+    const int width = 64, height = 32;
+    cl_device_id device;
+    ClContext context(createOpenCLContext(CL_DEVICE_TYPE_CPU, device));
+    ClQueue queueOwner(createQueue(context.get(), device));
+    ClKernel kernelOwner(buildFillKernel(context.get(), device));
+    cl_context clContext = context.get();
+    cl_command_queue queue = queueOwner.get();
+    cl_kernel kernel = kernelOwner.get();
+    stubState = {clContext, width, height, {}, {}, {}, {}, -1};
+
+    ClVaSharing sharing = {};
+    sharing.getDeviceIDs = [](cl_platform_id, cl_va_api_device_source_intel, void*, cl_va_api_device_set_intel,
+                              cl_uint, cl_device_id*, cl_uint*) -> cl_int { return CL_INVALID_VALUE; };
+    sharing.createFromSurface = stubCreateFromSurface;
+    sharing.enqueueAcquire = stubEnqueueAcquire;
+    sharing.enqueueRelease = stubEnqueueRelease;
+
+    {
+        ClVaSurfaceBatch batch(sharing, clContext, nullptr, false);
+        for (int i = 0; i < numSurfaces; ++i) {
+            CHECK(batch.addSurface(VASurfaceID(100 + i), 2) == size_t(i));
+        }
+        CHECK(stubState.created.size() == size_t(2 * numSurfaces));
+        for (int i = 0; i < numSurfaces; ++i) {
+            for (cl_uint p = 0; p < 2; ++p) {
+                CHECK(batch.surface(i) == VASurfaceID(100 + i) && batch.plane(i, p) == stubState.images[2 * i + p]);
+                CHECK(stubState.created[2 * i + p].first == VASurfaceID(100 + i) && stubState.created[2 * i + p].second == p);
+            }
+        }
+
+        // One acquire and one release for the whole batch, every image in plane order
+        fillBatch(queue, kernel, batch, width, height);
+        CHECK(stubState.acquires.size() == 1 && stubState.releases.size() == 1);
+        CHECK(stubState.acquires[0] == stubState.images && stubState.releases[0] == stubState.images);
+        for (size_t i = 0; i < batch.size(); ++i) {
+            CHECK(isImageColor(queue, batch.plane(i, 0), batch.plane(i, 1), width, height, surfaceColor(i)));
+        }
+
+        // Plain images cannot join a batch of shared surfaces, and are released on the way out
+        std::vector<cl_mem> plain = createNv12Images(clContext, width, height);
+        clRetainMemObject(plain[0]);
+        bool rejected = false;
+        try {
+            batch.addImages(plain);
+        } catch (const std::runtime_error&) {
+            rejected = true;
+        }
+        CHECK(rejected && batch.size() == size_t(numSurfaces) && referenceCount(plain[0]) == 1);
+        clReleaseMemObject(plain[0]);
+
+        // A failed plane releases the planes already created for that surface
+        stubState.failPlane = 1;
+        rejected = false;
+        try {
+            batch.addSurface(VASurfaceID(999), 2);
+        } catch (const std::runtime_error&) {
+            rejected = true;
+        }
+        CHECK(rejected && batch.size() == size_t(numSurfaces) && referenceCount(stubState.images.back()) == 1);
+        stubState.failPlane = -1;
+    }
+    // The batch released its reference to every image
+    for (cl_mem image : stubState.images) {
+        CHECK(referenceCount(image) == 1);
+        clReleaseMemObject(image);
+    }
+
+    // User sync: release() returns once the release has completed
+    {
+        ClVaSurfaceBatch batch(sharing, clContext, nullptr, true);
+        batch.addSurface(VASurfaceID(7), 2);
+        cl_event released;
+        CHECK(batch.release(queue, 0, nullptr, &released) == CL_SUCCESS);
+        cl_int status = CL_QUEUED;
+        clGetEventInfo(released, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, nullptr);
+        CHECK(status == CL_COMPLETE);
+        clReleaseEvent(released);
+    }
+    for (size_t i = 2 * numSurfaces + 1; i < stubState.images.size(); ++i) {
+        clReleaseMemObject(stubState.images[i]);
+    }
+
+    std::cout << "Batch checks passed for " << numSurfaces << " stub surfaces" << std::endl;
     return 0;
-}
\ No newline at end of file
+}
+
+// Usage: va_main [surfaces] [implicit|user-sync] [gpu|cpu]
+//        va_main selftest [surfaces]
+//   selftest: check ClVaSurfaceBatch against stub extension entry points on the OpenCL CPU
+//             runtime, no GPU or VA driver needed
+int main(int argc, char* argv[]) {
+    if (isSelfTest(argc, argv)) {
+        const int numSurfaces = argc > 2 ? std::stoi(argv[2]) : 8;
+        return runSelfTest([numSurfaces]() { return runBatchChecks(numSurfaces); });
+    }
+    int numSurfaces = argc > 1 ? std::stoi(argv[1]) : 8;
+    bool userSync = argc > 2 && std::string(argv[2]) == "user-sync";
+    const std::string device = argc > 3 ? argv[3] : "gpu";
+    bool cpu = device == "cpu";
+
+    int width = 1920;
+    int height = 1080;
+    std::cout << "Sync mode: " << (userSync ? "user-sync" : "implicit") << std::endl;
+
+    int failures = cpu ? runCpu(numSurfaces, userSync, width, height) : runGpu(numSurfaces, userSync, width, height);
+    if (failures == 0) {
+        std::cout << "All " << numSurfaces << " surfaces are correctly filled with red!" << std::endl;
+    }
+
+    traceFlushFromEnv();
+    return failures == 0 ? 0 : -1;
+}
@@ -1,3 +1,4 @@
+#include <memory>
 #include <optional>
 #include <vector>
 #include <string>
@@ -25,12 +26,36 @@ extern "C" {
 #include <va/va_drmcommon.h>
 }
 
-VASurfaceID DmaBufToVaSurface(VADisplay va_dpy, uintptr_t dma_fd, int width, int height) {
+#include "dmabuf_sync.hpp"
+#include "drm_tiling.hpp"
+#include "prime_frame.hpp"
+#include "scope_exit.hpp"
+#include "selftest.hpp"
+#include "surface_readback.hpp"
+#include "trace.hpp"
+#include "va_surface_caps.hpp"
+#include "ze_op_profiler.hpp"
+#include "ze_plane_ops.hpp"
+
+// Create a linear RGBA VASurface on top of the USM dma-buf. PRIME_2 is used when the driver
+// reports it, legacy PRIME when it only reports that. Returns VA_INVALID_SURFACE when the driver
+// shares no modifier with the linear buffer; it cannot be imported then.
+VASurfaceID DmaBufToVaSurface(VADisplay va_dpy, uintptr_t dma_fd, int width, int height, const VaSurfaceCaps& caps) {
     VAStatus va_status;
     VASurfaceID va_surface;
 
-    // TODO: Check if PRIME_2 is supported
-    bool use_prime2 = true;  // Assuming it's supported; adjust accordingly
+    // Rows of exactly width * 4 bytes, as writeToUSM and the fills assume
+    PrimeFrameLayout layout;
+    linearPrimeFrameLayout(layout, VA_FOURCC_RGBA, width, height, 4);
+    // Level Zero device allocations are linear, so that is the only modifier the USM side offers
+    layout.modifier[0] = chooseDrmModifier(caps, {DRM_FORMAT_MOD_LINEAR});
+    if (layout.modifier[0] == DRM_FORMAT_MOD_INVALID) {
+        return VA_INVALID_SURFACE;
+    }
+    const bool use_prime2 = caps.prime2;
+    if (!use_prime2 && !caps.prime) {
+        throw std::runtime_error("The VA driver imports neither PRIME_2 nor PRIME buffers");
+    }
 
     // Common attributes
     VASurfaceAttrib attribs[2];
@@ -42,62 +67,38 @@ VASurfaceID DmaBufToVaSurface(VADisplay va_dpy, uintptr_t dma_fd, int width, int
     attribs[1].flags = VA_SURFACE_ATTRIB_SETTABLE;
     attribs[1].value.type = VAGenericValueTypePointer;
 
-    if (use_prime2) {
-        std::cout << "Using PRIME_2 to export the memory" << std::endl;
-        VADRMPRIMESurfaceDescriptor prime_desc;
+    // Both descriptors must outlive vaCreateSurfaces
+    VADRMPRIMESurfaceDescriptor prime_desc;
+    VASurfaceAttribExternalBuffers va_ext_buf_desc;
 
-        // Set up the VASurfaceAttrib array
+    if (use_prime2) {
+        std::cout << "Using PRIME_2 to export the memory, modifier " << drmModifierName(layout.modifier[0])
+                  << std::endl;
         attribs[0].value.value.i = VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME_2;
         attribs[1].value.value.p = &prime_desc;
-
-        // Initialize the VADRMPRIMESurfaceDescriptor structure.
-        prime_desc.fourcc = VA_FOURCC_RGBA; // Assuming RGBA format
-        prime_desc.width = width;
-        prime_desc.height = height;
-        prime_desc.num_objects = 1;  // Assuming one object for simplicity
-        prime_desc.objects[0].fd = dma_fd;
-        prime_desc.objects[0].size = width * height * 4;  // For RGBA
-        prime_desc.objects[0].drm_format_modifier = DRM_FORMAT_MOD_LINEAR; // Set as Linear memory because it's layout as linearly
-
-        prime_desc.num_layers = 1;  // Assuming one layer for RGBA
-        prime_desc.layers[0].drm_format = VA_FOURCC_RGBA; // Again, assuming RGBA format
-        prime_desc.layers[0].num_planes = 1;  // RGBA is packed into a single plane
-        prime_desc.layers[0].object_index[0] = 0;
-        prime_desc.layers[0].offset[0] = 0;
-        prime_desc.layers[0].pitch[0] = width * 4;  // For RGBA
-
+        fillPrimeDescriptor(prime_desc, layout, (int)dma_fd);
     } else {
         std::cout << "Using PRIME to export the memory" << std::endl;
-        VASurfaceAttribExternalBuffers va_ext_buf_desc;
-
-        // Set up the VASurfaceAttrib array
         attribs[0].value.value.i = VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME;
         attribs[1].value.value.p = &va_ext_buf_desc;
-
-        // Initialize the VASurfaceAttribExternalBuffers structure.
-        va_ext_buf_desc.buffers = &dma_fd; // Pointer to the DMA-BUF FD
-        va_ext_buf_desc.num_buffers = 1;
-        va_ext_buf_desc.width = width;
-        va_ext_buf_desc.height = height;
-        va_ext_buf_desc.pixel_format = VA_FOURCC_RGBA; // Assuming the NV12 format
-        va_ext_buf_desc.data_size = width * height * 4; // For RGBA
-        va_ext_buf_desc.num_planes = 1; // RGBA (or RGBX) is packed into a single plane
-        va_ext_buf_desc.pitches[0] = width * 4; // For RGBA (or RGBX)
-        va_ext_buf_desc.offsets[0] = 0;
-
+        // PRIME has no modifier, so it is linear
+        fillExternalBuffers(va_ext_buf_desc, layout, &dma_fd);
     }
 
     // Create the surface
-    va_status = vaCreateSurfaces(
-        va_dpy,
-        VA_RT_FORMAT_RGB32,
-        width,
-        height,
-        &va_surface,
-        1,
-        attribs,
-        2 // Number of attribs
-    );
+    {
+        TRACE_SCOPE("vaCreateSurfaces");
+        va_status = vaCreateSurfaces(
+            va_dpy,
+            VA_RT_FORMAT_RGB32,
+            width,
+            height,
+            &va_surface,
+            1,
+            attribs,
+            2 // Number of attribs
+        );
+    }
     if (va_status != VA_STATUS_SUCCESS) {
         std::string errorMsg = use_prime2 ? "Failed to create vaCreateSurfaces with PRIME_2" : "Failed to create vaCreateSurfaces";
         throw std::runtime_error(errorMsg);
@@ -202,7 +203,11 @@ void* allocateUSM(ze_context_handle_t context, ze_device_handle_t device, size_t
     allocDesc.flags = 0;
     
     void* memory = nullptr;
-    ze_result_t result = zeMemAllocDevice(context, &allocDesc, size, 4096, device, &memory);
+    ze_result_t result;
+    {
+        TRACE_SCOPE("zeMemAllocDevice");
+        result = zeMemAllocDevice(context, &allocDesc, size, 4096, device, &memory);
+    }
     
     if (result != ZE_RESULT_SUCCESS) {
         // Handle error
@@ -220,7 +225,11 @@ int usmToDmaBuf(ze_context_handle_t context, void* usmPtr) {
     ze_memory_allocation_properties_t alloc_props = {};
     alloc_props.stype = ZE_STRUCTURE_TYPE_MEMORY_ALLOCATION_PROPERTIES;
     alloc_props.pNext = &export_fd;
-    ze_result_t ze_res = zeMemGetAllocProperties(context, usmPtr, &alloc_props, nullptr);
+    ze_result_t ze_res;
+    {
+        TRACE_SCOPE("zeMemGetAllocProperties export");
+        ze_res = zeMemGetAllocProperties(context, usmPtr, &alloc_props, nullptr);
+    }
     if (ze_res != ZE_RESULT_SUCCESS)
         throw std::runtime_error("Failed to convert USM pointer to DMA-BUF: " + std::to_string(ze_res));
 
@@ -228,7 +237,7 @@ int usmToDmaBuf(ze_context_handle_t context, void* usmPtr) {
     return dma_fd; // This is the DMA BUF handle
 }
 
-void writeToUSM(ze_context_handle_t context, ze_device_handle_t device, void* usmMemory, const void* srcData, size_t dataSize){
+void writeToUSM(ze_context_handle_t context, ze_device_handle_t device, void* usmMemory, const void* srcData, size_t dataSize, ZeOpProfiler& profiler){
     // Create command queue
     ze_command_queue_desc_t queueDesc = {};
     queueDesc.mode = ZE_COMMAND_QUEUE_MODE_DEFAULT;
@@ -250,7 +259,7 @@ void writeToUSM(ze_context_handle_t context, ze_device_handle_t device, void* us
     }
 
     // Append memory copy command
-    result = zeCommandListAppendMemoryCopy(cmdList, usmMemory, srcData, dataSize, nullptr, 0, nullptr);
+    result = zeCommandListAppendMemoryCopy(cmdList, usmMemory, srcData, dataSize, profiler.event("writeToUSM copy"), 0, nullptr);
     if (result != ZE_RESULT_SUCCESS) {
         std::cerr << "Failed to append memory copy. Error code: " << result << std::endl;
         zeCommandListDestroy(cmdList);
@@ -268,10 +277,14 @@ void writeToUSM(ze_context_handle_t context, ze_device_handle_t device, void* us
     }
 
     // Execute the command list
-    result = zeCommandQueueExecuteCommandLists(cmdQueue, 1, &cmdList, nullptr);
+    {
+        TRACE_SCOPE("writeToUSM execute");
+        result = zeCommandQueueExecuteCommandLists(cmdQueue, 1, &cmdList, nullptr);
+    }
     if (result != ZE_RESULT_SUCCESS) {
         std::cerr << "Failed to execute command list. Error code: " << result << std::endl;
     }
+    profiler.collect();
 
     // Clean up
     zeCommandListDestroy(cmdList);
@@ -279,113 +292,370 @@ void writeToUSM(ze_context_handle_t context, ze_device_handle_t device, void* us
 }
 
 // Fill the VASurface with a specific color (red)
-void fillSurfaceWithRed(VADisplay va_dpy, VASurfaceID surface, int width, int height, ze_context_handle_t contextHandle, ze_device_handle_t deviceHandle) {
+// gpu: ops is a ZePlaneOps and writes the USM allocation the surface was imported from,
+//      one zeCommandListAppendMemoryFill. cpu: ops is a CpuPlaneOps on a vaDeriveImage mapping.
+// Returns a SyncFd that fires once the surface contents can be used by Level Zero
+SyncFd fillSurfaceWithRed(VADisplay va_dpy, VASurfaceID surface, int width, int height, int dmaBufFd, SyncWatcher& watcher,
+                          PlaneOps& ops, bool gpu, void* usmMemory) {
     VASurfaceStatus status;
     vaQuerySurfaceStatus(va_dpy, surface, &status);
 
     if (status != VASurfaceReady) {
         throw std::runtime_error("Surface not ready!");
-        return;
     }
 
-    // Define a red RGBA color
-    std::vector<uint8_t> redData(width * height * 4, 0);
-    for (size_t i = 0; i < redData.size(); i += 4) {
-        redData[i] = 255;  // Red channel
-    }
+    static const uint8_t red[4] = {255, 0, 0, 0};
+    if (gpu) {
+        // The surface is linear RGBA at width * 4 bytes per row (DmaBufToVaSurface)
+        std::vector<SurfacePlane> planes = {{usmMemory, size_t(width) * 4, uint32_t(width), uint32_t(height), 4}};
+        TRACE_SCOPE("fillSurfaceWithRed gpu fill");
+        fillFrameRect(ops, planes, VA_FOURCC_RGBA, fullRect(planes[0]), red);
+        ops.finish();
+    } else {
+        // Map the surface to fill it
+        VAImage vaImage;
+        {
+            TRACE_SCOPE("vaDeriveImage");
+            vaDeriveImage(va_dpy, surface, &vaImage);
+        }
 
-    // Map the surface to fill it
-    VAImage vaImage;
-    vaDeriveImage(va_dpy, surface, &vaImage);
+        void* pBuf = nullptr;
+        {
+            TRACE_SCOPE("vaMapBuffer");
+            vaMapBuffer(va_dpy, vaImage.buf, &pBuf);
+        }
+        {
+            TRACE_SCOPE("fillSurfaceWithRed cpu fill");
+            std::vector<SurfacePlane> planes = imagePlanes(vaImage, pBuf);
+            fillFrameRect(ops, planes, VA_FOURCC_RGBA, fullRect(planes[0]), red);
+            ops.finish();
+        }
+        vaUnmapBuffer(va_dpy, vaImage.buf);
 
-    uint8_t* pBuf = nullptr;
-    vaMapBuffer(va_dpy, vaImage.buf, (void**)&pBuf);
-    memcpy(pBuf, redData.data(), redData.size());
-    vaUnmapBuffer(va_dpy, vaImage.buf);
+        vaDestroyImage(va_dpy, vaImage.image_id);
+    }
 
-    vaDestroyImage(va_dpy, vaImage.image_id);
+    // Hand the buffer over to Level Zero without waiting for VA here
+    TRACE_SCOPE("fillSurfaceWithRed handoff");
+    return vaSurfaceReady(watcher, va_dpy, surface, dmaBufFd);
+}
 
-    // Synchronize after filling the surface
-    ze_command_list_handle_t cmdList;
-    ze_command_list_desc_t cmdListDesc = {};
-    zeCommandListCreate(contextHandle, deviceHandle, &cmdListDesc, &cmdList);
+// Copy the first row of the USM buffer to the host once ready fires and check that it is red.
+// The copy is queued right away behind a gate event; only the final poll() waits.
+bool isUsmRowRed(ze_context_handle_t contextHandle, ze_device_handle_t deviceHandle, void* usmMemory, int width,
+                 const SyncFd& ready, SyncWatcher& watcher, ZeOpProfiler& profiler) {
+    const size_t rowBytes = size_t(width) * 4;
+
+    ze_event_pool_desc_t poolDesc = {};
+    poolDesc.stype = ZE_STRUCTURE_TYPE_EVENT_POOL_DESC;
+    poolDesc.flags = ZE_EVENT_POOL_FLAG_HOST_VISIBLE;
+    poolDesc.count = 2;
+    ze_event_pool_handle_t pool;
+    ze_result_t result = zeEventPoolCreate(contextHandle, &poolDesc, 1, &deviceHandle, &pool);
+    if (result != ZE_RESULT_SUCCESS) {
+        throw std::runtime_error("Failed to create event pool: " + std::to_string(result));
+    }
+    // Everything below is released on the throw paths too
+    ze_event_handle_t gate = nullptr, done = nullptr;
+    void* hostRow = nullptr;
+    ze_command_list_handle_t cmdList = nullptr;
+    ScopeExit release([&]() {
+        if (cmdList) {
+            zeCommandListDestroy(cmdList);
+        }
+        if (hostRow) {
+            zeMemFree(contextHandle, hostRow);
+        }
+        if (done) {
+            zeEventDestroy(done);
+        }
+        if (gate) {
+            zeEventDestroy(gate);
+        }
+        zeEventPoolDestroy(pool);
+    });
+
+    ze_event_desc_t eventDesc = {};
+    eventDesc.stype = ZE_STRUCTURE_TYPE_EVENT_DESC;
+    eventDesc.signal = ZE_EVENT_SCOPE_FLAG_HOST;
+    eventDesc.wait = ZE_EVENT_SCOPE_FLAG_HOST;
+    eventDesc.index = 0;
+    if (zeEventCreate(pool, &eventDesc, &gate) != ZE_RESULT_SUCCESS) {
+        gate = nullptr;
+        throw std::runtime_error("Failed to create the gate event");
+    }
+    eventDesc.index = 1;
+    if (zeEventCreate(pool, &eventDesc, &done) != ZE_RESULT_SUCCESS) {
+        done = nullptr;
+        throw std::runtime_error("Failed to create the copy event");
+    }
 
-    zeCommandListAppendBarrier(cmdList, nullptr, 0, nullptr);
-    zeCommandListClose(cmdList);
+    ze_host_mem_alloc_desc_t hostDesc = {};
+    hostDesc.stype = ZE_STRUCTURE_TYPE_HOST_MEM_ALLOC_DESC;
+    result = zeMemAllocHost(contextHandle, &hostDesc, rowBytes, 64, &hostRow);
+    if (result != ZE_RESULT_SUCCESS) {
+        hostRow = nullptr;
+        throw std::runtime_error("Failed to allocate host memory: " + std::to_string(result));
+    }
 
-    ze_command_queue_handle_t cmdQueue;
-    ze_command_queue_desc_t cmdQueueDesc = {};
-    zeCommandQueueCreate(contextHandle, deviceHandle, &cmdQueueDesc, &cmdQueue);
+    ze_command_queue_desc_t queueDesc = {};
+    queueDesc.stype = ZE_STRUCTURE_TYPE_COMMAND_QUEUE_DESC;
+    queueDesc.mode = ZE_COMMAND_QUEUE_MODE_ASYNCHRONOUS;
+    result = zeCommandListCreateImmediate(contextHandle, deviceHandle, &queueDesc, &cmdList);
+    if (result != ZE_RESULT_SUCCESS) {
+        cmdList = nullptr;
+        throw std::runtime_error("Failed to create immediate command list: " + std::to_string(result));
+    }
 
-    zeCommandQueueExecuteCommandLists(cmdQueue, 1, &cmdList, nullptr);
-    zeCommandQueueSynchronize(cmdQueue, UINT32_MAX);
+    {
+        TRACE_SCOPE("isUsmRowRed submit");
+        zeCommandListAppendMemoryCopy(cmdList, hostRow, usmMemory, rowBytes, profiler.event("isUsmRowRed copy"), 1,
+                                      &gate);
+        // The copy's own event belongs to the profiler; a barrier signals done
+        zeCommandListAppendBarrier(cmdList, done, 0, nullptr);
+        zeSignalWhenReady(watcher, ready, gate);
+    }
 
-    zeCommandListReset(cmdList);
-    zeCommandListDestroy(cmdList);
-    zeCommandQueueDestroy(cmdQueue);
+    // An event loop would add this fd to its poll set instead of waiting on it
+    SyncFd copied = zeEventDone(watcher, done);
+    {
+        TRACE_SCOPE("isUsmRowRed wait");
+        // The gate stays shut when VA fails; don't wait for a copy that never starts then
+        while (!copied.wait(100)) {
+            if (ready.signaled() && ready.failed()) {
+                // Open it only to drain the queued copy before the list is destroyed, and drop the result
+                zeEventHostSignal(gate);
+                copied.wait(-1);
+                profiler.discard();
+                throw std::runtime_error("The surface never became ready for Level Zero");
+            }
+        }
+    }
+    if (copied.failed()) {
+        profiler.discard();
+        throw std::runtime_error("The row copy failed");
+    }
+    profiler.collect();
+
+    bool red = true;
+    const uint8_t* pixel = static_cast<const uint8_t*>(hostRow);
+    for (int x = 0; x < width && red; ++x, pixel += 4) {
+        red = pixel[0] == 255 && pixel[1] == 0 && pixel[2] == 0;
+    }
+    return red;
 }
 
-bool isSurfaceRed(VADisplay va_dpy, VASurfaceID surface, int width, int height) {
-    VAImage vaImage;
-    vaDeriveImage(va_dpy, surface, &vaImage);
+// The "device" readback method: a Level Zero copy of the USM allocation behind the
+// surface into host USM. The surface is linear RGBA at width * 4 bytes per row.
+class UsmReadback {
+public:
+    UsmReadback(ze_context_handle_t context, ze_device_handle_t device, const void* usmMemory, uint32_t width,
+                uint32_t height, ZeOpProfiler& profiler)
+        : context_(context), usmMemory_(usmMemory), profiler_(profiler) {
+        bytes_ = linearPrimeFrameLayout(frame_.layout, VA_FOURCC_RGBA, width, height, 4);
+        ze_host_mem_alloc_desc_t hostDesc = {};
+        hostDesc.stype = ZE_STRUCTURE_TYPE_HOST_MEM_ALLOC_DESC;
+        ze_command_queue_desc_t queueDesc = {};
+        queueDesc.stype = ZE_STRUCTURE_TYPE_COMMAND_QUEUE_DESC;
+        queueDesc.mode = ZE_COMMAND_QUEUE_MODE_DEFAULT;
+        ze_command_list_desc_t listDesc = {};
+        listDesc.stype = ZE_STRUCTURE_TYPE_COMMAND_LIST_DESC;
+        if (zeMemAllocHost(context, &hostDesc, bytes_, 64, &host_) != ZE_RESULT_SUCCESS ||
+            zeCommandQueueCreate(context, device, &queueDesc, &queue_) != ZE_RESULT_SUCCESS ||
+            zeCommandListCreate(context, device, &listDesc, &list_) != ZE_RESULT_SUCCESS) {
+            release();
+            throw std::runtime_error("Failed to set up the USM readback");
+        }
+        frame_.base = static_cast<const uint8_t*>(host_);
+    }
+
+    ~UsmReadback() { release(); }
 
-    uint8_t* pBuf = nullptr;
-    vaMapBuffer(va_dpy, vaImage.buf, (void**)&pBuf);
+    UsmReadback(const UsmReadback&) = delete;
+    UsmReadback& operator=(const UsmReadback&) = delete;
 
+    HostFrame copy() {
+        TRACE_SCOPE("UsmReadback copy");
+        ze_result_t result = zeCommandListAppendMemoryCopy(list_, host_, usmMemory_, bytes_,
+                                                           profiler_.event("UsmReadback copy"), 0, nullptr);
+        if (result == ZE_RESULT_SUCCESS) {
+            zeCommandListClose(list_);
+            result = zeCommandQueueExecuteCommandLists(queue_, 1, &list_, nullptr);
+        }
+        if (result == ZE_RESULT_SUCCESS) {
+            result = zeCommandQueueSynchronize(queue_, UINT64_MAX);
+        }
+        zeCommandListReset(list_);
+        if (result != ZE_RESULT_SUCCESS) {
+            profiler_.discard();
+            throw std::runtime_error("USM readback failed: " + std::to_string(result));
+        }
+        profiler_.collect();
+        return frame_;
+    }
+
+private:
+    void release() {
+        if (list_) {
+            zeCommandListDestroy(list_);
+        }
+        if (queue_) {
+            zeCommandQueueDestroy(queue_);
+        }
+        if (host_) {
+            zeMemFree(context_, host_);
+        }
+    }
+
+    ze_context_handle_t context_;
+    const void* usmMemory_;
+    ZeOpProfiler& profiler_;
+    size_t bytes_ = 0;
+    void* host_ = nullptr;
+    ze_command_queue_handle_t queue_ = nullptr;
+    ze_command_list_handle_t list_ = nullptr;
+    HostFrame frame_ = {};
+};
+
+// Scans a cached copy of the surface: reading the mapping pixel by pixel would
+// run at uncached speed
+bool isSurfaceRed(SurfaceReadback& readback, VASurfaceID surface, int width, int height) {
+    TRACE_SCOPE("isSurfaceRed");
+    HostFrame frame = readback.read(surface);
     for (int y = 0; y < height; ++y) {
-        for (int x = 0; x < width; ++x) {
-            uint8_t* pixel = &pBuf[y * vaImage.pitches[0] + x * 4];
+        const uint8_t* pixel = frame.plane(0) + size_t(y) * frame.pitch(0);
+        for (int x = 0; x < width; ++x, pixel += 4) {
             if (pixel[0] != 255 || pixel[1] != 0 || pixel[2] != 0) {
-                vaUnmapBuffer(va_dpy, vaImage.buf);
-                vaDestroyImage(va_dpy, vaImage.image_id);
                 return false;
             }
         }
     }
-
-    vaUnmapBuffer(va_dpy, vaImage.buf);
-    vaDestroyImage(va_dpy, vaImage.image_id);
     return true;
 }
-bool verifyVASurface(VASurfaceID surface, VADisplay vaDpy) {
-    VAImage vaImg;
-    VAStatus vaStatus;
-    uint8_t* bufPtr = nullptr;
-
-    // Derive an image from the surface
-    vaStatus = vaDeriveImage(vaDpy, surface, &vaImg);
-    if (vaStatus != VA_STATUS_SUCCESS) {
-        std::cerr << "vaDeriveImage failed. Error code: " << vaStatus << std::endl;
-        return false;
-    }
-
-    // Map the buffer into process address space
-    vaStatus = vaMapBuffer(vaDpy, vaImg.buf, (void**)&bufPtr);
-    if (vaStatus != VA_STATUS_SUCCESS) {
-        std::cerr << "vaMapBuffer failed. Error code: " << vaStatus << std::endl;
-        vaDestroyImage(vaDpy, vaImg.image_id); // Clean up the image
+bool verifyVASurface(SurfaceReadback& readback, VASurfaceID surface) {
+    HostFrame frame;
+    try {
+        frame = readback.read(surface);
+    } catch (const std::exception& e) {
+        std::cerr << "Surface readback failed: " << e.what() << std::endl;
         return false;
     }
     bool crash_flag = true;
-    // Check the data; let's assume the image data type is int32 and stride is width * 4
+    // Check the data; the first row holds writeToUSM's int32 pattern
+    const int* data = reinterpret_cast<const int*>(frame.plane(0));
     for (int i = 0; i < 100; ++i) {
-        if (((int*)bufPtr)[i] != i + 1) {
-            std::cerr << "Data mismatch at index " << i << ". Expected: " << (i + 1) << ", Got: " << ((int*)bufPtr)[i] << std::endl;
-            // vaUnmapBuffer(vaDpy, vaImg.buf); // Unmap before returning
-            // vaDestroyImage(vaDpy, vaImg.image_id); // Clean up the image
+        if (data[i] != i + 1) {
+            std::cerr << "Data mismatch at index " << i << ". Expected: " << (i + 1) << ", Got: " << data[i] << std::endl;
             crash_flag = false;
         }
     }
 
-    vaUnmapBuffer(vaDpy, vaImg.buf);
-    vaDestroyImage(vaDpy, vaImg.image_id); // Clean up the image
     if (crash_flag == false)
         throw std::runtime_error("Surface not ready!");
     std::cout << "GPU data match!" << std::endl;
     return true; // Data matched
 }
 
-int main() {
+// ---------------------------------
+//        PlaneOps self-check
+// ---------------------------------
+
+// Letterbox, sub-rectangle fill and overlay copy on small frames with padded rows.
+// The buffers must be host-readable: malloc'd for CpuPlaneOps, shared USM for ZePlaneOps.
+const uint32_t kCheckWidth = 60, kCheckHeight = 30, kOverlayWidth = 16, kOverlayHeight = 8;
+
+size_t planeOpsCheckBytes() {
+    PrimeFrameLayout layout;
+    return linearPrimeFrameLayout(layout, VA_FOURCC_NV12, kCheckWidth, kCheckHeight);
+}
+
+bool checkPlaneOps(PlaneOps& ops, void* canvas, void* overlay, void* rgba) {
+    PrimeFrameLayout canvasLayout, overlayLayout, rgbaLayout;
+    linearPrimeFrameLayout(canvasLayout, VA_FOURCC_NV12, kCheckWidth, kCheckHeight);
+    linearPrimeFrameLayout(overlayLayout, VA_FOURCC_NV12, kOverlayWidth, kOverlayHeight);
+    linearPrimeFrameLayout(rgbaLayout, VA_FOURCC_RGBA, 9, 7);
+    std::vector<SurfacePlane> dst = framePlanes(canvasLayout, &canvas);
+    std::vector<SurfacePlane> src = framePlanes(overlayLayout, &overlay);
+    std::vector<SurfacePlane> packed = framePlanes(rgbaLayout, &rgba);
+
+    const YuvColor picture = {200, 90, 60}, black = {16, 128, 128}, logo = {50, 70, 80};
+    const PlaneRect content = {10, 4, 40, 22};
+    const uint32_t logoX = 20, logoY = 10;
+
+    std::cout << "Running letterbox and overlay" << std::endl;
+    fillFrameRect(ops, dst, VA_FOURCC_NV12, fullRect(dst[0]), picture);
+    fillOutside(ops, dst, VA_FOURCC_NV12, content, black);
+    fillFrameRect(ops, src, VA_FOURCC_NV12, fullRect(src[0]), logo);
+    copyFrameRect(ops, dst, logoX, logoY, src, fullRect(src[0]));
+
+    std::cout << "Running sub-rectangle fill" << std::endl;
+    const uint8_t clear[4] = {0, 0, 0, 0}, pixel[4] = {1, 2, 3, 4};
+    fillFrameRect(ops, packed, VA_FOURCC_RGBA, fullRect(packed[0]), clear);
+    fillFrameRect(ops, packed, VA_FOURCC_RGBA, {2, 1, 5, 4}, pixel);
+    ops.finish();
+
+    auto inside = [](const PlaneRect& r, uint32_t x, uint32_t y) {
+        return x >= r.x && x < r.x + r.width && y >= r.y && y < r.y + r.height;
+    };
+    const PlaneRect logoRect = {logoX, logoY, kOverlayWidth, kOverlayHeight};
+    int mismatches = 0;
+    for (uint32_t y = 0; y < kCheckHeight; ++y) {
+        const uint8_t* row = static_cast<const uint8_t*>(dst[0].base) + y * dst[0].pitch;
+        for (uint32_t x = 0; x < kCheckWidth; ++x) {
+            const YuvColor& want = inside(logoRect, x, y) ? logo : inside(content, x, y) ? picture : black;
+            mismatches += row[x] != want.y;
+        }
+    }
+    for (uint32_t y = 0; y < kCheckHeight / 2; ++y) {
+        const uint8_t* row = static_cast<const uint8_t*>(dst[1].base) + y * dst[1].pitch;
+        for (uint32_t x = 0; x < kCheckWidth / 2; ++x) {
+            const YuvColor& want = inside(logoRect, x * 2, y * 2)  ? logo
+                                   : inside(content, x * 2, y * 2) ? picture
+                                                                   : black;
+            mismatches += row[x * 2] != want.u || row[x * 2 + 1] != want.v;
+        }
+    }
+    for (uint32_t y = 0; y < packed[0].height; ++y) {
+        const uint8_t* row = static_cast<const uint8_t*>(packed[0].base) + y * packed[0].pitch;
+        for (uint32_t x = 0; x < packed[0].width; ++x) {
+            mismatches += memcmp(row + x * 4, inside({2, 1, 5, 4}, x, y) ? pixel : clear, 4) != 0;
+        }
+    }
+    if (mismatches != 0) {
+        std::cerr << "PlaneOps check: " << mismatches << " wrong samples" << std::endl;
+        return false;
+    }
+    std::cout << "PlaneOps checks passed" << std::endl;
+    return true;
+}
+
+// Usage: va_main [gpu|cpu|selftest]
+//   gpu:      fill the surface with red through its USM allocation (default)
+//   cpu:      fill it through a vaDeriveImage mapping
+//   selftest: run the PlaneOps checks on host memory and the handoff checks on sw_sync
+//             fences (skipped without sw_sync), no GPU needed
+int main(int argc, char* argv[]) {
+    if (isSelfTest(argc, argv)) {
+        return runSelfTest([]() {
+            std::vector<uint8_t> canvas(planeOpsCheckBytes()), overlay(canvas.size()), rgba(canvas.size());
+            CpuPlaneOps ops;
+            const bool planeOpsOk = checkPlaneOps(ops, canvas.data(), overlay.data(), rgba.data());
+            return planeOpsOk && checkSwSyncHandoff() ? 0 : -1;
+        });
+    }
+    const std::string mode = argc > 1 ? argv[1] : "gpu";
+    if (mode != "gpu" && mode != "cpu") {
+        std::cerr << "Usage: " << argv[0] << " [gpu|cpu|selftest]" << std::endl;
+        return -1;
+    }
+    try {
+        checkReadbackMethodEnv(true);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return -1;
+    }
+
+
     // Initialize Level Zero driver and device
     std::cout << "Running initializeDriver" << std::endl;
     ze_driver_handle_t driverHandle = initializeDriver();
@@ -446,26 +716,95 @@ int main() {
     size_t memorySize = width * height * 4;
     std::cout << "Running allocateUSM" << std::endl;
     void* usmMemory = allocateUSM(contextHandle, deviceHandle, memorySize);
+    ZeOpProfiler profiler(contextHandle, deviceHandle);
     std::vector<int> srcData(memorySize / sizeof(int), 0);  // Assuming memorySize is a multiple of sizeof(int)
     for (int i = 0; i < 100 && i < srcData.size(); ++i) {
         srcData[i] = i + 1;
     }
-    writeToUSM(contextHandle, deviceHandle, usmMemory, srcData.data(), memorySize);
+    writeToUSM(contextHandle, deviceHandle, usmMemory, srcData.data(), memorySize, profiler);
 
     std::cout << "Running usmToDmaBuf" << std::endl;
     int dmaBufFd = usmToDmaBuf(contextHandle, usmMemory);
     std::cout << "USM DMA BUF FD: " << dmaBufFd << std::endl;
+    VaSurfaceCaps caps = queryVaSurfaceCaps(vaDisplay);
+    std::cout << "VA memory types: PRIME_2 " << (caps.prime2 ? "yes" : "no") << ", PRIME " << (caps.prime ? "yes" : "no")
+              << ", " << caps.modifiers.size() << " modifier(s) reported" << std::endl;
     std::cout << "Running DmaBufToVaSurface" << std::endl;
-    VASurfaceID vaSurface = DmaBufToVaSurface(vaDisplay, (uintptr_t)dmaBufFd, width, height);
-    verifyVASurface(vaSurface, vaDisplay);
-
-    fillSurfaceWithRed(vaDisplay, vaSurface, width, height, contextHandle, deviceHandle);
+    VASurfaceID vaSurface = DmaBufToVaSurface(vaDisplay, (uintptr_t)dmaBufFd, width, height, caps);
+    if (vaSurface == VA_INVALID_SURFACE) {
+        // Sharing one buffer is the point of this sample; 05-vaapi-interop-usm-dmabuf-vaapi shows the copy path
+        std::cerr << "The VA driver takes no linear buffers, so it cannot share the USM allocation" << std::endl;
+        close(dmaBufFd);
+        profiler.release();
+        vaTerminate(vaDisplay);
+        close(drmFd);
+        zeMemFree(contextHandle, usmMemory);
+        zeContextDestroy(contextHandle);
+        return -1;
+    }
+    // Reads pick the fastest of vaDeriveImage, vaGetImage and a Level Zero copy of the USM
+    auto readback = std::make_unique<SurfaceReadback>(vaDisplay, VA_FOURCC_RGBA, width, height);
+    auto usmReadback = std::make_unique<UsmReadback>(contextHandle, deviceHandle, usmMemory, width, height, profiler);
+    readback->setDeviceCopy([&usmReadback](VASurfaceID) { return usmReadback->copy(); });
+    verifyVASurface(*readback, vaSurface);
+    std::cout << "Readback: " << readback->describe() << std::endl;
+
+    SyncWatcher watcher;
+    std::unique_ptr<PlaneOps> ops;
+    if (mode == "gpu") {
+        ops = std::make_unique<ZePlaneOps>(contextHandle, deviceHandle, &profiler);
+    } else {
+        ops = std::make_unique<CpuPlaneOps>();
+    }
+    SyncFd surfaceReady =
+        fillSurfaceWithRed(vaDisplay, vaSurface, width, height, dmaBufFd, watcher, *ops, mode == "gpu", usmMemory);
     std::cout << "USM DMA BUF FD: " << dmaBufFd << std::endl;
-    if (isSurfaceRed(vaDisplay, vaSurface, width, height)) {
+    std::cout << "VA -> L0 handoff via " << (surfaceReady.isSyncFile() ? "dma-buf sync file" : "surface status polling")
+              << std::endl;
+    bool surfaceOk = true;
+    if (isUsmRowRed(contextHandle, deviceHandle, usmMemory, width, surfaceReady, watcher, profiler)) {
+        std::cout << "Level Zero sees the red surface" << std::endl;
+    } else {
+        std::cerr << "Level Zero does not see the red surface!" << std::endl;
+        surfaceOk = false;
+    }
+    if (isSurfaceRed(*readback, vaSurface, width, height)) {
         std::cout << "Surface is correctly filled with red!" << std::endl;
     } else {
         std::cerr << "Surface color doesn't match expected red color!" << std::endl;
+        surfaceOk = false;
     }
+    bool planeOpsOk = true;
+    if (mode == "gpu") {
+        // The same checks on the device, in shared USM so the host can read the result back
+        ze_device_mem_alloc_desc_t deviceDesc = {};
+        deviceDesc.stype = ZE_STRUCTURE_TYPE_DEVICE_MEM_ALLOC_DESC;
+        ze_host_mem_alloc_desc_t hostDesc = {};
+        hostDesc.stype = ZE_STRUCTURE_TYPE_HOST_MEM_ALLOC_DESC;
+        void* buffers[3] = {};
+        for (void*& buffer : buffers) {
+            ze_result_t result = zeMemAllocShared(contextHandle, &deviceDesc, &hostDesc, planeOpsCheckBytes(), 64,
+                                                  deviceHandle, &buffer);
+            if (result != ZE_RESULT_SUCCESS) {
+                std::cerr << "Failed to allocate plane op check buffers: " << result << std::endl;
+                buffer = nullptr;
+                planeOpsOk = false;
+            }
+        }
+        if (planeOpsOk) {
+            planeOpsOk = checkPlaneOps(*ops, buffers[0], buffers[1], buffers[2]);
+        }
+        for (void* buffer : buffers) {
+            if (buffer) {
+                zeMemFree(contextHandle, buffer);
+            }
+        }
+    }
+    ops.reset();
+    readback.reset();
+    usmReadback.reset();
+    profiler.release();
+    printOpRecords();
     std::cout << "Running vaTerminate" << std::endl;
     vaTerminate(vaDisplay);
     close(drmFd);
@@ -473,5 +812,6 @@ int main() {
     zeMemFree(contextHandle, usmMemory);
     std::cout << "Running zeContextDestroy" << std::endl;
     zeContextDestroy(contextHandle);
-    return 0;
-}
\ No newline at end of file
+    traceFlushFromEnv();
+    return surfaceOk && planeOpsOk ? 0 : -1;
+}
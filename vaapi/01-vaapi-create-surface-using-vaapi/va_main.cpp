@@ -3,6 +3,8 @@
 #include <string>
 #include <iostream>
 #include <cstring>
+#include <chrono>
+#include <set>
 #include <fcntl.h>
 #include <unistd.h>
 
@@ -19,9 +21,154 @@ extern "C" {
 #include <va/va_drmcommon.h>
 }
 
+#include "selftest.hpp"
+#include "va_surface_pool.hpp"
+
 #define RED_COLOR 0x00FF0000 // This represents the color red in ARGB format.
 
-int main() {
+// Stub allocator: hands out increasing IDs and records which ones are alive
+typedef struct {
+    VASurfaceID next = 1;
+    std::set<VASurfaceID> alive;
+    std::vector<VASurfaceID> destroyed;
+} StubSurfaces;
+
+VaSurfaceAllocator stubAllocator(StubSurfaces& stub) {
+    VaSurfaceAllocator allocator;
+    allocator.create = [&stub](const VaSurfaceKey&) {
+        stub.alive.insert(stub.next);
+        return stub.next++;
+    };
+    allocator.destroy = [&stub](VASurfaceID surface) {
+        if (stub.alive.erase(surface) != 1) {
+            throw std::runtime_error("Surface " + std::to_string(surface) + " destroyed twice");
+        }
+        stub.destroyed.push_back(surface);
+    };
+    allocator.bytes = [](const VaSurfaceKey& key) { return size_t(key.width) * key.height; };
+    return allocator;
+}
+
+// Pool logic against the stub allocator, no driver needed
+int runPoolChecks() {
+    StubSurfaces stub;
+    const VaSurfaceKey small = {VA_FOURCC_NV12, VA_RT_FORMAT_YUV420, 100, 10}; // 1000 bytes
+    const VaSurfaceKey large = {VA_FOURCC_RGBA, VA_RT_FORMAT_RGB32, 100, 20};  // 2000 bytes
+    {
+        VaSurfacePool pool(stubAllocator(stub), 4000);
+
+        std::cout << "Running reserve" << std::endl;
+        pool.reserve(small, 2);
+        CHECK(pool.stats().idle == 2 && pool.stats().created == 2 && pool.stats().misses == 0);
+
+        std::cout << "Running acquire" << std::endl;
+        VASurfaceID first;
+        {
+            VaSurfaceLease a = pool.acquire(small);
+            VaSurfaceLease b = pool.acquire(small);
+            VaSurfaceLease c = pool.acquire(small);
+            CHECK(pool.stats().hits == 2 && pool.stats().misses == 1 && pool.stats().leased == 3);
+            CHECK(a.surface() != b.surface() && b.surface() != c.surface());
+            first = c.surface();
+            VaSurfaceLease moved = std::move(c);
+            CHECK(!c && moved.surface() == first);
+        }
+        CHECK(pool.stats().leased == 0 && pool.stats().idle == 3 && pool.stats().bytes == 3000);
+        {
+            // The most recently released surface of the key comes back first
+            VaSurfaceLease again = pool.acquire(small);
+            CHECK(pool.stats().hits == 3);
+        }
+
+        std::cout << "Running budget eviction" << std::endl;
+        {
+            // 3000 idle + 2000 new > 4000: the least recently used idle surface makes room.
+            // That is c's surface, released before a's and b's.
+            VaSurfaceLease big = pool.acquire(large);
+            CHECK(pool.stats().evicted == 1 && pool.stats().bytes == 4000 && stub.destroyed.size() == 1);
+            CHECK(stub.destroyed[0] == first);
+        }
+        CHECK(pool.stats().idle == 3 && pool.stats().bytes == 4000);
+
+        std::cout << "Running trim" << std::endl;
+        pool.trim(2500);
+        CHECK(pool.stats().bytes == 2000 && pool.stats().idle == 1);
+        {
+            // The large surface was released last, so it survived the trim
+            VaSurfaceLease big = pool.acquire(large);
+            CHECK(pool.stats().misses == 2);
+
+            // Leases are never refused: over budget, every idle surface goes
+            VaSurfaceLease a = pool.acquire(small);
+            CHECK(pool.stats().bytes == 3000 && pool.stats().idle == 0);
+        }
+        CHECK(pool.stats().bytes <= 2500);
+
+        printVaSurfacePoolStats(pool.stats());
+    }
+    // Destroying the pool destroys its idle surfaces
+    CHECK(stub.alive.empty());
+
+    std::cout << "Running lease outliving the pool" << std::endl;
+    VaSurfaceLease survivor;
+    {
+        VaSurfacePool pool(stubAllocator(stub), 1 << 20);
+        pool.reserve(small, 2);
+        survivor = pool.acquire(small);
+    }
+    CHECK(stub.alive.size() == 1 && stub.alive.count(survivor.surface()) == 1);
+    survivor.release();
+    CHECK(stub.alive.empty());
+
+    std::cout << "Surface pool checks passed" << std::endl;
+    return 0;
+}
+
+// Per-frame vaCreateSurfaces/vaDestroySurfaces against pool leases. Frames alternate
+// between two output sizes, as in a pipeline that scales to two resolutions.
+int runChurn(VADisplay vaDisplay, int frames) {
+    const VaSurfaceKey keys[2] = {vaSurfaceKey(VA_FOURCC_NV12, 1920, 1080), vaSurfaceKey(VA_FOURCC_NV12, 1280, 720)};
+    auto usPerFrame = [frames](std::chrono::steady_clock::time_point start) {
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        return std::chrono::duration<double, std::micro>(elapsed).count() / frames;
+    };
+
+    std::cout << "Running vaCreateSurfaces per frame" << std::endl;
+    VaSurfaceAllocator allocator = vaSurfaceAllocator(vaDisplay);
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < frames; ++i) {
+        allocator.destroy(allocator.create(keys[i % 2]));
+    }
+    const double direct = usPerFrame(start);
+
+    std::cout << "Running VaSurfacePool leases" << std::endl;
+    VaSurfacePool pool(vaDisplay, 64 << 20);
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < frames; ++i) {
+        VaSurfaceLease lease = pool.acquire(keys[i % 2]);
+    }
+    const double pooled = usPerFrame(start);
+
+    std::cout << "vaCreateSurfaces + vaDestroySurfaces: " << direct << " us/frame" << std::endl;
+    std::cout << "Pool acquire + release: " << pooled << " us/frame" << std::endl;
+    printVaSurfacePoolStats(pool.stats());
+    return 0;
+}
+
+// Usage: va_main [fill|churn|selftest] [frames]
+//   fill:     create an RGBA surface and fill it with red (default)
+//   churn:    time per-frame surface creation against the surface pool
+//   selftest: check the surface pool against a stub allocator, no GPU needed
+int main(int argc, char* argv[]) {
+    if (isSelfTest(argc, argv)) {
+        return runSelfTest(runPoolChecks);
+    }
+    const std::string mode = argc > 1 ? argv[1] : "fill";
+    if (mode != "fill" && mode != "churn") {
+        std::cerr << "Usage: " << argv[0] << " [fill|churn|selftest] [frames]" << std::endl;
+        return -1;
+    }
+
     std::cout << "Running drmFd" << std::endl;
     int drmFd = open("/dev/dri/renderD128", O_RDWR); // Opening the first render node. Change index as per your system.
     if (drmFd < 0) {
@@ -44,6 +191,13 @@ int main() {
         close(drmFd);
         return -1;
     }
+
+    if (mode == "churn") {
+        int result = runChurn(vaDisplay, argc > 2 ? std::stoi(argv[2]) : 1000);
+        vaTerminate(vaDisplay);
+        close(drmFd);
+        return result;
+    }
     
     // 1. Create a VASurface
     // Set up VASurface attributes for RGBA format
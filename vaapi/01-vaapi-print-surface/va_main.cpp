@@ -20,23 +20,29 @@ extern "C" {
 #include <va/va_drmcommon.h>
 }
 
+#include "surface_readback.hpp"
+
 #define RED_COLOR 0x00FF0000 // This represents the color red in ARGB format.
 
-void save_to_rgb_file(const std::string& filename, uint32_t* pixels, int width, int height) {
+// frame is a cached copy (SurfaceReadback), so the per-pixel reads here are cheap
+void save_to_rgb_file(const std::string& filename, const HostFrame& frame) {
     std::ofstream file(filename, std::ios::binary);
     if (!file.is_open()) {
         std::cerr << "Failed to open file: " << filename << std::endl;
         return;
     }
 
-    for (int i = 0; i < width * height; i++) {
-        uint32_t pixel = pixels[i];
-        uint8_t r = (pixel >> 16) & 0xFF; // Extract red channel
-        uint8_t g = (pixel >> 8) & 0xFF;  // Extract green channel
-        uint8_t b = pixel & 0xFF;         // Extract blue channel
-        file.write((char*)&r, sizeof(r));
-        file.write((char*)&g, sizeof(g));
-        file.write((char*)&b, sizeof(b));
+    const uint32_t width = frame.layout.width, height = frame.layout.height;
+    std::vector<uint8_t> row(width * 3);
+    for (uint32_t y = 0; y < height; y++) {
+        const uint32_t* pixels = (const uint32_t*)(frame.plane(0) + y * frame.pitch(0));
+        for (uint32_t x = 0; x < width; x++) {
+            uint32_t pixel = pixels[x];
+            row[x * 3] = (pixel >> 16) & 0xFF;    // Extract red channel
+            row[x * 3 + 1] = (pixel >> 8) & 0xFF; // Extract green channel
+            row[x * 3 + 2] = pixel & 0xFF;        // Extract blue channel
+        }
+        file.write((const char*)row.data(), row.size());
     }
 
     file.close();
@@ -44,6 +50,13 @@ void save_to_rgb_file(const std::string& filename, uint32_t* pixels, int width,
 }
 
 int main() {
+    try {
+        checkReadbackMethodEnv(false);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return -1;
+    }
+
     std::cout << "Running drmFd" << std::endl;
     int drmFd = open("/dev/dri/renderD128", O_RDWR); // Opening the first render node. Change index as per your system.
     if (drmFd < 0) {
@@ -92,18 +105,32 @@ int main() {
     // Fill the image data with red
     uint32_t* pixels = nullptr;
     vaStatus = vaMapBuffer(vaDisplay, image.buf, (void**)&pixels);
-    for (int i = 0; i < image.width * image.height; i++) {
-        pixels[i] = RED_COLOR;
+    for (int y = 0; y < image.height; y++) {
+        uint32_t* row = (uint32_t*)((uint8_t*)pixels + image.offsets[0] + y * image.pitches[0]);
+        for (int x = 0; x < image.width; x++) {
+            row[x] = RED_COLOR;
+        }
     }
-    save_to_rgb_file("output.rgb", pixels, image.width, image.height); // Save to raw RGB file
     vaUnmapBuffer(vaDisplay, image.buf);
+    vaDestroyImage(vaDisplay, image.image_id);
 
-    // Verification
+    // Read the surface back into cached memory once; the mapping may be write-combined
     bool isRed = true;
-    for (int i = 0; i < image.width * image.height; i++) {
-        if (pixels[i] != RED_COLOR) {
-            isRed = false;
-            break;
+    {
+        SurfaceReadback readback(vaDisplay, VA_FOURCC_RGBA, image.width, image.height);
+        HostFrame frame = readback.read(surface);
+        std::cout << "Readback: " << readback.describe() << std::endl;
+        save_to_rgb_file("output.rgb", frame); // Save to raw RGB file
+
+        // Verification
+        for (uint32_t y = 0; y < frame.layout.height && isRed; y++) {
+            const uint32_t* row = (const uint32_t*)(frame.plane(0) + y * frame.pitch(0));
+            for (uint32_t x = 0; x < frame.layout.width; x++) {
+                if (row[x] != RED_COLOR) {
+                    isRed = false;
+                    break;
+                }
+            }
         }
     }
 
@@ -7,11 +7,15 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <iostream>
 #include <memory>
 #include <sstream>
 #include <stdlib.h>
 #include <string.h>
+#include <thread>
 #include <vector>
 
 extern "C" {
@@ -25,10 +29,262 @@ extern "C" {
 #include <va/va_drmcommon.h>
 }
 
+#include "alloc_counter.hpp"
+#include "frame_sampler.hpp"
+#include "frame_writer.hpp"
+#include "numa_placement.hpp"
+#include "spsc_ring.hpp"
+#include "surface_readback.hpp"
+#include "trace.hpp"
+
+// Frames the loop keeps referenced: each one stays alive until the ring wraps,
+// as it would while downstream stages still read it. The decoder's hw surface
+// pool is grown by the same amount so decode never waits for a surface.
+const int kPipelineDepth = 4;
+
+// Frames decoded before allocations are counted: the parser, the hw frame pool
+// and the frame writer are set up during the first few
+const int kWarmupFrames = 16;
+
+// Packets the demux thread may read ahead of the decoder
+const int kPacketQueueDepth = 32;
+
+// Steady-state heap allocations of the decode thread, by where they happened
+typedef struct {
+  uint64_t read = 0;   // Inside av_read_frame, on whichever thread demuxes
+  uint64_t decode = 0; // Inside avcodec_send_packet/avcodec_receive_frame
+  uint64_t loop = 0;   // Everything else on the decode thread: packet/frame
+                       // handling, map, dump
+  int frames = 0;
+} AllocStats;
+
+// Where the decode loop gets its video packets.
+//   serial:    av_read_frame on the decode thread, between decode calls, so
+//              every read stalls the decoder
+//   pipelined: a demux thread reads ahead into an SPSC ring and the decode
+//              thread drains it. Emptied packets travel back on a second ring,
+//              so the packets are allocated once. When the decoder falls
+//              behind, the demux thread waits for an empty packet.
+// read_delay_us throttles every read, to stand in for slow storage or a network.
+// The demux thread runs on the placement's node, next to the decode thread.
+class PacketSource {
+public:
+  PacketSource(AVFormatContext *input_ctx, int video_stream, bool pipelined,
+               int read_delay_us, const NumaPlacement &placement)
+      : input_ctx_(input_ctx), video_stream_(video_stream),
+        pipelined_(pipelined), read_delay_us_(read_delay_us),
+        placement_(placement), filled_(kPacketQueueDepth),
+        empty_(kPacketQueueDepth) {
+    if (!pipelined_) {
+      packet_ = av_packet_alloc();
+      return;
+    }
+    for (int i = 0; i < kPacketQueueDepth; i++)
+      empty_.push(av_packet_alloc());
+    thread_ = std::thread(&PacketSource::demux, this);
+  }
+
+  ~PacketSource() {
+    // Releases a demux thread blocked on either ring
+    filled_.close();
+    empty_.close();
+    if (thread_.joinable())
+      thread_.join();
+    AVPacket *packet;
+    while (filled_.tryPop(packet))
+      av_packet_free(&packet);
+    while (empty_.tryPop(packet))
+      av_packet_free(&packet);
+    av_packet_free(&packet_);
+  }
+
+  // The next video packet, nullptr at the end of the input (see read_error).
+  // Hand it back with release() before asking for the next one.
+  AVPacket *next() {
+    if (!pipelined_) {
+      read_err_ = read(packet_);
+      return read_err_ < 0 ? nullptr : packet_;
+    }
+    AVPacket *packet = nullptr;
+    filled_.pop(packet);
+    return packet;
+  }
+
+  void release(AVPacket *packet) {
+    av_packet_unref(packet);
+    if (pipelined_ && !empty_.push(packet))
+      av_packet_free(&packet);
+  }
+
+  // AVERROR_EOF at a clean end
+  int read_error() const { return read_err_; }
+
+  // Count av_read_frame's allocations from now on
+  void start_counting() { counting_ = true; }
+  uint64_t read_allocs() const { return read_allocs_; }
+
+private:
+  // Read until a video packet arrives
+  int read(AVPacket *packet) {
+    for (;;) {
+      if (read_delay_us_ > 0)
+        std::this_thread::sleep_for(std::chrono::microseconds(read_delay_us_));
+      int err;
+      {
+        TRACE_SCOPE("av_read_frame");
+        const uint64_t start = allocCount();
+        err = av_read_frame(input_ctx_, packet);
+        if (counting_)
+          read_allocs_ += allocCount() - start;
+      }
+      if (err < 0 || packet->stream_index == video_stream_)
+        return err;
+      av_packet_unref(packet); // Non-video (ex, audio) packet
+    }
+  }
+
+  void demux() {
+    pinCurrentThread(placement_);
+    AVPacket *packet;
+    while (empty_.pop(packet)) {
+      int err = read(packet);
+      if (err < 0) {
+        // Published by the push: next() sees it once it pops the end marker
+        read_err_ = err;
+        av_packet_free(&packet);
+        filled_.push(nullptr);
+        return;
+      }
+      if (!filled_.push(packet)) {
+        av_packet_free(&packet);
+        return;
+      }
+    }
+  }
+
+  AVFormatContext *input_ctx_;
+  int video_stream_;
+  bool pipelined_;
+  int read_delay_us_;
+  NumaPlacement placement_;
+  AVPacket *packet_ = nullptr;  // Serial only
+  SpscRing<AVPacket *> filled_; // Demux -> decode, nullptr marks the end
+  SpscRing<AVPacket *> empty_;  // Decode -> demux
+  std::thread thread_;
+  int read_err_ = 0;
+  std::atomic<bool> counting_{false};
+  std::atomic<uint64_t> read_allocs_{0};
+};
+
+// Frames the writer thread may hold before the decoder has to wait for the disk
+const int kWriteBuffers = 16;
+
+// Bytes of one gathered width x height 4:2:0 frame
+size_t frameBytes(int width, int height) {
+  return (size_t)width * height +
+         (size_t)((width + 1) / 2) * ((height + 1) / 2) * 2;
+}
+
+// Copy a decoded frame's visible area into dst as tightly packed planes.
+// vaapi frames are NV12, copied straight out of the readback's mapping with
+// streaming loads (readback picks vaDeriveImage or vaGetImage), sw frames are
+// yuv420p. planar writes I420 either way (NV12 UV rows are split into U and
+// V); the caller checks the size with frameBytes() first.
+size_t gatherFrame(SurfaceReadback *readback, const AVFrame *av_frame,
+                   uint8_t *dst, bool planar) {
+  const int width = av_frame->width, height = av_frame->height;
+  const int chroma_width = (width + 1) / 2, chroma_height = (height + 1) / 2;
+  uint8_t *const start = dst;
+  if (av_frame->format == AV_PIX_FMT_VAAPI) {
+    VASurfaceID va_surface =
+        (VASurfaceID)(size_t)av_frame->data[3]; // As defined by AV_PIX_FMT_VAAPI
+    TRACE_SCOPE("gather planes");
+    uint8_t *const luma = dst;
+    uint8_t *const chroma = dst + (size_t)width * height;
+    readback->readRows(va_surface, [&](uint32_t plane, uint32_t y,
+                                       const uint8_t *row, size_t) {
+      if (plane == 0) {
+        streamingCopy(luma + (size_t)y * width, row, width);
+      } else if (!planar) {
+        // NV12 UV rows hold both chroma samples
+        streamingCopy(chroma + (size_t)y * chroma_width * 2, row,
+                      chroma_width * 2);
+      } else {
+        // Through a small cached bounce buffer: split pairs out of the
+        // mapping one sample at a time would run at uncached speed
+        uint8_t *u = chroma + (size_t)y * chroma_width;
+        uint8_t *v = u + (size_t)chroma_width * chroma_height;
+        alignas(64) uint8_t pairs[4096];
+        for (int c = 0; c < chroma_width;) {
+          const int count = std::min(chroma_width - c, int(sizeof(pairs) / 2));
+          streamingCopy(pairs, row + 2 * c, count * 2);
+          for (int i = 0; i < count; i++, c++) {
+            u[c] = pairs[2 * i];
+            v[c] = pairs[2 * i + 1];
+          }
+        }
+      }
+    });
+    return frameBytes(width, height);
+  }
+  if (av_frame->format != AV_PIX_FMT_YUV420P &&
+      av_frame->format != AV_PIX_FMT_YUVJ420P) {
+    throw std::runtime_error("Unsupported av_frame format");
+  }
+
+  TRACE_SCOPE("gather planes");
+  for (int p = 0; p < 3; p++) {
+    const int plane_width = p ? chroma_width : width;
+    const int plane_height = p ? chroma_height : height;
+    for (int r = 0; r < plane_height; r++) {
+      memcpy(dst, av_frame->data[p] + (size_t)r * av_frame->linesize[p],
+             plane_width);
+      dst += plane_width;
+    }
+  }
+  return dst - start;
+}
 
+
+// Usage: va_main [input] [vaapi|sw] [pipelined|serial] [read_delay_us] [output]
+//                [all|key|N]
+//   vaapi:         decode on the GPU (default)
+//   sw:            decode on the CPU
+//   pipelined:     demux on its own thread, ahead of the decoder (default)
+//   serial:        read and decode in turn on one thread
+//   read_delay_us: sleep before every read, to simulate slow input (default 0)
+//   output:        out.y4m (default) gets a Y4M header and I420 frames; a
+//                  .raw name gets headerless NV12 (vaapi) or I420 (sw) frames
+//   all|key|N:     frames passed on to readback and the writer: every one
+//                  (default), keyframes only, or about one in N. Key mode
+//                  does not preserve timing: the Y4M keeps the source rate
+// Build with -DALLOC_COUNTING=ON to get the steady-state allocation counts;
+// sw mode then fails if the loop allocates.
 int main(int argc, char *argv[]) {
-  const char *filename = "../planet.mp4";
-  FILE *fout = fopen("out.raw", "wb");
+  const char *filename = argc > 1 ? argv[1] : "../planet.mp4";
+  const std::string mode = argc > 2 ? argv[2] : "vaapi";
+  const std::string stages = argc > 3 ? argv[3] : "pipelined";
+  const int read_delay_us = argc > 4 ? atoi(argv[4]) : 0;
+  const std::string output = argc > 5 ? argv[5] : "out.y4m";
+  FrameSampling sampling;
+  try {
+    sampling = parseFrameSampling(argc > 6 ? argv[6] : "all");
+    checkReadbackMethodEnv(false);
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return -1;
+  }
+  if ((mode != "vaapi" && mode != "sw") ||
+      (stages != "pipelined" && stages != "serial")) {
+    std::cerr << "Usage: " << argv[0]
+              << " [input] [vaapi|sw] [pipelined|serial] [read_delay_us]"
+                 " [output] [all|key|N]"
+              << std::endl;
+    return -1;
+  }
+  const bool hw = mode == "vaapi";
+  const bool y4m = output.size() < 4 ||
+                   output.compare(output.size() - 4, 4, ".raw") != 0;
 
   // ---------------------------------
   // find video stream information
@@ -36,11 +292,14 @@ int main(int argc, char *argv[]) {
   // ---------------------------------
   AVInputFormat *input_format = NULL;
   AVFormatContext *input_ctx = NULL;
-  avformat_open_input(&input_ctx, filename, input_format, NULL);
+  if (avformat_open_input(&input_ctx, filename, input_format, NULL) < 0)
+    throw std::runtime_error(std::string("Cannot open ") + filename);
   const AVCodec *codec = nullptr;
 
   int video_stream =
       av_find_best_stream(input_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, &codec, 0);
+  if (video_stream < 0)
+    throw std::runtime_error("No video stream");
 
   AVCodecParameters *codecpar = input_ctx->streams[video_stream]->codecpar;
 
@@ -48,6 +307,7 @@ int main(int argc, char *argv[]) {
   AVBufferRef *hw_device_ctx = NULL;
   decoder_ctx = avcodec_alloc_context3(codec);
   avcodec_parameters_to_context(decoder_ctx, codecpar);
+  applyFrameSampling(decoder_ctx, sampling);
 
 
   // ---------------------------------
@@ -55,22 +315,34 @@ int main(int argc, char *argv[]) {
   // so that va_display is available later
   // for the vaapi->dmabuf conversion
   // ---------------------------------
-  decoder_ctx->pix_fmt = AV_PIX_FMT_VAAPI; 
   const char *device = "/dev/dri/renderD128"; 
 
   VADisplay va_display = 0;
-  int drm_fd = open(device, O_RDWR);
-  va_display = vaGetDisplayDRM(drm_fd);
-  int major, minor;
-  vaInitialize(va_display, &major, &minor);
-
-  hw_device_ctx = av_hwdevice_ctx_alloc(AV_HWDEVICE_TYPE_VAAPI);
-
-  AVHWDeviceContext *hwctx = (AVHWDeviceContext *)hw_device_ctx->data;
-  AVVAAPIDeviceContext *vactx = (AVVAAPIDeviceContext *)hwctx->hwctx;
-  vactx->display = va_display;
-  av_hwdevice_ctx_init(hw_device_ctx);
-  decoder_ctx->hw_device_ctx = hw_device_ctx;
+  int drm_fd = -1;
+
+  // Keep the decode and readback thread on the GPU's NUMA node. The demux and
+  // writer threads pin themselves to the same placement.
+  NumaPlacement placement = choosePlacement(renderNodePciBdf(device));
+  printPlacement(device, placement);
+  pinCurrentThread(placement);
+  if (hw) {
+    decoder_ctx->pix_fmt = AV_PIX_FMT_VAAPI; 
+    drm_fd = open(device, O_RDWR);
+    va_display = vaGetDisplayDRM(drm_fd);
+    int major, minor;
+    vaInitialize(va_display, &major, &minor);
+
+    hw_device_ctx = av_hwdevice_ctx_alloc(AV_HWDEVICE_TYPE_VAAPI);
+
+    AVHWDeviceContext *hwctx = (AVHWDeviceContext *)hw_device_ctx->data;
+    AVVAAPIDeviceContext *vactx = (AVVAAPIDeviceContext *)hwctx->hwctx;
+    vactx->display = va_display;
+    av_hwdevice_ctx_init(hw_device_ctx);
+    decoder_ctx->hw_device_ctx = av_buffer_ref(hw_device_ctx);
+
+    // The decoder's own reference frames plus every frame the ring holds
+    decoder_ctx->extra_hw_frames = kPipelineDepth;
+  }
 
   avcodec_open2(decoder_ctx, codec, NULL);
 
@@ -78,85 +350,200 @@ int main(int argc, char *argv[]) {
   // ---------------------------------
   //          MAIN LOOP
   // ---------------------------------
-  int frame_num = 0;
-
-  for (;;) {
-
-    // Read packet with compressed video frame
-    AVPacket *avpacket = av_packet_alloc();
-
-    if (av_read_frame(input_ctx, avpacket) < 0) {
-      av_packet_free(&avpacket); // End of stream or error. Send NULL to
-      // avcodec_send_packet once to flush decoder
-    } else if (avpacket->stream_index != video_stream) {
-      av_packet_free(&avpacket); // Non-video (ex, audio) packet
-      continue;
+  // A ring of frames, allocated once and unref'd between uses. The packets
+  // belong to the source.
+  AVFrame *frames[kPipelineDepth];
+  for (AVFrame *&frame : frames)
+    frame = av_frame_alloc();
+  int slot = 0;
+
+  int frame_num = 0;    // Frames passed on
+  int decoded_num = 0;  // Frames out of the decoder, passed on or not
+  int packet_num = 0;   // Video packets read, one per source frame
+  // Created at the first frame, once its size is known
+  std::unique_ptr<FrameWriter> writer;
+  std::unique_ptr<SurfaceReadback> readback;
+  AVRational frame_rate = input_ctx->streams[video_stream]->avg_frame_rate;
+  if (frame_rate.num <= 0 || frame_rate.den <= 0)
+    frame_rate = AVRational{30, 1};
+  FrameSampler sampler(sampling, input_ctx->streams[video_stream]->time_base,
+                       frame_rate);
+  AllocStats allocs;
+  bool eof = false;
+
+  auto start_time = std::chrono::steady_clock::now();
+  auto source = std::make_unique<PacketSource>(
+      input_ctx, video_stream, stages == "pipelined", read_delay_us, placement);
+
+  while (!eof) {
+    const bool counting = frame_num >= kWarmupFrames;
+    if (counting)
+      source->start_counting();
+    const uint64_t iteration_start = allocCount();
+    uint64_t in_source = 0, in_decode = 0;
+
+    // Next packet with a compressed video frame
+    AVPacket *avpacket;
+    {
+      const uint64_t start = allocCount();
+      avpacket = source->next();
+      in_source += allocCount() - start;
+    }
+    // End of stream or error. Send NULL to avcodec_send_packet once to flush
+    // the decoder
+    eof = avpacket == nullptr;
+    if (avpacket) {
+      packet_num++;
+      if (!sampler.wantsPacket(avpacket)) {
+        // Keyframes only: the decoder never sees the others
+        source->release(avpacket);
+        continue;
+      }
     }
 
     // Send packet to decoder
-    avcodec_send_packet(decoder_ctx, avpacket);
+    {
+      TRACE_SCOPE("avcodec_send_packet");
+      const uint64_t start = allocCount();
+      avcodec_send_packet(decoder_ctx, avpacket);
+      in_decode += allocCount() - start;
+    }
+    if (avpacket) {
+      const uint64_t start = allocCount();
+      source->release(avpacket);
+      in_source += allocCount() - start;
+    }
 
     //----------------------------------------------
     // Receive frame(s) from decoder
     //----------------------------------------------
     while (true) {
-      auto av_frame = av_frame_alloc();
-      int decode_err = avcodec_receive_frame(decoder_ctx, av_frame);
+      // Reusing the slot drops the oldest frame the ring held
+      AVFrame *av_frame = frames[slot];
+      av_frame_unref(av_frame);
+      int decode_err;
+      {
+        TRACE_SCOPE("avcodec_receive_frame");
+        const uint64_t start = allocCount();
+        decode_err = avcodec_receive_frame(decoder_ctx, av_frame);
+        in_decode += allocCount() - start;
+      }
 
       if (decode_err == AVERROR(EAGAIN) || decode_err == AVERROR_EOF) {
         break;
       }
+      if (decode_err < 0)
+        throw std::runtime_error("avcodec_receive_frame failed: " +
+                                 std::to_string(decode_err));
+      decoded_num++;
+      // Not sampled: the slot is unref'd and reused by the next frame
+      if (!sampler.take(av_frame))
+        continue;
+      slot = (slot + 1) % kPipelineDepth;
 
       printf("Frame %d ", frame_num++);
-
-      if (av_frame->format != AV_PIX_FMT_VAAPI)
-        throw std::runtime_error("Unsupported av_frame format");
-
-      VASurfaceID va_surface =
-          (VASurfaceID)(size_t)
-              av_frame->data[3]; // As defined by AV_PIX_FMT_VAAPI
-
-      printf("va_surface %d\n", va_surface);
+      if (hw)
+        printf("va_surface %d\n", (VASurfaceID)(size_t)av_frame->data[3]);
+      else
+        printf("%s\n", av_get_pix_fmt_name((AVPixelFormat)av_frame->format));
 
       //------------------------------------------------
-      // dump NV12 output (debug only)
+      // dump the frame (debug only): one copy into a pooled
+      // buffer, written to disk on the writer thread
       //------------------------------------------------
-      VAImage image;
-      unsigned char *Y, *UV;
-
-      void *buffer;
-      vaDeriveImage(va_display, va_surface, &image);
-      vaMapBuffer(va_display, image.buf, &buffer);
-
-      /* NV12 */
-      Y = (unsigned char *)buffer + image.offsets[0];
-      UV = (unsigned char *)buffer + image.offsets[1];
-
-      for (int r = 0; r < image.height; r++) {
-        fwrite(Y, image.width, 1, fout);
-        Y += image.pitches[0];
+      if (!writer) {
+        FrameWriterOptions options;
+        options.width = av_frame->width;
+        options.height = av_frame->height;
+        options.frameBytes = frameBytes(av_frame->width, av_frame->height);
+        options.y4m = y4m;
+        // Sampled output plays back at the sampled rate. Keyframe spacing is
+        // unknown when the header is written and need not be regular, so key
+        // mode keeps the source rate and plays back faster than real time.
+        options.frameRateNum = frame_rate.num;
+        options.frameRateDen = frame_rate.den * sampling.interval;
+        options.buffers = kWriteBuffers;
+        if (y4m && sampling.mode == SampleMode::Keyframes)
+          printf("Keyframe-only Y4M: timing not preserved, frames play at "
+                 "the source rate\n");
+        writer = std::make_unique<FrameWriter>(output, options, placement);
       }
-      for (int r = 0; r < image.height / 2; r++) {
-        fwrite(UV, image.width, 1, fout);
-        UV += image.pitches[1];
+      if (frameBytes(av_frame->width, av_frame->height) !=
+          writer->frameBytes())
+        throw std::runtime_error("Frame size changed mid-stream");
+      if (hw && !readback) {
+        readback = std::make_unique<SurfaceReadback>(
+            va_display, VA_FOURCC_NV12, av_frame->width, av_frame->height);
+        readback->calibrate((VASurfaceID)(size_t)av_frame->data[3]);
+        printf("Readback: %s\n", readback->describe().c_str());
       }
-      vaUnmapBuffer(va_display, image.buf);
-      vaDestroyImage(va_display, image.image_id);
-
-      av_frame_free(&av_frame);
+      uint8_t *buffer = writer->acquire();
+      gatherFrame(readback.get(), av_frame, buffer, y4m);
+      writer->submit(buffer);
     }
 
-    if (avpacket)
-      av_packet_free(&avpacket);
+    if (counting) {
+      allocs.decode += in_decode;
+      allocs.loop += allocCount() - iteration_start - in_source - in_decode;
+      allocs.frames = frame_num - kWarmupFrames;
+    }
+  }
+  allocs.read = source->read_allocs();
+  const double seconds = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - start_time)
+                             .count();
+  if (source->read_error() != AVERROR_EOF) {
+    char text[128];
+    av_strerror(source->read_error(), text, sizeof(text));
+    fprintf(stderr, "Input ended early: %s\n", text);
+  }
+  // Joins the demux thread before the input closes
+  source.reset();
+  printf("Decoded %d frames in %.3f s (%.1f fps, %s, read delay %d us)\n",
+         decoded_num, seconds, decoded_num / seconds, stages.c_str(),
+         read_delay_us);
+  printf("Sampling %s: %d source frames (%.1f fps), %d decoded, %d passed on\n",
+         frameSamplingName(sampling).c_str(), packet_num, packet_num / seconds,
+         decoded_num, frame_num);
+
+  for (AVFrame *&frame : frames)
+    av_frame_free(&frame);
+
+  if (writer) {
+    // Waits for the frames still queued
+    writer->close();
+    FrameWriterStats written = writer->stats();
+    printf("Wrote %llu frames (%.1f MB) to %s in %llu writes; decoder waited "
+           "for the disk %llu times (%.1f ms)\n",
+           (unsigned long long)written.frames, written.bytes / 1e6,
+           output.c_str(), (unsigned long long)written.writes,
+           (unsigned long long)written.stalls, written.stallSeconds * 1e3);
+    writer.reset();
+  }
 
-    else
-      break; // End of stream
+  if (allocCountingEnabled && allocs.frames > 0) {
+    printf("Steady-state allocations over %d frames: read %llu, decode %llu, "
+           "loop %llu\n",
+           allocs.frames, (unsigned long long)allocs.read,
+           (unsigned long long)allocs.decode, (unsigned long long)allocs.loop);
   }
 
   avformat_close_input(&input_ctx);
   avcodec_free_context(&decoder_ctx);
-  fclose(fout);
-  vaTerminate(va_display);
-  close(drm_fd);
+  av_buffer_unref(&hw_device_ctx);
+  readback.reset();
+  if (hw) {
+    vaTerminate(va_display);
+    close(drm_fd);
+  }
+  traceFlushFromEnv();
+  // The loop's own buffers are all reused, so it must not touch the heap.
+  // Decode allocations are up to libavcodec (side data, threading) and only
+  // reported above.
+  if (allocCountingEnabled && !hw && allocs.loop != 0) {
+    fprintf(stderr, "Steady state allocated %llu times in the loop\n",
+            (unsigned long long)allocs.loop);
+    return -1;
+  }
   return 0;
 }
@@ -0,0 +1,402 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/hwcontext.h>
+#include <libavutil/hwcontext_vaapi.h>
+#include <va/va.h>
+#include <va/va_drm.h>
+}
+
+#include "surface_readback.hpp"
+#include "vpp_reference.hpp"
+#include "trace.hpp"
+#include "va_vpp.hpp"
+
+// Decoded frames whose conversion may be in flight at once. Each holds its
+// decoder surface until the output is consumed, so the decoder's pool grows
+// by the same amount.
+const int kPipelineDepth = 4;
+
+// Verify mode: frames compared with the CPU reference, and the worst mean
+// difference per sample accepted. VPP filters where the reference takes the
+// nearest sample, so edges differ by more.
+const int kVerifyFrames = 8;
+const double kVerifyMeanDiff = 4.0;
+
+typedef struct {
+    std::string mode;
+    int frames = 0;
+    double seconds = 0;      // Whole loop: demux, decode, conversion, consumer
+    double stageSeconds = 0; // Conversion on the decode thread: VPP submit, or readback + CPU conversion
+    double waitSeconds = 0;  // Consumer blocked on a VPP output
+    int mismatches = 0;      // Verify: outputs too far from the CPU reference
+} PipelineResult;
+
+// Parse WxH[:rgba|bgra|nv12][:letterbox][:crop=X,Y,W,H], e.g. 640x640:rgba:letterbox
+VppOutput parseOutput(const std::string& spec) {
+    VppOutput output;
+    std::vector<std::string> fields;
+    for (size_t start = 0;;) {
+        const size_t end = spec.find(':', start);
+        fields.push_back(spec.substr(start, end - start));
+        if (end == std::string::npos) {
+            break;
+        }
+        start = end + 1;
+    }
+    if (sscanf(fields[0].c_str(), "%ux%u", &output.width, &output.height) != 2) {
+        throw std::runtime_error("Bad output size in " + spec);
+    }
+    for (size_t i = 1; i < fields.size(); ++i) {
+        const std::string& field = fields[i];
+        unsigned x, y, w, h;
+        int length = 0;
+        if (field == "rgba") {
+            output.fourcc = VA_FOURCC_RGBA;
+        } else if (field == "bgra") {
+            output.fourcc = VA_FOURCC_BGRA;
+        } else if (field == "nv12") {
+            output.fourcc = VA_FOURCC_NV12;
+        } else if (field == "letterbox") {
+            output.letterbox = true;
+        } else if (sscanf(field.c_str(), "crop=%u,%u,%u,%u%n", &x, &y, &w, &h, &length) == 4 &&
+                   size_t(length) == field.size()) {
+            // VARectangle holds int16_t x, y and uint16_t width, height; a zero size would mean no crop
+            if (x > INT16_MAX || y > INT16_MAX || w == 0 || h == 0 || w > UINT16_MAX || h > UINT16_MAX) {
+                throw std::runtime_error("Crop out of range in " + spec + ": x and y must be at most " +
+                                         std::to_string(INT16_MAX) + ", width and height 1 to " +
+                                         std::to_string(UINT16_MAX));
+            }
+            output.crop = {int16_t(x), int16_t(y), uint16_t(w), uint16_t(h)};
+        } else {
+            throw std::runtime_error("Bad output option " + field + " in " + spec);
+        }
+    }
+    return output;
+}
+
+std::string describeOutput(const VppOutput& output) {
+    std::string text = std::to_string(output.width) + "x" + std::to_string(output.height);
+    text += output.fourcc == VA_FOURCC_NV12 ? " nv12" : output.fourcc == VA_FOURCC_BGRA ? " bgra" : " rgba";
+    if (output.crop.width && output.crop.height) {
+        text += " crop " + std::to_string(output.crop.x) + "," + std::to_string(output.crop.y) + "," +
+                std::to_string(output.crop.width) + "," + std::to_string(output.crop.height);
+    }
+    return output.letterbox ? text + " letterbox" : text;
+}
+
+// Host buffers the CPU reference writes an output into
+typedef struct {
+    VppOutput spec;
+    PrimeFrameLayout layout;
+    std::vector<uint8_t> pixels;
+} CpuOutput;
+
+std::vector<CpuOutput> cpuOutputs(const std::vector<VppOutput>& specs, uint32_t width, uint32_t height) {
+    std::vector<CpuOutput> outputs;
+    for (VppOutput spec : specs) {
+        const VppPlacement placement = vppPlacement(spec, width, height);
+        if (!vppSourceInside(placement, width, height)) {
+            throw std::runtime_error("Output " + describeOutput(spec) + " crops outside the " + std::to_string(width) +
+                                     "x" + std::to_string(height) + " picture");
+        }
+        spec.width = spec.width ? spec.width : placement.source.width;
+        spec.height = spec.height ? spec.height : placement.source.height;
+        CpuOutput output;
+        output.spec = spec;
+        output.pixels.resize(linearPrimeFrameLayout(output.layout, spec.fourcc, spec.width, spec.height));
+        outputs.push_back(std::move(output));
+    }
+    return outputs;
+}
+
+// Decode input on the GPU and convert every frame to each of outputs (empty: RGBA at the decoder's size).
+// mode fast/default/hq runs a VppStage with that scaling hint on the decoder's surfaces, cpu reads them
+// back with vaGetImage and converts on the CPU. verify runs fast on the first kVerifyFrames frames and
+// compares every output with the CPU reference.
+PipelineResult runPipeline(VADisplay vaDisplay, const std::string& input, const std::string& mode,
+                           const std::vector<VppOutput>& outputSpecs) {
+    AVFormatContext* inputCtx = nullptr;
+    if (avformat_open_input(&inputCtx, input.c_str(), nullptr, nullptr) < 0) {
+        throw std::runtime_error("Cannot open " + input);
+    }
+    const AVCodec* codec = nullptr;
+    const int videoStream = av_find_best_stream(inputCtx, AVMEDIA_TYPE_VIDEO, -1, -1, &codec, 0);
+    if (videoStream < 0) {
+        avformat_close_input(&inputCtx);
+        throw std::runtime_error("No video stream in " + input);
+    }
+
+    // The decoder shares the stage's VADisplay, so its surfaces feed VPP directly
+    AVCodecContext* decoderCtx = avcodec_alloc_context3(codec);
+    avcodec_parameters_to_context(decoderCtx, inputCtx->streams[videoStream]->codecpar);
+    AVBufferRef* hwDeviceCtx = av_hwdevice_ctx_alloc(AV_HWDEVICE_TYPE_VAAPI);
+    AVHWDeviceContext* hwctx = (AVHWDeviceContext*)hwDeviceCtx->data;
+    ((AVVAAPIDeviceContext*)hwctx->hwctx)->display = vaDisplay;
+    av_hwdevice_ctx_init(hwDeviceCtx);
+    decoderCtx->hw_device_ctx = av_buffer_ref(hwDeviceCtx);
+    decoderCtx->pix_fmt = AV_PIX_FMT_VAAPI;
+    decoderCtx->extra_hw_frames = kPipelineDepth;
+    if (avcodec_open2(decoderCtx, codec, nullptr) < 0) {
+        avcodec_free_context(&decoderCtx);
+        av_buffer_unref(&hwDeviceCtx);
+        avformat_close_input(&inputCtx);
+        throw std::runtime_error("Cannot open the decoder for " + input);
+    }
+
+    // Everything below is freed on the way out, also when a stage throws
+    PipelineResult result;
+    AVFrame* sources[kPipelineDepth] = {};
+    AVFrame* decoded = nullptr;
+    AVPacket* packet = nullptr;
+    auto cleanUp = [&]() {
+        for (AVFrame*& frame : sources) {
+            av_frame_free(&frame);
+        }
+        av_frame_free(&decoded);
+        av_packet_free(&packet);
+        avcodec_free_context(&decoderCtx);
+        av_buffer_unref(&hwDeviceCtx);
+        avformat_close_input(&inputCtx);
+    };
+    try {
+        const uint32_t width = decoderCtx->width, height = decoderCtx->height;
+        const bool verify = mode == "verify";
+
+        std::unique_ptr<VppStage> vpp;
+        std::unique_ptr<SurfaceReadback> readback;
+        std::vector<CpuOutput> cpu;
+        if (mode == "cpu" || verify) {
+            readback = std::make_unique<SurfaceReadback>(vaDisplay, VA_FOURCC_NV12, width, height);
+            // The baseline is the plain vaGetImage copy on every machine, not whichever readback is fastest
+            readback->use(ReadbackMethod::GetImage);
+            cpu = cpuOutputs(outputSpecs.empty() ? std::vector<VppOutput>(1) : outputSpecs, width, height);
+        }
+        if (mode != "cpu") {
+            VppOptions options;
+            options.inWidth = width;
+            options.inHeight = height;
+            options.outputs = outputSpecs;
+            options.scaling = mode == "default" ? VppScaling::Default
+                              : mode == "hq"    ? VppScaling::Quality
+                                                : VppScaling::Fast;
+            options.depth = kPipelineDepth;
+            vpp = std::make_unique<VppStage>(vaDisplay, options);
+        }
+        const size_t outputCount = vpp ? vpp->outputCount() : cpu.size();
+
+        // Verify: one readback per output, and the worst difference seen per output
+        std::vector<std::unique_ptr<SurfaceReadback>> outputReadbacks;
+        std::vector<VppDiff> diffs(outputCount);
+        if (verify) {
+            for (size_t o = 0; o < outputCount; ++o) {
+                const VppOutput& spec = vpp->output(o);
+                outputReadbacks.push_back(
+                    std::make_unique<SurfaceReadback>(vaDisplay, spec.fourcc, spec.width, spec.height));
+            }
+        }
+
+        // VPP mode: a ring of decoded frames and their outputs. The consumer takes the
+        // oldest outputs only when their slot comes round again, so up to kPipelineDepth
+        // frames are converted behind the decoder. Verify compares each slot's outputs
+        // with the reference of the same source before releasing it.
+        std::vector<VppFrame> outputs(kPipelineDepth * outputCount);
+        for (AVFrame*& frame : sources) {
+            frame = av_frame_alloc();
+        }
+        int slot = 0;
+        result.mode = mode;
+        auto consume = [&](int i) {
+            VppFrame* frames = &outputs[i * outputCount];
+            for (size_t o = 0; o < outputCount; ++o) {
+                if (!frames[o]) {
+                    continue;
+                }
+                // A consumer (encoder, inference) that needs the output surface now
+                const VASurfaceID surface = frames[o].ready();
+                if (verify) {
+                    const HostFrame source = readback->read((VASurfaceID)(size_t)sources[i]->data[3]);
+                    vppReference(source, width, height, cpu[o].spec, cpu[o].layout, cpu[o].pixels.data());
+                    const VppDiff diff = vppCompare(outputReadbacks[o]->read(surface),
+                                                    HostFrame{cpu[o].pixels.data(), cpu[o].layout});
+                    diffs[o].maxDiff = std::max(diffs[o].maxDiff, diff.maxDiff);
+                    diffs[o].meanDiff = std::max(diffs[o].meanDiff, diff.meanDiff);
+                }
+                frames[o] = VppFrame();
+            }
+            av_frame_unref(sources[i]);
+        };
+
+        packet = av_packet_alloc();
+        decoded = av_frame_alloc();
+        auto start = std::chrono::steady_clock::now();
+        bool eof = false;
+        while (!eof && !(verify && result.frames >= kVerifyFrames)) {
+            int err = av_read_frame(inputCtx, packet);
+            if (err >= 0 && packet->stream_index != videoStream) {
+                av_packet_unref(packet);
+                continue;
+            }
+            eof = err < 0;
+            {
+                TRACE_SCOPE("avcodec_send_packet");
+                avcodec_send_packet(decoderCtx, eof ? nullptr : packet);
+            }
+            av_packet_unref(packet);
+
+            for (;;) {
+                {
+                    TRACE_SCOPE("avcodec_receive_frame");
+                    err = avcodec_receive_frame(decoderCtx, decoded);
+                }
+                if (err == AVERROR(EAGAIN) || err == AVERROR_EOF) {
+                    break;
+                }
+                if (err < 0) {
+                    throw std::runtime_error("avcodec_receive_frame failed: " + std::to_string(err));
+                }
+                const VASurfaceID surface = (VASurfaceID)(size_t)decoded->data[3];
+                if (vpp) {
+                    consume(slot);
+                    av_frame_move_ref(sources[slot], decoded);
+                    vpp->submit(surface, &outputs[slot * outputCount]);
+                    slot = (slot + 1) % kPipelineDepth;
+                } else {
+                    TRACE_SCOPE("cpu convert");
+                    if (result.frames == 0) {
+                        // Create the reused VAImage before the clock starts
+                        readback->read(surface);
+                    }
+                    auto convertStart = std::chrono::steady_clock::now();
+                    const HostFrame source = readback->read(surface);
+                    for (CpuOutput& output : cpu) {
+                        vppReference(source, width, height, output.spec, output.layout, output.pixels.data());
+                    }
+                    result.stageSeconds +=
+                        std::chrono::duration<double>(std::chrono::steady_clock::now() - convertStart).count();
+                    av_frame_unref(decoded);
+                }
+                result.frames++;
+            }
+        }
+        for (int i = 0; i < kPipelineDepth; ++i) {
+            consume(i);
+        }
+        result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        if (vpp) {
+            result.stageSeconds = vpp->stats().submitSeconds;
+            result.waitSeconds = vpp->stats().syncSeconds;
+            printVaSurfacePoolStats(vpp->poolStats());
+        }
+        if (verify) {
+            for (size_t o = 0; o < outputCount; ++o) {
+                const bool ok = diffs[o].meanDiff <= kVerifyMeanDiff;
+                printf("Output %zu (%s): max diff %d, mean diff %.2f: %s\n", o, describeOutput(vpp->output(o)).c_str(),
+                       diffs[o].maxDiff, diffs[o].meanDiff, ok ? "ok" : "MISMATCH");
+                result.mismatches += ok ? 0 : 1;
+            }
+        } else if (readback) {
+            std::cout << "Readback: " << readback->describe() << std::endl;
+        }
+    } catch (...) {
+        cleanUp();
+        throw;
+    }
+    cleanUp();
+    return result;
+}
+
+void printResults(const std::vector<PipelineResult>& results, const std::vector<VppOutput>& outputs) {
+    if (outputs.empty()) {
+        printf("Output: RGBA at the decoder's size\n");
+    }
+    for (size_t o = 0; o < outputs.size(); ++o) {
+        printf("Output %zu: %s\n", o, describeOutput(outputs[o]).c_str());
+    }
+    printf("%-8s %8s %10s %16s %16s\n", "mode", "frames", "fps", "convert ms/frame", "wait ms/frame");
+    for (const PipelineResult& r : results) {
+        const int frames = std::max(r.frames, 1);
+        printf("%-8s %8d %10.1f %16.3f %16.3f\n", r.mode.c_str(), r.frames, r.frames / r.seconds,
+               r.stageSeconds * 1e3 / frames, r.waitSeconds * 1e3 / frames);
+    }
+}
+
+// Usage: va_main [input] [fast|default|hq|cpu|bench|verify] [output...]
+//   fast:    decode, then convert on VPP with VA_FILTER_SCALING_FAST (default)
+//   default: the same with VA_FILTER_SCALING_DEFAULT
+//   hq:      the same with VA_FILTER_SCALING_HQ
+//   cpu:     decode, read every frame back with vaGetImage and convert it on the CPU
+//   bench:   run all four on the same input and compare them
+//   verify:  run fast on the first frames and compare every output with the CPU reference
+//   output: WxH[:rgba|bgra|nv12][:letterbox][:crop=X,Y,W,H], any number of them, all
+//           produced from every frame (default: RGBA at the decoder's size)
+int main(int argc, char* argv[]) {
+    const std::string input = argc > 1 ? argv[1] : "../planet.mp4";
+    const std::string mode = argc > 2 ? argv[2] : "fast";
+    if (mode != "fast" && mode != "default" && mode != "hq" && mode != "cpu" && mode != "bench" && mode != "verify") {
+        std::cerr << "Usage: " << argv[0] << " [input] [fast|default|hq|cpu|bench|verify] [output...]" << std::endl;
+        std::cerr << "  output: WxH[:rgba|bgra|nv12][:letterbox][:crop=X,Y,W,H]" << std::endl;
+        return -1;
+    }
+    std::vector<VppOutput> outputs;
+    try {
+        for (int i = 3; i < argc; ++i) {
+            outputs.push_back(parseOutput(argv[i]));
+        }
+        checkReadbackMethodEnv(false);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return -1;
+    }
+
+    std::cout << "Running vaGetDisplayDRM" << std::endl;
+    int drmFd = open("/dev/dri/renderD128", O_RDWR);
+    if (drmFd < 0) {
+        std::cerr << "Cannot open /dev/dri/renderD128" << std::endl;
+        return -1;
+    }
+    VADisplay vaDisplay = vaGetDisplayDRM(drmFd);
+    int major, minor;
+    if (!vaDisplay || vaInitialize(vaDisplay, &major, &minor) != VA_STATUS_SUCCESS) {
+        std::cerr << "Cannot initialize VA-API" << std::endl;
+        close(drmFd);
+        return -1;
+    }
+
+    std::vector<PipelineResult> results;
+    int status = 0;
+    try {
+        for (const char* m : {"fast", "default", "hq", "cpu", "verify"}) {
+            if (mode == m || (mode == "bench" && std::string(m) != "verify")) {
+                std::cout << "Running " << m << std::endl;
+                results.push_back(runPipeline(vaDisplay, input, m, outputs));
+                status = results.back().mismatches ? -1 : status;
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        status = -1;
+    }
+    printResults(results, outputs);
+
+    std::cout << "Running vaTerminate" << std::endl;
+    vaTerminate(vaDisplay);
+    close(drmFd);
+    traceFlushFromEnv();
+    return status;
+}
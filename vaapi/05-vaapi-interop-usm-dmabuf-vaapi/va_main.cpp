@@ -25,13 +25,13 @@ extern "C" {
 #include <va/va_drmcommon.h>
 }
 
-VASurfaceID DmaBufToVaSurface(VADisplay va_dpy, uintptr_t dma_fd, int width, int height) {
-    VAStatus va_status;
-    VASurfaceID va_surface;
-
-    // TODO: Check if PRIME_2 is supported
-    bool use_prime2 = true;  // Assuming it's supported; adjust accordingly
+#include "prime_frame.hpp"
+#include "va_surface_caps.hpp"
+#include "trace.hpp"
 
+// Create a VASurface on top of a dma-buf, with PRIME_2 or with legacy PRIME
+VAStatus createSurfaceFromDmaBuf(VADisplay va_dpy, uintptr_t dma_fd, const PrimeFrameLayout& layout, bool use_prime2,
+                                 VASurfaceID* va_surface) {
     // Common attributes
     VASurfaceAttrib attribs[2];
     attribs[0].type = VASurfaceAttribMemoryType;
@@ -42,71 +42,115 @@ VASurfaceID DmaBufToVaSurface(VADisplay va_dpy, uintptr_t dma_fd, int width, int
     attribs[1].flags = VA_SURFACE_ATTRIB_SETTABLE;
     attribs[1].value.type = VAGenericValueTypePointer;
 
+    // Both descriptors must outlive vaCreateSurfaces
+    VADRMPRIMESurfaceDescriptor prime_desc;
+    VASurfaceAttribExternalBuffers va_ext_buf_desc;
+
     if (use_prime2) {
         std::cout << "Using PRIME_2 to export the memory" << std::endl;
-        VADRMPRIMESurfaceDescriptor prime_desc;
 
         // Set up the VASurfaceAttrib array
         attribs[0].value.value.i = VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME_2;
         attribs[1].value.value.p = &prime_desc;
 
-        // Initialize the VADRMPRIMESurfaceDescriptor structure.
-        prime_desc.fourcc = VA_FOURCC_RGBA; // Assuming RGBA format
-        prime_desc.width = width;
-        prime_desc.height = height;
-        prime_desc.num_objects = 1;  // Assuming one object for simplicity
-        prime_desc.objects[0].fd = dma_fd;
-        prime_desc.objects[0].size = width * height * 4;  // For RGBA
-        prime_desc.objects[0].drm_format_modifier = DRM_FORMAT_MOD_LINEAR; // Set as Linear memory because it's layout as linearly
-
-        prime_desc.num_layers = 1;  // Assuming one layer for RGBA
-        prime_desc.layers[0].drm_format = VA_FOURCC_RGBA; // Again, assuming RGBA format
-        prime_desc.layers[0].num_planes = 1;  // RGBA is packed into a single plane
-        prime_desc.layers[0].object_index[0] = 0;
-        prime_desc.layers[0].offset[0] = 0;
-        prime_desc.layers[0].pitch[0] = width * 4;  // For RGBA
-
+        // One object, one composed layer carrying every plane (Y and UV for NV12/P010)
+        fillPrimeDescriptor(prime_desc, layout, (int)dma_fd);
     } else {
         std::cout << "Using PRIME to export the memory" << std::endl;
-        VASurfaceAttribExternalBuffers va_ext_buf_desc;
 
         // Set up the VASurfaceAttrib array
         attribs[0].value.value.i = VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME;
         attribs[1].value.value.p = &va_ext_buf_desc;
 
-        // Initialize the VASurfaceAttribExternalBuffers structure.
-        va_ext_buf_desc.buffers = &dma_fd; // Pointer to the DMA-BUF FD
-        va_ext_buf_desc.num_buffers = 1;
-        va_ext_buf_desc.width = width;
-        va_ext_buf_desc.height = height;
-        va_ext_buf_desc.pixel_format = VA_FOURCC_RGBA; // Assuming the NV12 format
-        va_ext_buf_desc.data_size = width * height * 4; // For RGBA
-        va_ext_buf_desc.num_planes = 1; // RGBA (or RGBX) is packed into a single plane
-        va_ext_buf_desc.pitches[0] = width * 4; // For RGBA (or RGBX)
-        va_ext_buf_desc.offsets[0] = 0;
-
+        // Per-plane pitches and offsets into the single buffer; PRIME has no modifier, so it is linear
+        fillExternalBuffers(va_ext_buf_desc, layout, &dma_fd);
     }
 
     // Create the surface
-    va_status = vaCreateSurfaces(
+    TRACE_SCOPE("vaCreateSurfaces");
+    return vaCreateSurfaces(
         va_dpy,
-        VA_RT_FORMAT_RGB32,
-        width,
-        height,
-        &va_surface,
+        primeFormatInfo(layout.vaFourcc).rtFormat,
+        layout.width,
+        layout.height,
+        va_surface,
         1,
         attribs,
         2 // Number of attribs
     );
+}
+
+// Create a VASurface on top of a USM dma-buf. layout describes every plane of the buffer,
+// e.g. from linearPrimeFrameLayout(). PRIME_2 is used when the driver reports it, with a
+// fallback to legacy PRIME when PRIME_2 is missing or rejects the buffer. Returns
+// VA_INVALID_SURFACE when the driver cannot take a linear buffer at all.
+VASurfaceID DmaBufToVaSurface(VADisplay va_dpy, uintptr_t dma_fd, PrimeFrameLayout layout, const VaSurfaceCaps& caps) {
+    if (!vaSupportsFourcc(caps, layout.vaFourcc)) {
+        throw std::runtime_error("The VA driver does not support fourcc " + std::to_string(layout.vaFourcc));
+    }
+
+    // Level Zero device allocations are linear, so that is the only modifier the USM side offers
+    layout.modifier[0] = chooseDrmModifier(caps, {DRM_FORMAT_MOD_LINEAR});
+    if (layout.modifier[0] == DRM_FORMAT_MOD_INVALID) {
+        return VA_INVALID_SURFACE;
+    }
+
+    VASurfaceID va_surface = VA_INVALID_SURFACE;
+    VAStatus va_status = VA_STATUS_ERROR_UNSUPPORTED_MEMORY_TYPE;
+    if (caps.prime2) {
+        va_status = createSurfaceFromDmaBuf(va_dpy, dma_fd, layout, true, &va_surface);
+    }
+    if (va_status != VA_STATUS_SUCCESS && (caps.prime || !caps.prime2)) {
+        va_status = createSurfaceFromDmaBuf(va_dpy, dma_fd, layout, false, &va_surface);
+    }
     if (va_status != VA_STATUS_SUCCESS) {
-        std::string errorMsg = use_prime2 ? "Failed to create vaCreateSurfaces with PRIME_2" : "Failed to create vaCreateSurfaces";
-        throw std::runtime_error(errorMsg);
+        throw std::runtime_error("Failed to create vaCreateSurfaces from the DMA BUF: " + std::to_string(va_status));
     }
 
     std::cout << "Successfully create a VASurface based on USM buffer" << std::endl;
 
     return va_surface;
 }
+// The copy path: read the USM buffer back to the host and put it into a surface the
+// driver allocates in its own tiling
+VASurfaceID copyUsmToVaSurface(VADisplay va_dpy, ze_context_handle_t context, ze_device_handle_t device,
+                               void* usmMemory, const PrimeFrameLayout& layout) {
+    ze_host_mem_alloc_desc_t hostDesc = {};
+    hostDesc.stype = ZE_STRUCTURE_TYPE_HOST_MEM_ALLOC_DESC;
+    void* host = nullptr;
+    ze_result_t result = zeMemAllocHost(context, &hostDesc, layout.objectSize[0], 64, &host);
+    if (result != ZE_RESULT_SUCCESS) {
+        throw std::runtime_error("Failed to allocate the host copy: " + std::to_string(result));
+    }
+
+    ze_command_queue_desc_t queueDesc = {};
+    queueDesc.stype = ZE_STRUCTURE_TYPE_COMMAND_QUEUE_DESC;
+    queueDesc.mode = ZE_COMMAND_QUEUE_MODE_SYNCHRONOUS;
+    ze_command_list_handle_t cmdList = nullptr;
+    result = zeCommandListCreateImmediate(context, device, &queueDesc, &cmdList);
+    if (result == ZE_RESULT_SUCCESS) {
+        TRACE_SCOPE("copyUsmToVaSurface readback");
+        // Synchronous queue: the copy is done when the call returns
+        result = zeCommandListAppendMemoryCopy(cmdList, host, usmMemory, layout.objectSize[0], nullptr, 0, nullptr);
+        zeCommandListDestroy(cmdList);
+    }
+    if (result != ZE_RESULT_SUCCESS) {
+        zeMemFree(context, host);
+        throw std::runtime_error("Failed to copy the USM buffer to the host: " + std::to_string(result));
+    }
+
+    VASurfaceID va_surface = VA_INVALID_SURFACE;
+    try {
+        TRACE_SCOPE("copyUsmToVaSurface vaPutImage");
+        va_surface = copyFrameToNewSurface(va_dpy, layout, static_cast<const uint8_t*>(host));
+    } catch (...) {
+        zeMemFree(context, host);
+        throw;
+    }
+    zeMemFree(context, host);
+    return va_surface;
+}
+
 // Initialize Level Zero driver
 ze_driver_handle_t initializeDriver() {
     uint32_t driverCount = 0;
@@ -204,7 +248,11 @@ void* createUSMmemory(ze_context_handle_t context, ze_device_handle_t device, si
     allocDesc.flags = 0;
     
     void* memory = nullptr;
-    ze_result_t result = zeMemAllocDevice(context, &allocDesc, size, 4096, device, &memory);
+    ze_result_t result;
+    {
+        TRACE_SCOPE("zeMemAllocDevice");
+        result = zeMemAllocDevice(context, &allocDesc, size, 4096, device, &memory);
+    }
     
     if (result != ZE_RESULT_SUCCESS) {
         // Handle error
@@ -222,7 +270,11 @@ int usmToDmaBuf(ze_context_handle_t context, void* usmPtr) {
     ze_memory_allocation_properties_t alloc_props = {};
     alloc_props.stype = ZE_STRUCTURE_TYPE_MEMORY_ALLOCATION_PROPERTIES;
     alloc_props.pNext = &export_fd;
-    ze_result_t ze_res = zeMemGetAllocProperties(context, usmPtr, &alloc_props, nullptr);
+    ze_result_t ze_res;
+    {
+        TRACE_SCOPE("zeMemGetAllocProperties export");
+        ze_res = zeMemGetAllocProperties(context, usmPtr, &alloc_props, nullptr);
+    }
     if (ze_res != ZE_RESULT_SUCCESS)
         throw std::runtime_error("Failed to convert USM pointer to DMA-BUF: " + std::to_string(ze_res));
 
@@ -284,24 +336,54 @@ int main() {
         return -1;
     }
 
-    // Allocate memory using USM
-    size_t width = 1920;
-    size_t height = 1080;
-    size_t memorySize = width * height * 4;
-    std::cout << "Running createUSMmemory" << std::endl;
-    void* usmMemory = createUSMmemory(contextHandle, deviceHandle, memorySize);
-    std::cout << "Running usmToDmaBuf" << std::endl;
-    int dmaBufFd = usmToDmaBuf(contextHandle, usmMemory);
-    std::cout << "USM DMA BUF FD: " << dmaBufFd << std::endl;
-    std::cout << "Running DmaBufToVaSurface" << std::endl;
-
-    // Create the vaSurface based on the USM memory
-    VASurfaceID vaSurface = DmaBufToVaSurface(vaDisplay, (uintptr_t)dmaBufFd, width, height);
+    // Ask the driver which external memory types it takes
+    VaSurfaceCaps caps = queryVaSurfaceCaps(vaDisplay);
+    std::cout << "VA memory types: PRIME_2 " << (caps.prime2 ? "yes" : "no") << ", PRIME " << (caps.prime ? "yes" : "no")
+              << ", " << caps.modifiers.size() << " modifier(s) reported" << std::endl;
+
+    // Allocate memory using USM, one buffer per format, and wrap it in a VASurface
+    const uint32_t width = 1920;
+    const uint32_t height = 1080;
+    const struct {
+        const char* name;
+        uint32_t fourcc;
+    } formats[] = {{"RGBA", VA_FOURCC_RGBA}, {"NV12", VA_FOURCC_NV12}, {"P010", VA_FOURCC_P010}};
+
+    for (const auto& format : formats) {
+        std::cout << "Format " << format.name << std::endl;
+        PrimeFrameLayout layout;
+        size_t memorySize = linearPrimeFrameLayout(layout, format.fourcc, width, height);
+        for (uint32_t p = 0; p < layout.numPlanes; ++p) {
+            std::cout << "Plane " << p << ": offset " << layout.planes[p].offset << ", pitch "
+                      << layout.planes[p].pitch << std::endl;
+        }
+
+        std::cout << "Running createUSMmemory" << std::endl;
+        void* usmMemory = createUSMmemory(contextHandle, deviceHandle, memorySize);
+        if (!usmMemory) {
+            break;
+        }
+        std::cout << "Running usmToDmaBuf" << std::endl;
+        int dmaBufFd = usmToDmaBuf(contextHandle, usmMemory);
+        std::cout << "USM DMA BUF FD: " << dmaBufFd << std::endl;
+        std::cout << "Running DmaBufToVaSurface" << std::endl;
+
+        // Create the vaSurface based on the USM memory
+        VASurfaceID vaSurface = DmaBufToVaSurface(vaDisplay, (uintptr_t)dmaBufFd, layout, caps);
+        if (vaSurface == VA_INVALID_SURFACE) {
+            std::cout << "The VA driver takes no linear buffers, copying the USM buffer instead" << std::endl;
+            vaSurface = copyUsmToVaSurface(vaDisplay, contextHandle, deviceHandle, usmMemory, layout);
+        }
+        vaDestroySurfaces(vaDisplay, &vaSurface, 1);
+        close(dmaBufFd);
+        std::cout << "Running zeMemFree" << std::endl;
+        zeMemFree(contextHandle, usmMemory);
+    }
+
     vaTerminate(vaDisplay);
     close(drmFd);
-    std::cout << "Running zeMemFree" << std::endl;
-    zeMemFree(contextHandle, usmMemory);
     std::cout << "Running zeContextDestroy" << std::endl;
     zeContextDestroy(contextHandle);
+    traceFlushFromEnv();
     return 0;
 }
\ No newline at end of file
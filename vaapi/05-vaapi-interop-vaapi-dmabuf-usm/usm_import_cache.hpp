@@ -0,0 +1,210 @@
+#pragma once
+
+// Cache of VA surface -> dma-buf -> USM imports.
+//
+// Decoders recycle a small fixed pool of surfaces, so the same few buffers are
+// imported over and over. The cache keeps one USM import per (VADisplay,
+// VASurfaceID) and hands it out again on later frames.
+//
+// A surface ID can be reused for a different buffer once the original surface
+// is destroyed, so every acquire() still exports the surface and compares the
+// inode of its first dma-buf with the cached one. Exporting the same buffer
+// again yields the same dma-buf, so a matching inode means the import is still
+// valid; a different inode replaces the entry. Exported fds are closed before acquire()
+// returns, on every path.
+//
+// Multi-plane formats (NV12, P010) are supported whether the driver exports
+// one object or one per plane; every object is imported and the plane layout
+// is kept with the entry (see common/prime_frame.hpp).
+//
+// Call evict() before vaDestroySurfaces() and evictDisplay() before
+// vaTerminate(). An imported allocation keeps its buffer alive until it is
+// freed, so surfaces that are destroyed without eviction leak their memory.
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include <level_zero/ze_api.h>
+
+extern "C" {
+#include <va/va.h>
+#include <va/va_drmcommon.h>
+}
+
+#include "prime_frame.hpp"
+#include "trace.hpp"
+
+typedef struct {
+    PrimeFrameLayout layout;
+    void* usm_ptr[4];       // One import per layout object
+    dev_t dmabuf_dev;
+    ino_t dmabuf_ino;
+} UsmImport;
+
+typedef struct {
+    uint64_t acquires;
+    uint64_t exports;
+    uint64_t imports;
+    uint64_t evictions;
+} UsmImportStats;
+
+class UsmImportCache {
+public:
+    UsmImportCache(ze_context_handle_t ze_context, ze_device_handle_t ze_device)
+        : ze_context_(ze_context), ze_device_(ze_device) {}
+
+    ~UsmImportCache() { clear(); }
+
+    UsmImportCache(const UsmImportCache&) = delete;
+    UsmImportCache& operator=(const UsmImportCache&) = delete;
+
+    // USM view of the surface, imported on first use and reused while the dma-buf stays the same
+    UsmImport acquire(VADisplay va_display, VASurfaceID va_surface) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stats_.acquires++;
+
+        VADRMPRIMESurfaceDescriptor prime_desc = {};
+        VAStatus va_status;
+        {
+            TRACE_SCOPE("vaExportSurfaceHandle");
+            va_status = vaExportSurfaceHandle(va_display, va_surface, VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME_2,
+                                              VA_EXPORT_SURFACE_READ_WRITE, &prime_desc);
+        }
+        if (va_status != VA_STATUS_SUCCESS) {
+            throw std::runtime_error("vaExportSurfaceHandle failed: " + std::to_string(va_status));
+        }
+        stats_.exports++;
+        PrimeFds fds(prime_desc);
+
+        struct stat st;
+        if (prime_desc.num_objects == 0 || fstat(prime_desc.objects[0].fd, &st) != 0) {
+            throw std::runtime_error("fstat on the exported dma-buf failed");
+        }
+
+        const Key key{va_display, va_surface};
+        auto it = entries_.find(key);
+        if (it != entries_.end()) {
+            if (it->second.dmabuf_dev == st.st_dev && it->second.dmabuf_ino == st.st_ino) {
+                return it->second;
+            }
+            // The surface ID now names another buffer
+            release(it->second);
+            stats_.evictions++;
+            entries_.erase(it);
+        }
+
+        UsmImport entry = {};
+        entry.layout = primeFrameLayout(prime_desc);
+        entry.dmabuf_dev = st.st_dev;
+        entry.dmabuf_ino = st.st_ino;
+
+        // dmabuf -> USM conversion, one import per object
+        for (uint32_t i = 0; i < prime_desc.num_objects; ++i) {
+            ze_external_memory_import_fd_t import_fd = {
+                ZE_STRUCTURE_TYPE_EXTERNAL_MEMORY_IMPORT_FD,
+                nullptr,
+                ZE_EXTERNAL_MEMORY_TYPE_FLAG_DMA_BUF, prime_desc.objects[i].fd
+            };
+            ze_device_mem_alloc_desc_t alloc_desc = {};
+            alloc_desc.stype = ZE_STRUCTURE_TYPE_DEVICE_MEM_ALLOC_DESC;
+            alloc_desc.pNext = &import_fd;
+
+            ze_result_t ze_res;
+            {
+                TRACE_SCOPE("zeMemAllocDevice import");
+                ze_res = zeMemAllocDevice(ze_context_, &alloc_desc, prime_desc.objects[i].size, 1, ze_device_,
+                                          &entry.usm_ptr[i]);
+            }
+            if (ze_res != ZE_RESULT_SUCCESS) {
+                release(entry);
+                throw std::runtime_error("Failed to convert DMA to USM pointer: " + std::to_string(ze_res));
+            }
+            stats_.imports++;
+        }
+
+        entries_.emplace(key, entry);
+        return entry;
+    }
+
+    // Drop the import of one surface. Call before vaDestroySurfaces.
+    void evict(VADisplay va_display, VASurfaceID va_surface) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = entries_.find(Key{va_display, va_surface});
+        if (it != entries_.end()) {
+            release(it->second);
+            stats_.evictions++;
+            entries_.erase(it);
+        }
+    }
+
+    // Drop every import made from a display. Call before vaTerminate.
+    void evictDisplay(VADisplay va_display) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto it = entries_.begin(); it != entries_.end();) {
+            if (it->first.first == va_display) {
+                release(it->second);
+                stats_.evictions++;
+                it = entries_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto& [key, entry] : entries_) {
+            release(entry);
+            stats_.evictions++;
+        }
+        entries_.clear();
+    }
+
+    size_t size() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return entries_.size();
+    }
+
+    UsmImportStats stats() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return stats_;
+    }
+
+private:
+    typedef std::pair<VADisplay, VASurfaceID> Key;
+
+    // Closes every object fd of an exported descriptor when it goes out of scope
+    class PrimeFds {
+    public:
+        explicit PrimeFds(const VADRMPRIMESurfaceDescriptor& desc) : desc_(desc) {}
+        ~PrimeFds() {
+            for (uint32_t i = 0; i < desc_.num_objects; ++i) {
+                close(desc_.objects[i].fd);
+            }
+        }
+
+    private:
+        const VADRMPRIMESurfaceDescriptor& desc_;
+    };
+
+    void release(UsmImport& entry) {
+        for (void*& ptr : entry.usm_ptr) {
+            if (ptr) {
+                zeMemFree(ze_context_, ptr);
+                ptr = nullptr;
+            }
+        }
+    }
+
+    ze_context_handle_t ze_context_;
+    ze_device_handle_t ze_device_;
+    mutable std::mutex mutex_;
+    std::map<Key, UsmImport> entries_;
+    UsmImportStats stats_ = {};
+};
@@ -9,6 +9,7 @@
 #include <chrono>
 
 #include <fcntl.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <level_zero/ze_api.h>
 
@@ -25,17 +26,27 @@ extern "C" {
 #include <va/va_drmcommon.h>
 }
 
+#include "drm_tiling.hpp"
+#include "selftest.hpp"
+#include "trace.hpp"
+#include "usm_import_cache.hpp"
+#include "va_surface_caps.hpp"
+#include "ze_op_profiler.hpp"
+
 typedef struct {
-    unsigned int width;
-    unsigned int height;
-    ptrdiff_t stride;
-    ptrdiff_t offset;
+    PrimeFrameLayout layout;    // Objects, planes, offsets and pitches
     VASurfaceID va_surface;
     VADisplay va_display;
-    void* usm_ptr;
+    void* usm_ptr[4];           // USM import of each layout object
     ze_context_handle_t ze_context;
 } Frame;
 
+// Typed Y/UV planes of an NV12 or P010 frame in USM
+template <typename T>
+PlanarFrameView<T> frame_view(const Frame& frame) {
+    return makePlanarFrameView<T>(frame.layout, frame.usm_ptr);
+}
+
 // Initialize Level Zero driver
 ze_driver_handle_t initializeDriver() {
     uint32_t driverCount = 0;
@@ -129,52 +140,265 @@ ze_context_handle_t createContext(ze_driver_handle_t driverHandle) {
     return contextHandle;
 }
 
-void* vaapi_to_usm(VASurfaceID va_surface, VADisplay va_display_, ze_context_handle_t ze_context_, ze_device_handle_t ze_device_) {
-    // vaapi -> dmabuf conversion
-    VADRMPRIMESurfaceDescriptor prime_desc;
-    vaExportSurfaceHandle(
-        va_display_, va_surface, VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME_2,
-        VA_EXPORT_SURFACE_READ_WRITE,
-        &prime_desc);
-    
-    // Assuming that the RGB plane is at index 0
-    if (prime_desc.num_layers != 1 || prime_desc.layers->num_planes != 1) {
-        throw std::runtime_error("Unexpected number of layers or planes in the descriptor.");
-    }
+// vaapi -> dmabuf -> USM, imported once per surface and reused from the cache afterwards
+Frame vaapi_to_usm(VASurfaceID va_surface, VADisplay va_display_, ze_context_handle_t ze_context_, UsmImportCache& cache) {
+    UsmImport import = cache.acquire(va_display_, va_surface);
 
     // Filling Frame
     Frame frame;
-    frame.width = prime_desc.width;
-    frame.height = prime_desc.height;
-    frame.stride = prime_desc.layers->pitch[0];
-    frame.offset = prime_desc.layers->offset[0];
+    frame.layout = import.layout;
     frame.va_surface = va_surface;
     frame.va_display = va_display_;
+    for (int i = 0; i < 4; ++i) {
+        frame.usm_ptr[i] = import.usm_ptr[i];
+    }
+    frame.ze_context = ze_context_;
+    return frame;
+}
 
-    auto dma_fd = prime_desc.objects->fd;
-    auto dma_size = prime_desc.objects->size;
-    
-    // dmabuf -> USM conversion
-    ze_external_memory_import_fd_t import_fd = {
-        ZE_STRUCTURE_TYPE_EXTERNAL_MEMORY_IMPORT_FD,
-        nullptr,
-        ZE_EXTERNAL_MEMORY_TYPE_FLAG_DMA_BUF, dma_fd
-    };
-    ze_device_mem_alloc_desc_t alloc_desc = {};
-    alloc_desc.stype = ZE_STRUCTURE_TYPE_DEVICE_MEM_ALLOC_DESC;
-    alloc_desc.pNext = &import_fd;
-    
-    ze_result_t ze_res = zeMemAllocDevice(ze_context_, &alloc_desc, dma_size, 1, ze_device_, &frame.usm_ptr);
+// Copy one plane of a frame to the host and detile it into a linear buffer
+std::vector<uint8_t> plane_to_host(const Frame& frame, uint32_t planeIndex, ze_device_handle_t ze_device,
+                                   ZeOpProfiler& profiler) {
+    const PrimePlane& plane = frame.layout.planes[planeIndex];
+    const uint64_t modifier = frame.layout.modifier[plane.objectIndex];
+    const uint32_t rowBytes = plane.width * primeFormatInfo(frame.layout.vaFourcc).bytesPerSample * (planeIndex > 0 ? 2 : 1);
+    const size_t objectSize = frame.layout.objectSize[plane.objectIndex];
+
+    ze_host_mem_alloc_desc_t host_desc = {};
+    host_desc.stype = ZE_STRUCTURE_TYPE_HOST_MEM_ALLOC_DESC;
+    void* host = nullptr;
+    ze_result_t ze_res = zeMemAllocHost(frame.ze_context, &host_desc, objectSize, 4096, &host);
     if (ze_res != ZE_RESULT_SUCCESS) {
-        std::cout << "[ERROR]: Failed to convert DMA to USM pointer: " << ze_res << std::endl;
+        throw std::runtime_error("Failed to allocate host memory: " + std::to_string(ze_res));
     }
 
-    frame.ze_context = ze_context_;
-    close(dma_fd);
-    return frame.usm_ptr;
+    ze_command_queue_desc_t queue_desc = {};
+    queue_desc.stype = ZE_STRUCTURE_TYPE_COMMAND_QUEUE_DESC;
+    queue_desc.mode = ZE_COMMAND_QUEUE_MODE_SYNCHRONOUS;
+    ze_command_list_handle_t cmdList = nullptr;
+    ze_res = zeCommandListCreateImmediate(frame.ze_context, ze_device, &queue_desc, &cmdList);
+    if (ze_res == ZE_RESULT_SUCCESS) {
+        ze_res = zeCommandListAppendMemoryCopy(cmdList, host, frame.usm_ptr[plane.objectIndex], objectSize,
+                                               profiler.event("plane_to_host copy"), 0, nullptr);
+        zeCommandListDestroy(cmdList);
+    }
+    if (ze_res != ZE_RESULT_SUCCESS) {
+        profiler.discard();
+        zeMemFree(frame.ze_context, host);
+        throw std::runtime_error("Failed to copy the plane to the host: " + std::to_string(ze_res));
+    }
+
+    profiler.collect();
+
+    std::vector<uint8_t> linear(size_t(rowBytes) * plane.height);
+    detilePlane(modifier, static_cast<uint8_t*>(host) + plane.offset, plane.pitch, linear.data(), rowBytes, rowBytes,
+                plane.height);
+    zeMemFree(frame.ze_context, host);
+    return linear;
+}
+
+// Layout code against memfd-backed buffers, no driver needed
+int runLayoutChecks() {
+    const uint32_t width = 1921, height = 1081; // Odd sizes round the chroma up
+    for (uint32_t fourcc : {VA_FOURCC_NV12, VA_FOURCC_P010, VA_FOURCC_RGBA}) {
+        PrimeFrameLayout layout;
+        const size_t bytes = linearPrimeFrameLayout(layout, fourcc, width, height);
+        const PrimeFormatInfo info = primeFormatInfo(fourcc);
+        CHECK(layout.numPlanes == info.numPlanes && layout.planes[0].pitch % 64 == 0);
+        CHECK(layout.planes[0].pitch >= width * info.bytesPerSample);
+
+        int fd = memfd_create("prime_frame", 0);
+        CHECK(fd >= 0);
+        CHECK(ftruncate(fd, bytes) == 0);
+        void* base = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        CHECK(base != MAP_FAILED);
+
+        // Composed layer, one object: the descriptor flattens back to the same planes
+        VADRMPRIMESurfaceDescriptor desc;
+        fillPrimeDescriptor(desc, layout, fd);
+        CHECK(desc.objects[0].fd == fd && desc.layers[0].drm_format == info.drmFormat);
+        PrimeFrameLayout parsed = primeFrameLayout(desc);
+        CHECK(parsed.numPlanes == layout.numPlanes && parsed.objectSize[0] == bytes);
+        for (uint32_t p = 0; p < layout.numPlanes; ++p) {
+            CHECK(parsed.planes[p].objectIndex == 0 && parsed.planes[p].offset == layout.planes[p].offset);
+            CHECK(parsed.planes[p].pitch == layout.planes[p].pitch && parsed.planes[p].height == layout.planes[p].height);
+        }
+
+        // Legacy PRIME describes the same planes
+        uintptr_t handle = fd;
+        VASurfaceAttribExternalBuffers ext;
+        fillExternalBuffers(ext, layout, &handle);
+        CHECK(ext.data_size == bytes && ext.num_planes == layout.numPlanes && ext.buffers[0] == uintptr_t(fd));
+        CHECK(ext.offsets[layout.numPlanes - 1] == layout.planes[layout.numPlanes - 1].offset);
+
+        // A plane past the end of its object is rejected
+        desc.objects[0].size = bytes - 1;
+        bool rejected = false;
+        try {
+            primeFrameLayout(desc);
+        } catch (const std::runtime_error&) {
+            rejected = true;
+        }
+        CHECK(rejected);
+
+        if (info.numPlanes == 2) {
+            // Separate layers in separate objects, as some drivers export decoder surfaces
+            VADRMPRIMESurfaceDescriptor split = {};
+            split.fourcc = fourcc;
+            split.width = width;
+            split.height = height;
+            split.num_objects = 2;
+            split.num_layers = 2;
+            for (uint32_t p = 0; p < 2; ++p) {
+                split.objects[p] = {fd, uint32_t(layout.planes[p].pitch * layout.planes[p].height), 0};
+                split.layers[p].drm_format = info.planeDrmFormat[p];
+                split.layers[p].num_planes = 1;
+                split.layers[p].object_index[0] = p;
+                split.layers[p].pitch[0] = layout.planes[p].pitch;
+            }
+            PrimeFrameLayout separate = primeFrameLayout(split);
+            CHECK(separate.numObjects == 2 && separate.planes[1].objectIndex == 1 && separate.planes[1].offset == 0);
+            CHECK(separate.planes[1].width == (width + 1) / 2 && separate.planes[1].height == (height + 1) / 2);
+
+            // The view's last Y and UV samples land at the layout's offsets in the mapping
+            void* objects[4] = {base};
+            const uint32_t lastY = height - 1, lastUv = (height + 1) / 2 - 1;
+            const size_t yAt = size_t(lastY) * layout.planes[0].pitch + (width - 1) * info.bytesPerSample;
+            const size_t uvAt = layout.planes[1].offset + size_t(lastUv) * layout.planes[1].pitch +
+                                ((width + 1) / 2 * 2 - 1) * info.bytesPerSample;
+            uint8_t* bytesAt = static_cast<uint8_t*>(base);
+            if (fourcc == VA_FOURCC_NV12) {
+                NV12FrameView view = makePlanarFrameView<uint8_t>(layout, objects);
+                view.yRow(lastY)[width - 1] = 0x5a;
+                view.uvRow(lastUv)[(width + 1) / 2 * 2 - 1] = 0xa5;
+                CHECK(bytesAt[yAt] == 0x5a && bytesAt[uvAt] == 0xa5);
+            } else {
+                P010FrameView view = makePlanarFrameView<uint16_t>(layout, objects);
+                view.yRow(lastY)[width - 1] = 0x3ff << 6;
+                view.uvRow(lastUv)[(width + 1) / 2 * 2 - 1] = 0x155 << 6;
+                CHECK(*reinterpret_cast<uint16_t*>(bytesAt + yAt) == 0x3ff << 6);
+                CHECK(*reinterpret_cast<uint16_t*>(bytesAt + uvAt) == 0x155 << 6);
+                CHECK(uvAt + 2 <= bytes);
+            }
+        }
+        munmap(base, bytes);
+        close(fd);
+        std::cout << "Layout " << std::string(reinterpret_cast<const char*>(&fourcc), 4) << ": " << bytes
+                  << " bytes, checks passed" << std::endl;
+    }
+    return 0;
+}
+
+// Tile offset from the bit layout documented in drm_tiling.hpp, most significant bit first:
+// 'x'/'y' plus the bit number
+uint32_t documentedTileOffset(const char* bits, uint32_t x, uint32_t y) {
+    uint32_t offset = 0;
+    for (const char* bit = bits; *bit; bit += 2) {
+        offset = (offset << 1) | ((((bit[0] == 'x' ? x : y) >> (bit[1] - '0')) & 1));
+    }
+    return offset;
 }
 
-int main() {
+// Tiling and modifier negotiation, no driver needed
+int runTilingChecks() {
+    const struct {
+        uint64_t modifier;
+        const char* bits;
+    } tilings[] = {{I915_FORMAT_MOD_Y_TILED, "x6x5x4y4y3y2y1y0x3x2x1x0"},
+                   {I915_FORMAT_MOD_4_TILED, "y4x6y3x5y2x4y1y0x3x2x1x0"}};
+    for (const auto& tiling : tilings) {
+        std::vector<bool> used(4096);
+        for (uint32_t y = 0; y < 32; ++y) {
+            for (uint32_t x = 0; x < 128; ++x) {
+                const uint32_t offset = tileByteOffset(tiling.modifier, x, y);
+                CHECK(offset == documentedTileOffset(tiling.bits, x, y) && !used[offset]);
+                used[offset] = true;
+            }
+        }
+
+        // 1080p luma, and a chroma-sized plane whose rows and height are not tile multiples
+        for (uint32_t rowBytes : {1920u, 962u}) {
+            const uint32_t rows = rowBytes == 1920 ? 1080 : 541;
+            const size_t pitch = (rowBytes + 127) / 128 * 128;
+            std::vector<uint8_t> linear(size_t(rowBytes) * rows), back(linear.size());
+            std::vector<uint8_t> tiled(tiledPlaneSize(tiling.modifier, pitch, rows));
+            for (size_t i = 0; i < linear.size(); ++i) {
+                linear[i] = uint8_t(i * 31 + i / rowBytes);
+            }
+            tilePlane(tiling.modifier, linear.data(), rowBytes, tiled.data(), pitch, rowBytes, rows);
+            CHECK(tiled[tiledByteOffset(tiling.modifier, pitch, rowBytes - 1, rows - 1)] == linear.back());
+            auto start = std::chrono::steady_clock::now();
+            detilePlane(tiling.modifier, tiled.data(), pitch, back.data(), rowBytes, rowBytes, rows);
+            double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            CHECK(back == linear);
+            std::cout << drmModifierName(tiling.modifier) << " " << rowBytes << "x" << rows
+                      << ": round trip passed, detile " << ms << " ms" << std::endl;
+        }
+    }
+
+    // Tile4 chunk order as tabulated in the PRM and Mesa's isl_tiled_memcpy.c: the memory index
+    // of each 16-byte x 4-row chunk, chunk rows top to bottom. Independent of the bit string above.
+    static const uint8_t tile4Chunks[8][8] = {{0, 1, 4, 5, 16, 17, 20, 21},     {2, 3, 6, 7, 18, 19, 22, 23},
+                                              {8, 9, 12, 13, 24, 25, 28, 29},   {10, 11, 14, 15, 26, 27, 30, 31},
+                                              {32, 33, 36, 37, 48, 49, 52, 53}, {34, 35, 38, 39, 50, 51, 54, 55},
+                                              {40, 41, 44, 45, 56, 57, 60, 61}, {42, 43, 46, 47, 58, 59, 62, 63}};
+    for (uint32_t row = 0; row < 8; ++row) {
+        for (uint32_t column = 0; column < 8; ++column) {
+            CHECK(tileByteOffset(I915_FORMAT_MOD_4_TILED, column * 16, row * 4) == tile4Chunks[row][column] * 64u);
+        }
+    }
+    // Inside a chunk the rows are 16 bytes apart
+    CHECK(tileByteOffset(I915_FORMAT_MOD_4_TILED, 64 + 5, 8 + 3) == 24 * 64 + 3 * 16 + 5);
+
+    // Unaligned tiled pitches are refused
+    std::vector<uint8_t> plane(tiledPlaneSize(I915_FORMAT_MOD_Y_TILED, 2048, 32)), row(2000);
+    bool rejected = false;
+    try {
+        detilePlane(I915_FORMAT_MOD_Y_TILED, plane.data(), 2000, row.data(), 2000, 2000, 1);
+    } catch (const std::runtime_error&) {
+        rejected = true;
+    }
+    CHECK(rejected);
+
+    // Drivers that report no modifiers negotiate to linear; otherwise the fastest shared one wins,
+    // and sharing none is DRM_FORMAT_MOD_INVALID so the caller copies
+    const std::vector<uint64_t> host = {I915_FORMAT_MOD_4_TILED, I915_FORMAT_MOD_Y_TILED, DRM_FORMAT_MOD_LINEAR};
+    VaSurfaceCaps silent = {};
+    CHECK(chooseDrmModifier(silent, host) == DRM_FORMAT_MOD_LINEAR && commonDrmModifiers(silent, host).size() == 1);
+    VaSurfaceCaps gen12 = {};
+    gen12.modifiers = {DRM_FORMAT_MOD_LINEAR, I915_FORMAT_MOD_X_TILED, I915_FORMAT_MOD_Y_TILED};
+    CHECK(chooseDrmModifier(gen12, host) == I915_FORMAT_MOD_Y_TILED);
+    CHECK(chooseDrmModifier(gen12, {DRM_FORMAT_MOD_LINEAR}) == DRM_FORMAT_MOD_LINEAR);
+    VaSurfaceCaps tile4Only = {};
+    tile4Only.modifiers = {I915_FORMAT_MOD_4_TILED};
+    CHECK(commonDrmModifiers(tile4Only, {DRM_FORMAT_MOD_LINEAR}).empty());
+    CHECK(chooseDrmModifier(tile4Only, {DRM_FORMAT_MOD_LINEAR}) == DRM_FORMAT_MOD_INVALID);
+    CHECK(chooseDrmModifier(tile4Only, host) == I915_FORMAT_MOD_4_TILED);
+    std::cout << "Modifier negotiation checks passed" << std::endl;
+    return 0;
+}
+
+// Usage: va_main [frames] [nv12|p010|rgba]
+//        va_main selftest
+//   selftest: check the PRIME_2 layout code on memfd buffers, CPU tiling and modifier
+//             negotiation, no GPU needed
+int main(int argc, char* argv[]) {
+    if (isSelfTest(argc, argv)) {
+        return runSelfTest([]() { return runLayoutChecks() == 0 ? runTilingChecks() : -1; });
+    }
+    const int frames = argc > 1 ? std::stoi(argv[1]) : 300;
+    const std::string format = argc > 2 ? argv[2] : "nv12";
+    uint32_t fourcc = VA_FOURCC_NV12;
+    if (format == "p010") {
+        fourcc = VA_FOURCC_P010;
+    } else if (format == "rgba") {
+        fourcc = VA_FOURCC_RGBA;
+    } else if (format != "nv12") {
+        std::cerr << "Usage: " << argv[0] << " [frames] [nv12|p010|rgba]" << std::endl;
+        std::cerr << "       " << argv[0] << " selftest" << std::endl;
+        return -1;
+    }
+
     // Initialize Level Zero driver and device
     std::cout << "Running initializeDriver" << std::endl;
     ze_driver_handle_t driverHandle = initializeDriver();
@@ -229,17 +453,38 @@ int main() {
         return -1;
     }
 
-    // 1. Create a VASurface
-    // Set up VASurface attributes for RGBA format
-    VASurfaceAttrib attrib;
-    attrib.type = VASurfaceAttribPixelFormat;
-    attrib.flags = VA_SURFACE_ATTRIB_SETTABLE;
-    attrib.value.type = VAGenericValueTypeInteger;
-    attrib.value.value.i = VA_FOURCC_RGBA;
+    // 1. Create a pool of VASurfaces, like the fixed pool a decoder cycles through
+    // Set up VASurface attributes for the requested format
+    VASurfaceAttrib attribs[2];
+    unsigned int numAttribs = 1;
+    attribs[0].type = VASurfaceAttribPixelFormat;
+    attribs[0].flags = VA_SURFACE_ATTRIB_SETTABLE;
+    attribs[0].value.type = VAGenericValueTypeInteger;
+    attribs[0].value.value.i = fourcc;
+
+    // Ask for the fastest layout the host can still detile. Drivers that do not report their
+    // modifiers pick the layout themselves; the export below tells which one they chose.
+    VaSurfaceCaps caps = queryVaSurfaceCaps(vaDisplay);
+    std::vector<uint64_t> modifiers = commonDrmModifiers(
+        caps, {I915_FORMAT_MOD_4_TILED, I915_FORMAT_MOD_Y_TILED, DRM_FORMAT_MOD_LINEAR});
+    VADRMFormatModifierList modifierList = {static_cast<uint32_t>(modifiers.size()), modifiers.data()};
+    if (!caps.modifiers.empty() && !modifiers.empty()) {
+        std::cout << "Requesting modifier " << drmModifierName(modifiers.front()) << std::endl;
+        attribs[1].type = VASurfaceAttribDRMFormatModifiers;
+        attribs[1].flags = VA_SURFACE_ATTRIB_SETTABLE;
+        attribs[1].value.type = VAGenericValueTypePointer;
+        attribs[1].value.value.p = &modifierList;
+        numAttribs = 2;
+    }
 
-    // Create the VASurface with RGBA format
-    VASurfaceID surface;
-    VAStatus vaStatusSurface = vaCreateSurfaces(vaDisplay, VA_RT_FORMAT_RGB32, 1920, 1080, &surface, 1, &attrib, 1);
+    // Create the VASurfaces
+    constexpr unsigned int poolSize = 4;
+    VASurfaceID surfaces[poolSize];
+    VAStatus vaStatusSurface;
+    {
+        TRACE_SCOPE("vaCreateSurfaces");
+        vaStatusSurface = vaCreateSurfaces(vaDisplay, primeFormatInfo(fourcc).rtFormat, 1920, 1080, surfaces, poolSize, attribs, numAttribs);
+    }
     if (vaStatusSurface != VA_STATUS_SUCCESS) {
         // Handle error
         vaTerminate(vaDisplay);
@@ -247,12 +492,56 @@ int main() {
         return -1;
     }
 
-    void *usm = vaapi_to_usm(surface, vaDisplay, contextHandle, deviceHandle);
+    // 2. Map one surface per frame, round robin over the pool
+    std::cout << "Running vaapi_to_usm x" << frames << std::endl;
+    UsmImportCache importCache(contextHandle, deviceHandle);
+    ZeOpProfiler profiler(contextHandle, deviceHandle);
+    for (int i = 0; i < frames; ++i) {
+        Frame frame = vaapi_to_usm(surfaces[i % poolSize], vaDisplay, contextHandle, importCache);
+        if (!frame.usm_ptr[0]) {
+            std::cerr << "Failed to map surface " << frame.va_surface << std::endl;
+            break;
+        }
+        if (i == 0) {
+            for (uint32_t p = 0; p < frame.layout.numPlanes; ++p) {
+                const PrimePlane& plane = frame.layout.planes[p];
+                std::cout << "Plane " << p << ": object " << plane.objectIndex << ", offset " << plane.offset
+                          << ", pitch " << plane.pitch << ", " << plane.width << "x" << plane.height << ", "
+                          << drmModifierName(frame.layout.modifier[plane.objectIndex]) << std::endl;
+            }
+            // Consume the Y plane on the host, detiling it when the driver chose a tiled layout
+            if (cpuTilingSupported(frame.layout.modifier[frame.layout.planes[0].objectIndex])) {
+                auto start = std::chrono::steady_clock::now();
+                std::vector<uint8_t> luma = plane_to_host(frame, 0, deviceHandle, profiler);
+                double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+                std::cout << "Y plane on the host: " << luma.size() << " bytes in " << ms << " ms" << std::endl;
+            }
+            if (fourcc == VA_FOURCC_NV12) {
+                NV12FrameView view = frame_view<uint8_t>(frame);
+                std::cout << "NV12 view: Y " << (void*)view.y << ", UV " << (void*)view.uv << std::endl;
+            } else if (fourcc == VA_FOURCC_P010) {
+                P010FrameView view = frame_view<uint16_t>(frame);
+                std::cout << "P010 view: Y " << (void*)view.y << ", UV " << (void*)view.uv << std::endl;
+            }
+        }
+    }
+    UsmImportStats stats = importCache.stats();
+    std::cout << "Frames: " << stats.acquires << ", exports: " << stats.exports << ", imports: " << stats.imports
+              << " (pool of " << poolSize << ")" << std::endl;
+
+    // 3. Drop the imports before the surfaces go away
+    std::cout << "Running vaDestroySurfaces" << std::endl;
+    for (unsigned int i = 0; i < poolSize; ++i) {
+        importCache.evict(vaDisplay, surfaces[i]);
+    }
+    vaDestroySurfaces(vaDisplay, surfaces, poolSize);
+    importCache.evictDisplay(vaDisplay);
     vaTerminate(vaDisplay);
     close(drmFd);
-    std::cout << "Running zeMemFree" << std::endl;
-    zeMemFree(contextHandle, usm);
+    profiler.release();
+    printOpRecords();
     std::cout << "Running zeContextDestroy" << std::endl;
     zeContextDestroy(contextHandle);
+    traceFlushFromEnv();
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,255 @@
+#include <vector>
+#include <string>
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <level_zero/ze_api.h>
+
+extern "C" {
+#include <va/va.h>
+#include <va/va_drm.h>
+#include <va/va_drmcommon.h>
+}
+
+#include "dlpack_frame.hpp"
+#include "trace.hpp"
+#include "ze_op_profiler.hpp"
+
+// Test pattern: byte x of row y of plane p
+uint8_t patternByte(uint32_t plane, uint32_t y, uint32_t x) {
+    return static_cast<uint8_t>(x + y * 3 + plane * 101);
+}
+
+uint32_t planeRowBytes(const PrimeFrameLayout& layout, uint32_t p) {
+    return layout.planes[p].width * primeFormatInfo(layout.vaFourcc).bytesPerSample * (p > 0 ? 2 : 1);
+}
+
+// A producer's tensor, as NumPy or a framework would hand it over
+typedef struct {
+    DLManagedTensor tensor;
+    int64_t shape[3];
+    int64_t strides[3];
+    ze_context_handle_t ze_context;   // Set for USM tensors
+    bool* deleted;                    // Set once the deleter ran
+} ProducerTensor;
+
+void deleteProducerTensor(DLManagedTensor* tensor) {
+    ProducerTensor* producer = static_cast<ProducerTensor*>(tensor->manager_ctx);
+    if (producer->ze_context) {
+        zeMemFree(producer->ze_context, tensor->dl_tensor.data);
+    } else {
+        free(tensor->dl_tensor.data);
+    }
+    *producer->deleted = true;
+    delete producer;
+}
+
+// Frame in the single-tensor layout of dlpackToVaSurface: RGBA [H, W, 4], NV12 [H * 3 / 2, W]
+// ze_context, ze_device and profiler are set for a USM tensor and null for a host one
+DLManagedTensor* makeProducerTensor(uint32_t fourcc, uint32_t width, uint32_t height, ze_context_handle_t ze_context,
+                                    ze_device_handle_t ze_device, ZeOpProfiler* profiler, bool* deleted) {
+    PrimeFrameLayout layout;
+    const size_t size = linearPrimeFrameLayout(layout, fourcc, width, height);
+    const uint32_t pitch = layout.planes[0].pitch;
+
+    // The pattern is built on the host and uploaded for USM tensors
+    std::vector<uint8_t> host(size);
+    for (uint32_t p = 0; p < layout.numPlanes; ++p) {
+        for (uint32_t y = 0; y < layout.planes[p].height; ++y) {
+            for (uint32_t x = 0; x < planeRowBytes(layout, p); ++x) {
+                host[layout.planes[p].offset + size_t(y) * pitch + x] = patternByte(p, y, x);
+            }
+        }
+    }
+
+    void* data = nullptr;
+    if (ze_context) {
+        ze_device_mem_alloc_desc_t alloc_desc = {};
+        alloc_desc.stype = ZE_STRUCTURE_TYPE_DEVICE_MEM_ALLOC_DESC;
+        ze_result_t ze_res = zeMemAllocDevice(ze_context, &alloc_desc, size, 4096, ze_device, &data);
+        ze_command_queue_desc_t queue_desc = {};
+        queue_desc.stype = ZE_STRUCTURE_TYPE_COMMAND_QUEUE_DESC;
+        queue_desc.mode = ZE_COMMAND_QUEUE_MODE_SYNCHRONOUS;
+        ze_command_list_handle_t cmdList = nullptr;
+        if (ze_res == ZE_RESULT_SUCCESS) {
+            ze_res = zeCommandListCreateImmediate(ze_context, ze_device, &queue_desc, &cmdList);
+        }
+        if (ze_res == ZE_RESULT_SUCCESS) {
+            ze_res = zeCommandListAppendMemoryCopy(cmdList, data, host.data(), size,
+                                                   profiler->event("tensor upload"), 0, nullptr);
+            zeCommandListDestroy(cmdList);
+        }
+        if (ze_res != ZE_RESULT_SUCCESS) {
+            profiler->discard();
+            throw std::runtime_error("Failed to create the USM tensor: " + std::to_string(ze_res));
+        }
+        profiler->collect();
+    } else {
+        // Page aligned, so the driver can wrap it as a user pointer
+        data = aligned_alloc(4096, (size + 4095) / 4096 * 4096);
+        memcpy(data, host.data(), size);
+    }
+
+    ProducerTensor* producer = new ProducerTensor();
+    producer->ze_context = ze_context;
+    producer->deleted = deleted;
+    const bool rgb = layout.numPlanes == 1;
+    producer->shape[0] = rgb ? height : height * 3 / 2;
+    producer->shape[1] = width;
+    producer->shape[2] = 4;
+    producer->strides[0] = rgb ? pitch : pitch / primeFormatInfo(fourcc).bytesPerSample;
+    producer->strides[1] = rgb ? 4 : 1;
+    producer->strides[2] = 1;
+
+    DLTensor& t = producer->tensor.dl_tensor;
+    t.data = data;
+    t.device = ze_context ? DLDevice{kDLOneAPI, 0} : DLDevice{kDLCPU, 0};
+    t.ndim = rgb ? 3 : 2;
+    t.dtype = {kDLUInt, static_cast<uint8_t>(rgb ? 8 : primeFormatInfo(fourcc).bytesPerSample * 8), 1};
+    t.shape = producer->shape;
+    t.strides = producer->strides;
+    t.byte_offset = 0;
+    producer->tensor.manager_ctx = producer;
+    producer->tensor.deleter = deleteProducerTensor;
+    return &producer->tensor;
+}
+
+bool isSurfacePattern(VADisplay va_dpy, VASurfaceID surface, uint32_t fourcc, uint32_t width, uint32_t height) {
+    VAImage image;
+    if (vaDeriveImage(va_dpy, surface, &image) != VA_STATUS_SUCCESS) {
+        throw std::runtime_error("vaDeriveImage failed");
+    }
+    uint8_t* data = nullptr;
+    VAStatus va_status = vaMapBuffer(va_dpy, image.buf, (void**)&data);
+    if (va_status != VA_STATUS_SUCCESS) {
+        vaDestroyImage(va_dpy, image.image_id);
+        throw std::runtime_error("vaMapBuffer failed: " + std::to_string(va_status));
+    }
+
+    PrimeFrameLayout layout;
+    linearPrimeFrameLayout(layout, fourcc, width, height);
+    bool match = true;
+    for (uint32_t p = 0; p < layout.numPlanes && match; ++p) {
+        for (uint32_t y = 0; y < layout.planes[p].height && match; ++y) {
+            const uint8_t* row = data + image.offsets[p] + size_t(y) * image.pitches[p];
+            for (uint32_t x = 0; x < planeRowBytes(layout, p); ++x) {
+                if (row[x] != patternByte(p, y, x)) {
+                    match = false;
+                    break;
+                }
+            }
+        }
+    }
+
+    vaUnmapBuffer(va_dpy, image.buf);
+    vaDestroyImage(va_dpy, image.image_id);
+    return match;
+}
+
+// Initialize Level Zero and return the first GPU device and a context for it
+ze_context_handle_t createContext(ze_device_handle_t* deviceHandle) {
+    uint32_t driverCount = 1;
+    ze_driver_handle_t driverHandle;
+    if (zeInit(ZE_INIT_FLAG_GPU_ONLY) != ZE_RESULT_SUCCESS || zeDriverGet(&driverCount, &driverHandle) != ZE_RESULT_SUCCESS ||
+        driverCount == 0) {
+        throw std::runtime_error("Failed to initialize Level Zero");
+    }
+    uint32_t deviceCount = 1;
+    if (zeDeviceGet(driverHandle, &deviceCount, deviceHandle) != ZE_RESULT_SUCCESS || deviceCount == 0) {
+        throw std::runtime_error("No devices found for the driver");
+    }
+    ze_context_desc_t contextDesc = {};
+    contextDesc.stype = ZE_STRUCTURE_TYPE_CONTEXT_DESC;
+    ze_context_handle_t contextHandle;
+    if (zeContextCreate(driverHandle, &contextDesc, &contextHandle) != ZE_RESULT_SUCCESS) {
+        throw std::runtime_error("Failed to create Level Zero context");
+    }
+    return contextHandle;
+}
+
+// Usage: va_main [gpu|cpu] [nv12|p010|rgba]
+//   gpu: the tensor lives in USM device memory (kDLOneAPI)
+//   cpu: the tensor lives in host memory (kDLCPU)
+int main(int argc, char* argv[]) {
+    const bool cpu = argc > 1 && std::string(argv[1]) == "cpu";
+    const std::string format = argc > 2 ? argv[2] : "nv12";
+    uint32_t fourcc = VA_FOURCC_NV12;
+    if (format == "p010") {
+        fourcc = VA_FOURCC_P010;
+    } else if (format == "rgba") {
+        fourcc = VA_FOURCC_RGBA;
+    } else if (format != "nv12") {
+        std::cerr << "Usage: " << argv[0] << " [gpu|cpu] [nv12|p010|rgba]" << std::endl;
+        return -1;
+    }
+    const uint32_t width = 1920;
+    const uint32_t height = 1080;
+
+    ze_device_handle_t deviceHandle = nullptr;
+    ze_context_handle_t contextHandle = nullptr;
+    std::unique_ptr<ZeOpProfiler> profiler;
+    if (!cpu) {
+        std::cout << "Running createContext" << std::endl;
+        contextHandle = createContext(&deviceHandle);
+        profiler = std::make_unique<ZeOpProfiler>(contextHandle, deviceHandle);
+    }
+
+    std::cout << "Running drmFd" << std::endl;
+    int drmFd = open("/dev/dri/renderD128", O_RDWR); // Opening the first render node. Change index as per your system.
+    if (drmFd < 0) {
+        std::cerr << "Failed to open DRM" << std::endl;
+        return -1;
+    }
+    std::cout << "Running vaGetDisplayDRM" << std::endl;
+    VADisplay vaDisplay = vaGetDisplayDRM(drmFd);
+    int major, minor;
+    if (vaDisplay == nullptr || vaInitialize(vaDisplay, &major, &minor) != VA_STATUS_SUCCESS) {
+        std::cerr << "Failed to initialize VA Display" << std::endl;
+        close(drmFd);
+        return -1;
+    }
+
+    bool deleted = false;
+    DLManagedTensor* tensor = makeProducerTensor(fourcc, width, height, contextHandle, deviceHandle, profiler.get(), &deleted);
+
+    int failures = 0;
+    {
+        std::cout << "Running dlpackToVaSurface" << std::endl;
+        DLPackVaSurface surface;
+        {
+            TRACE_SCOPE("dlpackToVaSurface");
+            surface = dlpackToVaSurface(vaDisplay, tensor, fourcc, contextHandle);
+        }
+        std::cout << "Surface " << surface.surface() << (surface.zeroCopy() ? " aliases" : " is a copy of")
+                  << " the tensor" << std::endl;
+
+        if (isSurfacePattern(vaDisplay, surface.surface(), fourcc, width, height)) {
+            std::cout << "Surface matches the tensor" << std::endl;
+        } else {
+            std::cerr << "Surface doesn't match the tensor!" << std::endl;
+            failures++;
+        }
+        if (surface.zeroCopy() && deleted) {
+            std::cerr << "The tensor was released while the surface still aliases it!" << std::endl;
+            failures++;
+        }
+    }
+    if (!deleted) {
+        std::cerr << "The tensor was not released with the surface!" << std::endl;
+        failures++;
+    }
+
+    vaTerminate(vaDisplay);
+    close(drmFd);
+    profiler.reset();
+    printOpRecords();
+    if (contextHandle) {
+        zeContextDestroy(contextHandle);
+    }
+    traceFlushFromEnv();
+    return failures == 0 ? 0 : -1;
+}
@@ -0,0 +1,377 @@
+#include <vector>
+#include <string>
+#include <iostream>
+#include <cstring>
+#include <memory>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <level_zero/ze_api.h>
+
+#include <drm_fourcc.h> // For DRM_FORMAT_MOD_LINEAR
+
+extern "C" {
+#include <va/va.h>
+#include <va/va_drm.h>
+#include <va/va_drmcommon.h>
+}
+
+#include "dlpack_frame.hpp"
+#include "trace.hpp"
+#include "ze_op_profiler.hpp"
+
+// Test pattern: byte x of row y of plane p
+uint8_t patternByte(uint32_t plane, uint32_t y, uint32_t x) {
+    return static_cast<uint8_t>(x + y * 3 + plane * 101);
+}
+
+uint32_t planeRowBytes(const PrimeFrameLayout& layout, uint32_t p) {
+    return layout.planes[p].width * primeFormatInfo(layout.vaFourcc).bytesPerSample * (p > 0 ? 2 : 1);
+}
+
+void writePattern(const PrimeFrameLayout& layout, uint8_t* const* objectBase, const uint32_t* pitches,
+                  const uint32_t* offsets) {
+    for (uint32_t p = 0; p < layout.numPlanes; ++p) {
+        uint8_t* plane = objectBase[layout.planes[p].objectIndex] + offsets[p];
+        for (uint32_t y = 0; y < layout.planes[p].height; ++y) {
+            for (uint32_t x = 0; x < planeRowBytes(layout, p); ++x) {
+                plane[size_t(y) * pitches[p] + x] = patternByte(p, y, x);
+            }
+        }
+    }
+}
+
+// Read every element of a CPU plane tensor through its shape and strides
+bool isTensorPattern(const DLTensor& t, uint32_t plane) {
+    const int64_t channels = t.ndim == 3 ? t.shape[2] : 1;
+    const int64_t elementBytes = t.dtype.bits / 8;
+    const uint8_t* data = static_cast<const uint8_t*>(t.data) + t.byte_offset;
+    for (int64_t y = 0; y < t.shape[0]; ++y) {
+        for (int64_t x = 0; x < t.shape[1]; ++x) {
+            for (int64_t c = 0; c < channels; ++c) {
+                const int64_t element = y * t.strides[0] + x * t.strides[1] + (t.ndim == 3 ? c * t.strides[2] : 0);
+                for (int64_t b = 0; b < elementBytes; ++b) {
+                    const uint32_t rowByte = static_cast<uint32_t>((x * channels + c) * elementBytes + b);
+                    if (data[element * elementBytes + b] != patternByte(plane, y, rowByte)) {
+                        return false;
+                    }
+                }
+            }
+        }
+    }
+    return true;
+}
+
+void printTensor(const DLTensor& t, uint32_t plane) {
+    std::cout << "Plane " << plane << ": device " << (t.device.device_type == kDLOneAPI ? "kDLOneAPI" : "kDLCPU")
+              << ", uint" << int(t.dtype.bits) << " [";
+    for (int i = 0; i < t.ndim; ++i) {
+        std::cout << t.shape[i] << (i + 1 < t.ndim ? ", " : "");
+    }
+    std::cout << "], strides [";
+    for (int i = 0; i < t.ndim; ++i) {
+        std::cout << t.strides[i] << (i + 1 < t.ndim ? ", " : "");
+    }
+    std::cout << "]" << std::endl;
+}
+
+// Host frame in a memfd, exported as kDLCPU tensors. The tensors own the mapping and the fd.
+std::vector<DLManagedTensor*> host_frame_to_dlpack(uint32_t fourcc, uint32_t width, uint32_t height, int* fdOut,
+                                                   std::weak_ptr<DLPackFrameOwner>* ownerOut) {
+    PrimeFrameLayout layout;
+    const size_t size = linearPrimeFrameLayout(layout, fourcc, width, height);
+
+    int fd = memfd_create("dlpack-frame", MFD_CLOEXEC);
+    if (fd < 0 || ftruncate(fd, size) != 0) {
+        throw std::runtime_error("Failed to create the memfd frame");
+    }
+    void* base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        close(fd);
+        throw std::runtime_error("Failed to map the memfd frame");
+    }
+
+    uint8_t* objects[4] = {static_cast<uint8_t*>(base)};
+    uint32_t pitches[4], offsets[4];
+    for (uint32_t p = 0; p < layout.numPlanes; ++p) {
+        pitches[p] = layout.planes[p].pitch;
+        offsets[p] = layout.planes[p].offset;
+    }
+    writePattern(layout, objects, pitches, offsets);
+
+    auto owner = std::make_shared<DLPackFrameOwner>();
+    owner->addMapping(base, size);
+    owner->addFd(fd);
+    *fdOut = fd;
+    *ownerOut = owner;
+
+    void* objectBase[4] = {base};
+    return dlpackFromFrame(layout, objectBase, {kDLCPU, 0}, std::move(owner));
+}
+
+int runCpu(uint32_t fourcc) {
+    std::cout << "Running host_frame_to_dlpack" << std::endl;
+    int fd = -1;
+    std::weak_ptr<DLPackFrameOwner> owner;
+    std::vector<DLManagedTensor*> tensors = host_frame_to_dlpack(fourcc, 640, 360, &fd, &owner);
+
+    int failures = 0;
+    for (uint32_t p = 0; p < tensors.size(); ++p) {
+        printTensor(tensors[p]->dl_tensor, p);
+        if (!isTensorPattern(tensors[p]->dl_tensor, p)) {
+            std::cerr << "Plane " << p << " does not read back through its strides!" << std::endl;
+            failures++;
+        }
+    }
+
+    // Consumers delete in any order; the frame goes away with the last tensor
+    for (DLManagedTensor* tensor : tensors) {
+        if (owner.expired()) {
+            std::cerr << "The frame was released while a tensor was still alive!" << std::endl;
+            failures++;
+        }
+        tensor->deleter(tensor);
+    }
+    if (!owner.expired() || fcntl(fd, F_GETFD) != -1) {
+        std::cerr << "The last deleter did not release the frame!" << std::endl;
+        failures++;
+    }
+    if (failures == 0) {
+        std::cout << "CPU tensors read back correctly and released the frame" << std::endl;
+    }
+    return failures;
+}
+
+// Initialize Level Zero driver
+ze_driver_handle_t initializeDriver() {
+    ze_result_t result = zeInit(ZE_INIT_FLAG_GPU_ONLY);
+    if (result != ZE_RESULT_SUCCESS) {
+        throw std::runtime_error("Failed to initialize Level Zero");
+    }
+    uint32_t driverCount = 1;
+    ze_driver_handle_t driverHandle;
+    result = zeDriverGet(&driverCount, &driverHandle);
+    if (result != ZE_RESULT_SUCCESS || driverCount == 0) {
+        throw std::runtime_error("Failed to find any drivers");
+    }
+    return driverHandle;
+}
+
+// Initialize Level Zero device
+ze_device_handle_t initializeDevice(ze_driver_handle_t driverHandle) {
+    uint32_t deviceCount = 1;
+    ze_device_handle_t deviceHandle;
+    ze_result_t result = zeDeviceGet(driverHandle, &deviceCount, &deviceHandle);
+    if (result != ZE_RESULT_SUCCESS || deviceCount == 0) {
+        throw std::runtime_error("No devices found for the driver");
+    }
+    return deviceHandle;
+}
+
+// Get Context
+ze_context_handle_t createContext(ze_driver_handle_t driverHandle) {
+    ze_context_desc_t contextDesc = {};
+    contextDesc.stype = ZE_STRUCTURE_TYPE_CONTEXT_DESC;
+    ze_context_handle_t contextHandle;
+    if (zeContextCreate(driverHandle, &contextDesc, &contextHandle) != ZE_RESULT_SUCCESS) {
+        throw std::runtime_error("Failed to create Level Zero context");
+    }
+    return contextHandle;
+}
+
+// vaapi -> dmabuf -> USM -> DLPack. The tensors own the surface, the imports and the dma-buf fds.
+std::vector<DLManagedTensor*> vaapi_to_dlpack(VASurfaceID va_surface, VADisplay va_display,
+                                              ze_context_handle_t ze_context, ze_device_handle_t ze_device) {
+    VADRMPRIMESurfaceDescriptor prime_desc = {};
+    VAStatus va_status;
+    {
+        TRACE_SCOPE("vaExportSurfaceHandle");
+        va_status = vaExportSurfaceHandle(va_display, va_surface, VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME_2,
+                                          VA_EXPORT_SURFACE_READ_WRITE, &prime_desc);
+    }
+    if (va_status != VA_STATUS_SUCCESS) {
+        throw std::runtime_error("vaExportSurfaceHandle failed: " + std::to_string(va_status));
+    }
+
+    // From here on the owner closes the fds and destroys the surface, on success and on error
+    auto owner = std::make_shared<DLPackFrameOwner>();
+    owner->setSurface(va_display, va_surface);
+    for (uint32_t i = 0; i < prime_desc.num_objects; ++i) {
+        owner->addFd(prime_desc.objects[i].fd);
+    }
+    PrimeFrameLayout layout = primeFrameLayout(prime_desc);
+
+    void* usm_ptr[4] = {};
+    for (uint32_t i = 0; i < prime_desc.num_objects; ++i) {
+        ze_external_memory_import_fd_t import_fd = {
+            ZE_STRUCTURE_TYPE_EXTERNAL_MEMORY_IMPORT_FD,
+            nullptr,
+            ZE_EXTERNAL_MEMORY_TYPE_FLAG_DMA_BUF, prime_desc.objects[i].fd
+        };
+        ze_device_mem_alloc_desc_t alloc_desc = {};
+        alloc_desc.stype = ZE_STRUCTURE_TYPE_DEVICE_MEM_ALLOC_DESC;
+        alloc_desc.pNext = &import_fd;
+
+        ze_result_t ze_res;
+        {
+            TRACE_SCOPE("zeMemAllocDevice import");
+            ze_res = zeMemAllocDevice(ze_context, &alloc_desc, prime_desc.objects[i].size, 1, ze_device, &usm_ptr[i]);
+        }
+        if (ze_res != ZE_RESULT_SUCCESS) {
+            throw std::runtime_error("Failed to convert DMA to USM pointer: " + std::to_string(ze_res));
+        }
+        owner->addUsm(ze_context, usm_ptr[i]);
+    }
+
+    return dlpackFromFrame(layout, usm_ptr, dlpackDeviceOf(ze_context, usm_ptr[0]), std::move(owner));
+}
+
+// First row of a device plane tensor, copied to the host
+std::vector<uint8_t> tensor_row_to_host(const DLTensor& t, ze_context_handle_t ze_context,
+                                        ze_device_handle_t ze_device, ZeOpProfiler& profiler) {
+    const size_t rowBytes = t.shape[1] * (t.ndim == 3 ? t.shape[2] : 1) * (t.dtype.bits / 8);
+    std::vector<uint8_t> row(rowBytes);
+
+    ze_command_queue_desc_t queue_desc = {};
+    queue_desc.stype = ZE_STRUCTURE_TYPE_COMMAND_QUEUE_DESC;
+    queue_desc.mode = ZE_COMMAND_QUEUE_MODE_SYNCHRONOUS;
+    ze_command_list_handle_t cmdList = nullptr;
+    ze_result_t ze_res = zeCommandListCreateImmediate(ze_context, ze_device, &queue_desc, &cmdList);
+    if (ze_res == ZE_RESULT_SUCCESS) {
+        ze_res = zeCommandListAppendMemoryCopy(cmdList, row.data(), static_cast<uint8_t*>(t.data) + t.byte_offset,
+                                               rowBytes, profiler.event("tensor row copy"), 0, nullptr);
+        zeCommandListDestroy(cmdList);
+    }
+    if (ze_res != ZE_RESULT_SUCCESS) {
+        profiler.discard();
+        throw std::runtime_error("Failed to copy the tensor row to the host: " + std::to_string(ze_res));
+    }
+    profiler.collect();
+    return row;
+}
+
+// A linear surface filled with the test pattern through vaDeriveImage
+VASurfaceID createPatternSurface(VADisplay vaDisplay, uint32_t fourcc, uint32_t width, uint32_t height) {
+    // DLPack strides cannot describe tiles, so ask for a linear surface
+    uint64_t linear = DRM_FORMAT_MOD_LINEAR;
+    VADRMFormatModifierList modifierList = {1, &linear};
+    VASurfaceAttrib attribs[2];
+    attribs[0].type = VASurfaceAttribPixelFormat;
+    attribs[0].flags = VA_SURFACE_ATTRIB_SETTABLE;
+    attribs[0].value.type = VAGenericValueTypeInteger;
+    attribs[0].value.value.i = fourcc;
+    attribs[1].type = VASurfaceAttribDRMFormatModifiers;
+    attribs[1].flags = VA_SURFACE_ATTRIB_SETTABLE;
+    attribs[1].value.type = VAGenericValueTypePointer;
+    attribs[1].value.value.p = &modifierList;
+
+    VASurfaceID surface;
+    VAStatus va_status = vaCreateSurfaces(vaDisplay, primeFormatInfo(fourcc).rtFormat, width, height, &surface, 1,
+                                          attribs, 2);
+    if (va_status != VA_STATUS_SUCCESS) {
+        throw std::runtime_error("vaCreateSurfaces failed: " + std::to_string(va_status));
+    }
+
+    VAImage image;
+    uint8_t* data = nullptr;
+    if (vaDeriveImage(vaDisplay, surface, &image) != VA_STATUS_SUCCESS) {
+        vaDestroySurfaces(vaDisplay, &surface, 1);
+        throw std::runtime_error("vaDeriveImage failed");
+    }
+    va_status = vaMapBuffer(vaDisplay, image.buf, (void**)&data);
+    if (va_status != VA_STATUS_SUCCESS) {
+        vaDestroyImage(vaDisplay, image.image_id);
+        vaDestroySurfaces(vaDisplay, &surface, 1);
+        throw std::runtime_error("vaMapBuffer failed: " + std::to_string(va_status));
+    }
+    PrimeFrameLayout layout;
+    linearPrimeFrameLayout(layout, fourcc, width, height);
+    uint8_t* objects[4] = {data};
+    writePattern(layout, objects, image.pitches, image.offsets);
+    vaUnmapBuffer(vaDisplay, image.buf);
+    vaDestroyImage(vaDisplay, image.image_id);
+    return surface;
+}
+
+int runGpu(uint32_t fourcc) {
+    std::cout << "Running initializeDriver" << std::endl;
+    ze_driver_handle_t driverHandle = initializeDriver();
+    std::cout << "Running initializeDevice" << std::endl;
+    ze_device_handle_t deviceHandle = initializeDevice(driverHandle);
+    std::cout << "Running createContext" << std::endl;
+    ze_context_handle_t contextHandle = createContext(driverHandle);
+    ZeOpProfiler profiler(contextHandle, deviceHandle);
+
+    std::cout << "Running drmFd" << std::endl;
+    int drmFd = open("/dev/dri/renderD128", O_RDWR); // Opening the first render node. Change index as per your system.
+    if (drmFd < 0) {
+        throw std::runtime_error("Failed to open DRM");
+    }
+    std::cout << "Running vaGetDisplayDRM" << std::endl;
+    VADisplay vaDisplay = vaGetDisplayDRM(drmFd);
+    int major, minor;
+    if (vaDisplay == nullptr || vaInitialize(vaDisplay, &major, &minor) != VA_STATUS_SUCCESS) {
+        close(drmFd);
+        throw std::runtime_error("Failed to initialize VA Display");
+    }
+
+    std::cout << "Running createPatternSurface" << std::endl;
+    VASurfaceID surface = createPatternSurface(vaDisplay, fourcc, 1920, 1080);
+
+    std::cout << "Running vaapi_to_dlpack" << std::endl;
+    std::vector<DLManagedTensor*> tensors = vaapi_to_dlpack(surface, vaDisplay, contextHandle, deviceHandle);
+
+    int failures = 0;
+    for (uint32_t p = 0; p < tensors.size(); ++p) {
+        const DLTensor& t = tensors[p]->dl_tensor;
+        printTensor(t, p);
+        std::vector<uint8_t> row = tensor_row_to_host(t, contextHandle, deviceHandle, profiler);
+        for (uint32_t x = 0; x < row.size(); ++x) {
+            if (row[x] != patternByte(p, 0, x)) {
+                std::cerr << "Plane " << p << " differs at byte " << x << std::endl;
+                failures++;
+                break;
+            }
+        }
+    }
+
+    // Deleting the last tensor frees the imports, closes the fds and destroys the surface
+    for (DLManagedTensor* tensor : tensors) {
+        tensor->deleter(tensor);
+    }
+    VASurfaceStatus status;
+    if (vaQuerySurfaceStatus(vaDisplay, surface, &status) == VA_STATUS_SUCCESS) {
+        std::cerr << "The surface outlived its tensors!" << std::endl;
+        failures++;
+    }
+    if (failures == 0) {
+        std::cout << "USM tensors match the surface and released it" << std::endl;
+    }
+
+    vaTerminate(vaDisplay);
+    close(drmFd);
+    profiler.release();
+    printOpRecords();
+    zeContextDestroy(contextHandle);
+    return failures;
+}
+
+// Usage: va_main [gpu|cpu] [nv12|p010|rgba]
+int main(int argc, char* argv[]) {
+    const bool cpu = argc > 1 && std::string(argv[1]) == "cpu";
+    const std::string format = argc > 2 ? argv[2] : "nv12";
+    uint32_t fourcc = VA_FOURCC_NV12;
+    if (format == "p010") {
+        fourcc = VA_FOURCC_P010;
+    } else if (format == "rgba") {
+        fourcc = VA_FOURCC_RGBA;
+    } else if (format != "nv12") {
+        std::cerr << "Usage: " << argv[0] << " [gpu|cpu] [nv12|p010|rgba]" << std::endl;
+        return -1;
+    }
+
+    int failures = cpu ? runCpu(fourcc) : runGpu(fourcc);
+    traceFlushFromEnv();
+    return failures == 0 ? 0 : -1;
+}
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Load the scheduler tracks for each device of the group
+struct DeviceLoad {
+    uint32_t activeStreams = 0; // Streams currently pinned to the device
+    uint32_t queueDepth = 0;    // Frames submitted to the device and not completed yet
+};
+
+// Assigns decode/interop streams to the devices of a group by current load.
+//
+// The scheduler only deals with device indices, it never touches VA or Level Zero,
+// so it can be driven with any number of mock devices. Once a stream is assigned it
+// stays on its device until released: the surfaces and USM imports of a stream are
+// only valid on the device that created them.
+class StreamScheduler {
+public:
+    // streamWeight is how many queued frames one active stream is worth when
+    // comparing devices. A new stream usually brings a steady frame rate with it,
+    // so it weighs more than a transient backlog.
+    explicit StreamScheduler(size_t deviceCount, uint32_t streamWeight = 4)
+        : loads_(deviceCount), streamWeight_(streamWeight) {
+        if (deviceCount == 0) {
+            throw std::runtime_error("StreamScheduler needs at least one device");
+        }
+    }
+
+    size_t deviceCount() const { return loads_.size(); }
+
+    // Pick the least loaded device for a stream. Calling it again for a stream
+    // that is already assigned returns the same device.
+    size_t assign(uint64_t streamId) {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        auto it = assignments_.find(streamId);
+        if (it != assignments_.end()) {
+            return it->second;
+        }
+
+        // Ties go to the lowest index so the placement is deterministic
+        size_t best = 0;
+        uint64_t bestScore = std::numeric_limits<uint64_t>::max();
+        for (size_t i = 0; i < loads_.size(); ++i) {
+            uint64_t s = score(loads_[i]);
+            if (s < bestScore) {
+                best = i;
+                bestScore = s;
+            }
+        }
+
+        loads_[best].activeStreams++;
+        assignments_.emplace(streamId, best);
+        return best;
+    }
+
+    // Drop a stream from its device. Frames still queued are discarded from the load.
+    void release(uint64_t streamId) {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        auto it = assignments_.find(streamId);
+        if (it == assignments_.end()) {
+            return;
+        }
+
+        DeviceLoad& load = loads_[it->second];
+        load.activeStreams--;
+        auto queued = pending_.find(streamId);
+        if (queued != pending_.end()) {
+            load.queueDepth -= queued->second;
+            pending_.erase(queued);
+        }
+        assignments_.erase(it);
+    }
+
+    // Device a stream was assigned to
+    size_t deviceOf(uint64_t streamId) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        auto it = assignments_.find(streamId);
+        if (it == assignments_.end()) {
+            throw std::runtime_error("Stream " + std::to_string(streamId) + " is not assigned to a device");
+        }
+        return it->second;
+    }
+
+    // Account for frames a stream submitted to its device
+    void submitted(uint64_t streamId, uint32_t frames = 1) {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        auto it = assignments_.find(streamId);
+        if (it == assignments_.end()) {
+            throw std::runtime_error("Stream " + std::to_string(streamId) + " is not assigned to a device");
+        }
+        loads_[it->second].queueDepth += frames;
+        pending_[streamId] += frames;
+    }
+
+    // Account for frames of a stream that finished on its device
+    void completed(uint64_t streamId, uint32_t frames = 1) {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        auto it = assignments_.find(streamId);
+        auto queued = pending_.find(streamId);
+        if (it == assignments_.end() || queued == pending_.end() || queued->second < frames) {
+            throw std::runtime_error("Stream " + std::to_string(streamId) + " completed more frames than it submitted");
+        }
+        loads_[it->second].queueDepth -= frames;
+        queued->second -= frames;
+    }
+
+    DeviceLoad load(size_t device) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return loads_.at(device);
+    }
+
+private:
+    uint64_t score(const DeviceLoad& load) const {
+        return static_cast<uint64_t>(load.activeStreams) * streamWeight_ + load.queueDepth;
+    }
+
+    mutable std::mutex mutex_;
+    std::vector<DeviceLoad> loads_;
+    std::unordered_map<uint64_t, size_t> assignments_;
+    std::unordered_map<uint64_t, uint32_t> pending_;
+    uint32_t streamWeight_;
+};
@@ -0,0 +1,431 @@
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <level_zero/ze_api.h>
+
+extern "C" {
+#include <va/va.h>
+#include <va/va_drm.h>
+#include <va/va_drmcommon.h>
+}
+
+#include "device_group.hpp"
+#include "numa_placement.hpp"
+#include "scope_exit.hpp"
+#include "selftest.hpp"
+#include "trace.hpp"
+#include "ze_op_profiler.hpp"
+
+// One GPU of the group: its render node, VA display and Level Zero context
+typedef struct {
+    std::string renderNode;
+    ze_pci_address_ext_t pciAddress;
+    int drmFd;
+    VADisplay vaDisplay;
+    ze_driver_handle_t zeDriver;
+    ze_device_handle_t zeDevice;
+    ze_context_handle_t zeContext;
+    NumaPlacement placement;
+} GpuDevice;
+
+// Find the render node belonging to a PCI address by walking /sys/class/drm
+std::string findRenderNode(const ze_pci_address_ext_t& address) {
+    char bdf[32];
+    snprintf(bdf, sizeof(bdf), "%04x:%02x:%02x.%x", address.domain, address.bus, address.device, address.function);
+
+    for (const auto& entry : std::filesystem::directory_iterator("/sys/class/drm")) {
+        std::string name = entry.path().filename().string();
+        if (name.rfind("renderD", 0) != 0) {
+            continue;
+        }
+        std::error_code ec;
+        auto device = std::filesystem::canonical(entry.path() / "device", ec);
+        if (!ec && device.filename().string() == bdf) {
+            return "/dev/dri/" + name;
+        }
+    }
+    throw std::runtime_error(std::string("No render node found for GPU at ") + bdf);
+}
+
+// Open a VA display and a Level Zero context on every GPU of every driver
+std::vector<GpuDevice> openDeviceGroup() {
+    ze_result_t result = zeInit(ZE_INIT_FLAG_GPU_ONLY);
+    if (result != ZE_RESULT_SUCCESS) {
+        throw std::runtime_error("Failed to initialize Level Zero");
+    }
+
+    uint32_t driverCount = 0;
+    result = zeDriverGet(&driverCount, nullptr);
+    if (result != ZE_RESULT_SUCCESS || driverCount == 0) {
+        throw std::runtime_error("Failed to find any drivers");
+    }
+    std::vector<ze_driver_handle_t> drivers(driverCount);
+    result = zeDriverGet(&driverCount, drivers.data());
+    if (result != ZE_RESULT_SUCCESS) {
+        throw std::runtime_error("Error retrieving driver handles");
+    }
+
+    std::vector<GpuDevice> group;
+    for (ze_driver_handle_t driver : drivers) {
+        uint32_t deviceCount = 0;
+        result = zeDeviceGet(driver, &deviceCount, nullptr);
+        if (result != ZE_RESULT_SUCCESS) {
+            throw std::runtime_error("Error querying device count");
+        }
+        std::vector<ze_device_handle_t> devices(deviceCount);
+        result = zeDeviceGet(driver, &deviceCount, devices.data());
+        if (result != ZE_RESULT_SUCCESS) {
+            throw std::runtime_error("Error retrieving device handles");
+        }
+
+        for (ze_device_handle_t device : devices) {
+            GpuDevice gpu = {};
+            gpu.zeDriver = driver;
+            gpu.zeDevice = device;
+
+            ze_pci_ext_properties_t pciProperties = {};
+            pciProperties.stype = ZE_STRUCTURE_TYPE_PCI_EXT_PROPERTIES;
+            result = zeDevicePciGetPropertiesExt(device, &pciProperties);
+            if (result != ZE_RESULT_SUCCESS) {
+                throw std::runtime_error("Failed to query the PCI address of a device");
+            }
+            gpu.pciAddress = pciProperties.address;
+            gpu.renderNode = findRenderNode(gpu.pciAddress);
+            gpu.placement = choosePlacement(pciBdfString(gpu.pciAddress.domain, gpu.pciAddress.bus,
+                                                         gpu.pciAddress.device, gpu.pciAddress.function));
+
+            // A context per GPU keeps every import of a stream local to its device
+            ze_context_desc_t contextDesc = {};
+            contextDesc.stype = ZE_STRUCTURE_TYPE_CONTEXT_DESC;
+            result = zeContextCreate(driver, &contextDesc, &gpu.zeContext);
+            if (result != ZE_RESULT_SUCCESS) {
+                throw std::runtime_error("Failed to create Level Zero context");
+            }
+
+            gpu.drmFd = open(gpu.renderNode.c_str(), O_RDWR);
+            if (gpu.drmFd < 0) {
+                throw std::runtime_error("Failed to open " + gpu.renderNode);
+            }
+            gpu.vaDisplay = vaGetDisplayDRM(gpu.drmFd);
+            if (gpu.vaDisplay == nullptr) {
+                throw std::runtime_error("Failed to get VA display for " + gpu.renderNode);
+            }
+            int major, minor;
+            if (vaInitialize(gpu.vaDisplay, &major, &minor) != VA_STATUS_SUCCESS) {
+                throw std::runtime_error("Failed to initialize VA display for " + gpu.renderNode);
+            }
+
+            printf("GPU %zu: %04x:%02x:%02x.%x -> %s\n", group.size(), gpu.pciAddress.domain, gpu.pciAddress.bus,
+                   gpu.pciAddress.device, gpu.pciAddress.function, gpu.renderNode.c_str());
+            printPlacement("GPU " + std::to_string(group.size()), gpu.placement);
+            group.push_back(gpu);
+        }
+    }
+    return group;
+}
+
+void closeDeviceGroup(std::vector<GpuDevice>& group) {
+    for (GpuDevice& gpu : group) {
+        vaTerminate(gpu.vaDisplay);
+        close(gpu.drmFd);
+        zeContextDestroy(gpu.zeContext);
+    }
+    group.clear();
+}
+
+// VASurface -> dma-buf -> USM on the device that owns the surface
+void* vaapi_to_usm(VASurfaceID va_surface, const GpuDevice& gpu, size_t* size) {
+    VADRMPRIMESurfaceDescriptor prime_desc;
+    TRACE_SCOPE("vaapi_to_usm");
+    VAStatus va_status = vaExportSurfaceHandle(gpu.vaDisplay, va_surface, VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME_2,
+                                               VA_EXPORT_SURFACE_READ_WRITE | VA_EXPORT_SURFACE_COMPOSED_LAYERS,
+                                               &prime_desc);
+    if (va_status != VA_STATUS_SUCCESS) {
+        throw std::runtime_error("Failed to export VASurface: " + std::to_string(va_status));
+    }
+    for (uint32_t i = 1; i < prime_desc.num_objects; ++i) {
+        close(prime_desc.objects[i].fd);
+    }
+
+    ze_external_memory_import_fd_t import_fd = {
+        ZE_STRUCTURE_TYPE_EXTERNAL_MEMORY_IMPORT_FD,
+        nullptr,
+        ZE_EXTERNAL_MEMORY_TYPE_FLAG_DMA_BUF, prime_desc.objects[0].fd
+    };
+    ze_device_mem_alloc_desc_t alloc_desc = {};
+    alloc_desc.stype = ZE_STRUCTURE_TYPE_DEVICE_MEM_ALLOC_DESC;
+    alloc_desc.pNext = &import_fd;
+
+    void* usm_ptr = nullptr;
+    ze_result_t ze_res = zeMemAllocDevice(gpu.zeContext, &alloc_desc, prime_desc.objects[0].size, 1, gpu.zeDevice, &usm_ptr);
+    close(prime_desc.objects[0].fd);
+    if (ze_res != ZE_RESULT_SUCCESS) {
+        throw std::runtime_error("Failed to convert DMA to USM pointer: " + std::to_string(ze_res));
+    }
+
+    *size = prime_desc.objects[0].size;
+    return usm_ptr;
+}
+
+// One stream: a small ring of NV12 surfaces on its device, touched by the GPU every frame.
+// Everything it creates, and its scheduler slot, is released however it returns.
+void runStream(const std::vector<GpuDevice>& group, StreamScheduler& scheduler, uint64_t streamId,
+               int frames, std::atomic<uint64_t>* deviceFrames) {
+    const size_t device = scheduler.assign(streamId);
+    ScopeExit releaseSlot([&]() { scheduler.release(streamId); });
+    const GpuDevice& gpu = group[device];
+    constexpr int ringSize = 4;
+
+    // Keep the thread that drives the GPU on the GPU's socket
+    pinCurrentThread(gpu.placement);
+
+    VASurfaceAttrib attrib;
+    attrib.type = VASurfaceAttribPixelFormat;
+    attrib.flags = VA_SURFACE_ATTRIB_SETTABLE;
+    attrib.value.type = VAGenericValueTypeInteger;
+    attrib.value.value.i = VA_FOURCC_NV12;
+
+    VASurfaceID surfaces[ringSize];
+    VAStatus va_status;
+    {
+        TRACE_SCOPE("vaCreateSurfaces");
+        va_status = vaCreateSurfaces(gpu.vaDisplay, VA_RT_FORMAT_YUV420, 1920, 1080, surfaces, ringSize, &attrib, 1);
+    }
+    if (va_status != VA_STATUS_SUCCESS) {
+        throw std::runtime_error("Failed to create surfaces for stream " + std::to_string(streamId));
+    }
+    ScopeExit destroySurfaces([&]() { vaDestroySurfaces(gpu.vaDisplay, surfaces, ringSize); });
+
+    void* usm[ringSize] = {};
+    size_t usmSize[ringSize];
+    ScopeExit freeUsm([&]() {
+        for (void* memory : usm) {
+            if (memory) {
+                zeMemFree(gpu.zeContext, memory);
+            }
+        }
+    });
+    for (int i = 0; i < ringSize; ++i) {
+        usm[i] = vaapi_to_usm(surfaces[i], gpu, &usmSize[i]);
+    }
+
+    // Asynchronous, so up to ringSize frames are really queued on the device at once
+    ze_command_queue_desc_t queueDesc = {};
+    queueDesc.stype = ZE_STRUCTURE_TYPE_COMMAND_QUEUE_DESC;
+    queueDesc.mode = ZE_COMMAND_QUEUE_MODE_ASYNCHRONOUS;
+    ze_command_list_handle_t cmdList;
+    if (zeCommandListCreateImmediate(gpu.zeContext, gpu.zeDevice, &queueDesc, &cmdList) != ZE_RESULT_SUCCESS) {
+        throw std::runtime_error("Failed to create immediate command list");
+    }
+    ScopeExit destroyList([&]() {
+        // A stream that threw may leave fills queued on the ring it is about to free
+        zeCommandListHostSynchronize(cmdList, UINT64_MAX);
+        zeCommandListDestroy(cmdList);
+    });
+    ZeOpProfiler profiler(gpu.zeContext, gpu.zeDevice);
+
+    // One completion event per ring slot: a slot is reused once its previous frame is done
+    ze_event_pool_desc_t poolDesc = {};
+    poolDesc.stype = ZE_STRUCTURE_TYPE_EVENT_POOL_DESC;
+    poolDesc.flags = ZE_EVENT_POOL_FLAG_HOST_VISIBLE;
+    poolDesc.count = ringSize;
+    ze_device_handle_t zeDevice = gpu.zeDevice;
+    ze_event_pool_handle_t eventPool;
+    if (zeEventPoolCreate(gpu.zeContext, &poolDesc, 1, &zeDevice, &eventPool) != ZE_RESULT_SUCCESS) {
+        throw std::runtime_error("Failed to create event pool");
+    }
+    ze_event_handle_t done[ringSize] = {};
+    ScopeExit destroyEvents([&]() {
+        for (ze_event_handle_t event : done) {
+            if (event) {
+                zeEventDestroy(event);
+            }
+        }
+        zeEventPoolDestroy(eventPool);
+    });
+    for (int i = 0; i < ringSize; ++i) {
+        ze_event_desc_t eventDesc = {};
+        eventDesc.stype = ZE_STRUCTURE_TYPE_EVENT_DESC;
+        eventDesc.index = i;
+        eventDesc.signal = ZE_EVENT_SCOPE_FLAG_HOST;
+        eventDesc.wait = ZE_EVENT_SCOPE_FLAG_HOST;
+        if (zeEventCreate(eventPool, &eventDesc, &done[i]) != ZE_RESULT_SUCCESS) {
+            done[i] = nullptr;
+            throw std::runtime_error("Failed to create completion event");
+        }
+    }
+
+    // Wait for the frame in a slot and take it off the device's queue depth
+    auto retire = [&](int slot) {
+        TRACE_SCOPE("zeEventHostSynchronize");
+        zeEventHostSynchronize(done[slot], UINT64_MAX);
+        zeEventHostReset(done[slot]);
+        scheduler.completed(streamId);
+        deviceFrames[device]++;
+    };
+
+    for (int frame = 0; frame < frames; ++frame) {
+        const int slot = frame % ringSize;
+        if (frame >= ringSize) {
+            retire(slot);
+        }
+        scheduler.submitted(streamId);
+        uint8_t value = static_cast<uint8_t>(frame);
+        TRACE_SCOPE("zeCommandListAppendMemoryFill");
+        zeCommandListAppendMemoryFill(cmdList, usm[slot], &value, sizeof(value), usmSize[slot],
+                                      profiler.event("stream fill"), 0, nullptr);
+        // The fill's own event belongs to the profiler; a barrier signals the slot
+        zeCommandListAppendBarrier(cmdList, done[slot], 0, nullptr);
+    }
+    for (int frame = std::max(0, frames - ringSize); frame < frames; ++frame) {
+        retire(frame % ringSize);
+    }
+
+}
+
+// A simulated device for the selftest: serves one frame at a time
+typedef struct {
+    std::mutex busy;
+    std::atomic<uint64_t> frames{0};
+} MockDevice;
+
+// Drive StreamScheduler with simulated devices, no GPU or VA needed. Streams are admitted
+// one by one, then each runs its frames on its mock device, so queue depth builds up
+// wherever streams share a device. Returns false unless the streams are spread evenly,
+// a backlog steers new streams away and every load drains back to zero.
+bool runMock(int streams, int frames, size_t deviceCount) {
+    StreamScheduler scheduler(deviceCount);
+    std::vector<MockDevice> devices(deviceCount);
+    std::vector<int> streamsOn(deviceCount, 0);
+    for (int s = 0; s < streams; ++s) {
+        streamsOn[scheduler.assign(s)]++;
+    }
+    const auto [fewest, most] = std::minmax_element(streamsOn.begin(), streamsOn.end());
+    bool ok = *most - *fewest <= 1;
+
+    std::vector<std::thread> workers;
+    for (int s = 0; s < streams; ++s) {
+        workers.emplace_back([&, s]() {
+            MockDevice& device = devices[scheduler.deviceOf(s)];
+            for (int frame = 0; frame < frames; ++frame) {
+                scheduler.submitted(s);
+                {
+                    std::lock_guard<std::mutex> lock(device.busy);
+                    std::this_thread::sleep_for(std::chrono::microseconds(50));
+                }
+                scheduler.completed(s);
+                device.frames++;
+            }
+            scheduler.release(s);
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    uint64_t total = 0;
+    for (size_t i = 0; i < deviceCount; ++i) {
+        const DeviceLoad load = scheduler.load(i);
+        printf("Mock GPU %zu: %d streams, %lu frames, load after release %u/%u\n", i, streamsOn[i],
+               (unsigned long)devices[i].frames.load(), load.activeStreams, load.queueDepth);
+        ok = ok && load.activeStreams == 0 && load.queueDepth == 0;
+        total += devices[i].frames;
+    }
+    ok = ok && total == uint64_t(streams) * frames;
+
+    // Two devices with a stream each: the one with a backlog loses the next stream
+    StreamScheduler backlog(2);
+    backlog.assign(0);
+    backlog.assign(1);
+    backlog.submitted(0, 8);
+    ok = ok && backlog.assign(2) == 1;
+
+    printf("Scheduler checks %s\n", ok ? "passed" : "FAILED");
+    return ok;
+}
+
+// Usage: va_main [streams] [frames]
+//        va_main selftest [streams] [frames] [devices]   scheduler only, on simulated devices
+int main(int argc, char* argv[]) {
+    if (isSelfTest(argc, argv)) {
+        int streams = argc > 2 ? std::stoi(argv[2]) : 8;
+        int frames = argc > 3 ? std::stoi(argv[3]) : 300;
+        int devices = argc > 4 ? std::stoi(argv[4]) : 3;
+        if (streams < 0 || frames < 0 || devices < 1) {
+            std::cerr << "Usage: " << argv[0] << " selftest [streams] [frames] [devices >= 1]" << std::endl;
+            return -1;
+        }
+        return runSelfTest([&]() { return runMock(streams, frames, devices) ? 0 : -1; });
+    }
+    int streams = argc > 1 ? std::stoi(argv[1]) : 8;
+    int frames = argc > 2 ? std::stoi(argv[2]) : 300;
+
+    std::cout << "Running openDeviceGroup" << std::endl;
+    std::vector<GpuDevice> group = openDeviceGroup();
+    if (group.empty()) {
+        std::cerr << "No GPU found!" << std::endl;
+        return -1;
+    }
+
+    StreamScheduler scheduler(group.size());
+    std::vector<std::atomic<uint64_t>> deviceFrames(group.size());
+
+    std::cout << "Running " << streams << " streams of " << frames << " frames on " << group.size() << " GPU(s)" << std::endl;
+    auto start = std::chrono::steady_clock::now();
+    // A failed stream must not take the process down from its thread: keep the error for after the join
+    std::vector<std::exception_ptr> errors(streams);
+    std::vector<std::thread> workers;
+    for (int s = 0; s < streams; ++s) {
+        workers.emplace_back([&, s]() {
+            try {
+                runStream(group, scheduler, s, frames, deviceFrames.data());
+            } catch (...) {
+                errors[s] = std::current_exception();
+            }
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    int failed = 0;
+    for (int s = 0; s < streams; ++s) {
+        if (!errors[s]) {
+            continue;
+        }
+        try {
+            std::rethrow_exception(errors[s]);
+        } catch (const std::exception& e) {
+            std::cerr << "Stream " << s << " failed: " << e.what() << std::endl;
+        } catch (...) {
+            std::cerr << "Stream " << s << " failed" << std::endl;
+        }
+        failed++;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    uint64_t total = 0;
+    for (size_t i = 0; i < group.size(); ++i) {
+        total += deviceFrames[i];
+        printf("GPU %zu (%s): %lu frames, %.1f fps\n", i, group[i].renderNode.c_str(),
+               (unsigned long)deviceFrames[i].load(), deviceFrames[i] / seconds);
+    }
+    printf("Aggregate: %lu frames, %.1f fps\n", (unsigned long)total, total / seconds);
+    printOpRecords();
+
+    std::cout << "Running closeDeviceGroup" << std::endl;
+    closeDeviceGroup(group);
+    traceFlushFromEnv();
+    return failed == 0 ? 0 : -1;
+}
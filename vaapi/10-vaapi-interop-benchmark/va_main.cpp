@@ -0,0 +1,603 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <level_zero/ze_api.h>
+
+extern "C" {
+#include <va/va.h>
+#include <va/va_drm.h>
+#include <va/va_drmcommon.h>
+}
+
+#include "prime_frame.hpp"
+#include "trace.hpp"
+#ifdef HAVE_OPENCL
+#include "cl_va_sharing.hpp"
+#endif
+
+// Frames run before timing starts: first-touch allocations, driver caches
+static const int kWarmupFrames = 5;
+
+// Thrown when a path cannot run on this machine; the path is reported as skipped
+class SkipPath : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+typedef struct {
+    int drmFd;
+    VADisplay vaDisplay;              // nullptr without a VA driver
+    std::string vaError;
+    ze_context_handle_t zeContext;    // nullptr without a Level Zero GPU
+    ze_device_handle_t zeDevice;
+    std::string zeError;
+#ifdef HAVE_OPENCL
+    ClVaSharing clSharing;
+    cl_context clContext;             // nullptr without cl_intel_va_api_media_sharing
+    cl_command_queue clQueue;
+    std::string clError;
+#endif
+} BenchEnv;
+
+typedef struct {
+    uint32_t fourcc;
+    const char* name;
+} BenchFormat;
+
+typedef struct {
+    uint32_t width;
+    uint32_t height;
+    const char* name;
+} BenchSize;
+
+typedef struct {
+    std::vector<double> frameUs;   // Latency of every timed frame
+    double wallSeconds;
+    double cpuSeconds;             // Process CPU time, driver threads included
+    size_t frameBytes;             // Pixel bytes moved per frame; 0 for paths that only map or import
+} BenchSamples;
+
+typedef BenchSamples (*BenchFn)(BenchEnv& env, uint32_t fourcc, uint32_t width, uint32_t height, int frames);
+
+typedef struct {
+    const char* name;
+    const char* zeroCopy;   // "yes" when the consumer works on the surface memory itself
+    BenchFn run;
+} BenchPath;
+
+double processCpuSeconds() {
+    timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+template <typename Frame>
+BenchSamples timeFrames(int frames, size_t frameBytes, Frame&& frame) {
+    for (int i = 0; i < kWarmupFrames; ++i) {
+        frame();
+    }
+
+    BenchSamples samples = {};
+    samples.frameBytes = frameBytes;
+    samples.frameUs.reserve(frames);
+    const double cpuStart = processCpuSeconds();
+    const auto wallStart = std::chrono::steady_clock::now();
+    for (int i = 0; i < frames; ++i) {
+        const auto start = std::chrono::steady_clock::now();
+        frame();
+        samples.frameUs.push_back(
+            std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+    }
+    samples.wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+    samples.cpuSeconds = processCpuSeconds() - cpuStart;
+    return samples;
+}
+
+// Nearest-rank percentile of sorted samples
+double percentile(const std::vector<double>& sorted, double p) {
+    size_t rank = static_cast<size_t>(p / 100.0 * sorted.size() + 0.5);
+    return sorted[std::min(sorted.size() - 1, rank > 0 ? rank - 1 : 0)];
+}
+
+// Tightly packed host frame: what a CPU consumer wants to end up with
+PrimeFrameLayout hostLayout(uint32_t fourcc, uint32_t width, uint32_t height) {
+    PrimeFrameLayout layout;
+    linearPrimeFrameLayout(layout, fourcc, width, height, 1);
+    return layout;
+}
+
+// Copy every plane between a mapped VAImage and a packed host frame
+void copyImagePlanes(uint8_t* image, const VAImage& va_image, uint8_t* host, const PrimeFrameLayout& layout,
+                     bool toHost) {
+    for (uint32_t p = 0; p < layout.numPlanes; ++p) {
+        const PrimePlane& plane = layout.planes[p];
+        for (uint32_t y = 0; y < plane.height; ++y) {
+            uint8_t* imageRow = image + va_image.offsets[p] + size_t(y) * va_image.pitches[p];
+            uint8_t* hostRow = host + plane.offset + size_t(y) * plane.pitch;
+            if (toHost) {
+                memcpy(hostRow, imageRow, plane.pitch);
+            } else {
+                memcpy(imageRow, hostRow, plane.pitch);
+            }
+        }
+    }
+}
+
+// A VA call of a timed frame failed. Unlike SkipPath, this stops the whole run:
+// the path is supported, so its timings would measure an error path.
+void checkVa(VAStatus va_status, const char* call) {
+    if (va_status != VA_STATUS_SUCCESS) {
+        throw std::runtime_error(std::string(call) + " failed: " + vaErrorStr(va_status));
+    }
+}
+
+// For paths without a separate probe: failing on the first (warm-up) frame means the path is
+// unsupported here and is skipped, failing after that is an error like checkVa
+[[noreturn]] void failFrame(bool firstFrame, const std::string& what) {
+    if (firstFrame) {
+        throw SkipPath(what);
+    }
+    throw std::runtime_error(what);
+}
+
+void requireVa(const BenchEnv& env) {
+    if (!env.vaDisplay) {
+        throw SkipPath(env.vaError);
+    }
+}
+
+void requireLevelZero(const BenchEnv& env) {
+    requireVa(env);
+    if (!env.zeContext) {
+        throw SkipPath(env.zeError);
+    }
+}
+
+VASurfaceID createSurface(const BenchEnv& env, uint32_t fourcc, uint32_t width, uint32_t height) {
+    VASurfaceAttrib attrib = {};
+    attrib.type = VASurfaceAttribPixelFormat;
+    attrib.flags = VA_SURFACE_ATTRIB_SETTABLE;
+    attrib.value.type = VAGenericValueTypeInteger;
+    attrib.value.value.i = fourcc;
+
+    VASurfaceID surface;
+    VAStatus va_status =
+        vaCreateSurfaces(env.vaDisplay, primeFormatInfo(fourcc).rtFormat, width, height, &surface, 1, &attrib, 1);
+    if (va_status != VA_STATUS_SUCCESS) {
+        throw SkipPath("vaCreateSurfaces does not support this format/size: " + std::to_string(va_status));
+    }
+    return surface;
+}
+
+// Destroys the benchmark surface on every exit path
+class ScopedSurface {
+public:
+    ScopedSurface(const BenchEnv& env, VASurfaceID surface) : va_dpy_(env.vaDisplay), surface_(surface) {}
+    ~ScopedSurface() { vaDestroySurfaces(va_dpy_, &surface_, 1); }
+    ScopedSurface(const ScopedSurface&) = delete;
+    ScopedSurface& operator=(const ScopedSurface&) = delete;
+
+private:
+    VADisplay va_dpy_;
+    VASurfaceID surface_;
+};
+
+// Baseline without any hardware: one memcpy of the packed frame
+BenchSamples benchHostMemcpy(BenchEnv&, uint32_t fourcc, uint32_t width, uint32_t height, int frames) {
+    const size_t bytes = hostLayout(fourcc, width, height).objectSize[0];
+    std::vector<uint8_t> src(bytes, 0x80);
+    std::vector<uint8_t> dst(bytes);
+    return timeFrames(frames, bytes, [&]() { memcpy(dst.data(), src.data(), bytes); });
+}
+
+// vaDeriveImage + vaMapBuffer: the CPU reads the surface memory directly
+BenchSamples benchDeriveMap(BenchEnv& env, uint32_t fourcc, uint32_t width, uint32_t height, int frames) {
+    requireVa(env);
+    VASurfaceID surface = createSurface(env, fourcc, width, height);
+    ScopedSurface guard(env, surface);
+    const PrimeFrameLayout layout = hostLayout(fourcc, width, height);
+    std::vector<uint8_t> host(layout.objectSize[0]);
+
+    VAImage probe;
+    if (vaDeriveImage(env.vaDisplay, surface, &probe) != VA_STATUS_SUCCESS) {
+        throw SkipPath("vaDeriveImage is not supported for this surface");
+    }
+    vaDestroyImage(env.vaDisplay, probe.image_id);
+
+    return timeFrames(frames, host.size(), [&]() {
+        VAImage va_image;
+        checkVa(vaDeriveImage(env.vaDisplay, surface, &va_image), "vaDeriveImage");
+        uint8_t* data = nullptr;
+        VAStatus va_status = vaMapBuffer(env.vaDisplay, va_image.buf, (void**)&data);
+        if (va_status == VA_STATUS_SUCCESS) {
+            copyImagePlanes(data, va_image, host.data(), layout, true);
+            va_status = vaUnmapBuffer(env.vaDisplay, va_image.buf);
+        }
+        vaDestroyImage(env.vaDisplay, va_image.image_id);
+        checkVa(va_status, "vaMapBuffer/vaUnmapBuffer of the derived image");
+    });
+}
+
+VAImage createImage(const BenchEnv& env, uint32_t fourcc, uint32_t width, uint32_t height) {
+    VAImageFormat format = {};
+    format.fourcc = fourcc;
+    format.byte_order = VA_LSB_FIRST;
+    format.bits_per_pixel = fourcc == VA_FOURCC_NV12 ? 12 : 32;
+
+    VAImage va_image;
+    if (vaCreateImage(env.vaDisplay, &format, width, height, &va_image) != VA_STATUS_SUCCESS) {
+        throw SkipPath("vaCreateImage does not support this format");
+    }
+    return va_image;
+}
+
+// Destroys an image made by createImage on every exit path
+class ScopedImage {
+public:
+    ScopedImage(const BenchEnv& env, const VAImage& va_image) : va_dpy_(env.vaDisplay), image_(va_image.image_id) {}
+    ~ScopedImage() { vaDestroyImage(va_dpy_, image_); }
+    ScopedImage(const ScopedImage&) = delete;
+    ScopedImage& operator=(const ScopedImage&) = delete;
+
+private:
+    VADisplay va_dpy_;
+    VAImageID image_;
+};
+
+// vaCreateImage + vaGetImage: the driver copies the surface into an image, the CPU reads the image
+BenchSamples benchGetImage(BenchEnv& env, uint32_t fourcc, uint32_t width, uint32_t height, int frames) {
+    requireVa(env);
+    VASurfaceID surface = createSurface(env, fourcc, width, height);
+    ScopedSurface guard(env, surface);
+    const PrimeFrameLayout layout = hostLayout(fourcc, width, height);
+    std::vector<uint8_t> host(layout.objectSize[0]);
+    VAImage va_image = createImage(env, fourcc, width, height);
+
+    ScopedImage imageGuard(env, va_image);
+
+    return timeFrames(frames, host.size(), [&]() {
+        checkVa(vaGetImage(env.vaDisplay, surface, 0, 0, width, height, va_image.image_id), "vaGetImage");
+        uint8_t* data = nullptr;
+        checkVa(vaMapBuffer(env.vaDisplay, va_image.buf, (void**)&data), "vaMapBuffer");
+        copyImagePlanes(data, va_image, host.data(), layout, true);
+        checkVa(vaUnmapBuffer(env.vaDisplay, va_image.buf), "vaUnmapBuffer");
+    });
+}
+
+// vaCreateImage + vaPutImage: the CPU writes an image, the driver copies it into the surface
+BenchSamples benchPutImage(BenchEnv& env, uint32_t fourcc, uint32_t width, uint32_t height, int frames) {
+    requireVa(env);
+    VASurfaceID surface = createSurface(env, fourcc, width, height);
+    ScopedSurface guard(env, surface);
+    const PrimeFrameLayout layout = hostLayout(fourcc, width, height);
+    std::vector<uint8_t> host(layout.objectSize[0], 0x80);
+    VAImage va_image = createImage(env, fourcc, width, height);
+
+    ScopedImage imageGuard(env, va_image);
+
+    return timeFrames(frames, host.size(), [&]() {
+        uint8_t* data = nullptr;
+        checkVa(vaMapBuffer(env.vaDisplay, va_image.buf, (void**)&data), "vaMapBuffer");
+        copyImagePlanes(data, va_image, host.data(), layout, false);
+        checkVa(vaUnmapBuffer(env.vaDisplay, va_image.buf), "vaUnmapBuffer");
+        checkVa(vaPutImage(env.vaDisplay, surface, va_image.image_id, 0, 0, width, height, 0, 0, width, height),
+                "vaPutImage");
+        checkVa(vaSyncSurface(env.vaDisplay, surface), "vaSyncSurface");
+    });
+}
+
+// VA -> dma-buf -> USM: export the surface and import every object as a device allocation.
+// Nothing reads the pixels, so only the latency is reported.
+BenchSamples benchVaDmaBufUsm(BenchEnv& env, uint32_t fourcc, uint32_t width, uint32_t height, int frames) {
+    requireLevelZero(env);
+    VASurfaceID surface = createSurface(env, fourcc, width, height);
+    ScopedSurface guard(env, surface);
+
+    bool firstFrame = true;
+    auto frame = [&]() {
+        VADRMPRIMESurfaceDescriptor prime_desc = {};
+        VAStatus va_status = vaExportSurfaceHandle(env.vaDisplay, surface, VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME_2,
+                                                   VA_EXPORT_SURFACE_READ_WRITE, &prime_desc);
+        if (va_status != VA_STATUS_SUCCESS) {
+            failFrame(firstFrame, "vaExportSurfaceHandle failed: " + std::to_string(va_status));
+        }
+
+        // Stop at the first object that does not import; every object must
+        ze_result_t ze_res = ZE_RESULT_SUCCESS;
+        uint32_t failed = 0;
+        for (uint32_t i = 0; i < prime_desc.num_objects && ze_res == ZE_RESULT_SUCCESS; ++i) {
+            ze_external_memory_import_fd_t import_fd = {ZE_STRUCTURE_TYPE_EXTERNAL_MEMORY_IMPORT_FD, nullptr,
+                                                        ZE_EXTERNAL_MEMORY_TYPE_FLAG_DMA_BUF,
+                                                        prime_desc.objects[i].fd};
+            ze_device_mem_alloc_desc_t alloc_desc = {};
+            alloc_desc.stype = ZE_STRUCTURE_TYPE_DEVICE_MEM_ALLOC_DESC;
+            alloc_desc.pNext = &import_fd;
+
+            void* usm_ptr = nullptr;
+            ze_res = zeMemAllocDevice(env.zeContext, &alloc_desc, prime_desc.objects[i].size, 1, env.zeDevice,
+                                      &usm_ptr);
+            if (ze_res == ZE_RESULT_SUCCESS) {
+                zeMemFree(env.zeContext, usm_ptr);
+            } else {
+                failed = i;
+            }
+        }
+        for (uint32_t i = 0; i < prime_desc.num_objects; ++i) {
+            close(prime_desc.objects[i].fd);
+        }
+        if (ze_res != ZE_RESULT_SUCCESS) {
+            failFrame(firstFrame, "Importing dma-buf object " + std::to_string(failed) + " as USM failed: " +
+                                      std::to_string(ze_res));
+        }
+        firstFrame = false;
+    };
+    return timeFrames(frames, 0, frame);
+}
+
+// USM -> dma-buf -> VA: export a device allocation and wrap it in a new surface.
+// Nothing touches the pixels, so only the latency is reported.
+BenchSamples benchUsmDmaBufVa(BenchEnv& env, uint32_t fourcc, uint32_t width, uint32_t height, int frames) {
+    requireLevelZero(env);
+    PrimeFrameLayout layout;
+    const size_t bytes = linearPrimeFrameLayout(layout, fourcc, width, height);
+
+    ze_device_mem_alloc_desc_t alloc_desc = {};
+    alloc_desc.stype = ZE_STRUCTURE_TYPE_DEVICE_MEM_ALLOC_DESC;
+    void* usm_ptr = nullptr;
+    if (zeMemAllocDevice(env.zeContext, &alloc_desc, bytes, 4096, env.zeDevice, &usm_ptr) != ZE_RESULT_SUCCESS) {
+        throw SkipPath("zeMemAllocDevice failed");
+    }
+
+    bool firstFrame = true;
+    auto frame = [&]() {
+        ze_external_memory_export_fd_t export_fd = {ZE_STRUCTURE_TYPE_EXTERNAL_MEMORY_EXPORT_FD, nullptr,
+                                                    ZE_EXTERNAL_MEMORY_TYPE_FLAG_DMA_BUF, 0};
+        ze_memory_allocation_properties_t alloc_props = {};
+        alloc_props.stype = ZE_STRUCTURE_TYPE_MEMORY_ALLOCATION_PROPERTIES;
+        alloc_props.pNext = &export_fd;
+        if (zeMemGetAllocProperties(env.zeContext, usm_ptr, &alloc_props, nullptr) != ZE_RESULT_SUCCESS) {
+            failFrame(firstFrame, "Exporting the USM allocation as a dma-buf failed");
+        }
+
+        VADRMPRIMESurfaceDescriptor prime_desc;
+        fillPrimeDescriptor(prime_desc, layout, export_fd.fd);
+        VASurfaceAttrib attribs[2] = {};
+        attribs[0].type = VASurfaceAttribMemoryType;
+        attribs[0].flags = VA_SURFACE_ATTRIB_SETTABLE;
+        attribs[0].value.type = VAGenericValueTypeInteger;
+        attribs[0].value.value.i = VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME_2;
+        attribs[1].type = VASurfaceAttribExternalBufferDescriptor;
+        attribs[1].flags = VA_SURFACE_ATTRIB_SETTABLE;
+        attribs[1].value.type = VAGenericValueTypePointer;
+        attribs[1].value.value.p = &prime_desc;
+
+        VASurfaceID surface;
+        VAStatus va_status = vaCreateSurfaces(env.vaDisplay, primeFormatInfo(fourcc).rtFormat, width, height,
+                                              &surface, 1, attribs, 2);
+        close(export_fd.fd);
+        if (va_status != VA_STATUS_SUCCESS) {
+            failFrame(firstFrame, "vaCreateSurfaces rejected the PRIME_2 buffer: " + std::to_string(va_status));
+        }
+        checkVa(vaDestroySurfaces(env.vaDisplay, &surface, 1), "vaDestroySurfaces");
+        firstFrame = false;
+    };
+
+    try {
+        BenchSamples samples = timeFrames(frames, 0, frame);
+        zeMemFree(env.zeContext, usm_ptr);
+        return samples;
+    } catch (...) {
+        zeMemFree(env.zeContext, usm_ptr);
+        throw;
+    }
+}
+
+#ifdef HAVE_OPENCL
+// VA -> OpenCL: wrap the surface planes as images and acquire/release them.
+// No kernel reads the images, so only the latency is reported.
+BenchSamples benchOpenCL(BenchEnv& env, uint32_t fourcc, uint32_t width, uint32_t height, int frames) {
+    requireVa(env);
+    if (!env.clContext) {
+        throw SkipPath(env.clError);
+    }
+    VASurfaceID surface = createSurface(env, fourcc, width, height);
+    ScopedSurface guard(env, surface);
+    const cl_uint numPlanes = primeFormatInfo(fourcc).numPlanes;
+
+    bool firstFrame = true;
+    auto frame = [&]() {
+        ClVaSurfaceBatch batch(env.clSharing, env.clContext, env.vaDisplay, false);
+        try {
+            batch.addSurface(surface, numPlanes);
+        } catch (const std::runtime_error& e) {
+            failFrame(firstFrame, e.what());
+        }
+        batch.acquire(env.clQueue);
+        batch.release(env.clQueue);
+        clFinish(env.clQueue);
+        firstFrame = false;
+    };
+    return timeFrames(frames, 0, frame);
+}
+#endif
+
+void initializeVa(BenchEnv& env) {
+    env.drmFd = open("/dev/dri/renderD128", O_RDWR); // Opening the first render node. Change index as per your system.
+    if (env.drmFd < 0) {
+        env.vaError = "no render node at /dev/dri/renderD128";
+        return;
+    }
+    VADisplay va_dpy = vaGetDisplayDRM(env.drmFd);
+    int major, minor;
+    if (!va_dpy || vaInitialize(va_dpy, &major, &minor) != VA_STATUS_SUCCESS) {
+        env.vaError = "vaInitialize failed";
+        return;
+    }
+    env.vaDisplay = va_dpy;
+}
+
+void initializeLevelZero(BenchEnv& env) {
+    uint32_t driverCount = 1;
+    ze_driver_handle_t driver;
+    if (zeInit(ZE_INIT_FLAG_GPU_ONLY) != ZE_RESULT_SUCCESS || zeDriverGet(&driverCount, &driver) != ZE_RESULT_SUCCESS ||
+        driverCount == 0) {
+        env.zeError = "no Level Zero GPU driver";
+        return;
+    }
+    uint32_t deviceCount = 1;
+    if (zeDeviceGet(driver, &deviceCount, &env.zeDevice) != ZE_RESULT_SUCCESS || deviceCount == 0) {
+        env.zeError = "no Level Zero GPU device";
+        return;
+    }
+    ze_context_desc_t contextDesc = {};
+    contextDesc.stype = ZE_STRUCTURE_TYPE_CONTEXT_DESC;
+    if (zeContextCreate(driver, &contextDesc, &env.zeContext) != ZE_RESULT_SUCCESS) {
+        env.zeContext = nullptr;
+        env.zeError = "zeContextCreate failed";
+    }
+}
+
+#ifdef HAVE_OPENCL
+void initializeOpenCL(BenchEnv& env) {
+    if (!env.vaDisplay) {
+        env.clError = env.vaError;
+        return;
+    }
+    try {
+        env.clSharing = findClVaSharing();
+        if (!clVaSharingSupported(env.clSharing)) {
+            env.clError = "no OpenCL platform with cl_intel_va_api_media_sharing";
+            return;
+        }
+        std::vector<cl_device_id> devices = clDevicesForVaDisplay(env.clSharing, env.vaDisplay);
+        env.clContext = createClVaContext(env.clSharing, env.vaDisplay, devices, false);
+        env.clQueue = clCreateCommandQueueWithProperties(env.clContext, devices[0], nullptr, nullptr);
+    } catch (const std::runtime_error& e) {
+        env.clError = e.what();
+    }
+}
+#endif
+
+void printRow(bool csv, const BenchPath& path, const BenchFormat& format, const BenchSize& size,
+              BenchSamples* samples, const std::string& skipReason) {
+    if (!samples) {
+        if (csv) {
+            printf("%s,%s,%s,%s,,,,,,,,\"skipped: %s\"\n", path.name, format.name, size.name, path.zeroCopy,
+                   skipReason.c_str());
+        } else {
+            printf("%-16s %-5s %-6s %-9s skipped: %s\n", path.name, format.name, size.name, path.zeroCopy,
+                   skipReason.c_str());
+        }
+        return;
+    }
+
+    std::vector<double>& us = samples->frameUs;
+    std::sort(us.begin(), us.end());
+    const double fps = us.size() / samples->wallSeconds;
+    const double cpuUs = samples->cpuSeconds * 1e6 / us.size();
+    // GB/s only for paths that move pixels; the others report per-op latency alone
+    char gbps[16] = "";
+    if (samples->frameBytes > 0) {
+        snprintf(gbps, sizeof(gbps), "%.2f", fps * samples->frameBytes / 1e9);
+    } else if (!csv) {
+        snprintf(gbps, sizeof(gbps), "-");
+    }
+    const char* fmt = csv ? "%s,%s,%s,%s,%.1f,%.1f,%.1f,%.1f,%.1f,%s,%.1f,\n"
+                          : "%-16s %-5s %-6s %-9s %9.1f %9.1f %9.1f %9.1f %9.1f %7s %9.1f\n";
+    printf(fmt, path.name, format.name, size.name, path.zeroCopy, percentile(us, 50), percentile(us, 90),
+           percentile(us, 99), us.back(), fps, gbps, cpuUs);
+}
+
+// Run every path, format and size. False when a supported path failed mid-run.
+bool runMatrix(BenchEnv& env, int frames, bool csv) {
+    const BenchPath paths[] = {
+        {"host-memcpy", "no", benchHostMemcpy},
+        {"derive-map", "yes", benchDeriveMap},
+        {"get-image", "no", benchGetImage},
+        {"put-image", "no", benchPutImage},
+        {"va-dmabuf-usm", "yes", benchVaDmaBufUsm},
+        {"usm-dmabuf-va", "yes", benchUsmDmaBufVa},
+#ifdef HAVE_OPENCL
+        {"opencl-sharing", "yes", benchOpenCL},
+#endif
+    };
+    const BenchFormat formats[] = {{VA_FOURCC_RGBA, "RGBA"}, {VA_FOURCC_NV12, "NV12"}};
+    const BenchSize sizes[] = {{1280, 720, "720p"}, {1920, 1080, "1080p"}, {3840, 2160, "4K"}};
+
+    if (csv) {
+        printf("path,format,size,zero_copy,p50_us,p90_us,p99_us,max_us,fps,gb_per_s,cpu_us_per_frame,note\n");
+    } else {
+        printf("%-16s %-5s %-6s %-9s %9s %9s %9s %9s %9s %7s %9s\n", "path", "fmt", "size", "zero-copy", "p50 us",
+               "p90 us", "p99 us", "max us", "fps", "GB/s", "cpu us/f");
+    }
+
+    for (const BenchPath& path : paths) {
+        for (const BenchFormat& format : formats) {
+            for (const BenchSize& size : sizes) {
+                TRACE_SCOPE(path.name);
+                try {
+                    BenchSamples samples = path.run(env, format.fourcc, size.width, size.height, frames);
+                    printRow(csv, path, format, size, &samples, "");
+                } catch (const SkipPath& e) {
+                    printRow(csv, path, format, size, nullptr, e.what());
+                } catch (const std::exception& e) {
+                    std::cerr << path.name << " " << format.name << " " << size.name << " failed: " << e.what()
+                              << std::endl;
+                    return false;
+                }
+                fflush(stdout);
+            }
+        }
+    }
+    return true;
+}
+
+// Usage: va_main [frames] [table|csv]
+int main(int argc, char* argv[]) {
+    int frames = argc > 1 ? std::max(1, std::stoi(argv[1])) : 200;
+    bool csv = argc > 2 && std::string(argv[2]) == "csv";
+
+    // Progress goes to stderr so the csv output stays clean
+    BenchEnv env = {};
+    env.drmFd = -1;
+    std::cerr << "Running initializeVa" << std::endl;
+    initializeVa(env);
+    std::cerr << "Running initializeLevelZero" << std::endl;
+    initializeLevelZero(env);
+#ifdef HAVE_OPENCL
+    std::cerr << "Running initializeOpenCL" << std::endl;
+    initializeOpenCL(env);
+#endif
+
+    const bool ok = runMatrix(env, frames, csv);
+
+#ifdef HAVE_OPENCL
+    if (env.clQueue) {
+        clReleaseCommandQueue(env.clQueue);
+    }
+    if (env.clContext) {
+        clReleaseContext(env.clContext);
+    }
+#endif
+    if (env.zeContext) {
+        zeContextDestroy(env.zeContext);
+    }
+    if (env.vaDisplay) {
+        vaTerminate(env.vaDisplay);
+    }
+    if (env.drmFd >= 0) {
+        close(env.drmFd);
+    }
+
+    traceFlushFromEnv();
+    return ok ? 0 : -1;
+}
@@ -0,0 +1,79 @@
+#!/usr/bin/env python3
+# Frames per second as seen from Python.
+#
+# Baseline: software decode, and every plane copied into a NumPy array. That is
+# what a Python stack that copies every frame pays. The other modes hand over
+# zero-copy views, one frame at a time or in batches, from software or VAAPI decode.
+#
+# Usage: python3 bench.py video.mp4 [--frames N] [--batch N] [--no-hw]
+
+import argparse
+import sys
+import time
+
+import numpy as np
+
+import vadecode
+
+
+def consume(frame, copy):
+    if copy:
+        return [np.array(plane, copy=True) for plane in frame.planes]
+    return [np.asarray(plane) for plane in frame.planes]
+
+
+def run(path, hw, copy, batch, frames):
+    count = 0
+    start = time.perf_counter()
+    with vadecode.Stream(path, hw=hw) as stream:
+        while count < frames:
+            if batch > 1:
+                decoded = stream.next_batch(min(batch, frames - count))
+            else:
+                frame = next(stream, None)
+                decoded = [frame] if frame is not None else []
+            if not decoded:
+                break
+            for frame in decoded:
+                consume(frame, copy)
+            count += len(decoded)
+    elapsed = time.perf_counter() - start
+    return count, elapsed
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("path")
+    parser.add_argument("--frames", type=int, default=1000, help="frames per mode (default 1000)")
+    parser.add_argument("--batch", type=int, default=8, help="batch size of the batch modes (default 8)")
+    parser.add_argument("--no-hw", action="store_true", help="skip the VAAPI modes")
+    args = parser.parse_args()
+
+    modes = [
+        ("sw, numpy copy (baseline)", False, True, 1),
+        ("sw, zero-copy", False, False, 1),
+        ("sw, zero-copy, batch %d" % args.batch, False, False, args.batch),
+    ]
+    if not args.no_hw:
+        modes += [
+            ("vaapi, zero-copy", True, False, 1),
+            ("vaapi, zero-copy, batch %d" % args.batch, True, False, args.batch),
+        ]
+
+    baseline = None
+    print("%-32s %8s %10s %8s" % ("mode", "frames", "fps", "vs base"))
+    for name, hw, copy, batch in modes:
+        try:
+            count, elapsed = run(args.path, hw, copy, batch, args.frames)
+        except RuntimeError as e:
+            print("%-32s skipped: %s" % (name, e))
+            continue
+        fps = count / elapsed if elapsed > 0 else 0.0
+        if baseline is None:
+            baseline = fps
+        print("%-32s %8d %10.1f %7.2fx" % (name, count, fps, fps / baseline if baseline else 0.0))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
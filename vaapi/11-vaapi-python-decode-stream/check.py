@@ -0,0 +1,133 @@
+#!/usr/bin/env python3
+# Checks of the vadecode module against a real input, software decode by default.
+#
+# Covers iteration and batches, plane shapes and strides, read-only buffers,
+# the read-only DLPack 1.0 export, frame lifetime after the Frame object is
+# gone, error propagation and GIL release while waiting. Exits non-zero on the
+# first failed check.
+#
+# Usage: python3 check.py video.mp4 [--hw]
+
+import argparse
+import ctypes
+import gc
+import sys
+import threading
+import time
+
+import numpy as np
+
+import vadecode
+
+
+def check(condition, what):
+    if not condition:
+        raise AssertionError(what)
+
+
+def raises(error, call):
+    try:
+        call()
+    except error:
+        return True
+    return False
+
+
+def capsule_name_is(capsule, name):
+    is_valid = ctypes.pythonapi.PyCapsule_IsValid
+    is_valid.restype = ctypes.c_int
+    is_valid.argtypes = [ctypes.py_object, ctypes.c_char_p]
+    return is_valid(capsule, name) == 1
+
+
+def check_plane(plane, height, width):
+    view = memoryview(plane)
+    check(view.readonly, "buffer views are read-only")
+    check(view.shape == plane.shape, "memoryview shape matches the plane")
+    check(view.shape[0] in (height, (height + 1) // 2), "plane rows match the frame")
+    check(view.strides[0] >= view.shape[1] * view.strides[1], "row stride covers the row")
+    # A writable buffer request is refused
+    check(raises((TypeError, BufferError), lambda: (ctypes.c_char * 1).from_buffer(plane)), "writable buffer refused")
+
+    # DLPack: 1.0 consumers only, and the tensor is read-only
+    check(raises(BufferError, lambda: plane.__dlpack__()), "pre-1.0 DLPack export refused")
+    check(capsule_name_is(plane.__dlpack__(max_version=(1, 0)), b"dltensor_versioned"), "versioned capsule")
+    check(plane.__dlpack_device__() == (1, 0), "kDLCPU device")
+    tensor = np.from_dlpack(plane)
+    array = np.asarray(plane)
+    check(not tensor.flags.writeable and not array.flags.writeable, "NumPy arrays are read-only")
+    check(tensor.__array_interface__["data"][0] == array.__array_interface__["data"][0], "no copy")
+    check(tensor.strides == array.strides and np.array_equal(tensor, array), "DLPack and buffer views agree")
+
+
+def check_gil_released(args):
+    # The source stalls for 200 ms before every read, so the first next() blocks.
+    # Another Python thread has to keep running while that call waits.
+    stream = vadecode.Stream(args.path, hw=args.hw, queue_depth=1, read_delay_us=200000)
+    stamps = []
+    stop = threading.Event()
+
+    def tick():
+        while not stop.is_set():
+            stamps.append(time.monotonic())
+            time.sleep(0.001)
+
+    ticker = threading.Thread(target=tick, daemon=True)
+    ticker.start()
+    start = time.monotonic()
+    next(stream)
+    end = time.monotonic()
+    stop.set()
+    ticker.join()
+    stream.close()
+
+    check(end - start >= 0.1, "next() blocks on a stalled source")
+    check(any(start + 0.02 < t < end - 0.02 for t in stamps), "GIL released while waiting")
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("path")
+    parser.add_argument("--hw", action="store_true", help="decode with VAAPI instead of software")
+    args = parser.parse_args()
+
+    check(raises(RuntimeError, lambda: vadecode.Stream(args.path + ".missing", hw=args.hw)), "open error raised")
+
+    stream = vadecode.Stream(args.path, hw=args.hw, queue_depth=4)
+    check(stream.hw == args.hw and stream.width > 0 and stream.height > 0, "stream properties")
+    frame = next(stream)
+    check(frame.index == 0 and (frame.width, frame.height) == (stream.width, stream.height), "first frame")
+    if args.hw:
+        check(frame.format in ("nv12", "p010") and len(frame.planes) == 2, "VAAPI frames are nv12 or p010")
+        check(frame.planes[1].shape[2] == 2, "interleaved UV plane")
+    for plane in frame.planes:
+        check_plane(plane, frame.height, frame.width)
+
+    # A view keeps its frame alive after the Frame and Plane objects are gone
+    kept = np.from_dlpack(frame.planes[0])
+    copy = kept.copy()
+    del frame
+    gc.collect()
+    batch = stream.next_batch(5)
+    check([f.index for f in batch] == list(range(1, 1 + len(batch))), "batch continues in decode order")
+    check(np.array_equal(kept, copy), "kept view still holds the first frame")
+    del kept
+
+    rest = list(stream)
+    last = rest[-1].index if rest else batch[-1].index
+    check(last == len(batch) + len(rest), "every frame delivered once")
+    check(stream.next_batch(3) == [], "empty batch at the end")
+
+    stream.close()
+    check(raises(ValueError, lambda: next(stream)), "closed stream refuses to iterate")
+    check_gil_released(args)
+    print("vadecode checks passed: %d frames, %s" % (last + 1, "vaapi" if args.hw else "software"))
+    return 0
+
+
+if __name__ == "__main__":
+    try:
+        sys.exit(main())
+    except AssertionError as e:
+        print("Check failed: %s" % e)
+        sys.exit(1)
@@ -0,0 +1,412 @@
+#pragma once
+
+// Decode-ahead FFmpeg/VAAPI stream for the Python module.
+//
+// A native thread runs the decode loop of 02-vaapi-ffmpeg-decoding and queues
+// frames that are already mapped for the CPU. Nothing in here touches Python,
+// so the thread never needs the GIL.
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/types.h>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/hwcontext.h>
+#include <libavutil/hwcontext_vaapi.h>
+#include <libavutil/pixdesc.h>
+#include <va/va.h>
+}
+
+#include "numa_placement.hpp"
+
+inline std::string avErrorString(int err) {
+    char text[128] = {};
+    av_strerror(err, text, sizeof(text));
+    return text;
+}
+
+// One plane as an N-d array. Strides are in bytes, as the buffer protocol wants them.
+typedef struct {
+    uint8_t* data;
+    int ndim;
+    ssize_t shape[3];
+    ssize_t strides[3];
+    int itemsize;   // 1 for 8-bit formats, 2 for P010 and 10-bit planar
+} FramePlane;
+
+// A decoded frame, mapped for CPU reads.
+//
+// The frame holds its AVFrame reference until it is destroyed. For VAAPI
+// frames, that reference keeps the surface out of the decoder's pool and keeps
+// the frames context, and with it the VA display, alive. So a frame may
+// outlive its stream.
+class DecodedFrame {
+public:
+    DecodedFrame(AVFrame* src, int64_t index) : index(index) {
+        frame_ = av_frame_alloc();
+        av_frame_move_ref(frame_, src);
+        pts = frame_->pts;
+        width = frame_->width;
+        height = frame_->height;
+        try {
+            if (frame_->format == AV_PIX_FMT_VAAPI) {
+                mapSurface();
+            } else {
+                describeSoftwareFrame();
+            }
+        } catch (...) {
+            release();
+            throw;
+        }
+    }
+
+    ~DecodedFrame() {
+        release();
+    }
+
+    DecodedFrame(const DecodedFrame&) = delete;
+    DecodedFrame& operator=(const DecodedFrame&) = delete;
+
+    int64_t index;
+    int64_t pts;
+    int width;
+    int height;
+    std::string format;     // "nv12", "p010", "yuv420p", ...
+    std::vector<FramePlane> planes;
+
+private:
+    void release() {
+        if (mapped_) {
+            vaUnmapBuffer(display_, image_.buf);
+            vaDestroyImage(display_, image_.image_id);
+            mapped_ = false;
+        }
+        av_frame_free(&frame_);
+    }
+
+    void addPlane(uint8_t* data, int itemsize, ssize_t pitch, ssize_t rows, ssize_t cols, ssize_t components) {
+        FramePlane plane = {};
+        plane.data = data;
+        plane.itemsize = itemsize;
+        plane.ndim = components > 1 ? 3 : 2;
+        plane.shape[0] = rows;
+        plane.shape[1] = cols;
+        plane.shape[2] = components;
+        plane.strides[0] = pitch;
+        plane.strides[1] = itemsize * components;
+        plane.strides[2] = itemsize;
+        planes.push_back(plane);
+    }
+
+    // Y [H, W] and interleaved UV [H/2, W/2, 2]
+    void addSemiPlanar(uint8_t* y, ssize_t yPitch, uint8_t* uv, ssize_t uvPitch, int itemsize) {
+        addPlane(y, itemsize, yPitch, height, width, 1);
+        addPlane(uv, itemsize, uvPitch, (height + 1) / 2, (width + 1) / 2, 2);
+    }
+
+    void mapSurface() {
+        AVHWFramesContext* frames = (AVHWFramesContext*)frame_->hw_frames_ctx->data;
+        display_ = ((AVVAAPIDeviceContext*)frames->device_ctx->hwctx)->display;
+        VASurfaceID surface = (VASurfaceID)(uintptr_t)frame_->data[3]; // As defined by AV_PIX_FMT_VAAPI
+
+        if (vaSyncSurface(display_, surface) != VA_STATUS_SUCCESS ||
+            vaDeriveImage(display_, surface, &image_) != VA_STATUS_SUCCESS) {
+            throw std::runtime_error("vaDeriveImage failed for surface " + std::to_string(surface));
+        }
+        void* buffer = nullptr;
+        if (vaMapBuffer(display_, image_.buf, &buffer) != VA_STATUS_SUCCESS) {
+            vaDestroyImage(display_, image_.image_id);
+            throw std::runtime_error("vaMapBuffer failed for surface " + std::to_string(surface));
+        }
+        mapped_ = true;
+
+        uint8_t* base = (uint8_t*)buffer;
+        if (image_.format.fourcc == VA_FOURCC_NV12) {
+            format = "nv12";
+            addSemiPlanar(base + image_.offsets[0], image_.pitches[0], base + image_.offsets[1], image_.pitches[1], 1);
+        } else if (image_.format.fourcc == VA_FOURCC_P010) {
+            format = "p010";
+            addSemiPlanar(base + image_.offsets[0], image_.pitches[0], base + image_.offsets[1], image_.pitches[1], 2);
+        } else {
+            throw std::runtime_error("Unsupported surface fourcc " + std::to_string(image_.format.fourcc));
+        }
+    }
+
+    // Software frames are exposed in place, straight from the AVFrame buffers
+    void describeSoftwareFrame() {
+        const AVPixelFormat pix_fmt = (AVPixelFormat)frame_->format;
+        const ssize_t chromaRows = (height + 1) / 2;
+        const ssize_t chromaCols = (width + 1) / 2;
+        switch (pix_fmt) {
+        case AV_PIX_FMT_YUV420P:
+        case AV_PIX_FMT_YUVJ420P:
+        case AV_PIX_FMT_YUV420P10LE: {
+            const int itemsize = pix_fmt == AV_PIX_FMT_YUV420P10LE ? 2 : 1;
+            addPlane(frame_->data[0], itemsize, frame_->linesize[0], height, width, 1);
+            addPlane(frame_->data[1], itemsize, frame_->linesize[1], chromaRows, chromaCols, 1);
+            addPlane(frame_->data[2], itemsize, frame_->linesize[2], chromaRows, chromaCols, 1);
+            break;
+        }
+        case AV_PIX_FMT_NV12:
+        case AV_PIX_FMT_P010LE:
+            addSemiPlanar(frame_->data[0], frame_->linesize[0], frame_->data[1], frame_->linesize[1],
+                          pix_fmt == AV_PIX_FMT_P010LE ? 2 : 1);
+            break;
+        default:
+            throw std::runtime_error(std::string("Unsupported pixel format ") + av_get_pix_fmt_name(pix_fmt));
+        }
+        format = av_get_pix_fmt_name(pix_fmt);
+    }
+
+    AVFrame* frame_ = nullptr;
+    VADisplay display_ = nullptr;
+    VAImage image_ = {};
+    bool mapped_ = false;
+};
+
+typedef struct {
+    std::string device = "/dev/dri/renderD128";
+    bool hw = true;             // VAAPI decode; false for the software decoder
+    size_t queueDepth = 8;      // Frames decoded ahead of the consumer
+    int extraFrames = 16;       // Surfaces the consumer may hold on top of the queue
+    int threads = 0;            // Software decoder threads, 0 = FFmpeg's choice
+    int readDelayUs = 0;        // Sleep before every read, to simulate slow input
+} DecodeStreamOptions;
+
+// Decodes the best video stream of a file on its own thread.
+//
+// next() and nextBatch() block until frames are ready. They are meant to be
+// called with the GIL released. Decode errors are rethrown on the consumer's
+// thread, after the frames decoded before them.
+class DecodeStream {
+public:
+    DecodeStream(const std::string& path, const DecodeStreamOptions& options) : options_(options) {
+        if (options_.queueDepth == 0) {
+            throw std::runtime_error("queue depth must be at least 1");
+        }
+        try {
+            open(path);
+        } catch (...) {
+            freeContexts();
+            throw;
+        }
+        thread_ = std::thread(&DecodeStream::run, this);
+    }
+
+    ~DecodeStream() {
+        close();
+        freeContexts();
+    }
+
+    DecodeStream(const DecodeStream&) = delete;
+    DecodeStream& operator=(const DecodeStream&) = delete;
+
+    // The next frame, or nullptr at the end of the stream
+    std::shared_ptr<DecodedFrame> next() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        notEmpty_.wait(lock, [this] { return !queue_.empty() || finished_; });
+        if (queue_.empty()) {
+            if (error_) {
+                std::rethrow_exception(error_);
+            }
+            return nullptr;
+        }
+        std::shared_ptr<DecodedFrame> frame = std::move(queue_.front());
+        queue_.pop_front();
+        notFull_.notify_one();
+        return frame;
+    }
+
+    // Up to count frames; fewer only at the end of the stream
+    std::vector<std::shared_ptr<DecodedFrame>> nextBatch(size_t count) {
+        std::vector<std::shared_ptr<DecodedFrame>> batch;
+        batch.reserve(count);
+        while (batch.size() < count) {
+            std::shared_ptr<DecodedFrame> frame;
+            try {
+                frame = next();
+            } catch (...) {
+                if (batch.empty()) {
+                    throw;
+                }
+                // Hand over what was decoded; the error is raised again by the next call
+                break;
+            }
+            if (!frame) {
+                break;
+            }
+            batch.push_back(std::move(frame));
+        }
+        return batch;
+    }
+
+    // Stop decoding and join the thread. Frames already handed out stay valid.
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+            queue_.clear();
+        }
+        notFull_.notify_all();
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+    }
+
+    int width() const { return width_; }
+    int height() const { return height_; }
+    const char* codec() const { return codec_; }
+    bool hw() const { return options_.hw; }
+
+private:
+    void freeContexts() {
+        avcodec_free_context(&decoder_ctx_);
+        avformat_close_input(&input_ctx_);
+        av_buffer_unref(&hw_device_ctx_);
+    }
+
+    void open(const std::string& path) {
+        int err = avformat_open_input(&input_ctx_, path.c_str(), nullptr, nullptr);
+        if (err < 0) {
+            throw std::runtime_error("Failed to open " + path + ": " + avErrorString(err));
+        }
+        if ((err = avformat_find_stream_info(input_ctx_, nullptr)) < 0) {
+            throw std::runtime_error("Failed to read stream info of " + path + ": " + avErrorString(err));
+        }
+        const AVCodec* codec = nullptr;
+        video_stream_ = av_find_best_stream(input_ctx_, AVMEDIA_TYPE_VIDEO, -1, -1, &codec, 0);
+        if (video_stream_ < 0) {
+            throw std::runtime_error("No video stream in " + path);
+        }
+
+        const AVCodecParameters* codecpar = input_ctx_->streams[video_stream_]->codecpar;
+        width_ = codecpar->width;
+        height_ = codecpar->height;
+        codec_ = codec->name;
+
+        decoder_ctx_ = avcodec_alloc_context3(codec);
+        avcodec_parameters_to_context(decoder_ctx_, codecpar);
+        if (options_.hw) {
+            // FFmpeg owns the display here, so it lives as long as the last frame that references it
+            err = av_hwdevice_ctx_create(&hw_device_ctx_, AV_HWDEVICE_TYPE_VAAPI, options_.device.c_str(), nullptr, 0);
+            if (err < 0) {
+                throw std::runtime_error("Failed to open VAAPI device " + options_.device + ": " + avErrorString(err));
+            }
+            decoder_ctx_->pix_fmt = AV_PIX_FMT_VAAPI;
+            decoder_ctx_->hw_device_ctx = av_buffer_ref(hw_device_ctx_);
+            // The pool must cover the queue and every frame Python still holds
+            decoder_ctx_->extra_hw_frames = (int)options_.queueDepth + options_.extraFrames;
+        } else {
+            decoder_ctx_->thread_count = options_.threads;
+        }
+        if ((err = avcodec_open2(decoder_ctx_, codec, nullptr)) < 0) {
+            throw std::runtime_error(std::string("Failed to open decoder ") + codec->name + ": " + avErrorString(err));
+        }
+    }
+
+    // Blocks while the queue is full. False once the stream is closed.
+    bool push(std::shared_ptr<DecodedFrame> frame) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        notFull_.wait(lock, [this] { return queue_.size() < options_.queueDepth || stop_; });
+        if (stop_) {
+            return false;
+        }
+        queue_.push_back(std::move(frame));
+        notEmpty_.notify_one();
+        return true;
+    }
+
+    // Sends the packet and queues every frame it completes. False at the end or once closed.
+    bool decode(const AVPacket* packet) {
+        int err = avcodec_send_packet(decoder_ctx_, packet);
+        if (err < 0 && err != AVERROR_EOF) {
+            throw std::runtime_error("avcodec_send_packet failed: " + avErrorString(err));
+        }
+        for (;;) {
+            err = avcodec_receive_frame(decoder_ctx_, frame_);
+            if (err == AVERROR(EAGAIN)) {
+                return true;
+            }
+            if (err == AVERROR_EOF) {
+                return false;
+            }
+            if (err < 0) {
+                throw std::runtime_error("avcodec_receive_frame failed: " + avErrorString(err));
+            }
+            if (!push(std::make_shared<DecodedFrame>(frame_, frames_++))) {
+                return false;
+            }
+        }
+    }
+
+    void run() {
+        // Surface mapping reads are cheapest from the GPU's NUMA node, as in the decode sample
+        if (options_.hw) {
+            pinCurrentThread(choosePlacement(renderNodePciBdf(options_.device)));
+        }
+
+        AVPacket* packet = av_packet_alloc();
+        frame_ = av_frame_alloc();
+        try {
+            bool running = true;
+            while (running) {
+                if (options_.readDelayUs > 0) {
+                    std::this_thread::sleep_for(std::chrono::microseconds(options_.readDelayUs));
+                }
+                int err = av_read_frame(input_ctx_, packet);
+                if (err < 0) {
+                    // Drain the decoder, so the frames before a read error still reach the consumer
+                    decode(nullptr);
+                    if (err != AVERROR_EOF) {
+                        throw std::runtime_error("av_read_frame failed: " + avErrorString(err));
+                    }
+                    break;
+                }
+                if (packet->stream_index == video_stream_) {
+                    running = decode(packet);
+                }
+                av_packet_unref(packet);
+            }
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            error_ = std::current_exception();
+        }
+        av_frame_free(&frame_);
+        av_packet_free(&packet);
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        finished_ = true;
+        notEmpty_.notify_all();
+    }
+
+    DecodeStreamOptions options_;
+    AVFormatContext* input_ctx_ = nullptr;
+    AVCodecContext* decoder_ctx_ = nullptr;
+    AVBufferRef* hw_device_ctx_ = nullptr;
+    int video_stream_ = -1;
+    int width_ = 0;
+    int height_ = 0;
+    const char* codec_ = "";
+    AVFrame* frame_ = nullptr;  // Decode thread only
+    int64_t frames_ = 0;        // Decode thread only
+
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable notEmpty_;
+    std::condition_variable notFull_;
+    std::deque<std::shared_ptr<DecodedFrame>> queue_;
+    std::exception_ptr error_;
+    bool finished_ = false;
+    bool stop_ = false;
+};
@@ -0,0 +1,512 @@
+// vadecode: decoded frames for Python, without copies.
+//
+//   import numpy as np, vadecode
+//   with vadecode.Stream("../planet.mp4") as stream:
+//       for frame in stream:
+//           y = np.asarray(frame.planes[0])    # buffer protocol, read-only view
+//       batch = stream.next_batch(8)
+//       uv = np.from_dlpack(batch[0].planes[1])
+//
+// Each plane is a view of the decoder's memory: the mapped VA surface for
+// VAAPI decode, or the AVFrame buffer for software decode. A plane keeps its
+// frame alive, so a surface goes back to the decoder once the last array that
+// views it is gone.
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <structmember.h>
+
+#include <new>
+
+#include <dlpack/dlpack.h>
+
+#include "decode_stream.hpp"
+
+// Planes are exported as DLPack 1.0 capsules, the first version that can mark a tensor read-only
+#if !defined(DLPACK_MAJOR_VERSION) || DLPACK_MAJOR_VERSION < 1
+#error "vadecode needs DLPack 1.0 or later"
+#endif
+
+// Runs f with the GIL released; a C++ exception becomes a RuntimeError
+template <typename F>
+static bool callWithoutGil(F&& f) {
+    bool ok = true;
+    std::string error;
+    Py_BEGIN_ALLOW_THREADS
+    try {
+        f();
+    } catch (const std::exception& e) {
+        ok = false;
+        error = e.what();
+    }
+    Py_END_ALLOW_THREADS
+    if (!ok) {
+        PyErr_SetString(PyExc_RuntimeError, error.c_str());
+    }
+    return ok;
+}
+
+// ---------------------------------
+//          Plane
+// ---------------------------------
+typedef struct {
+    PyObject_HEAD
+    std::shared_ptr<DecodedFrame> frame;
+    size_t index;
+} PlaneObject;
+
+static const FramePlane& planeOf(PlaneObject* self) {
+    return self->frame->planes[self->index];
+}
+
+static bool isContiguous(const FramePlane& plane) {
+    ssize_t expected = plane.itemsize;
+    for (int d = plane.ndim - 1; d >= 0; --d) {
+        if (plane.strides[d] != expected) {
+            return false;
+        }
+        expected *= plane.shape[d];
+    }
+    return true;
+}
+
+static int planeGetBuffer(PyObject* obj, Py_buffer* view, int flags) {
+    PlaneObject* self = (PlaneObject*)obj;
+    const FramePlane& plane = planeOf(self);
+
+    // The decoder still predicts from this memory
+    if (flags & PyBUF_WRITABLE) {
+        PyErr_SetString(PyExc_BufferError, "decoded frames are read-only");
+        return -1;
+    }
+    if ((flags & PyBUF_STRIDES) != PyBUF_STRIDES && !isContiguous(plane)) {
+        PyErr_SetString(PyExc_BufferError, "plane rows are padded; request a strided buffer");
+        return -1;
+    }
+
+    Py_ssize_t len = plane.itemsize;
+    for (int d = 0; d < plane.ndim; ++d) {
+        len *= plane.shape[d];
+    }
+    view->obj = Py_NewRef(obj);
+    view->buf = plane.data;
+    view->len = len;
+    view->readonly = 1;
+    view->itemsize = plane.itemsize;
+    view->format = (flags & PyBUF_FORMAT) ? (char*)(plane.itemsize == 2 ? "H" : "B") : nullptr;
+    view->ndim = plane.ndim;
+    view->shape = (flags & PyBUF_ND) ? (Py_ssize_t*)plane.shape : nullptr;
+    view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? (Py_ssize_t*)plane.strides : nullptr;
+    view->suboffsets = nullptr;
+    view->internal = nullptr;
+    return 0;
+}
+
+// The tensor shares ownership of the frame, so it outlives the Plane object if the consumer keeps it
+typedef struct {
+    DLManagedTensorVersioned tensor;
+    int64_t shape[3];
+    int64_t strides[3];
+    std::shared_ptr<DecodedFrame> frame;
+} PlaneTensor;
+
+static void deletePlaneTensor(DLManagedTensorVersioned* tensor) {
+    delete static_cast<PlaneTensor*>(tensor->manager_ctx);
+}
+
+static void dltensorCapsuleDestructor(PyObject* capsule) {
+    // A consumer renames the capsule to "used_dltensor_versioned" once it owns the tensor
+    if (PyCapsule_IsValid(capsule, "dltensor_versioned")) {
+        DLManagedTensorVersioned* tensor =
+            (DLManagedTensorVersioned*)PyCapsule_GetPointer(capsule, "dltensor_versioned");
+        tensor->deleter(tensor);
+    }
+}
+
+static PyObject* planeDlpack(PyObject* obj, PyObject* args, PyObject* kwargs) {
+    static const char* keywords[] = {"stream", "max_version", "dl_device", "copy", nullptr};
+    PyObject* stream = Py_None;
+    PyObject* maxVersion = Py_None;
+    PyObject* dlDevice = Py_None;
+    PyObject* copy = Py_None;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|$OOOO", (char**)keywords, &stream, &maxVersion, &dlDevice,
+                                     &copy)) {
+        return nullptr;
+    }
+    if (copy == Py_True) {
+        PyErr_SetString(PyExc_BufferError, "planes are only exported without a copy");
+        return nullptr;
+    }
+    // A pre-1.0 capsule has no read-only flag, so the consumer would get a writable view of
+    // memory the decoder still predicts from. Only consumers that take 1.0 capsules get one.
+    int major = 0, minor = 0;
+    if (maxVersion != Py_None && (!PyTuple_Check(maxVersion) || !PyArg_ParseTuple(maxVersion, "ii", &major, &minor))) {
+        PyErr_SetString(PyExc_TypeError, "max_version must be a (major, minor) tuple");
+        return nullptr;
+    }
+    if (major < 1) {
+        PyErr_SetString(PyExc_BufferError,
+                        "planes are read-only and need a DLPack 1.0 consumer (max_version >= (1, 0))");
+        return nullptr;
+    }
+
+    PlaneObject* self = (PlaneObject*)obj;
+    const FramePlane& plane = planeOf(self);
+    PlaneTensor* owner = new PlaneTensor();
+    owner->frame = self->frame;
+    for (int d = 0; d < plane.ndim; ++d) {
+        owner->shape[d] = plane.shape[d];
+        owner->strides[d] = plane.strides[d] / plane.itemsize; // DLPack strides are in elements
+    }
+    DLTensor& t = owner->tensor.dl_tensor;
+    t.data = plane.data;
+    t.device = {kDLCPU, 0};
+    t.ndim = plane.ndim;
+    t.dtype = {kDLUInt, static_cast<uint8_t>(plane.itemsize * 8), 1};
+    t.shape = owner->shape;
+    t.strides = owner->strides;
+    t.byte_offset = 0;
+    owner->tensor.version = {DLPACK_MAJOR_VERSION, DLPACK_MINOR_VERSION};
+    owner->tensor.flags = DLPACK_FLAG_BITMASK_READ_ONLY;
+    owner->tensor.manager_ctx = owner;
+    owner->tensor.deleter = deletePlaneTensor;
+
+    PyObject* capsule = PyCapsule_New(&owner->tensor, "dltensor_versioned", dltensorCapsuleDestructor);
+    if (!capsule) {
+        delete owner;
+    }
+    return capsule;
+}
+
+static PyObject* planeDlpackDevice(PyObject*, PyObject*) {
+    return Py_BuildValue("(ii)", (int)kDLCPU, 0);
+}
+
+static PyObject* planeGetShape(PyObject* obj, void*) {
+    const FramePlane& plane = planeOf((PlaneObject*)obj);
+    PyObject* shape = PyTuple_New(plane.ndim);
+    for (int d = 0; shape && d < plane.ndim; ++d) {
+        PyTuple_SET_ITEM(shape, d, PyLong_FromSsize_t(plane.shape[d]));
+    }
+    return shape;
+}
+
+static void planeDealloc(PyObject* obj) {
+    PlaneObject* self = (PlaneObject*)obj;
+    self->frame.~shared_ptr();
+    Py_TYPE(obj)->tp_free(obj);
+}
+
+static PyBufferProcs planeBufferProcs = {planeGetBuffer, nullptr};
+
+static PyMethodDef planeMethods[] = {
+    {"__dlpack__", (PyCFunction)(void (*)(void))planeDlpack, METH_VARARGS | METH_KEYWORDS,
+     "Export the plane as a read-only DLPack 1.0 capsule (kDLCPU, uint8 or uint16). Needs a consumer that "
+     "passes max_version >= (1, 0)."},
+    {"__dlpack_device__", planeDlpackDevice, METH_NOARGS, "(kDLCPU, 0)"},
+    {nullptr, nullptr, 0, nullptr},
+};
+
+static PyGetSetDef planeGetSet[] = {
+    {"shape", planeGetShape, nullptr, "Shape in elements: (H, W) or (H, W, 2)", nullptr},
+    {nullptr, nullptr, nullptr, nullptr, nullptr},
+};
+
+static PyTypeObject PlaneType = {};
+
+static PyObject* newPlane(const std::shared_ptr<DecodedFrame>& frame, size_t index) {
+    PlaneObject* self = PyObject_New(PlaneObject, &PlaneType);
+    if (!self) {
+        return nullptr;
+    }
+    new (&self->frame) std::shared_ptr<DecodedFrame>(frame);
+    self->index = index;
+    return (PyObject*)self;
+}
+
+// ---------------------------------
+//          Frame
+// ---------------------------------
+typedef struct {
+    PyObject_HEAD
+    PyObject* planes;   // Tuple of Plane
+    long long index;
+    long long pts;
+    int width;
+    int height;
+    PyObject* format;
+} FrameObject;
+
+static void frameDealloc(PyObject* obj) {
+    FrameObject* self = (FrameObject*)obj;
+    Py_XDECREF(self->planes);
+    Py_XDECREF(self->format);
+    Py_TYPE(obj)->tp_free(obj);
+}
+
+static PyMemberDef frameMembers[] = {
+    {"planes", T_OBJECT_EX, offsetof(FrameObject, planes), READONLY, "Planes: Y, UV (nv12/p010) or Y, U, V"},
+    {"index", T_LONGLONG, offsetof(FrameObject, index), READONLY, "Decode order index"},
+    {"pts", T_LONGLONG, offsetof(FrameObject, pts), READONLY, "Presentation timestamp in stream time base"},
+    {"width", T_INT, offsetof(FrameObject, width), READONLY, nullptr},
+    {"height", T_INT, offsetof(FrameObject, height), READONLY, nullptr},
+    {"format", T_OBJECT_EX, offsetof(FrameObject, format), READONLY, "Pixel format, e.g. nv12 or yuv420p"},
+    {nullptr, 0, 0, 0, nullptr},
+};
+
+static PyTypeObject FrameType = {};
+
+static PyObject* newFrame(const std::shared_ptr<DecodedFrame>& frame) {
+    FrameObject* self = PyObject_New(FrameObject, &FrameType);
+    if (!self) {
+        return nullptr;
+    }
+    self->index = frame->index;
+    self->pts = frame->pts;
+    self->width = frame->width;
+    self->height = frame->height;
+    self->format = PyUnicode_FromString(frame->format.c_str());
+    self->planes = PyTuple_New(frame->planes.size());
+    if (!self->format || !self->planes) {
+        Py_DECREF(self);
+        return nullptr;
+    }
+    for (size_t p = 0; p < frame->planes.size(); ++p) {
+        PyObject* plane = newPlane(frame, p);
+        if (!plane) {
+            Py_DECREF(self);
+            return nullptr;
+        }
+        PyTuple_SET_ITEM(self->planes, p, plane);
+    }
+    return (PyObject*)self;
+}
+
+// ---------------------------------
+//          Stream
+// ---------------------------------
+typedef struct {
+    PyObject_HEAD
+    DecodeStream* stream;
+} StreamObject;
+
+static int streamInit(PyObject* obj, PyObject* args, PyObject* kwargs) {
+    static const char* keywords[] = {"path", "hw", "device", "queue_depth", "extra_frames", "threads",
+                                     "read_delay_us", nullptr};
+    StreamObject* self = (StreamObject*)obj;
+    DecodeStreamOptions options;
+    const char* path = nullptr;
+    const char* device = options.device.c_str();
+    int hw = options.hw;
+    Py_ssize_t queueDepth = options.queueDepth;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|psniii", (char**)keywords, &path, &hw, &device, &queueDepth,
+                                     &options.extraFrames, &options.threads, &options.readDelayUs)) {
+        return -1;
+    }
+    if (queueDepth < 1 || options.extraFrames < 0 || options.readDelayUs < 0) {
+        PyErr_SetString(PyExc_ValueError, "queue_depth must be >= 1, extra_frames and read_delay_us >= 0");
+        return -1;
+    }
+    options.device = device;
+    options.hw = hw;
+    options.queueDepth = queueDepth;
+
+    if (self->stream) {
+        PyErr_SetString(PyExc_RuntimeError, "stream is already open");
+        return -1;
+    }
+    // Opening probes the file, which may block on I/O
+    return callWithoutGil([&] { self->stream = new DecodeStream(path, options); }) ? 0 : -1;
+}
+
+static DecodeStream* openStream(StreamObject* self) {
+    if (!self->stream) {
+        PyErr_SetString(PyExc_ValueError, "stream is closed");
+    }
+    return self->stream;
+}
+
+// Closing joins the decode thread, which may be blocked on a full queue or in the decoder
+static void closeStream(StreamObject* self) {
+    DecodeStream* stream = self->stream;
+    self->stream = nullptr;
+    Py_BEGIN_ALLOW_THREADS
+    delete stream;
+    Py_END_ALLOW_THREADS
+}
+
+static void streamDealloc(PyObject* obj) {
+    closeStream((StreamObject*)obj);
+    Py_TYPE(obj)->tp_free(obj);
+}
+
+static PyObject* streamIterNext(PyObject* obj) {
+    DecodeStream* stream = openStream((StreamObject*)obj);
+    if (!stream) {
+        return nullptr;
+    }
+    std::shared_ptr<DecodedFrame> frame;
+    if (!callWithoutGil([&] { frame = stream->next(); })) {
+        return nullptr;
+    }
+    if (!frame) {
+        return nullptr; // StopIteration
+    }
+    return newFrame(frame);
+}
+
+static PyObject* streamNextBatch(PyObject* obj, PyObject* args) {
+    Py_ssize_t count = 0;
+    if (!PyArg_ParseTuple(args, "n", &count)) {
+        return nullptr;
+    }
+    if (count < 1) {
+        PyErr_SetString(PyExc_ValueError, "count must be >= 1");
+        return nullptr;
+    }
+    DecodeStream* stream = openStream((StreamObject*)obj);
+    if (!stream) {
+        return nullptr;
+    }
+
+    // One GIL release for the whole batch
+    std::vector<std::shared_ptr<DecodedFrame>> frames;
+    if (!callWithoutGil([&] { frames = stream->nextBatch(count); })) {
+        return nullptr;
+    }
+
+    PyObject* batch = PyList_New(frames.size());
+    for (size_t i = 0; batch && i < frames.size(); ++i) {
+        PyObject* frame = newFrame(frames[i]);
+        if (!frame) {
+            Py_CLEAR(batch);
+            break;
+        }
+        PyList_SET_ITEM(batch, i, frame);
+    }
+    return batch;
+}
+
+static PyObject* streamClose(PyObject* obj, PyObject*) {
+    closeStream((StreamObject*)obj);
+    Py_RETURN_NONE;
+}
+
+static PyObject* streamEnter(PyObject* obj, PyObject*) {
+    return Py_NewRef(obj);
+}
+
+static PyObject* streamExit(PyObject* obj, PyObject*) {
+    closeStream((StreamObject*)obj);
+    Py_RETURN_FALSE;
+}
+
+static PyObject* streamGetWidth(PyObject* obj, void*) {
+    DecodeStream* stream = openStream((StreamObject*)obj);
+    return stream ? PyLong_FromLong(stream->width()) : nullptr;
+}
+
+static PyObject* streamGetHeight(PyObject* obj, void*) {
+    DecodeStream* stream = openStream((StreamObject*)obj);
+    return stream ? PyLong_FromLong(stream->height()) : nullptr;
+}
+
+static PyObject* streamGetCodec(PyObject* obj, void*) {
+    DecodeStream* stream = openStream((StreamObject*)obj);
+    return stream ? PyUnicode_FromString(stream->codec()) : nullptr;
+}
+
+static PyObject* streamGetHw(PyObject* obj, void*) {
+    DecodeStream* stream = openStream((StreamObject*)obj);
+    return stream ? PyBool_FromLong(stream->hw()) : nullptr;
+}
+
+static PyMethodDef streamMethods[] = {
+    {"next_batch", streamNextBatch, METH_VARARGS,
+     "next_batch(count) -> list of up to count frames, fewer only at the end of the stream"},
+    {"close", streamClose, METH_NOARGS, "Stop decoding. Frames already returned stay valid."},
+    {"__enter__", streamEnter, METH_NOARGS, nullptr},
+    {"__exit__", streamExit, METH_VARARGS, nullptr},
+    {nullptr, nullptr, 0, nullptr},
+};
+
+static PyGetSetDef streamGetSet[] = {
+    {"width", streamGetWidth, nullptr, nullptr, nullptr},
+    {"height", streamGetHeight, nullptr, nullptr, nullptr},
+    {"codec", streamGetCodec, nullptr, nullptr, nullptr},
+    {"hw", streamGetHw, nullptr, "True for VAAPI decode", nullptr},
+    {nullptr, nullptr, nullptr, nullptr, nullptr},
+};
+
+static PyTypeObject StreamType = {};
+
+// ---------------------------------
+//          Module
+// ---------------------------------
+static struct PyModuleDef vadecodeModule = {
+    PyModuleDef_HEAD_INIT,
+    "vadecode",
+    "FFmpeg/VAAPI decode-ahead streams with zero-copy frames (buffer protocol and DLPack)",
+    -1,
+    nullptr,  // m_methods
+    nullptr,  // m_slots
+    nullptr,  // m_traverse
+    nullptr,  // m_clear
+    nullptr,  // m_free
+};
+
+// The type statics are value-initialized; this gives one the head PyVarObject_HEAD_INIT would
+static void initTypeHead(PyTypeObject& type) {
+    static const PyVarObject head[] = {PyVarObject_HEAD_INIT(nullptr, 0)};
+    type.ob_base = head[0];
+}
+
+PyMODINIT_FUNC PyInit_vadecode(void) {
+    for (PyTypeObject* type : {&PlaneType, &FrameType, &StreamType}) {
+        initTypeHead(*type);
+    }
+
+    PlaneType.tp_name = "vadecode.Plane";
+    PlaneType.tp_basicsize = sizeof(PlaneObject);
+    PlaneType.tp_flags = Py_TPFLAGS_DEFAULT;
+    PlaneType.tp_doc = "One plane of a decoded frame. Supports the buffer protocol and __dlpack__.";
+    PlaneType.tp_dealloc = planeDealloc;
+    PlaneType.tp_as_buffer = &planeBufferProcs;
+    PlaneType.tp_methods = planeMethods;
+    PlaneType.tp_getset = planeGetSet;
+
+    FrameType.tp_name = "vadecode.Frame";
+    FrameType.tp_basicsize = sizeof(FrameObject);
+    FrameType.tp_flags = Py_TPFLAGS_DEFAULT;
+    FrameType.tp_doc = "A decoded frame";
+    FrameType.tp_dealloc = frameDealloc;
+    FrameType.tp_members = frameMembers;
+
+    StreamType.tp_name = "vadecode.Stream";
+    StreamType.tp_basicsize = sizeof(StreamObject);
+    StreamType.tp_flags = Py_TPFLAGS_DEFAULT;
+    StreamType.tp_doc = "Stream(path, hw=True, device='/dev/dri/renderD128', queue_depth=8, extra_frames=16, "
+                        "threads=0, read_delay_us=0)\n\nDecodes path on a native thread, queue_depth frames ahead "
+                        "of the reader.\nUse a stream from one Python thread at a time.";
+    StreamType.tp_new = PyType_GenericNew;
+    StreamType.tp_init = streamInit;
+    StreamType.tp_dealloc = streamDealloc;
+    StreamType.tp_iter = PyObject_SelfIter;
+    StreamType.tp_iternext = streamIterNext;
+    StreamType.tp_methods = streamMethods;
+    StreamType.tp_getset = streamGetSet;
+
+    if (PyType_Ready(&PlaneType) < 0 || PyType_Ready(&FrameType) < 0 || PyType_Ready(&StreamType) < 0) {
+        return nullptr;
+    }
+    PyObject* module = PyModule_Create(&vadecodeModule);
+    if (!module) {
+        return nullptr;
+    }
+    if (PyModule_AddObject(module, "Stream", Py_NewRef((PyObject*)&StreamType)) < 0) {
+        Py_DECREF(&StreamType);
+        Py_DECREF(module);
+        return nullptr;
+    }
+    return module;
+}
@@ -0,0 +1,552 @@
+#pragma once
+
+// Decodes many streams on a fixed pool of threads.
+//
+// Every stream gets its own demuxer and decoder, but they all share one
+// VADisplay (one AVHWDeviceContext). No stream owns a thread. A worker takes
+// a stream off the run queue, decodes until the stream produces one frame,
+// and puts it back at the end of the queue. 64 cameras on 8 threads are
+// therefore served round-robin, and a stream that waits on its input does not
+// hold a core.
+//
+// Decoded frames wait in a bounded per-stream queue. When the consumer falls
+// behind, the oldest frame is dropped, as a live view would, and counted.
+// Decoding never blocks on the consumer.
+//
+// Inputs are read through FFmpeg's file protocol, or from memory
+// (av_memory_input.hpp): an mmap of the file, a copy loaded once, or a buffer
+// the caller supplies. Streams that name the same file share one buffer.
+//
+// Every frame carries the times its packet was demuxed and sent and the frame
+// was received and handed out (FrameTimes). The engine aggregates them into
+// latency histograms. Low-latency mode trades throughput for those: the
+// decoder outputs each frame as soon as it is decoded (AV_CODEC_FLAG_LOW_DELAY,
+// on streams without frame reordering), software decoders thread by slice
+// instead of by frame, and the surface pool and demuxer buffer are minimal.
+//
+// With sampling (frame_sampler.hpp), streams decode only keyframes or about
+// one frame in N. Frames not sampled are dropped on the worker and never
+// reach the queue or the consumer.
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/hwcontext.h>
+}
+
+#include "av_memory_input.hpp"
+#include "frame_sampler.hpp"
+#include "latency_histogram.hpp"
+#include "numa_placement.hpp"
+
+inline std::string avErrorString(int err) {
+    char text[128] = {};
+    av_strerror(err, text, sizeof(text));
+    return text;
+}
+
+enum class InputMode {
+    File,       // avformat_open_input on the path: buffered read() syscalls
+    Mmap,       // InputBuffer::mapFile, shared by the streams of one file
+    Memory,     // InputBuffer::loadFile: the file is read once, reruns never touch it
+};
+
+typedef struct {
+    std::string device = "/dev/dri/renderD128";
+    bool hw = true;             // VAAPI decode; false for FFmpeg's software decoders
+    int threads = 4;            // Decode threads shared by every stream
+    size_t queueDepth = 8;      // Frames a stream keeps for the consumer before dropping the oldest
+    int decoderThreads = 1;     // FFmpeg threads per software decoder; the pool is the parallelism
+    InputMode input = InputMode::File;
+    bool lowLatency = false;    // Latency over throughput; pair with queueDepth 1 for a live view
+    FrameSampling sampling;     // Frames handed to the consumer: all, keyframes or one in N
+} DecodeEngineOptions;
+
+// Steady-clock nanoseconds of one frame's way through the engine
+typedef struct {
+    int64_t demux = 0;          // av_read_frame returned its packet
+    int64_t send = 0;           // avcodec_send_packet accepted the packet
+    int64_t receive = 0;        // avcodec_receive_frame returned the frame
+    int64_t deliver = 0;        // next() handed it to the consumer
+} FrameTimes;
+
+typedef struct {
+    LatencyHistogram decode;    // demux -> receive: packet in to frame out of the decoder
+    LatencyHistogram delivery;  // demux -> deliver: packet in to frame at the consumer
+} DecodeLatency;
+
+inline int64_t steadyNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+typedef struct {
+    std::string path;
+    uint64_t packets = 0;       // Video packets read, one per source frame
+    uint64_t decoded = 0;       // Frames out of the decoder and sampled
+    uint64_t delivered = 0;     // Frames handed to the consumer
+    uint64_t dropped = 0;       // Frames pushed out of a full queue
+    uint64_t skipped = 0;       // Frames decoded but not sampled
+    size_t queueDepth = 0;      // Frames waiting for the consumer now
+    size_t maxQueueDepth = 0;
+    bool lowDelay = false;      // The decoder outputs frames without reorder buffering
+    bool finished = false;
+    std::string error;          // Why the stream stopped early, empty at a clean end
+} DecodeStreamStats;
+
+class DecodeEngine {
+public:
+    explicit DecodeEngine(const DecodeEngineOptions& options) : options_(options) {
+        if (options_.threads < 1 || options_.queueDepth == 0) {
+            throw std::runtime_error("DecodeEngine needs at least one thread and a queue depth of at least 1");
+        }
+        if (options_.hw) {
+            // One display for every stream; each decoder holds a reference
+            int err = av_hwdevice_ctx_create(&hwDevice_, AV_HWDEVICE_TYPE_VAAPI, options_.device.c_str(), nullptr, 0);
+            if (err < 0) {
+                throw std::runtime_error("Failed to open VAAPI device " + options_.device + ": " + avErrorString(err));
+            }
+        }
+    }
+
+    ~DecodeEngine() {
+        stop();
+        for (auto& stream : streams_) {
+            for (QueuedFrame& queued : stream->queue) {
+                av_frame_free(&queued.frame);
+            }
+            for (AVFrame* frame : stream->spare) {
+                av_frame_free(&frame);
+            }
+            av_frame_free(&stream->frame);
+            av_packet_free(&stream->packet);
+            avcodec_free_context(&stream->decoder);
+            closeInput(&stream->input);
+        }
+        av_buffer_unref(&hwDevice_);
+    }
+
+    DecodeEngine(const DecodeEngine&) = delete;
+    DecodeEngine& operator=(const DecodeEngine&) = delete;
+
+    // Open an input and its decoder. Call before start(). Returns the stream index.
+    size_t addStream(const std::string& path) {
+        if (options_.input == InputMode::File) {
+            return addStream(path, nullptr);
+        }
+        // Streams of one file share its buffer
+        std::shared_ptr<const InputBuffer>& buffer = buffers_[path];
+        if (!buffer) {
+            buffer = options_.input == InputMode::Mmap ? InputBuffer::mapFile(path) : InputBuffer::loadFile(path);
+        }
+        bufferReaders_[path]++;
+        return addStream(path, buffer);
+    }
+
+    // Decode from a buffer the caller filled, e.g. InputBuffer::borrow
+    size_t addStream(std::shared_ptr<const InputBuffer> buffer) {
+        return addStream(buffer->name(), buffer);
+    }
+
+    void start() {
+        for (const auto& [path, buffer] : buffers_) {
+            buffer->adviseReaders(bufferReaders_[path]);
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto& stream : streams_) {
+            runQueue_.push_back(stream.get());
+        }
+        active_ = streams_.size();
+        for (int i = 0; i < options_.threads; ++i) {
+            workers_.emplace_back(&DecodeEngine::work, this);
+        }
+    }
+
+    // Move the next frame of any stream into out, taking streams in turn.
+    // Blocks until a frame is ready. False once every stream has finished and
+    // every frame was handed out. times, if given, receives the frame's timestamps.
+    bool next(AVFrame* out, size_t& streamIndex, FrameTimes* times = nullptr) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (;;) {
+            for (size_t n = 0; n < streams_.size(); ++n) {
+                const size_t i = (cursor_ + n) % streams_.size();
+                Stream& stream = *streams_[i];
+                if (stream.queue.empty()) {
+                    continue;
+                }
+                QueuedFrame queued = stream.queue.front();
+                stream.queue.pop_front();
+                av_frame_move_ref(out, queued.frame);
+                stream.spare.push_back(queued.frame);
+                queued.times.deliver = steadyNs();
+                if (queued.times.demux) {
+                    latency_.delivery.record(queued.times.deliver - queued.times.demux);
+                }
+                if (times) {
+                    *times = queued.times;
+                }
+                stream.stats.delivered++;
+                stream.stats.queueDepth = stream.queue.size();
+                cursor_ = i + 1;
+                streamIndex = i;
+                return true;
+            }
+            if (active_ == 0 || stop_) {
+                return false;
+            }
+            frameReady_.wait(lock);
+        }
+    }
+
+    // Stop decoding and join the pool. Frames already queued can still be taken with next().
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        runnable_.notify_all();
+        frameReady_.notify_all();
+        for (auto& worker : workers_) {
+            worker.join();
+        }
+        workers_.clear();
+    }
+
+    size_t streamCount() const { return streams_.size(); }
+
+    DecodeStreamStats stats(size_t streamIndex) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return streams_.at(streamIndex)->stats;
+    }
+
+    // Every stream's counters added up; path is empty and finished means all finished
+    DecodeStreamStats totals() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        DecodeStreamStats total;
+        total.finished = true;
+        for (const auto& stream : streams_) {
+            total.packets += stream->stats.packets;
+            total.decoded += stream->stats.decoded;
+            total.skipped += stream->stats.skipped;
+            total.delivered += stream->stats.delivered;
+            total.dropped += stream->stats.dropped;
+            total.queueDepth += stream->stats.queueDepth;
+            total.maxQueueDepth = std::max(total.maxQueueDepth, stream->stats.maxQueueDepth);
+            total.lowDelay = total.lowDelay || stream->stats.lowDelay;
+            total.finished = total.finished && stream->stats.finished;
+        }
+        return total;
+    }
+
+    // Latency of every stream's frames so far
+    DecodeLatency latency() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return latency_;
+    }
+
+private:
+    struct Stream;
+
+    // Times of a packet sent to the decoder, until its frame comes out
+    typedef struct {
+        int64_t pts;
+        int64_t demux;
+        int64_t send;
+    } PacketTimes;
+
+    // Packets whose frame has not come out yet; older entries are forgotten past this
+    static constexpr size_t kMaxPacketsInFlight = 64;
+
+    typedef struct {
+        AVFrame* frame;
+        FrameTimes times;
+    } QueuedFrame;
+
+    size_t addStream(const std::string& path, std::shared_ptr<const InputBuffer> buffer) {
+        if (!workers_.empty()) {
+            throw std::runtime_error("addStream after start");
+        }
+        auto stream = std::make_unique<Stream>();
+        stream->stats.path = path;
+        try {
+            open(*stream, buffer);
+        } catch (...) {
+            avcodec_free_context(&stream->decoder);
+            closeInput(&stream->input);
+            throw;
+        }
+        streams_.push_back(std::move(stream));
+        return streams_.size() - 1;
+    }
+
+    struct Stream {
+        AVFormatContext* input = nullptr;
+        AVCodecContext* decoder = nullptr;
+        int videoStream = -1;
+        AVPacket* packet = nullptr;     // Worker only, reused for every read
+        AVFrame* frame = nullptr;       // Worker only, the frame being received
+        bool draining = false;          // Worker only, the decoder got its flush packet
+        std::string readError;          // Worker only, raised once the decoder is drained
+        std::vector<PacketTimes> inFlight;  // Worker only, in send order
+        FrameTimes times;               // Worker only, of the frame being received
+        FrameSampler sampler;           // Worker only
+        uint64_t packets = 0;           // Worker only, published with the next frame
+        uint64_t skipped = 0;           // Worker only, published with the next frame
+
+        // Guarded by the engine's mutex
+        std::deque<QueuedFrame> queue;
+        std::vector<AVFrame*> spare;    // Empty frames to move the next decoded one into
+        DecodeStreamStats stats;
+    };
+
+    void open(Stream& stream, std::shared_ptr<const InputBuffer> buffer) {
+        const std::string& path = stream.stats.path;
+        int err = buffer ? openMemoryInput(&stream.input, buffer)
+                         : avformat_open_input(&stream.input, path.c_str(), nullptr, nullptr);
+        if (err < 0) {
+            throw std::runtime_error("Failed to open " + path + ": " + avErrorString(err));
+        }
+        if (options_.lowLatency) {
+            // No packet buffering inside the demuxer beyond what probing needs
+            stream.input->flags |= AVFMT_FLAG_NOBUFFER;
+        }
+        if ((err = avformat_find_stream_info(stream.input, nullptr)) < 0) {
+            throw std::runtime_error("Failed to read stream info of " + path + ": " + avErrorString(err));
+        }
+        const AVCodec* codec = nullptr;
+        stream.videoStream = av_find_best_stream(stream.input, AVMEDIA_TYPE_VIDEO, -1, -1, &codec, 0);
+        if (stream.videoStream < 0) {
+            throw std::runtime_error("No video stream in " + path);
+        }
+
+        stream.decoder = avcodec_alloc_context3(codec);
+        const AVCodecParameters* codecpar = stream.input->streams[stream.videoStream]->codecpar;
+        avcodec_parameters_to_context(stream.decoder, codecpar);
+        applyFrameSampling(stream.decoder, options_.sampling);
+        AVStream* video = stream.input->streams[stream.videoStream];
+        stream.sampler = FrameSampler(options_.sampling, video->time_base, video->avg_frame_rate);
+        if (options_.lowLatency && codecpar->video_delay == 0) {
+            // Output order is decode order, so nothing needs holding back for reordering.
+            // With B-frames the flag would emit frames out of order; those streams keep their delay.
+            stream.decoder->flags |= AV_CODEC_FLAG_LOW_DELAY;
+            stream.stats.lowDelay = true;
+        }
+        if (options_.hw) {
+            stream.decoder->pix_fmt = AV_PIX_FMT_VAAPI;
+            stream.decoder->hw_device_ctx = av_buffer_ref(hwDevice_);
+            // The queue, the frame the consumer holds and the one being decoded. Low latency
+            // needs all three: the worker still decodes the next frame while the consumer holds one.
+            stream.decoder->extra_hw_frames = (int)options_.queueDepth + 2;
+        } else {
+            stream.decoder->thread_count = options_.decoderThreads;
+            if (options_.lowLatency) {
+                // Frame threads hold thread_count - 1 frames back; slice threads hold none
+                stream.decoder->thread_type = FF_THREAD_SLICE;
+            }
+        }
+        if ((err = avcodec_open2(stream.decoder, codec, nullptr)) < 0) {
+            throw std::runtime_error(std::string("Failed to open decoder ") + codec->name + " for " + path + ": " +
+                                     avErrorString(err));
+        }
+
+        stream.packet = av_packet_alloc();
+        stream.frame = av_frame_alloc();
+        stream.inFlight.reserve(kMaxPacketsInFlight);
+        for (size_t i = 0; i < options_.queueDepth; ++i) {
+            stream.spare.push_back(av_frame_alloc());
+        }
+    }
+
+    void work() {
+        // Surface reads are cheapest from the GPU's NUMA node
+        if (options_.hw) {
+            pinCurrentThread(choosePlacement(renderNodePciBdf(options_.device)));
+        }
+        for (;;) {
+            Stream* stream;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                runnable_.wait(lock, [this] { return stop_ || !runQueue_.empty() || active_ == 0; });
+                if (stop_ || runQueue_.empty()) {
+                    return;
+                }
+                stream = runQueue_.front();
+                runQueue_.pop_front();
+            }
+
+            bool more = false;
+            std::string error;
+            try {
+                more = step(*stream);
+            } catch (const std::exception& e) {
+                error = e.what();
+            }
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (more) {
+                runQueue_.push_back(stream);
+                runnable_.notify_one();
+            } else {
+                stream->stats.finished = true;
+                stream->stats.error = error;
+                if (--active_ == 0) {
+                    runnable_.notify_all();
+                }
+                frameReady_.notify_all();
+            }
+        }
+    }
+
+    // Decode until the stream produces one frame. False at its end.
+    bool step(Stream& stream) {
+        for (;;) {
+            int err = avcodec_receive_frame(stream.decoder, stream.frame);
+            if (err == 0) {
+                stream.times = matchPacket(stream, stream.frame->pts);
+                stream.times.receive = steadyNs();
+                if (!stream.sampler.take(stream.frame)) {
+                    av_frame_unref(stream.frame);
+                    stream.skipped++;
+                    continue;
+                }
+                deliver(stream);
+                return true;
+            }
+            if (err == AVERROR_EOF) {
+                publishCounts(stream);
+                if (!stream.readError.empty()) {
+                    throw std::runtime_error(stream.readError);
+                }
+                return false;
+            }
+            if (err != AVERROR(EAGAIN)) {
+                throw std::runtime_error("avcodec_receive_frame failed: " + avErrorString(err));
+            }
+            if (stream.draining) {
+                throw std::runtime_error("Decoder wants input after the flush packet");
+            }
+
+            err = av_read_frame(stream.input, stream.packet);
+            const int64_t demuxed = steadyNs();
+            if (err < 0) {
+                // Drain the decoder first, so the frames before a read error still come out
+                if (err != AVERROR_EOF) {
+                    stream.readError = "av_read_frame failed: " + avErrorString(err);
+                }
+                stream.draining = true;
+                avcodec_send_packet(stream.decoder, nullptr);
+                continue;
+            }
+            if (stream.packet->stream_index == stream.videoStream) {
+                stream.packets++;
+            }
+            if (stream.packet->stream_index == stream.videoStream && stream.sampler.wantsPacket(stream.packet)) {
+                err = avcodec_send_packet(stream.decoder, stream.packet);
+                if (err >= 0) {
+                    if (stream.inFlight.size() == kMaxPacketsInFlight) {
+                        stream.inFlight.erase(stream.inFlight.begin());
+                    }
+                    stream.inFlight.push_back({stream.packet->pts, demuxed, steadyNs()});
+                }
+            }
+            av_packet_unref(stream.packet);
+            if (err < 0) {
+                throw std::runtime_error("avcodec_send_packet failed: " + avErrorString(err));
+            }
+        }
+    }
+
+    // The times of the packet a frame came from: the one with the frame's pts, or the
+    // oldest when timestamps are missing (raw elementary streams decode in order)
+    static FrameTimes matchPacket(Stream& stream, int64_t pts) {
+        FrameTimes times;
+        if (stream.inFlight.empty()) {
+            return times;
+        }
+        auto it = stream.inFlight.begin();
+        auto match = stream.inFlight.end();
+        if (pts != AV_NOPTS_VALUE) {
+            match = std::find_if(stream.inFlight.begin(), stream.inFlight.end(),
+                                 [pts](const PacketTimes& packet) { return packet.pts == pts; });
+        }
+        if (match == stream.inFlight.end()) {
+            times.demux = it->demux;
+            times.send = it->send;
+            stream.inFlight.erase(it);
+            return times;
+        }
+        times.demux = match->demux;
+        times.send = match->send;
+        // Frames come out in pts order, so a packet sent earlier with a lower pts will never
+        // produce one (the decoder dropped or discarded it): forget it with the match
+        auto kept = std::remove_if(stream.inFlight.begin(), match, [pts](const PacketTimes& packet) {
+            return packet.pts == AV_NOPTS_VALUE || packet.pts < pts;
+        });
+        stream.inFlight.erase(kept, match + 1);
+        return times;
+    }
+
+    // Worker counters into the stats, under the engine's lock
+    void publishCountsLocked(Stream& stream) {
+        stream.stats.packets = stream.packets;
+        stream.stats.skipped = stream.skipped;
+    }
+
+    void publishCounts(Stream& stream) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        publishCountsLocked(stream);
+    }
+
+    // Queue the received frame, dropping the oldest one when the consumer is behind
+    void deliver(Stream& stream) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        publishCountsLocked(stream);
+        AVFrame* slot;
+        if (stream.times.demux) {
+            latency_.decode.record(stream.times.receive - stream.times.demux);
+        }
+        if (stream.queue.size() >= options_.queueDepth) {
+            slot = stream.queue.front().frame;
+            stream.queue.pop_front();
+            av_frame_unref(slot);
+            stream.stats.dropped++;
+        } else {
+            slot = stream.spare.back();
+            stream.spare.pop_back();
+        }
+        av_frame_move_ref(slot, stream.frame);
+        stream.queue.push_back({slot, stream.times});
+        stream.stats.decoded++;
+        stream.stats.queueDepth = stream.queue.size();
+        stream.stats.maxQueueDepth = std::max(stream.stats.maxQueueDepth, stream.queue.size());
+        frameReady_.notify_one();
+    }
+
+    DecodeEngineOptions options_;
+    AVBufferRef* hwDevice_ = nullptr;
+    std::vector<std::unique_ptr<Stream>> streams_;
+    std::unordered_map<std::string, std::shared_ptr<const InputBuffer>> buffers_;
+    std::unordered_map<std::string, size_t> bufferReaders_;  // Streams opened on each buffer
+    std::vector<std::thread> workers_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable runnable_;
+    std::condition_variable frameReady_;
+    std::deque<Stream*> runQueue_;
+    size_t active_ = 0;     // Streams that have not finished
+    size_t cursor_ = 0;     // Stream next() looks at first
+    DecodeLatency latency_;
+    bool stop_ = false;
+};
@@ -0,0 +1,479 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <numeric>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+#include "decode_engine.hpp"
+#include "selftest.hpp"
+#include "trace.hpp"
+
+void printStats(const DecodeEngine& engine, double seconds) {
+    printf("%-4s %-32s %8s %8s %8s %8s %6s %6s\n", "id", "input", "decoded", "fps", "consumed", "dropped", "queue",
+           "max");
+    for (size_t i = 0; i < engine.streamCount(); ++i) {
+        DecodeStreamStats s = engine.stats(i);
+        printf("%-4zu %-32s %8lu %8.1f %8lu %8lu %6zu %6zu%s%s\n", i, s.path.c_str(), (unsigned long)s.decoded,
+               s.decoded / seconds, (unsigned long)s.delivered, (unsigned long)s.dropped, s.queueDepth,
+               s.maxQueueDepth, s.error.empty() ? "" : "  error: ", s.error.c_str());
+    }
+    DecodeStreamStats total = engine.totals();
+    printf("%-4s %-32s %8lu %8.1f %8lu %8lu %6zu %6zu\n", "all", "", (unsigned long)total.decoded,
+           total.decoded / seconds, (unsigned long)total.delivered, (unsigned long)total.dropped, total.queueDepth,
+           total.maxQueueDepth);
+}
+
+// Open every input and read all of its packets without decoding; bytes are packet payload
+void demuxAll(const std::vector<std::string>& inputs,
+              const std::unordered_map<std::string, std::shared_ptr<const InputBuffer>>& buffers, uint64_t& packets,
+              uint64_t& bytes) {
+    AVPacket* packet = av_packet_alloc();
+    for (const std::string& path : inputs) {
+        AVFormatContext* input = nullptr;
+        int err = buffers.empty() ? avformat_open_input(&input, path.c_str(), nullptr, nullptr)
+                                  : openMemoryInput(&input, buffers.at(path));
+        if (err < 0) {
+            av_packet_free(&packet);
+            throw std::runtime_error("Failed to open " + path + ": " + avErrorString(err));
+        }
+        if ((err = avformat_find_stream_info(input, nullptr)) < 0) {
+            closeInput(&input);
+            av_packet_free(&packet);
+            throw std::runtime_error("Failed to read stream info of " + path + ": " + avErrorString(err));
+        }
+        while (av_read_frame(input, packet) >= 0) {
+            packets++;
+            bytes += packet->size;
+            av_packet_unref(packet);
+        }
+        closeInput(&input);
+    }
+    av_packet_free(&packet);
+}
+
+// Demux throughput of FFmpeg's file protocol against mmap'ed and in-memory input
+int runDemuxBenchmark(const std::vector<std::string>& inputs, int runs) {
+    const struct {
+        const char* name;
+        InputMode mode;
+    } modes[] = {{"file", InputMode::File}, {"mmap", InputMode::Mmap}, {"memory", InputMode::Memory}};
+
+    printf("%-8s %10s %12s %12s %14s\n", "input", "load ms", "first MB/s", "rerun MB/s", "rerun pkts/s");
+    for (const auto& m : modes) {
+        auto start = std::chrono::steady_clock::now();
+        std::unordered_map<std::string, std::shared_ptr<const InputBuffer>> buffers;
+        for (const std::string& path : inputs) {
+            if (m.mode != InputMode::File && !buffers.count(path)) {
+                buffers[path] = m.mode == InputMode::Mmap ? InputBuffer::mapFile(path) : InputBuffer::loadFile(path);
+            }
+        }
+        const double loadMs =
+            std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        double firstMBs = 0, rerunSeconds = 0;
+        uint64_t rerunPackets = 0, rerunBytes = 0;
+        for (int run = 0; run < runs; ++run) {
+            uint64_t packets = 0, bytes = 0;
+            start = std::chrono::steady_clock::now();
+            demuxAll(inputs, buffers, packets, bytes);
+            const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            if (run == 0) {
+                firstMBs = bytes / seconds / 1e6;
+            } else {
+                rerunSeconds += seconds;
+                rerunPackets += packets;
+                rerunBytes += bytes;
+            }
+        }
+        if (rerunSeconds > 0) {
+            printf("%-8s %10.2f %12.1f %12.1f %14.0f\n", m.name, loadMs, firstMBs, rerunBytes / rerunSeconds / 1e6,
+                   rerunPackets / rerunSeconds);
+        } else {
+            printf("%-8s %10.2f %12.1f %12s %14s\n", m.name, loadMs, firstMBs, "-", "-");
+        }
+    }
+    return 0;
+}
+
+void printLatency(const DecodeLatency& latency) {
+    printLatencyHeader("latency");
+    printLatencyHistogram("decode", latency.decode);
+    printLatencyHistogram("delivery", latency.delivery);
+}
+
+// Decode the inputs once as configured and once in low-latency mode, and compare
+// packet-in to frame-out latency. The consumer takes every frame at once.
+int runLatencyBenchmark(bool hw, int threads, const std::vector<std::string>& inputs) {
+    const struct {
+        const char* name;
+        bool lowLatency;
+        size_t queueDepth;
+    } modes[] = {{"default", false, 8}, {"lowlat", true, 1}};
+
+    printf("%-8s %8s %9s %8s %9s %9s %9s %9s %9s\n", "mode", "frames", "fps", "lowdelay", "dec p50", "dec p99",
+           "dec p999", "dlv p50", "dlv p999");
+    for (const auto& m : modes) {
+        DecodeEngineOptions options;
+        options.hw = hw;
+        options.threads = threads;
+        options.lowLatency = m.lowLatency;
+        options.queueDepth = m.queueDepth;
+        DecodeEngine engine(options);
+        for (const std::string& path : inputs) {
+            engine.addStream(path);
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        engine.start();
+        AVFrame* frame = av_frame_alloc();
+        size_t stream;
+        while (engine.next(frame, stream)) {
+            av_frame_unref(frame);
+        }
+        av_frame_free(&frame);
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        engine.stop();
+
+        // Milliseconds; delivery counts only the frames the consumer got
+        const DecodeLatency latency = engine.latency();
+        const DecodeStreamStats total = engine.totals();
+        printf("%-8s %8lu %9.1f %8s %9.3f %9.3f %9.3f %9.3f %9.3f\n", m.name, (unsigned long)total.decoded,
+               total.decoded / seconds, total.lowDelay ? "yes" : "no", latency.decode.percentile(50) / 1e6,
+               latency.decode.percentile(99) / 1e6, latency.decode.percentile(99.9) / 1e6,
+               latency.delivery.percentile(50) / 1e6, latency.delivery.percentile(99.9) / 1e6);
+        for (size_t i = 0; i < engine.streamCount(); ++i) {
+            const DecodeStreamStats s = engine.stats(i);
+            if (!s.error.empty()) {
+                printf("  stream %zu: %s\n", i, s.error.c_str());
+            }
+        }
+    }
+    return 0;
+}
+
+// Decode the inputs in full and at several sampling ratios and compare throughput.
+// Source fps counts the input's frames, whether decoded or not.
+int runSamplingBenchmark(bool hw, int threads, const std::vector<std::string>& inputs) {
+    const char* samplings[] = {"all", "2", "5", "30", "key"};
+    printf("%-6s %9s %9s %9s %9s %9s %11s %8s\n", "sample", "source", "decoded", "passed", "dropped", "seconds",
+           "source fps", "speedup");
+    double fullFps = 0;
+    for (const char* name : samplings) {
+        DecodeEngineOptions options;
+        options.hw = hw;
+        options.threads = threads;
+        options.sampling = parseFrameSampling(name);
+        // A small queue, as in production: the consumer only unrefs, so it keeps up,
+        // and the dropped column shows if it ever did not
+        options.queueDepth = 4;
+        DecodeEngine engine(options);
+        for (const std::string& path : inputs) {
+            engine.addStream(path);
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        engine.start();
+        AVFrame* frame = av_frame_alloc();
+        size_t stream;
+        while (engine.next(frame, stream)) {
+            av_frame_unref(frame);
+        }
+        av_frame_free(&frame);
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        engine.stop();
+
+        const DecodeStreamStats total = engine.totals();
+        const double fps = total.packets / seconds;
+        fullFps = fullFps > 0 ? fullFps : fps;
+        printf("%-6s %9lu %9lu %9lu %9lu %9.3f %11.1f %7.2fx\n", frameSamplingName(options.sampling).c_str(),
+               (unsigned long)total.packets, (unsigned long)(total.decoded + total.skipped),
+               (unsigned long)total.delivered, (unsigned long)total.dropped, seconds, fps, fps / fullFps);
+        for (size_t i = 0; i < engine.streamCount(); ++i) {
+            const DecodeStreamStats s = engine.stats(i);
+            if (!s.error.empty()) {
+                printf("  stream %zu: %s\n", i, s.error.c_str());
+            }
+        }
+    }
+    return 0;
+}
+
+// LatencyHistogram against exact percentiles of sorted samples: a reported percentile is
+// the upper end of its bucket, at most 1/128 above the exact value
+int runHistogramCheck() {
+    std::mt19937_64 rng(1);
+    std::lognormal_distribution<double> latency(std::log(2e6), 1.0);
+    std::vector<uint64_t> values(200000);
+    LatencyHistogram even, odd;
+    for (size_t i = 0; i < values.size(); ++i) {
+        values[i] = uint64_t(latency(rng));
+        (i % 2 ? odd : even).record(values[i]);
+    }
+    even.add(odd);
+    std::sort(values.begin(), values.end());
+
+    const double mean = std::accumulate(values.begin(), values.end(), 0.0) / values.size();
+    bool ok = even.count() == values.size() && even.min() == values.front() && even.max() == values.back() &&
+              std::fabs(even.mean() - mean) < 1e-6 * mean;
+    double worst = 0;
+    printf("%-8s %12s %12s %9s\n", "pct", "exact ns", "reported ns", "error %");
+    for (double percentile : {1.0, 10.0, 50.0, 90.0, 99.0, 99.9, 99.99}) {
+        const uint64_t rank = std::max<uint64_t>(1, uint64_t(percentile / 100.0 * values.size() + 0.5));
+        const uint64_t exact = values[rank - 1], reported = even.percentile(percentile);
+        const double error = (double(reported) - double(exact)) / double(exact);
+        printf("%-8.2f %12lu %12lu %9.3f\n", percentile, (unsigned long)exact, (unsigned long)reported, error * 100);
+        ok = ok && reported >= exact && error <= 1.0 / LatencyHistogram::kSubBuckets;
+        worst = std::max(worst, error);
+    }
+
+    // Below kSubBuckets every value has a bucket of its own
+    LatencyHistogram small;
+    for (uint64_t value = 0; value < LatencyHistogram::kSubBuckets; ++value) {
+        small.record(value);
+    }
+    for (uint64_t value = 1; value <= LatencyHistogram::kSubBuckets; ++value) {
+        ok = ok && small.percentile(100.0 * value / LatencyHistogram::kSubBuckets) == value - 1;
+    }
+
+    printf("Worst error %.3f%% (bound %.3f%%): histogram checks %s\n", worst * 100,
+           100.0 / LatencyHistogram::kSubBuckets, ok ? "passed" : "FAILED");
+    return ok ? 0 : -1;
+}
+
+// Decode every stream to its end, the consumer spending consumeUs per frame. After every
+// frame, each stream must account for all of its frames: decoded == consumed + dropped + queued.
+bool drainBalanced(DecodeEngine& engine, int consumeUs) {
+    bool balanced = true;
+    engine.start();
+    AVFrame* frame = av_frame_alloc();
+    size_t stream;
+    while (engine.next(frame, stream)) {
+        if (consumeUs > 0) {
+            std::this_thread::sleep_for(std::chrono::microseconds(consumeUs));
+        }
+        av_frame_unref(frame);
+        for (size_t i = 0; i < engine.streamCount(); ++i) {
+            const DecodeStreamStats s = engine.stats(i);
+            balanced = balanced && s.decoded == s.delivered + s.dropped + s.queueDepth;
+        }
+    }
+    av_frame_free(&frame);
+    engine.stop();
+    return balanced;
+}
+
+// DecodeEngine's guarantees on one real clip, replayed from memory:
+//   - 4, 8 and 16 streams each decode every frame of the clip, and every frame is
+//     either handed out or counted as dropped
+//   - with a slow consumer and a small queue, the counts balance at every frame
+//   - a stream on a truncated copy of the clip stops alone; the others decode in full
+int runEngineCheck(bool hw, int threads, const std::string& path) {
+    const std::shared_ptr<const InputBuffer> clip = InputBuffer::loadFile(path);
+    DecodeEngineOptions options;
+    options.hw = hw;
+    options.threads = threads;
+
+    // The clip's frame count, from one stream
+    uint64_t frames;
+    {
+        DecodeEngine engine(options);
+        engine.addStream(clip);
+        CHECK(drainBalanced(engine, 0));
+        const DecodeStreamStats s = engine.stats(0);
+        CHECK(s.finished && s.error.empty() && s.decoded > 0);
+        frames = s.decoded;
+    }
+    printf("%s: %lu frames\n", path.c_str(), (unsigned long)frames);
+
+    for (size_t streams : {4, 8, 16}) {
+        DecodeEngine engine(options);
+        for (size_t i = 0; i < streams; ++i) {
+            engine.addStream(clip);
+        }
+        CHECK(drainBalanced(engine, 0));
+        for (size_t i = 0; i < streams; ++i) {
+            const DecodeStreamStats s = engine.stats(i);
+            CHECK(s.finished && s.error.empty());
+            CHECK(s.decoded == frames && s.delivered + s.dropped == frames && s.queueDepth == 0);
+        }
+        const DecodeStreamStats total = engine.totals();
+        printf("%2zu streams: %lu frames decoded, %lu consumed, %lu dropped\n", streams,
+               (unsigned long)total.decoded, (unsigned long)total.delivered, (unsigned long)total.dropped);
+    }
+
+    {
+        // About 500 frames/s at the consumer against 8 decoding streams
+        DecodeEngineOptions slow = options;
+        slow.queueDepth = 2;
+        DecodeEngine engine(slow);
+        for (int i = 0; i < 8; ++i) {
+            engine.addStream(clip);
+        }
+        CHECK(drainBalanced(engine, 2000));
+        const DecodeStreamStats total = engine.totals();
+        CHECK(total.decoded == 8 * frames && total.delivered + total.dropped == total.decoded);
+        printf("slow consumer: %lu frames decoded, %lu consumed, %lu dropped\n", (unsigned long)total.decoded,
+               (unsigned long)total.delivered, (unsigned long)total.dropped);
+    }
+
+    {
+        // Half the clip: the demuxer fails or ends early, depending on the container. A clip
+        // with its index at the end does not open at all, which also leaves the others alone.
+        const std::shared_ptr<const InputBuffer> truncated =
+            InputBuffer::borrow(clip->data(), clip->size() / 2, clip->name());
+        DecodeEngine engine(options);
+        size_t failing = SIZE_MAX;
+        for (int i = 0; i < 4; ++i) {
+            if (i != 1) {
+                engine.addStream(clip);
+                continue;
+            }
+            try {
+                failing = engine.addStream(truncated);
+            } catch (const std::exception& e) {
+                printf("truncated input refused at open: %s\n", e.what());
+            }
+        }
+        CHECK(drainBalanced(engine, 0));
+        for (size_t i = 0; i < engine.streamCount(); ++i) {
+            const DecodeStreamStats s = engine.stats(i);
+            CHECK(s.finished);
+            if (i == failing) {
+                CHECK(s.decoded < frames);
+                printf("truncated input: stopped after %lu frames%s%s\n", (unsigned long)s.decoded,
+                       s.error.empty() ? "" : ", error: ", s.error.c_str());
+            } else {
+                CHECK(s.error.empty() && s.decoded == frames);
+            }
+        }
+    }
+
+    printf("DecodeEngine checks passed\n");
+    return 0;
+}
+
+// Usage: va_main [vaapi|sw] [threads] [consume_us] [file|mmap|memory] input [input...]
+//        va_main demux [runs] input [input...]
+//        va_main latency [vaapi|sw] [threads] input [input...]
+//        va_main sample [vaapi|sw] [threads] input [input...]
+//        va_main selftest [vaapi|sw threads input]
+//   vaapi:      decode on the GPU, every stream on one VADisplay (default)
+//   sw:         FFmpeg's software decoders, no GPU needed
+//   threads:    decode threads shared by all streams (default 4)
+//   consume_us: time the consumer spends per frame; frames are dropped when it falls behind (default 0)
+//   file|mmap|memory: read inputs through FFmpeg's file protocol, an mmap, or a copy loaded once
+//   demux:      compare the demux throughput of the three input paths over several runs
+//   latency:    compare packet-in to frame-out latency with and without low-latency mode
+//   sample:     compare full decode with keyframe-only and every-Nth-frame decode
+//   selftest:   check the latency histogram's percentiles against exact ones; given a clip,
+//               also check frame accounting and error isolation on copies of it
+// The same file may be given many times to stand in for many cameras.
+int main(int argc, char* argv[]) {
+    const std::string mode = argc > 1 ? argv[1] : "";
+    if (isSelfTest(argc, argv) && (argc == 2 || argc == 5)) {
+        const std::string decode = argc == 5 ? argv[2] : "";
+        if (argc == 2 || decode == "vaapi" || decode == "sw") {
+            return runSelfTest([&]() {
+                if (runHistogramCheck() != 0) {
+                    return -1;
+                }
+                return argc == 5 ? runEngineCheck(decode == "vaapi", std::stoi(argv[3]), argv[4]) : 0;
+            });
+        }
+    }
+    if (mode == "demux" && argc >= 4) {
+        try {
+            return runDemuxBenchmark(std::vector<std::string>(argv + 3, argv + argc), std::stoi(argv[2]));
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            return -1;
+        }
+    }
+    if ((mode == "latency" || mode == "sample") && argc >= 5) {
+        const std::string decode = argv[2];
+        if (decode == "vaapi" || decode == "sw") {
+            const std::vector<std::string> inputs(argv + 4, argv + argc);
+            try {
+                return mode == "latency" ? runLatencyBenchmark(decode == "vaapi", std::stoi(argv[3]), inputs)
+                                         : runSamplingBenchmark(decode == "vaapi", std::stoi(argv[3]), inputs);
+            } catch (const std::exception& e) {
+                std::cerr << e.what() << std::endl;
+                return -1;
+            }
+        }
+    }
+    if (argc < 6 || (mode != "vaapi" && mode != "sw")) {
+        std::cerr << "Usage: " << argv[0] << " [vaapi|sw] [threads] [consume_us] [file|mmap|memory] input [input...]"
+                  << std::endl;
+        std::cerr << "       " << argv[0] << " demux [runs] input [input...]" << std::endl;
+        std::cerr << "       " << argv[0] << " latency [vaapi|sw] [threads] input [input...]" << std::endl;
+        std::cerr << "       " << argv[0] << " sample [vaapi|sw] [threads] input [input...]" << std::endl;
+        std::cerr << "       " << argv[0] << " selftest [vaapi|sw threads input]" << std::endl;
+        return -1;
+    }
+    DecodeEngineOptions options;
+    options.hw = mode == "vaapi";
+    options.threads = std::stoi(argv[2]);
+    const int consumeUs = std::stoi(argv[3]);
+    const std::string input = argv[4];
+    if (input == "mmap") {
+        options.input = InputMode::Mmap;
+    } else if (input == "memory") {
+        options.input = InputMode::Memory;
+    } else if (input != "file") {
+        std::cerr << "Unknown input mode " << input << std::endl;
+        return -1;
+    }
+
+    std::cout << "Running DecodeEngine" << std::endl;
+    DecodeEngine engine(options);
+    for (int i = 5; i < argc; ++i) {
+        try {
+            engine.addStream(argv[i]);
+        } catch (const std::exception& e) {
+            std::cerr << "Skipping " << argv[i] << ": " << e.what() << std::endl;
+        }
+    }
+    std::cout << "Running " << engine.streamCount() << " streams on " << options.threads << " decode threads ("
+              << mode << ", " << input << " input)" << std::endl;
+
+    // The consumer: takes frames of every stream in turn, as an inference stage would
+    auto start = std::chrono::steady_clock::now();
+    engine.start();
+    auto lastReport = start;
+    AVFrame* frame = av_frame_alloc();
+    size_t stream;
+    while (engine.next(frame, stream)) {
+        if (consumeUs > 0) {
+            TRACE_SCOPE("consume");
+            std::this_thread::sleep_for(std::chrono::microseconds(consumeUs));
+        }
+        av_frame_unref(frame);
+
+        auto now = std::chrono::steady_clock::now();
+        if (now - lastReport >= std::chrono::seconds(1)) {
+            printStats(engine, std::chrono::duration<double>(now - start).count());
+            lastReport = now;
+        }
+    }
+    av_frame_free(&frame);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::cout << "Finished in " << seconds << " s" << std::endl;
+    printStats(engine, seconds);
+    printLatency(engine.latency());
+    engine.stop();
+    traceFlushFromEnv();
+    return 0;
+}